@@ -0,0 +1,38 @@
+/**
+ * Shared utilities for the benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "bench.h"
+
+
+volatile uint32_t bench_sink;
+
+
+void
+bench_report_ns_per_op(const char *name,
+                       uint64_t start_ns,
+                       uint64_t end_ns,
+                       uint64_t n_ops)
+{
+	double ns_per_op = (double)(end_ns - start_ns) / (double)(n_ops ? n_ops : 1);
+	printf("{\"bench\": \"%s\", \"n_ops\": %llu, \"ns_per_op\": %.3f}\n",
+	       name, (unsigned long long)n_ops, ns_per_op);
+	fprintf(stderr, "%-40s %10.3f ns/op\n", name, ns_per_op);
+}
+
+
+uint64_t
+bench_n_iterations(int argc, char *argv[], uint64_t default_n_iterations)
+{
+	if (argc < 2)
+		return default_n_iterations;
+	
+	uint64_t n = strtoull(argv[1], NULL, 10);
+	return n ? n : default_n_iterations;
+}
@@ -0,0 +1,46 @@
+/**
+ * Shared utilities for the benchmarks.
+ *
+ * Results are printed as one JSON object per line (so that they may be
+ * collected and compared by scripts) and a short human-readable summary is
+ * printed to stderr.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+
+/**
+ * Somewhere to put results which the compiler must not optimise away.
+ */
+extern volatile uint32_t bench_sink;
+
+
+/**
+ * Report the mean time per operation of a microbenchmark.
+ *
+ * @param name The name of the benchmark.
+ * @param start_ns The uv_hrtime() before the first operation.
+ * @param end_ns The uv_hrtime() after the last operation.
+ * @param n_ops The number of operations performed.
+ */
+void bench_report_ns_per_op(const char *name,
+                            uint64_t start_ns,
+                            uint64_t end_ns,
+                            uint64_t n_ops);
+
+
+/**
+ * Parse the optional iteration count argument of a benchmark program.
+ *
+ * @returns the count given as the first argument or default_n_iterations if
+ *          there is none.
+ */
+uint64_t bench_n_iterations(int argc, char *argv[],
+                            uint64_t default_n_iterations);
+
+#endif
@@ -0,0 +1,383 @@
+/**
+ * Microbenchmarks of request dispatch and response matching.
+ *
+ * These drive a real connection's internals directly, without any network
+ * traffic:
+ *
+ * * dispatch.*: The time per packet taken by rs__process_request_queue to
+ *   refill a whole window of n_outstanding slots from the request queue, both
+ *   with individual SCP packet requests and with a single read request split
+ *   into one packet per slot.
+ * * recv.match.*: The time per response taken by rs__udp_recv_cb (including
+ *   buffer allocation, matching the response to its slot, processing it and
+ *   freeing the slot) with n_outstanding slots in flight. Responses are
+ *   delivered in a random order.
+ * * recv.miss.*: As above for responses which match no slot (e.g. duplicates
+ *   or late responses to retransmitted packets) and are discarded.
+ *
+ * The connection is opened with batching enabled and kept in the middle of a
+ * batch throughout so that dispatched packets are merely collected (and then
+ * discarded) rather than sent: the transmission syscalls would otherwise
+ * dwarf the costs being measured. Likewise, responses are copied into
+ * receive buffers and passed to rs__udp_recv_cb as libuv would.
+ *
+ * Usage:
+ *
+ *     ./bench_dispatch [n_iterations]
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "bench.h"
+
+#include "rs.h"
+#include "rs__internal.h"
+#include "rs__scp.h"
+
+
+#define SCP_DATA_LENGTH 256
+
+/**
+ * The largest response delivered (a full read response).
+ */
+#define MAX_RESPONSE_LENGTH (RS__READ_RESPONSE_HEADER_LENGTH + SCP_DATA_LENGTH)
+
+
+static const unsigned int sweep_n_outstanding[] = {1, 8, 64, 256, 1024};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+
+/**
+ * A response waiting to be delivered.
+ */
+typedef struct {
+	char packet[MAX_RESPONSE_LENGTH];
+	size_t len;
+} response_t;
+
+
+static uv_loop_t loop;
+
+// Buffer read into by the read requests
+static char read_buf[1024 * SCP_DATA_LENGTH];
+
+// Responses for every slot
+static response_t responses[1024];
+
+static uint32_t rand_state = 1;
+
+
+static uint32_t
+xorshift32(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+
+static void
+scp_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, unsigned int n_args,
+       uint32_t arg1, uint32_t arg2, uint32_t arg3, uv_buf_t data,
+       void *cb_data)
+{
+	bench_sink += error + cmd_rc;
+}
+
+
+static void
+rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+      void *cb_data)
+{
+	bench_sink += error + cmd_rc;
+}
+
+
+static rs_conn_t *
+open_conn(unsigned int n_outstanding)
+{
+	struct sockaddr_in addr;
+	uv_ip4_addr("127.0.0.1", 9, &addr);
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = SCP_DATA_LENGTH;
+	opts.n_outstanding = n_outstanding;
+	opts.batch = true;
+	rs_conn_t *conn = rs_init_ex(&loop, (struct sockaddr *)&addr, &opts);
+	if (!conn)
+		abort();
+	
+	// Never flush the batch (see discard_batch)
+	conn->batching = true;
+	
+	return conn;
+}
+
+
+static void
+close_conn(rs_conn_t *conn)
+{
+	conn->batching = false;
+	rs_free(conn, NULL, NULL);
+	uv_run(&loop, UV_RUN_DEFAULT);
+}
+
+
+/**
+ * Forget the packets dispatched (rather than sending them).
+ */
+static void
+discard_batch(rs_conn_t *conn)
+{
+	unsigned int i;
+	for (i = 0; i < conn->n_batched; i++)
+		conn->batch_slots[i]->batched = false;
+	conn->n_batched = 0;
+}
+
+
+/**
+ * Queue n SCP packet requests.
+ */
+static void
+queue_scp(rs_conn_t *conn, unsigned int n)
+{
+	uv_buf_t empty = uv_buf_init(NULL, 0);
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		if (rs_send_scp(conn, 0, 0, 1, 3, 0, 1, 2, 3, empty, 0, scp_cb, NULL))
+			abort();
+}
+
+
+/**
+ * Queue a read request which takes n packets.
+ */
+static void
+queue_read(rs_conn_t *conn, unsigned int n)
+{
+	uv_buf_t buf = uv_buf_init(read_buf, n * SCP_DATA_LENGTH);
+	if (rs_read(conn, 0, 0, 0x60000000, buf, rw_cb, NULL))
+		abort();
+}
+
+
+/**
+ * Build responses to every active slot (the number of which is returned) in a
+ * random order.
+ */
+static unsigned int
+make_responses(rs_conn_t *conn)
+{
+	static const char payload[SCP_DATA_LENGTH];
+	unsigned int n = 0;
+	unsigned int i;
+	for (i = 0; i < conn->n_outstanding; i++) {
+		rs__outstanding_t *os = &(conn->outstanding[i]);
+		if (!os->active)
+			continue;
+		
+		uv_buf_t data = uv_buf_init(NULL, 0);
+		if (os->type == RS__REQ_READ)
+			data = uv_buf_init((char *)payload, os->data.rw.data.len);
+		
+		response_t *response = &(responses[n++]);
+		uv_buf_t packet;
+		packet.base = response->packet + 2;
+		memset(response->packet, 0, 2);
+		rs__pack_scp_packet(&packet, SCP_DATA_LENGTH, 0, 0,
+		                    RS__SCP_CMD_OK, os->seq_num,
+		                    0, 0, 0, 0, data);
+		response->len = packet.len + 2;
+	}
+	
+	// Fisher-Yates shuffle
+	for (i = n; i > 1; i--) {
+		unsigned int j = xorshift32() % i;
+		response_t tmp = responses[i - 1];
+		responses[i - 1] = responses[j];
+		responses[j] = tmp;
+	}
+	
+	return n;
+}
+
+
+/**
+ * Deliver a response as libuv would.
+ */
+static void
+deliver(rs_conn_t *conn, const response_t *response)
+{
+	uv_buf_t buf;
+	rs__udp_recv_alloc_cb((uv_handle_t *)&(conn->udp_handle),
+	                      MAX_RESPONSE_LENGTH, &buf);
+	memcpy(buf.base, response->packet, response->len);
+	rs__udp_recv_cb(&(conn->udp_handle), response->len, &buf, NULL, 0);
+}
+
+
+/**
+ * Respond to every active slot, freeing them all.
+ */
+static void
+complete_all(rs_conn_t *conn)
+{
+	unsigned int n = make_responses(conn);
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		deliver(conn, &(responses[i]));
+	discard_batch(conn);
+}
+
+
+/**
+ * Time rs__process_request_queue refilling every slot in the window.
+ *
+ * @param read If true, a single read request is split across the window,
+ *             otherwise one SCP packet request is queued per slot.
+ */
+static void
+bench_dispatch(const char *type, uint64_t n, unsigned int n_outstanding,
+               bool read)
+{
+	rs_conn_t *conn = open_conn(n_outstanding);
+	uint64_t n_rounds = (n + n_outstanding - 1) / n_outstanding;
+	uint64_t total_ns = 0;
+	
+	uint64_t i;
+	for (i = 0; i < n_rounds; i++) {
+		// Hold the requests back (by closing the window) while they're queued
+		conn->window = 0;
+		if (read)
+			queue_read(conn, n_outstanding);
+		else
+			queue_scp(conn, n_outstanding);
+		conn->window = n_outstanding;
+		
+		uint64_t start = uv_hrtime();
+		rs__process_request_queue(conn);
+		total_ns += uv_hrtime() - start;
+		
+		if (conn->n_active != n_outstanding)
+			abort();
+		discard_batch(conn);
+		complete_all(conn);
+	}
+	
+	char name[64];
+	snprintf(name, sizeof(name), "dispatch.%s.n_outstanding_%u",
+	         type, n_outstanding);
+	bench_report_ns_per_op(name, 0, total_ns, n_rounds * n_outstanding);
+	
+	close_conn(conn);
+}
+
+
+/**
+ * Time rs__udp_recv_cb matching responses to n_outstanding slots.
+ */
+static void
+bench_recv_match(uint64_t n, unsigned int n_outstanding)
+{
+	rs_conn_t *conn = open_conn(n_outstanding);
+	uint64_t n_rounds = (n + n_outstanding - 1) / n_outstanding;
+	uint64_t total_ns = 0;
+	
+	uint64_t i;
+	for (i = 0; i < n_rounds; i++) {
+		queue_scp(conn, n_outstanding);
+		discard_batch(conn);
+		unsigned int n_responses = make_responses(conn);
+		
+		uint64_t start = uv_hrtime();
+		unsigned int j;
+		for (j = 0; j < n_responses; j++)
+			deliver(conn, &(responses[j]));
+		total_ns += uv_hrtime() - start;
+		
+		if (conn->n_active)
+			abort();
+		discard_batch(conn);
+	}
+	
+	char name[64];
+	snprintf(name, sizeof(name), "recv.match.n_outstanding_%u", n_outstanding);
+	bench_report_ns_per_op(name, 0, total_ns, n_rounds * n_outstanding);
+	
+	close_conn(conn);
+}
+
+
+/**
+ * Time rs__udp_recv_cb discarding responses which match none of its
+ * n_outstanding active slots.
+ */
+static void
+bench_recv_miss(uint64_t n, unsigned int n_outstanding)
+{
+	rs_conn_t *conn = open_conn(n_outstanding);
+	queue_scp(conn, n_outstanding);
+	discard_batch(conn);
+	
+	// Responses with sequence numbers far from any in use
+	unsigned int n_responses = make_responses(conn);
+	unsigned int j;
+	for (j = 0; j < n_responses; j++) {
+		uv_buf_t packet;
+		packet.base = responses[j].packet + 2;
+		packet.len = responses[j].len - 2;
+		rs__pack_scp_packet_seq_num(packet, conn->next_seq_num + 0x4000 + j);
+	}
+	
+	uint64_t i;
+	uint64_t start = uv_hrtime();
+	for (i = 0; i < n; i++)
+		deliver(conn, &(responses[i % n_responses]));
+	uint64_t end = uv_hrtime();
+	
+	if (conn->n_active != n_outstanding)
+		abort();
+	
+	char name[64];
+	snprintf(name, sizeof(name), "recv.miss.n_outstanding_%u", n_outstanding);
+	bench_report_ns_per_op(name, start, end, n);
+	
+	close_conn(conn);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t n = bench_n_iterations(argc, argv, 1000000);
+	
+	if (uv_loop_init(&loop))
+		abort();
+	
+	size_t i;
+	for (i = 0; i < LEN(sweep_n_outstanding); i++)
+		bench_dispatch("scp", n, sweep_n_outstanding[i], false);
+	for (i = 0; i < LEN(sweep_n_outstanding); i++)
+		bench_dispatch("read", n, sweep_n_outstanding[i], true);
+	for (i = 0; i < LEN(sweep_n_outstanding); i++)
+		if (sweep_n_outstanding[i] >= 8)
+			bench_recv_match(n, sweep_n_outstanding[i]);
+	for (i = 0; i < LEN(sweep_n_outstanding); i++)
+		if (sweep_n_outstanding[i] >= 8)
+			bench_recv_miss(n, sweep_n_outstanding[i]);
+	
+	uv_loop_close(&loop);
+	return 0;
+}
@@ -0,0 +1,568 @@
+/**
+ * A fast mock SC&MP for throughput benchmarks (see bench_machine.h).
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "bench_machine.h"
+
+#include "rs__scp.h"
+
+
+/**
+ * Byte offsets of the fields of an SCP packet (following the two padding
+ * bytes).
+ */
+#define BM_OFF_CMD_RC 8
+#define BM_OFF_SEQ_NUM 10
+#define BM_OFF_ARG1 12
+#define BM_OFF_ARG2 16
+#define BM_OFF_ARG3 20
+
+/**
+ * SC&MP commands and return codes not used by the library itself.
+ */
+#define BM_CMD_VER 0
+#define BM_RC_LEN 0x81
+#define BM_RC_ARG 0x83
+
+/**
+ * The size of each packet buffer: large enough for any request or response
+ * (including the padding bytes).
+ */
+#define BM_BUF_SIZE (2 + RS__SIZEOF_SCP_PACKET(3, BM_MAX_SCP_DATA_LENGTH))
+
+
+/**
+ * A response waiting for its due time.
+ */
+typedef struct bm_pending {
+	// The loop time (ms) at which the response is due and a tie-breaker
+	// preserving arrival order between responses due at the same time
+	uint64_t due;
+	uint64_t order;
+	
+	// Where to send the response
+	struct sockaddr_in addr;
+	
+	// The response packet (a BM_BUF_SIZE buffer) and its length
+	char *buf;
+	size_t len;
+	
+	// Should the response be sent twice?
+	bool duplicate;
+	
+	// Next in the free list
+	struct bm_pending *next_free;
+} bm_pending_t;
+
+
+/**
+ * A UDP send which could not complete immediately.
+ */
+typedef struct {
+	uv_udp_send_t req;
+	uv_buf_t buf;
+} bm_send_t;
+
+
+struct bm {
+	bm_opts_t opts;
+	
+	uv_loop_t loop;
+	uv_thread_t thread;
+	uv_udp_t udp_handle;
+	uv_timer_t timer_handle;
+	uv_async_t stop_handle;
+	
+	// Modelled SDRAM
+	char *sdram;
+	
+	// State of the random number generator
+	uint32_t rng;
+	
+	// Buffer into which requests are received
+	char recv_buf[BM_BUF_SIZE];
+	
+	// Binary min-heap of pending responses (ordered by due then order), its
+	// length and capacity
+	bm_pending_t **heap;
+	size_t heap_len;
+	size_t heap_cap;
+	uint64_t next_order;
+	
+	// Pending response structures not currently in use
+	bm_pending_t *free_pending;
+	
+	bm_counts_t counts;
+};
+
+
+static uint16_t
+bm_get_u16(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static uint32_t
+bm_get_u32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+	       ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void
+bm_put_u16(char *p, uint16_t v)
+{
+	uint8_t *b = (uint8_t *)p;
+	b[0] = v;
+	b[1] = v >> 8;
+}
+
+static void
+bm_put_u32(char *p, uint32_t v)
+{
+	uint8_t *b = (uint8_t *)p;
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+
+/**
+ * A uniformly distributed random number in [0, 1) (xorshift32).
+ */
+static double
+bm_random(bm_t *bm)
+{
+	uint32_t x = bm->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	bm->rng = x;
+	return (double)(x >> 8) / (double)(1u << 24);
+}
+
+
+void
+bm_opts_init(bm_opts_t *opts)
+{
+	opts->scp_data_length = 256;
+	opts->sdram_size = 64 * 1024 * 1024;
+	opts->latency = 0;
+	opts->jitter = 0;
+	opts->loss = 0.0;
+	opts->duplication = 0.0;
+	opts->seed = 1;
+}
+
+
+/******************************************************************************
+ * Pending response heap
+ ******************************************************************************/
+
+static bool
+bm_before(const bm_pending_t *a, const bm_pending_t *b)
+{
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+
+static bm_pending_t *
+bm_pending_alloc(bm_t *bm)
+{
+	bm_pending_t *p = bm->free_pending;
+	if (p) {
+		bm->free_pending = p->next_free;
+		return p;
+	}
+	
+	p = malloc(sizeof(bm_pending_t));
+	if (!p)
+		return NULL;
+	p->buf = malloc(BM_BUF_SIZE);
+	if (!p->buf) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+static void
+bm_pending_release(bm_t *bm, bm_pending_t *p)
+{
+	p->next_free = bm->free_pending;
+	bm->free_pending = p;
+}
+
+
+static bool
+bm_heap_push(bm_t *bm, bm_pending_t *p)
+{
+	if (bm->heap_len == bm->heap_cap) {
+		size_t cap = bm->heap_cap ? bm->heap_cap * 2 : 64;
+		bm_pending_t **heap = realloc(bm->heap, cap * sizeof(bm_pending_t *));
+		if (!heap)
+			return false;
+		bm->heap = heap;
+		bm->heap_cap = cap;
+	}
+	
+	size_t i = bm->heap_len++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!bm_before(p, bm->heap[parent]))
+			break;
+		bm->heap[i] = bm->heap[parent];
+		i = parent;
+	}
+	bm->heap[i] = p;
+	return true;
+}
+
+
+static bm_pending_t *
+bm_heap_pop(bm_t *bm)
+{
+	bm_pending_t *top = bm->heap[0];
+	bm_pending_t *last = bm->heap[--bm->heap_len];
+	
+	size_t i = 0;
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= bm->heap_len)
+			break;
+		if (child + 1 < bm->heap_len &&
+		    bm_before(bm->heap[child + 1], bm->heap[child]))
+			child++;
+		if (!bm_before(bm->heap[child], last))
+			break;
+		bm->heap[i] = bm->heap[child];
+		i = child;
+	}
+	if (bm->heap_len)
+		bm->heap[i] = last;
+	
+	return top;
+}
+
+
+/******************************************************************************
+ * Transmission
+ ******************************************************************************/
+
+static void
+bm_send_cb(uv_udp_send_t *req, int status)
+{
+	bm_send_t *send = (bm_send_t *)req;
+	free(send->buf.base);
+	free(send);
+}
+
+
+static void
+bm_send(bm_t *bm, const struct sockaddr_in *addr, char *base, size_t len)
+{
+	uv_buf_t buf = uv_buf_init(base, len);
+	int retval = uv_udp_try_send(&(bm->udp_handle), &buf, 1,
+	                             (const struct sockaddr *)addr);
+	if (retval >= 0)
+		return;
+	
+	// The send could not be made immediately, queue it instead
+	bm_send_t *send = malloc(sizeof(bm_send_t));
+	if (send)
+		send->buf.base = malloc(len);
+	if (!send || !send->buf.base) {
+		free(send);
+		bm->counts.n_send_failed++;
+		return;
+	}
+	memcpy(send->buf.base, base, len);
+	send->buf.len = len;
+	if (uv_udp_send(&(send->req), &(bm->udp_handle), &(send->buf), 1,
+	                (const struct sockaddr *)addr, bm_send_cb)) {
+		free(send->buf.base);
+		free(send);
+		bm->counts.n_send_failed++;
+	}
+}
+
+
+static void
+bm_send_pending(bm_t *bm, bm_pending_t *p)
+{
+	bm_send(bm, &(p->addr), p->buf, p->len);
+	if (p->duplicate)
+		bm_send(bm, &(p->addr), p->buf, p->len);
+}
+
+
+static void
+bm_timer_cb(uv_timer_t *handle)
+{
+	bm_t *bm = (bm_t *)handle->data;
+	uint64_t now = uv_now(&(bm->loop));
+	
+	while (bm->heap_len && bm->heap[0]->due <= now) {
+		bm_pending_t *p = bm_heap_pop(bm);
+		bm_send_pending(bm, p);
+		bm_pending_release(bm, p);
+	}
+	
+	if (bm->heap_len)
+		uv_timer_start(&(bm->timer_handle), bm_timer_cb,
+		               bm->heap[0]->due - now, 0);
+}
+
+
+/******************************************************************************
+ * Request handling
+ ******************************************************************************/
+
+/**
+ * Set the cmd_rc of a response and return its length when it consists of the
+ * header alone.
+ */
+static size_t
+bm_respond_rc(char *resp, uint16_t rc)
+{
+	bm_put_u16(resp + BM_OFF_CMD_RC, rc);
+	return RS__SIZEOF_SCP_PACKET(0, 0);
+}
+
+
+/**
+ * Form the response to a request. Both exclude the padding bytes.
+ *
+ * @returns the length of the response.
+ */
+static size_t
+bm_respond(bm_t *bm, const char *req, size_t len, char *resp)
+{
+	// The response header starts as a copy of the request header (the library
+	// does not inspect the SDP header of responses)
+	memcpy(resp, req, RS__SIZEOF_SCP_PACKET(0, 0));
+	
+	uint16_t cmd = bm_get_u16(req + BM_OFF_CMD_RC);
+	bool is_rw = cmd == RS__SCP_CMD_READ || cmd == RS__SCP_CMD_WRITE;
+	if (is_rw && len < RS__SIZEOF_SCP_PACKET(3, 0))
+		return bm_respond_rc(resp, BM_RC_LEN);
+	
+	uint32_t address = 0;
+	uint32_t length = 0;
+	if (is_rw) {
+		address = bm_get_u32(req + BM_OFF_ARG1);
+		length = bm_get_u32(req + BM_OFF_ARG2);
+		if (length > bm->opts.scp_data_length)
+			return bm_respond_rc(resp, BM_RC_LEN);
+		if (address < BM_SDRAM_BASE ||
+		    address - BM_SDRAM_BASE > bm->opts.sdram_size - length)
+			return bm_respond_rc(resp, BM_RC_ARG);
+		address -= BM_SDRAM_BASE;
+	}
+	
+	switch (cmd) {
+		case RS__SCP_CMD_READ:
+			memcpy(resp + RS__SIZEOF_SCP_PACKET(0, 0),
+			       bm->sdram + address, length);
+			bm_respond_rc(resp, RS__SCP_CMD_OK);
+			return RS__SIZEOF_SCP_PACKET(0, length);
+		
+		case RS__SCP_CMD_WRITE:
+			if (len - RS__SIZEOF_SCP_PACKET(3, 0) < length)
+				return bm_respond_rc(resp, BM_RC_LEN);
+			memcpy(bm->sdram + address, req + RS__SIZEOF_SCP_PACKET(3, 0), length);
+			return bm_respond_rc(resp, RS__SCP_CMD_OK);
+		
+		case BM_CMD_VER:
+			{
+				static const char version[] = "SC&MP/SpiNNaker";
+				bm_respond_rc(resp, RS__SCP_CMD_OK);
+				bm_put_u32(resp + BM_OFF_ARG1, 0);  // Chip (0, 0), core 0
+				bm_put_u32(resp + BM_OFF_ARG2,
+				           (uint32_t)(1u << 16) |  // Version 0.01
+				           (uint32_t)bm->opts.scp_data_length);
+				bm_put_u32(resp + BM_OFF_ARG3, 0);
+				memcpy(resp + RS__SIZEOF_SCP_PACKET(3, 0), version, sizeof(version));
+				return RS__SIZEOF_SCP_PACKET(3, sizeof(version));
+			}
+		
+		default:
+			memcpy(resp, req, len);
+			bm_respond_rc(resp, RS__SCP_CMD_OK);
+			return len;
+	}
+}
+
+
+static void
+bm_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+	bm_t *bm = (bm_t *)handle->data;
+	buf->base = bm->recv_buf;
+	buf->len = sizeof(bm->recv_buf);
+}
+
+
+static void
+bm_recv_cb(uv_udp_t *handle,
+           ssize_t nread, const uv_buf_t *buf,
+           const struct sockaddr *addr,
+           unsigned int flags)
+{
+	bm_t *bm = (bm_t *)handle->data;
+	
+	// Ignore errors, truncated packets and anything too short to be SCP
+	if (nread < 2 + RS__SIZEOF_SCP_PACKET(0, 0) || !addr ||
+	    (flags & UV_UDP_PARTIAL))
+		return;
+	
+	bm->counts.n_requests++;
+	if (bm->opts.loss > 0.0 && bm_random(bm) < bm->opts.loss) {
+		bm->counts.n_dropped++;
+		return;
+	}
+	
+	bm_pending_t *p = bm_pending_alloc(bm);
+	if (!p) {
+		bm->counts.n_send_failed++;
+		return;
+	}
+	
+	memset(p->buf, 0, 2);
+	p->len = 2 + bm_respond(bm, buf->base + 2, nread - 2, p->buf + 2);
+	memcpy(&(p->addr), addr, sizeof(struct sockaddr_in));
+	p->duplicate = bm->opts.duplication > 0.0 &&
+	               bm_random(bm) < bm->opts.duplication;
+	if (p->duplicate)
+		bm->counts.n_duplicated++;
+	
+	uint64_t delay = bm->opts.latency;
+	if (bm->opts.jitter)
+		delay += (uint64_t)(bm_random(bm) * (bm->opts.jitter + 1));
+	
+	// Respond immediately if possible (keeping responses in order)
+	if (!delay && !bm->heap_len) {
+		bm_send_pending(bm, p);
+		bm_pending_release(bm, p);
+		return;
+	}
+	
+	p->due = uv_now(&(bm->loop)) + delay;
+	p->order = bm->next_order++;
+	bool first = !bm->heap_len || bm_before(p, bm->heap[0]);
+	if (!bm_heap_push(bm, p)) {
+		bm->counts.n_send_failed++;
+		bm_pending_release(bm, p);
+		return;
+	}
+	if (first)
+		uv_timer_start(&(bm->timer_handle), bm_timer_cb, delay, 0);
+}
+
+
+/******************************************************************************
+ * Start up and shut down
+ ******************************************************************************/
+
+static void
+bm_stop_cb(uv_async_t *handle)
+{
+	bm_t *bm = (bm_t *)handle->data;
+	uv_close((uv_handle_t *)&(bm->udp_handle), NULL);
+	uv_close((uv_handle_t *)&(bm->timer_handle), NULL);
+	uv_close((uv_handle_t *)&(bm->stop_handle), NULL);
+}
+
+
+static void
+bm_thread_main(void *arg)
+{
+	bm_t *bm = (bm_t *)arg;
+	uv_run(&(bm->loop), UV_RUN_DEFAULT);
+}
+
+
+bm_t *
+bm_start(const bm_opts_t *opts, struct sockaddr_in *addr)
+{
+	if (opts->scp_data_length > BM_MAX_SCP_DATA_LENGTH)
+		return NULL;
+	
+	bm_t *bm = calloc(1, sizeof(bm_t));
+	if (!bm)
+		return NULL;
+	bm->opts = *opts;
+	bm->rng = opts->seed ? opts->seed : 1;
+	
+	bm->sdram = calloc(1, opts->sdram_size);
+	if (!bm->sdram) {
+		free(bm);
+		return NULL;
+	}
+	
+	if (uv_loop_init(&(bm->loop))) {
+		free(bm->sdram);
+		free(bm);
+		return NULL;
+	}
+	
+	// Nothing can fail once the first handle is initialised: the loop would
+	// otherwise need running to close it.
+	struct sockaddr_in bind_addr;
+	uv_ip4_addr("127.0.0.1", 0, &bind_addr);
+	if (uv_udp_init(&(bm->loop), &(bm->udp_handle)) ||
+	    uv_udp_bind(&(bm->udp_handle), (struct sockaddr *)&bind_addr, 0) ||
+	    uv_timer_init(&(bm->loop), &(bm->timer_handle)) ||
+	    uv_async_init(&(bm->loop), &(bm->stop_handle), bm_stop_cb))
+		abort();
+	bm->udp_handle.data = (void *)bm;
+	bm->timer_handle.data = (void *)bm;
+	bm->stop_handle.data = (void *)bm;
+	
+	int namelen = sizeof(struct sockaddr_in);
+	if (uv_udp_getsockname(&(bm->udp_handle), (struct sockaddr *)addr,
+	                       &namelen) ||
+	    uv_udp_recv_start(&(bm->udp_handle), bm_alloc_cb, bm_recv_cb) ||
+	    uv_thread_create(&(bm->thread), bm_thread_main, (void *)bm))
+		abort();
+	
+	return bm;
+}
+
+
+void
+bm_stop(bm_t *bm, bm_counts_t *counts)
+{
+	uv_async_send(&(bm->stop_handle));
+	uv_thread_join(&(bm->thread));
+	uv_loop_close(&(bm->loop));
+	
+	if (counts)
+		*counts = bm->counts;
+	
+	while (bm->heap_len)
+		bm_pending_release(bm, bm->heap[--bm->heap_len]);
+	while (bm->free_pending) {
+		bm_pending_t *p = bm->free_pending;
+		bm->free_pending = p->next_free;
+		free(p->buf);
+		free(p);
+	}
+	free(bm->heap);
+	free(bm->sdram);
+	free(bm);
+}
@@ -0,0 +1,117 @@
+/**
+ * A fast mock SC&MP for throughput benchmarks.
+ *
+ * Unlike the mock machine used by the tests (tests/mock_machine.h), which
+ * encodes the desired behaviour of each request in its fields, this machine
+ * behaves like a (single chip) SpiNNaker machine with configurable network
+ * conditions:
+ *
+ * * CMD_READ and CMD_WRITE access an in-memory model of SDRAM starting at
+ *   BM_SDRAM_BASE. Accesses outside it, or with a length longer than the
+ *   machine's scp_data_length, receive an RC_ARG or RC_LEN response.
+ * * CMD_VER responds with the machine's scp_data_length (so that
+ *   RS_SCP_DATA_LENGTH_AUTO may be used).
+ * * Anything else is echoed back with cmd_rc set to RC_OK.
+ *
+ * Each request is dropped with a given probability and otherwise answered
+ * after a fixed latency plus a uniformly distributed jitter (so responses may
+ * be reordered), each response being duplicated with a given probability.
+ * The machine runs its own event loop in a thread of its own so that its
+ * costs are not attributed to the library being measured.
+ *
+ * Pending responses are held in a binary heap ordered by due time and sent
+ * from fixed-size buffers taken from a free list; nothing is searched
+ * linearly.
+ */
+
+#ifndef BENCH_MACHINE_H
+#define BENCH_MACHINE_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+
+/**
+ * The address of the first byte of modelled SDRAM (sv->sdram_base on a real
+ * machine).
+ */
+#define BM_SDRAM_BASE 0x60000000u
+
+/**
+ * The largest scp_data_length the machine may be configured with.
+ */
+#define BM_MAX_SCP_DATA_LENGTH 4096
+
+
+/**
+ * Configuration of a mock machine.
+ */
+typedef struct {
+	// The largest data field accepted and returned. (Default: 256)
+	size_t scp_data_length;
+	
+	// The number of bytes of SDRAM modelled. (Default: 64 MiB)
+	size_t sdram_size;
+	
+	// Delay before each response (ms) and the maximum additional random delay
+	// (ms). (Default: 0 and 0)
+	unsigned int latency;
+	unsigned int jitter;
+	
+	// The probability that a request is dropped (i.e. never answered) and the
+	// probability that a response is sent twice. (Default: 0 and 0)
+	double loss;
+	double duplication;
+	
+	// Seed for the random number generator deciding the above. (Default: 1)
+	uint32_t seed;
+} bm_opts_t;
+
+
+/**
+ * Counters describing the requests a machine has handled.
+ */
+typedef struct {
+	uint64_t n_requests;
+	uint64_t n_dropped;
+	uint64_t n_duplicated;
+	
+	// Responses which could not be sent (the socket's buffer was full)
+	uint64_t n_send_failed;
+} bm_counts_t;
+
+
+struct bm;
+typedef struct bm bm_t;
+
+
+/**
+ * Initialise an options struct with default values.
+ */
+void bm_opts_init(bm_opts_t *opts);
+
+
+/**
+ * Start a mock machine, listening on an arbitrary loopback UDP port, in a new
+ * thread.
+ *
+ * @param addr Set to the address to send SCP packets to.
+ * @returns the machine or NULL on failure.
+ */
+bm_t *bm_start(const bm_opts_t *opts, struct sockaddr_in *addr);
+
+
+/**
+ * Stop a mock machine, free its resources and report what it did. Pending
+ * responses are discarded.
+ *
+ * @param counts If not NULL, set to the machine's counters.
+ */
+void bm_stop(bm_t *bm, bm_counts_t *counts);
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * Microbenchmark of the request queue (see rs__queue.h).
+ *
+ * Measures the time per entry inserted and removed from a queue of rs__req_t
+ * (as used for each priority's request queue) both in a steady state, where
+ * the queue holds a roughly constant number of entries and its ring buffer
+ * never grows, and under bursts, where a large number of entries are inserted
+ * at once and then drained. The bursts are measured from a freshly trimmed
+ * queue (so that the ring buffer must grow to accommodate the burst) and from
+ * a queue whose ring buffer is already large enough.
+ *
+ * Usage:
+ *
+ *     ./bench_queue [n_iterations]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include "bench.h"
+
+#include "rs.h"
+#include "rs__internal.h"
+#include "rs__queue.h"
+
+
+/**
+ * The number of entries inserted in each burst.
+ */
+#define BURST_LENGTH 4096
+
+
+static rs__q_t *
+make_queue(void)
+{
+	rs__q_t *q = rs__q_init(sizeof(rs__req_t), 0);
+	if (!q)
+		abort();
+	return q;
+}
+
+
+/**
+ * Insert and remove entries one at a time with a fixed number of other entries
+ * queued.
+ */
+static void
+bench_steady(const char *name, uint64_t n, unsigned int depth)
+{
+	rs__q_t *q = make_queue();
+	unsigned int i;
+	for (i = 0; i < depth; i++)
+		((rs__req_t *)rs__q_insert(q))->id = i;
+	
+	uint64_t j;
+	uint64_t start = uv_hrtime();
+	for (j = 0; j < n; j++) {
+		((rs__req_t *)rs__q_insert(q))->id = j;
+		bench_sink = ((rs__req_t *)rs__q_remove(q))->id;
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op(name, start, end, n);
+	
+	rs__q_free(q);
+}
+
+
+/**
+ * Insert a burst of entries and then remove them all. If trim is set, the
+ * queue is trimmed after each burst (as rs__process_request_queue does once a
+ * queue empties) so that every burst must grow the ring buffer again.
+ */
+static void
+bench_burst(const char *name, uint64_t n, bool trim)
+{
+	rs__q_t *q = make_queue();
+	uint64_t n_bursts = (n + BURST_LENGTH - 1) / BURST_LENGTH;
+	
+	// Grow the ring buffer to begin with (and shrink it again if every burst
+	// is to grow it)
+	unsigned int i;
+	for (i = 0; i < BURST_LENGTH; i++)
+		rs__q_insert(q);
+	while (rs__q_remove(q))
+		;
+	if (trim)
+		rs__q_trim(q);
+	
+	uint64_t j;
+	uint64_t start = uv_hrtime();
+	for (j = 0; j < n_bursts; j++) {
+		for (i = 0; i < BURST_LENGTH; i++) {
+			rs__req_t *req = (rs__req_t *)rs__q_insert(q);
+			if (!req)
+				abort();
+			req->id = i;
+		}
+		rs__req_t *req;
+		while ((req = (rs__req_t *)rs__q_remove(q)))
+			bench_sink = req->id;
+		if (trim)
+			rs__q_trim(q);
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op(name, start, end, n_bursts * BURST_LENGTH);
+	
+	rs__q_free(q);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t n = bench_n_iterations(argc, argv, 10000000);
+	
+	bench_steady("q.steady_depth_0", n, 0);
+	bench_steady("q.steady_depth_64", n, 64);
+	bench_steady("q.steady_depth_4096", n, 4096);
+	bench_burst("q.burst_4096_grow", n, true);
+	bench_burst("q.burst_4096_warm", n, false);
+	
+	return 0;
+}
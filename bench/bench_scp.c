@@ -0,0 +1,155 @@
+/**
+ * Microbenchmark of SCP packet packing and unpacking.
+ *
+ * Measures the CPU time spent per packet building read/write packet headers
+ * (both in full, as for SCP packet requests, and from a per-request template,
+ * as for reads and writes) and unpacking responses. Packets are packed and
+ * unpacked two bytes into their buffers, as they are when sent and received.
+ *
+ * Usage:
+ *
+ *     ./bench_scp [n_iterations]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "bench.h"
+
+#include "rs__scp.h"
+
+
+/**
+ * The payload length of a typical machine (the largest read response
+ * unpacked).
+ */
+#define SCP_DATA_LENGTH 256
+
+
+/**
+ * Packet buffers including the two padding bytes.
+ */
+static char packet_buf[2 + RS__SIZEOF_SCP_PACKET(3, SCP_DATA_LENGTH)];
+
+
+static void
+bench_pack_full(uint64_t n)
+{
+	uv_buf_t packet;
+	packet.base = packet_buf + 2;
+	uv_buf_t empty;
+	empty.base = NULL;
+	empty.len = 0;
+	
+	uint64_t i;
+	uint64_t start = uv_hrtime();
+	for (i = 0; i < n; i++) {
+		rs__pack_scp_packet(&packet, SCP_DATA_LENGTH,
+		                    0x0102, 3,
+		                    RS__SCP_CMD_READ, (uint16_t)i,
+		                    3, (uint32_t)i * SCP_DATA_LENGTH, SCP_DATA_LENGTH,
+		                    RS__RW_TYPE_WORD,
+		                    empty);
+		bench_sink = packet.base[RS__SIZEOF_SCP_PACKET(0, 0) - 1];
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op("scp.pack_rw_full", start, end, n);
+}
+
+
+static void
+bench_pack_template(uint64_t n)
+{
+	uv_buf_t packet;
+	packet.base = packet_buf + 2;
+	uint8_t template[RS__SCP_TEMPLATE_LENGTH];
+	rs__pack_scp_template(template, 0x0102, 3, RS__SCP_CMD_READ);
+	
+	uint64_t i;
+	uint64_t start = uv_hrtime();
+	for (i = 0; i < n; i++) {
+		rs__pack_scp_packet_template(&packet, template,
+		                             (uint16_t)i,
+		                             (uint32_t)i * SCP_DATA_LENGTH,
+		                             SCP_DATA_LENGTH,
+		                             RS__RW_TYPE_WORD);
+		bench_sink = packet.base[RS__SIZEOF_SCP_PACKET(0, 0) - 1];
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op("scp.pack_rw_template", start, end, n);
+}
+
+
+/**
+ * Unpack a response with the given number of arguments expected, as for a
+ * CMD_READ response (no arguments, a full payload) or an SCP packet response
+ * (three arguments).
+ */
+static void
+bench_unpack(const char *name, uint64_t n, unsigned int n_args_recv)
+{
+	uv_buf_t packet;
+	packet.base = packet_buf + 2;
+	memset(packet_buf, 0, sizeof(packet_buf));
+	uv_buf_t data;
+	data.base = packet_buf + 2 + RS__SIZEOF_SCP_PACKET(n_args_recv, 0);
+	data.len = SCP_DATA_LENGTH;
+	rs__pack_scp_packet(&packet, SCP_DATA_LENGTH + 4 * (3 - n_args_recv),
+	                    0x0102, 3,
+	                    RS__SCP_CMD_OK, 0,
+	                    n_args_recv, 1, 2, 3,
+	                    data);
+	
+	uint64_t i;
+	uint64_t start = uv_hrtime();
+	for (i = 0; i < n; i++) {
+		uint16_t cmd_rc;
+		uint16_t seq_num;
+		unsigned int n_args = n_args_recv;
+		uint32_t arg1 = 0;
+		uint32_t arg2 = 0;
+		uint32_t arg3 = 0;
+		rs__pack_scp_packet_seq_num(packet, (uint16_t)i);
+		rs__unpack_scp_packet(packet, &cmd_rc, &seq_num, &n_args,
+		                      &arg1, &arg2, &arg3, &data);
+		bench_sink = cmd_rc + seq_num + arg1 + arg2 + arg3 + data.len;
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op(name, start, end, n);
+}
+
+
+static void
+bench_unpack_seq_num(uint64_t n)
+{
+	uv_buf_t packet;
+	packet.base = packet_buf + 2;
+	packet.len = RS__SIZEOF_SCP_PACKET(0, 0);
+	
+	uint64_t i;
+	uint64_t start = uv_hrtime();
+	for (i = 0; i < n; i++) {
+		rs__pack_scp_packet_seq_num(packet, (uint16_t)i);
+		bench_sink = rs__unpack_scp_packet_seq_num(packet);
+	}
+	uint64_t end = uv_hrtime();
+	bench_report_ns_per_op("scp.unpack_seq_num", start, end, n);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t n = bench_n_iterations(argc, argv, 10000000);
+	
+	bench_pack_full(n);
+	bench_pack_template(n);
+	bench_unpack("scp.unpack_rw_response", n, 0);
+	bench_unpack("scp.unpack_scp_response", n, 3);
+	bench_unpack_seq_num(n);
+	
+	return 0;
+}
@@ -0,0 +1,357 @@
+/**
+ * Throughput benchmark of bulk reads and writes against a fast mock machine
+ * (see bench_machine.h).
+ *
+ * For every combination of n_outstanding, scp_data_length and timeout in the
+ * sweep, a fresh mock machine and connection are created and a region is
+ * written and then read back as a series of fixed-size requests, keeping a
+ * fixed number of requests queued at once. The throughput of each and the
+ * latency percentiles of the individual requests are reported as one JSON
+ * object per line.
+ *
+ * Usage:
+ *
+ *     ./bench_throughput [-q] [-b bytes] [-r request_len] [-l latency_ms]
+ *                        [-j jitter_ms] [-p loss] [-d duplication]
+ *
+ * * -q -- a quick sweep (fewer settings and less data).
+ * * -b -- the number of bytes written and read per setting (Default: 4 MiB)
+ * * -r -- the length of each read/write request (Default: 64 KiB)
+ * * -l, -j -- the mock machine's response latency and maximum jitter (ms).
+ *             (Default: 0 and 0)
+ * * -p, -d -- the probability of a request being dropped and of a response
+ *             being duplicated. (Default: 0.001 and 0.001)
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include <rs.h>
+
+#include "bench.h"
+#include "bench_machine.h"
+
+
+/**
+ * The number of read/write requests kept queued at once.
+ */
+#define DEPTH 4
+
+/**
+ * Number of transmission attempts before a request fails (generous since the
+ * mock machine may be lossy).
+ */
+#define N_TRIES 10
+
+
+static const unsigned int sweep_n_outstanding[] = {1, 4, 16, 64};
+static const size_t sweep_scp_data_length[] = {256, 1024};
+static const uint64_t sweep_timeout[] = {10, 100};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+
+// Set if any request failed or any data read back was wrong
+static bool failed = false;
+
+
+/**
+ * The state of a write or read of the whole region.
+ */
+typedef struct {
+	uv_loop_t *loop;
+	rs_conn_t *conn;
+	bool write;
+	
+	char *data;
+	size_t bytes;
+	size_t request_len;
+	
+	// The offset of the next request to submit and the number of requests
+	// yet to complete
+	size_t next_offset;
+	unsigned int n_in_flight;
+	
+	// The latencies (us) of the requests completed so far
+	uint64_t *latencies;
+	size_t n_latencies;
+	
+	unsigned int n_errors;
+} transfer_t;
+
+
+/**
+ * A single request of a transfer.
+ */
+typedef struct {
+	transfer_t *transfer;
+	uint64_t start_ns;
+} request_t;
+
+
+static void transfer_submit(transfer_t *t, request_t *request);
+
+
+static void
+rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+      void *cb_data)
+{
+	request_t *request = (request_t *)cb_data;
+	transfer_t *t = request->transfer;
+	
+	t->latencies[t->n_latencies++] = (uv_hrtime() - request->start_ns) / 1000;
+	if (error)
+		t->n_errors++;
+	t->n_in_flight--;
+	
+	if (t->next_offset < t->bytes)
+		transfer_submit(t, request);
+	else if (!t->n_in_flight)
+		uv_stop(t->loop);
+}
+
+
+static void
+transfer_submit(transfer_t *t, request_t *request)
+{
+	size_t offset = t->next_offset;
+	size_t len = t->request_len;
+	if (len > t->bytes - offset)
+		len = t->bytes - offset;
+	t->next_offset += len;
+	t->n_in_flight++;
+	
+	uv_buf_t buf = uv_buf_init(t->data + offset, len);
+	request->transfer = t;
+	request->start_ns = uv_hrtime();
+	int retval = t->write
+		? rs_write(t->conn, 0, 0, BM_SDRAM_BASE + offset, buf, rw_cb, request)
+		: rs_read(t->conn, 0, 0, BM_SDRAM_BASE + offset, buf, rw_cb, request);
+	if (retval) {
+		fprintf(stderr, "Failed to queue request!\n");
+		abort();
+	}
+}
+
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * The p-th percentile of a sorted array (nearest rank).
+ */
+static uint64_t
+percentile(const uint64_t *sorted, size_t n, double p)
+{
+	if (!n)
+		return 0;
+	size_t rank = (size_t)(p / 100.0 * n + 0.5);
+	return sorted[(rank ? rank : 1) - 1];
+}
+
+
+/**
+ * Write or read the whole region and report the outcome.
+ *
+ * @param expected If not NULL, the data which a read should have returned.
+ */
+static void
+run_transfer(uv_loop_t *loop, rs_conn_t *conn,
+             const rs_conn_opts_t *conn_opts, const bm_opts_t *bm_opts,
+             bool write, char *data, size_t bytes, size_t request_len,
+             const char *expected)
+{
+	size_t n_requests = (bytes + request_len - 1) / request_len;
+	transfer_t t;
+	t.loop = loop;
+	t.conn = conn;
+	t.write = write;
+	t.data = data;
+	t.bytes = bytes;
+	t.request_len = request_len;
+	t.next_offset = 0;
+	t.n_in_flight = 0;
+	t.latencies = malloc(n_requests * sizeof(uint64_t));
+	t.n_latencies = 0;
+	t.n_errors = 0;
+	if (!t.latencies)
+		abort();
+	
+	request_t requests[DEPTH];
+	uint64_t start = uv_hrtime();
+	unsigned int i;
+	for (i = 0; i < DEPTH && t.next_offset < bytes; i++)
+		transfer_submit(&t, &(requests[i]));
+	uv_run(loop, UV_RUN_DEFAULT);
+	uint64_t end = uv_hrtime();
+	
+	bool verified = !expected || !memcmp(data, expected, bytes);
+	if (t.n_errors || !verified)
+		failed = true;
+	double seconds = (double)(end - start) / 1e9;
+	qsort(t.latencies, t.n_latencies, sizeof(uint64_t), compare_u64);
+	
+	printf("{\"bench\": \"throughput\", \"op\": \"%s\", "
+	       "\"n_outstanding\": %u, \"scp_data_length\": %u, "
+	       "\"timeout_ms\": %llu, \"latency_ms\": %u, \"jitter_ms\": %u, "
+	       "\"loss\": %g, \"duplication\": %g, "
+	       "\"bytes\": %llu, \"request_len\": %llu, "
+	       "\"seconds\": %.6f, \"mb_per_s\": %.3f, "
+	       "\"request_latency_us\": {\"p50\": %llu, \"p90\": %llu, "
+	       "\"p99\": %llu, \"max\": %llu}, ",
+	       write ? "write" : "read",
+	       conn_opts->n_outstanding, (unsigned int)conn_opts->scp_data_length,
+	       (unsigned long long)conn_opts->timeout,
+	       bm_opts->latency, bm_opts->jitter,
+	       bm_opts->loss, bm_opts->duplication,
+	       (unsigned long long)bytes, (unsigned long long)request_len,
+	       seconds, (double)bytes / 1e6 / seconds,
+	       (unsigned long long)percentile(t.latencies, t.n_latencies, 50),
+	       (unsigned long long)percentile(t.latencies, t.n_latencies, 90),
+	       (unsigned long long)percentile(t.latencies, t.n_latencies, 99),
+	       (unsigned long long)percentile(t.latencies, t.n_latencies, 100));
+	
+	rs_stats_t stats;
+	if (!rs_get_stats(conn, &stats))
+		printf("\"n_retransmits\": %llu, ",
+		       (unsigned long long)(stats.n_retransmits_timeout +
+		                            stats.n_retransmits_fast));
+	printf("\"n_errors\": %u", t.n_errors);
+	if (expected)
+		printf(", \"verified\": %s", verified ? "true" : "false");
+	printf("}\n");
+	fflush(stdout);
+	
+	fprintf(stderr,
+	        "%-5s n_outstanding=%-3u scp_data_length=%-4u timeout=%-3llu "
+	        "%9.3f MB/s  p50=%llu us  p99=%llu us%s\n",
+	        write ? "write" : "read",
+	        conn_opts->n_outstanding, (unsigned int)conn_opts->scp_data_length,
+	        (unsigned long long)conn_opts->timeout,
+	        (double)bytes / 1e6 / seconds,
+	        (unsigned long long)percentile(t.latencies, t.n_latencies, 50),
+	        (unsigned long long)percentile(t.latencies, t.n_latencies, 99),
+	        (t.n_errors || !verified) ? "  FAILED" : "");
+	
+	free(t.latencies);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t bytes = 4 * 1024 * 1024;
+	size_t request_len = 64 * 1024;
+	bool quick = false;
+	
+	bm_opts_t bm_opts;
+	bm_opts_init(&bm_opts);
+	bm_opts.loss = 0.001;
+	bm_opts.duplication = 0.001;
+	
+	int c;
+	while ((c = getopt(argc, argv, "qb:r:l:j:p:d:")) != -1) {
+		switch (c) {
+			case 'q': quick = true; break;
+			case 'b': bytes = strtoull(optarg, NULL, 10); break;
+			case 'r': request_len = strtoull(optarg, NULL, 10); break;
+			case 'l': bm_opts.latency = atoi(optarg); break;
+			case 'j': bm_opts.jitter = atoi(optarg); break;
+			case 'p': bm_opts.loss = atof(optarg); break;
+			case 'd': bm_opts.duplication = atof(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-b bytes] [-r request_len] "
+				                "[-l latency_ms] [-j jitter_ms] [-p loss] "
+				                "[-d duplication]\n", argv[0]);
+				return -1;
+		}
+	}
+	if (quick)
+		bytes = 1024 * 1024;
+	if (!bytes || !request_len)
+		return -1;
+	bm_opts.sdram_size = bytes;
+	
+	char *write_data = malloc(bytes);
+	char *read_data = malloc(bytes);
+	if (!write_data || !read_data)
+		abort();
+	size_t i;
+	for (i = 0; i < bytes; i++)
+		write_data[i] = rand();
+	
+	uv_loop_t loop;
+	if (uv_loop_init(&loop))
+		abort();
+	
+	size_t o, l, t;
+	for (o = 0; o < LEN(sweep_n_outstanding); o++) {
+		for (l = 0; l < LEN(sweep_scp_data_length); l++) {
+			for (t = 0; t < LEN(sweep_timeout); t++) {
+				if (quick && (o % 2 || t))
+					continue;
+				
+				bm_opts.scp_data_length = sweep_scp_data_length[l];
+				struct sockaddr_in addr;
+				bm_t *bm = bm_start(&bm_opts, &addr);
+				if (!bm)
+					abort();
+				
+				rs_conn_opts_t conn_opts;
+				rs_conn_opts_init(&conn_opts);
+				conn_opts.scp_data_length = sweep_scp_data_length[l];
+				conn_opts.timeout = sweep_timeout[t];
+				conn_opts.n_tries = N_TRIES;
+				conn_opts.n_outstanding = sweep_n_outstanding[o];
+				rs_conn_t *conn = rs_init_ex(&loop, (struct sockaddr *)&addr,
+				                             &conn_opts);
+				if (!conn)
+					abort();
+				
+				run_transfer(&loop, conn, &conn_opts, &bm_opts, true,
+				             write_data, bytes, request_len, NULL);
+				memset(read_data, 0, bytes);
+				run_transfer(&loop, conn, &conn_opts, &bm_opts, false,
+				             read_data, bytes, request_len, write_data);
+				
+				rs_free(conn, NULL, NULL);
+				uv_run(&loop, UV_RUN_DEFAULT);
+				
+				bm_counts_t counts;
+				bm_stop(bm, &counts);
+				printf("{\"bench\": \"throughput\", \"op\": \"machine\", "
+				       "\"n_outstanding\": %u, \"scp_data_length\": %u, "
+				       "\"timeout_ms\": %llu, \"n_requests\": %llu, "
+				       "\"n_dropped\": %llu, \"n_duplicated\": %llu, "
+				       "\"n_send_failed\": %llu}\n",
+				       conn_opts.n_outstanding,
+				       (unsigned int)conn_opts.scp_data_length,
+				       (unsigned long long)conn_opts.timeout,
+				       (unsigned long long)counts.n_requests,
+				       (unsigned long long)counts.n_dropped,
+				       (unsigned long long)counts.n_duplicated,
+				       (unsigned long long)counts.n_send_failed);
+			}
+		}
+	}
+	
+	uv_loop_close(&loop);
+	free(write_data);
+	free(read_data);
+	return failed ? 1 : 0;
+}
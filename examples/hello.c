@@ -8,17 +8,16 @@
  *
  * Once compiled with `make hello`, the usage is like so:
  *
- *     ./hello hostname scp_data_length n_outstanding
+ *     ./hello hostname n_outstanding
  *
  * * hostname -- the SpiNNaker machine to communicate with. The machine should
  *               be already booted and not be running any applications.
- * * scp_data_length -- the maximum data field length supported by the machine
- *                      (in bytes), typically 256.
  * * n_outstanding -- the number of simultaneous commands which Rig SCP may
  *                    issue to the machine at once, typically between 1 and 8.
  *
- * Note: In general, one should query the machine to determine the appropriate
- * values for scp_data_length and n_outstanding.
+ * The maximum data field length supported by the machine is discovered by Rig
+ * SCP automatically. Note: In general, one should query the machine to
+ * determine the appropriate value for n_outstanding.
  */
 
 #include <sys/socket.h>
@@ -49,6 +48,10 @@
 // Number of cores to send the CMD_VER command to.
 #define N_CPUS 16
 
+// Size of the buffers (in bytes) into which CMD_VER responses are received.
+// This is large enough for the response from any SpiNNaker machine.
+#define CMD_VER_RESPONSE_LEN 256
+
 // Amount of data to read/write (in bytes) in this example program.
 #define DATA_LEN 10 * 1024 * 1024
 
@@ -118,14 +121,13 @@ int
 main(int argc, char *argv[])
 {
 	// First we'll parse the command line arguments
-	if (argc != 4) {
-		fprintf(stderr, "Expected 3 arguments: "
-		                "hostname scp_data_length n_outstanding\n");
+	if (argc != 3) {
+		fprintf(stderr, "Expected 2 arguments: "
+		                "hostname n_outstanding\n");
 		return -1;
 	}
 	const char *hostname = argv[1];
-	const size_t scp_data_length = (size_t)atoi(argv[2]);
-	const unsigned int n_outstanding = (unsigned int)atoi(argv[3]);
+	const unsigned int n_outstanding = (unsigned int)atoi(argv[2]);
 	
 	// Get a reference to the libuv event loop; we'll use this later!
 	loop = uv_default_loop();
@@ -149,12 +151,20 @@ main(int argc, char *argv[])
 	// one. Also, note that all connection parameters are set at connection time
 	// and cannot be changed: you must disconnect and recreate the connection with
 	// new parameters if you wish to change them later.
-	conn = rs_init(loop,
-	               addrinfo->ai_addr,
-	               scp_data_length,
-	               TIMEOUT,
-	               N_TRIES,
-	               n_outstanding);
+	//
+	// The parameters are given in an options struct which must first be filled
+	// with default values by rs_conn_opts_init; we then set just the options we
+	// care about. Setting scp_data_length to RS_SCP_DATA_LENGTH_AUTO asks Rig SCP
+	// to send its own CMD_VER to the Ethernet chip, (0, 0), to find out how much
+	// data the machine accepts per packet. The commands we send below simply
+	// wait in the queue until this has been found.
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = RS_SCP_DATA_LENGTH_AUTO;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = n_outstanding;
+	conn = rs_init_ex(loop, addrinfo->ai_addr, &opts);
 	assert(conn);
 	
 	// Start timing...
@@ -171,11 +181,11 @@ main(int argc, char *argv[])
 		// which we specify as a uv_buf_t (as is the convention in libuv) which has
 		// two fields: base and len. The base is a pointer to the start of the
 		// buffer and len is used to indicate the length of the useful data within
-		// it). We'll allocate rs_send_scp bytes which should be large enough to
-		// accept the CMD_VER response. To indicate that there is no data to be sent
-		// with our CMD_VER command we initially set data.len to 0.
+		// it). We'll allocate CMD_VER_RESPONSE_LEN bytes which should be large
+		// enough to accept the CMD_VER response. To indicate that there is no data
+		// to be sent with our CMD_VER command we initially set data.len to 0.
 		uv_buf_t data;
-		data.base = malloc(scp_data_length);
+		data.base = malloc(CMD_VER_RESPONSE_LEN);
 		assert(data.base);
 		data.len = 0;
 		
@@ -192,7 +202,7 @@ main(int argc, char *argv[])
 		            3, // All three arguments are expected in the response
 		            0, 0, 0, // Args1-3 just set arbitrarily.
 		            data, // No data to be sent but we'll get the response data here
-		            scp_data_length, // Maximum length of response
+		            CMD_VER_RESPONSE_LEN, // Maximum length of response
 		            cmd_ver_callback, // Callback on completion.
 		            &(got_cmd_ver_response[i]));
 	}
@@ -294,8 +304,10 @@ cmd_ver_callback(rs_conn_t *conn,
 			got_all_replies = false;
 	
 	if (got_all_replies) {
-		printf("All responses received after %0.0f ms.\n\n",
+		printf("All responses received after %0.0f ms.\n",
 		       (double)(uv_now(loop) - last_time));
+		printf("Machine accepts up to %u bytes of data per packet.\n\n",
+		       (unsigned int)rs_get_scp_data_length(conn));
 		
 		// Generate some random data to write and set up a uv_buf_t as before, this
 		// time we set the len field to indicate how much data in the buffer is to
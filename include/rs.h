@@ -84,9 +84,201 @@ typedef void (*rs_rw_cb)(rs_conn_t *conn,
 typedef void (*rs_free_cb)(void *cb_data);
 
 
+/**
+ * Request priorities. Queued requests of a higher priority are always
+ * dispatched before those of a lower priority (see rs_send_scp_ex, rs_write_ex
+ * and rs_read_ex).
+ */
+typedef enum {
+	RS_PRIORITY_NORMAL = 0,
+	RS_PRIORITY_HIGH = 1,
+} rs_priority_t;
+
+/**
+ * The number of priority levels.
+ */
+#define RS_N_PRIORITIES 2
+
+/**
+ * A special value for rs_conn_opts_t.scp_data_length which causes the data
+ * field length to be discovered from the machine (see rs_init_ex).
+ */
+#define RS_SCP_DATA_LENGTH_AUTO 0
+
+
+/**
+ * Options for a new SCP connection (see rs_init_ex).
+ *
+ * Always initialise an options struct using rs_conn_opts_init before setting
+ * any fields so that options added in future versions of this library take
+ * their default values.
+ */
+typedef struct {
+	// The maximum length (in bytes) of the SCP data field. This value should be
+	// chosen according to the target devices' sver response or, if
+	// RS_SCP_DATA_LENGTH_AUTO, discovered by sending a CMD_VER to the probe
+	// destination below when the connection is created. Until the response
+	// arrives no other packets are sent; should the probe fail, a length of
+	// 256 is used. (Default: 256)
+	size_t scp_data_length;
+	
+	// The chip and CPU to which the CMD_VER used to discover the SCP data
+	// length is sent when scp_data_length is RS_SCP_DATA_LENGTH_AUTO. This
+	// should be the Ethernet connected chip at the other end of the connection.
+	// (Default: chip (0, 0), CPU 0)
+	uint16_t probe_dest_addr;
+	uint8_t probe_dest_cpu;
+	
+	// Number of milliseconds to wait for a response from the machine before
+	// retransmitting. When adaptive_timeout is enabled, this is instead the
+	// initial and maximum retransmission timeout. (Default: 500)
+	uint64_t timeout;
+	
+	// Derive the retransmission timeout from the round-trip times measured for
+	// packets which received a response without being retransmitted. The
+	// timeout is set to the smoothed RTT plus four times its variance (as in
+	// TCP, RFC 6298), is bounded by min_timeout and timeout and is doubled for
+	// each successive retransmission of a packet. (Default: false)
+	bool adaptive_timeout;
+	
+	// The minimum retransmission timeout (in milliseconds) when adaptive_timeout
+	// is enabled. (Default: 10)
+	uint64_t min_timeout;
+	
+	// Number of transmission attempts to make (including initial attempt) before
+	// giving up on a request. Must be at least 1. (Default: 5)
+	unsigned int n_tries;
+	
+	// Number of packets which may be simultaneously awaiting responses. When
+	// dynamic_window is enabled, this is the maximum. (Default: 1)
+	unsigned int n_outstanding;
+	
+	// Dynamically adjust the number of packets which may be simultaneously
+	// awaiting responses (the window) between 1 and n_outstanding. The window
+	// starts at n_outstanding, is halved when a packet times out or the machine
+	// reports that it is busy and is grown by one each time a window's worth of
+	// packets receive OK responses. (Default: false)
+	bool dynamic_window;
+	
+	// Retransmit a packet without waiting for its timeout once this many
+	// responses have arrived for packets transmitted after it (suggesting the
+	// packet or its response was lost). Fast retransmissions count towards
+	// n_tries. Zero disables fast retransmission. (Default: 0)
+	unsigned int fast_retransmit;
+	
+	// Enable batched transmission and reception. When enabled, all packets
+	// dispatched together (e.g. when a read or write fills the window) are
+	// transmitted using a single system call and incoming packets are received
+	// in batches. On platforms where batched I/O is not supported, packets are
+	// silently sent and received individually. (Default: false)
+	bool batch;
+	
+	// Number of outstanding slots (within the window) which may only be used by
+	// requests with a priority above RS_PRIORITY_NORMAL, ensuring such requests
+	// need not wait for normal priority packets to complete. Normal priority
+	// requests may always use at least one slot. (Default: 0)
+	unsigned int n_reserved;
+	
+	// The maximum number of requests (of each priority) whose packets are
+	// dispatched concurrently. Packets are dispatched from each such request in
+	// turn, so short requests are not held up behind long reads and writes and
+	// the load is spread across the chips being accessed. With the default of
+	// 1, each read/write is fully dispatched before the next request is started.
+	// (Default: 1)
+	unsigned int n_interleaved;
+	
+	// When interleaving read/write requests, dispatch packets from the request
+	// with the least data remaining rather than from each in turn, minimising
+	// the latency of short requests. (Default: false)
+	bool interleave_shortest_first;
+	
+	// The maximum number of packets which may be awaiting responses from any
+	// one destination (i.e. dest_addr and dest_cpu) at once, preventing a single
+	// chip's monitor from being overwhelmed. While a destination is at its limit,
+	// packets for other destinations are dispatched instead. Since only the
+	// n_interleaved active requests are considered, n_interleaved should
+	// usually be raised when using this option. Zero means no limit.
+	// (Default: 0)
+	unsigned int max_in_flight_per_dest;
+	
+	// Merge reads (or writes) queued back-to-back for contiguous addresses on
+	// the same destination into a single request of up to scp_data_length
+	// bytes, provided they have not yet been dispatched (i.e. while the window
+	// is full). Each original request still receives its own callback once the
+	// merged request completes. Requests of scp_data_length bytes or more are
+	// never merged. (Default: false)
+	bool coalesce;
+	
+	// The n_retry_rcs response codes which, in response to a read or write
+	// packet, indicate a transient condition (e.g. the machine being busy) and
+	// so cause the packet to be retried after a backoff rather than failing the
+	// whole request with RS_EBAD_RC. Retries count towards n_tries. The array
+	// need not remain valid after rs_init_ex returns and codes above 255 are
+	// ignored. rs_transient_rcs lists the codes SC&MP uses for transient
+	// conditions. (Default: none)
+	const uint16_t *retry_rcs;
+	unsigned int n_retry_rcs;
+	
+	// The delay (in milliseconds) before retrying a packet following a
+	// response code in retry_rcs. The delay doubles with each further attempt
+	// but never exceeds timeout. (Default: 1)
+	uint64_t retry_backoff;
+	
+	// The maximum number of requests which may wait in the request queue of
+	// each priority (excluding those already being dispatched). Requests
+	// submitted while the queue is full are rejected with RS_EFULL. The memory
+	// used by the queue grows as required up to this limit and is released
+	// again whenever the queue empties. Zero means no limit. (Default: 0)
+	size_t max_queue_length;
+	
+	// Once a request has been rejected with RS_EFULL, the drain callback (see
+	// rs_set_drain_cb) is called when the queue has shrunk to this many
+	// requests. (Default: 0)
+	size_t queue_low_water;
+} rs_conn_opts_t;
+
+
+/**
+ * The SC&MP response codes which indicate transient conditions (such as full
+ * buffers or a timeout communicating with another chip), suitable for use as
+ * rs_conn_opts_t.retry_rcs.
+ */
+extern const uint16_t rs_transient_rcs[];
+extern const unsigned int rs_n_transient_rcs;
+
+
+/**
+ * Initialise a connection options struct with default values.
+ */
+void rs_conn_opts_init(rs_conn_opts_t *opts);
+
+
+/**
+ * Allocate and initialise a new connection to an SCP endpoint.
+ *
+ * Returns NULL on failure.
+ *
+ * Note: to simplify implementation and work around shortcomings in the libuv
+ * API, this library does not support the changing of the options supplied. If
+ * these options need to be changed, the connection must be closed (using
+ * rs_free) and a new connection made.
+ *
+ * @param loop The libuv event loop in which the connection will run.
+ * @param addr The socket address of the remote machine.
+ * @param opts The connection options. The struct need not remain valid after
+ *             this call returns.
+ */
+rs_conn_t *rs_init_ex(uv_loop_t *loop,
+                      const struct sockaddr *addr,
+                      const rs_conn_opts_t *opts);
+
+
 /**
  * Allocate and initialise a new connection to an SCP endpoint.
  *
+ * Equivalent to calling rs_init_ex with the supplied options and all other
+ * options set to their defaults.
+ *
  * Returns NULL on failure.
  *
  * Note: to simplify implementation and work around shortcomings in the libuv
@@ -142,7 +334,8 @@ rs_conn_t *rs_init(uv_loop_t *loop,
  *           returned.
  * @param cb_data User-supplied data that will be passed to the callback
  *                function.
- * @returns 0 if successfuly queued, non-zero otherwise.
+ * @returns 0 if successfuly queued, RS_EFULL if the request queue is full (see
+ *          max_queue_length in rs_conn_opts_t) or -1 on other failures.
  */
 int rs_send_scp(rs_conn_t *conn,
                 uint16_t dest_addr,
@@ -158,6 +351,25 @@ int rs_send_scp(rs_conn_t *conn,
                 rs_send_scp_cb cb,
                 void *cb_data);
 
+/**
+ * As rs_send_scp but with a specified priority (rs_send_scp uses
+ * RS_PRIORITY_NORMAL).
+ */
+int rs_send_scp_ex(rs_conn_t *conn,
+                   rs_priority_t priority,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint16_t cmd_rc,
+                   unsigned int n_args_send,
+                   unsigned int n_args_recv,
+                   uint32_t arg1,
+                   uint32_t arg2,
+                   uint32_t arg3,
+                   uv_buf_t data,
+                   size_t data_max_len,
+                   rs_send_scp_cb cb,
+                   void *cb_data);
+
 /**
  * Write a large block of data to a machine using SCP CMD_WRITE packets.
  *
@@ -170,7 +382,8 @@ int rs_send_scp(rs_conn_t *conn,
  * @param cb A callback function which will be called when the write completes.
  * @param cb_data User-supplied data that will be passed to the callback
  *                function.
- * @returns 0 if successfully queued, non-zero otherwise.
+ * @returns 0 if successfully queued, RS_EFULL if the request queue is full or
+ *          -1 on other failures.
  */
 int rs_write(rs_conn_t *conn,
              uint16_t dest_addr,
@@ -180,6 +393,19 @@ int rs_write(rs_conn_t *conn,
              rs_rw_cb cb,
              void *cb_data);
 
+/**
+ * As rs_write but with a specified priority (rs_write uses
+ * RS_PRIORITY_NORMAL).
+ */
+int rs_write_ex(rs_conn_t *conn,
+                rs_priority_t priority,
+                uint16_t dest_addr,
+                uint8_t dest_cpu,
+                uint32_t address,
+                uv_buf_t data,
+                rs_rw_cb cb,
+                void *cb_data);
+
 /**
  * Read a large block of data from a machine using SCP CMD_READ packets.
  *
@@ -193,7 +419,8 @@ int rs_write(rs_conn_t *conn,
  * @param cb A callback function which will be called once the read is complete.
  * @param cb_data User-supplied data that will be passed to the callback
  *                function.
- * @returns 0 if successfully queued, non-zero otherwise.
+ * @returns 0 if successfully queued, RS_EFULL if the request queue is full or
+ *          -1 on other failures.
  */
 int rs_read(rs_conn_t *conn,
             uint16_t dest_addr,
@@ -203,6 +430,371 @@ int rs_read(rs_conn_t *conn,
             rs_rw_cb cb,
             void *cb_data);
 
+/**
+ * As rs_read but with a specified priority (rs_read uses RS_PRIORITY_NORMAL).
+ */
+int rs_read_ex(rs_conn_t *conn,
+               rs_priority_t priority,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint32_t address,
+               uv_buf_t data,
+               rs_rw_cb cb,
+               void *cb_data);
+
+/**
+ * A region of memory to read or write using rs_readv or rs_writev.
+ */
+typedef struct {
+	// The chip and CPU via which to access the memory
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	
+	// The address of the region and a buffer the size of the region containing
+	// the data to write (or to be filled with the data read).
+	uint32_t address;
+	uv_buf_t data;
+	
+	// Set once the operation completes to the error (as for rs_rw_cb) and, if
+	// the error is RS_EBAD_RC, the cmd_rc of the bad response for this region.
+	int error;
+	uint16_t cmd_rc;
+} rs_region_t;
+
+/**
+ * Callback function type for rs_readv/rs_writev completion.
+ *
+ * @param conn The connection the regions were read/written via.
+ * @param error 0 if every region was read/written successfully, otherwise the
+ *              error of the first region (in array order) to fail. The error
+ *              and cmd_rc fields of each region give the outcome of that
+ *              region.
+ * @param n_regions The number of regions.
+ * @param regions The regions supplied, which may be safely freed/reused as of
+ *                this callback's arrival.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_rwv_cb)(rs_conn_t *conn,
+                          int error,
+                          unsigned int n_regions,
+                          rs_region_t *regions,
+                          void *cb_data);
+
+/**
+ * Read a set of regions, delivering a single callback once all are complete.
+ *
+ * Each region is read just as if rs_read had been called for each in turn and
+ * so the packets of successive regions are pipelined back-to-back.
+ *
+ * Should the request queue be full (see max_queue_length in rs_conn_opts_t),
+ * the remaining regions are queued as earlier regions complete. Any region
+ * which cannot be queued fails with RS_EFULL or UV_ENOMEM, reported via the
+ * callback.
+ *
+ * @param n_regions The number of regions to read.
+ * @param regions The regions to read. This array and the data buffers must
+ *                remain valid until the callback function is called.
+ * @param cb A callback function called once every region has been read (or
+ *           failed).
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully queued (in which case the callback will be
+ *          called), RS_EFULL if the request queue was full and no region
+ *          could be queued or -1 on other failures. On failure nothing is
+ *          read and the callback will not be called.
+ */
+int rs_readv(rs_conn_t *conn,
+             unsigned int n_regions,
+             rs_region_t *regions,
+             rs_rwv_cb cb,
+             void *cb_data);
+
+/**
+ * As rs_readv but writing each region.
+ */
+int rs_writev(rs_conn_t *conn,
+              unsigned int n_regions,
+              rs_region_t *regions,
+              rs_rwv_cb cb,
+              void *cb_data);
+
+/**
+ * Callback function type for rs_read_stream chunks.
+ *
+ * @param conn The connection the region is being read via.
+ * @param error 0 if the chunk was read successfully. If non-zero, the read has
+ *              failed, no further chunks will be delivered and last is true.
+ * @param cmd_rc If error is RS_EBAD_RC, the cmd_rc returned in the bad reply.
+ * @param offset The offset of the chunk within the region.
+ * @param data The chunk (within one of the supplied buffers). The buffer is
+ *             reused for a later chunk once this callback returns.
+ * @param last True if this is the last call for the read. The buffers may be
+ *             safely freed/reused as of this call's arrival.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_read_stream_cb)(rs_conn_t *conn,
+                                  int error,
+                                  uint16_t cmd_rc,
+                                  uint32_t offset,
+                                  uv_buf_t data,
+                                  bool last,
+                                  void *cb_data);
+
+/**
+ * Read a large region using a ring of buffers, passing each chunk of the
+ * region to a callback, strictly in order, as soon as it and all chunks before
+ * it have been read.
+ *
+ * Each buffer holds one chunk and has a chunk read into it as soon as it is
+ * free, so up to n_bufs chunks are read at once (their responses arriving in
+ * any order). Memory use is thus bounded by the buffers supplied rather than by
+ * the region's length. To keep the window full, supply at least n_outstanding
+ * buffers whose lengths are multiples of scp_data_length.
+ *
+ * @param address The address of the region to read.
+ * @param length The length of the region (bytes).
+ * @param n_bufs The number of buffers in the ring.
+ * @param bufs The buffers (the array is copied though the buffers themselves
+ *             must remain valid until the last callback). The length of each
+ *             gives the size of the chunks read into it.
+ * @param cb Called for each chunk and on failure.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully started, non-zero otherwise.
+ */
+int rs_read_stream(rs_conn_t *conn,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint32_t address,
+                   size_t length,
+                   unsigned int n_bufs,
+                   const uv_buf_t *bufs,
+                   rs_read_stream_cb cb,
+                   void *cb_data);
+
+/**
+ * Callback function type for rs_write_file/rs_read_file completion.
+ *
+ * @param conn The connection the region was written/read via.
+ * @param error 0 if the whole region was transferred. Negative errors
+ *              correspond with libuv errors (including those from file
+ *              operations, e.g. UV_EOF if the file ended before the region
+ *              did), positive errors with Rig SCP.
+ * @param cmd_rc If error is RS_EBAD_RC, the cmd_rc returned in the bad reply.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_file_cb)(rs_conn_t *conn,
+                           int error,
+                           uint16_t cmd_rc,
+                           void *cb_data);
+
+/**
+ * Write a region of a machine's memory with data from a file.
+ *
+ * The file is read a chunk at a time, using libuv fs requests (and so without
+ * blocking the event loop), into a small ring of buffers from which each chunk
+ * is written to the machine. Memory use is thus independent of the length of
+ * the region. (Files which are already mapped into memory may simply be
+ * passed to rs_write instead.)
+ *
+ * @param address The address of the region to write.
+ * @param fd The file to read, which must remain open until the callback.
+ * @param file_offset The offset within the file of the data.
+ * @param length The length of the region (bytes).
+ * @param cb Called once the whole region has been written (or failed).
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully started, non-zero otherwise.
+ */
+int rs_write_file(rs_conn_t *conn,
+                  uint16_t dest_addr,
+                  uint8_t dest_cpu,
+                  uint32_t address,
+                  uv_file fd,
+                  int64_t file_offset,
+                  size_t length,
+                  rs_file_cb cb,
+                  void *cb_data);
+
+/**
+ * As rs_write_file but reading a region of a machine's memory into a file
+ * (which must be open for writing).
+ */
+int rs_read_file(rs_conn_t *conn,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint32_t address,
+                 uv_file fd,
+                 int64_t file_offset,
+                 size_t length,
+                 rs_file_cb cb,
+                 void *cb_data);
+
+/**
+ * Callback function type for rs_fill completion.
+ *
+ * @param conn The connection the region was filled via.
+ * @param error 0 if the whole region was filled (as for rs_rw_cb).
+ * @param cmd_rc If error is RS_EBAD_RC, the cmd_rc returned in the bad reply.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_fill_cb)(rs_conn_t *conn,
+                           int error,
+                           uint16_t cmd_rc,
+                           void *cb_data);
+
+/**
+ * Fill a region of memory with a repeated 32-bit word.
+ *
+ * The word-aligned part of the region is filled by the machine using a single
+ * SC&MP CMD_FILL command (and so costs a single packet regardless of length)
+ * while any unaligned bytes at either end are written using CMD_WRITE.
+ *
+ * Should the request queue be full (see max_queue_length in rs_conn_opts_t),
+ * the remaining parts of the fill are queued as earlier parts complete. Any
+ * part which cannot be queued fails with RS_EFULL or UV_ENOMEM, reported via
+ * the callback.
+ *
+ * @param address The address of the region to fill.
+ * @param length The length of the region (bytes).
+ * @param value The word to fill the region with. Bytes at unaligned addresses
+ *              take the corresponding byte of the (little-endian) word as
+ *              though the fill were aligned.
+ * @param cb Called once the whole region has been filled (or failed).
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully queued (in which case the callback will be
+ *          called), RS_EFULL if the request queue was full and nothing could
+ *          be queued or -1 on other failures. On failure nothing is filled and
+ *          the callback will not be called.
+ */
+int rs_fill(rs_conn_t *conn,
+            uint16_t dest_addr,
+            uint8_t dest_cpu,
+            uint32_t address,
+            size_t length,
+            uint32_t value,
+            rs_fill_cb cb,
+            void *cb_data);
+
+/**
+ * A chip (and CPU) to write to using rs_write_multi.
+ */
+typedef struct {
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	
+	// Set once the write completes to the error (as for rs_rw_cb) for this
+	// target and, if the error is RS_EBAD_RC, the cmd_rc of the bad response.
+	int error;
+	uint16_t cmd_rc;
+} rs_target_t;
+
+/**
+ * Callback function type for rs_write_multi completion.
+ *
+ * @param conn The connection the targets were written via.
+ * @param error 0 if every target was written successfully, otherwise the error
+ *              of the first target (in array order) to fail.
+ * @param n_failed The number of targets which failed (whose error fields are
+ *                 non-zero).
+ * @param n_targets The number of targets.
+ * @param targets The targets supplied, which may be safely freed/reused as of
+ *                this callback's arrival.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_write_multi_cb)(rs_conn_t *conn,
+                                  int error,
+                                  unsigned int n_failed,
+                                  unsigned int n_targets,
+                                  rs_target_t *targets,
+                                  void *cb_data);
+
+/**
+ * Write the same data to the same address on many chips.
+ *
+ * The data is written a packet at a time to each target in turn so that the
+ * packets in flight are spread across the targets (avoiding overwhelming any
+ * one chip) and is never copied. Writing to a target stops at its first
+ * failure while the remaining targets continue.
+ *
+ * @param n_targets The number of targets.
+ * @param targets The targets to write to. This array must remain valid until
+ *                the callback function is called.
+ * @param address The address to write the data to on every target.
+ * @param data The data to write. Must remain valid until the callback function
+ *             is called.
+ * @param cb Called once every target has been written (or failed).
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully started, non-zero otherwise.
+ */
+int rs_write_multi(rs_conn_t *conn,
+                   unsigned int n_targets,
+                   rs_target_t *targets,
+                   uint32_t address,
+                   uv_buf_t data,
+                   rs_write_multi_cb cb,
+                   void *cb_data);
+
+/**
+ * Order the requests queued before and after this call.
+ *
+ * Requests (of normal priority) queued after the fence are not dispatched
+ * until every request queued before it has completed, at which point they are
+ * dispatched straight away (rather than only once the user's callbacks have
+ * reacted). For example, data may be written, followed by a fence, a write of
+ * a flag, another fence and finally a signal without waiting for any
+ * callbacks in between.
+ *
+ * If any request before the fence fails, the requests queued after it (up to
+ * the next fence) fail with RS_EFENCE without being sent. Since these count as
+ * failures, the requests after any later fences fail likewise. A failure is
+ * forgotten once no requests remain queued or in progress. Note that SCP
+ * packets (rs_send_scp) whose response has a bad cmd_rc are not failures.
+ *
+ * @returns 0 if the fence was queued, non-zero otherwise.
+ */
+int rs_fence(rs_conn_t *conn);
+
+/**
+ * As rs_fence but for requests of a specified priority. Requests of other
+ * priorities are unaffected.
+ */
+int rs_fence_ex(rs_conn_t *conn, rs_priority_t priority);
+
+/**
+ * Callback function type for notification that a full request queue has
+ * drained.
+ *
+ * @param conn The connection whose queue drained.
+ * @param priority The priority of the queue which drained.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_drain_cb)(rs_conn_t *conn,
+                            rs_priority_t priority,
+                            void *cb_data);
+
+/**
+ * Set a callback to be called when, after a request was rejected with RS_EFULL
+ * (see max_queue_length in rs_conn_opts_t), the request queue concerned has
+ * shrunk to queue_low_water requests, allowing producers to resume. The
+ * callback is called once per rejection episode and may submit requests.
+ *
+ * @param cb The callback to call or NULL to disable the callback.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ */
+void rs_set_drain_cb(rs_conn_t *conn, rs_drain_cb cb, void *cb_data);
+
+/**
+ * Get the maximum length (in bytes) of the SCP data field used by a
+ * connection. When the length is being discovered (see
+ * RS_SCP_DATA_LENGTH_AUTO) this is the provisional length until the probe
+ * completes.
+ */
+size_t rs_get_scp_data_length(rs_conn_t *conn);
+
 /**
  * Free any resources used by an SCP connection.
  *
@@ -220,6 +812,525 @@ int rs_read(rs_conn_t *conn,
 void rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data);
 
 
+/**
+ * Types of event reported to a trace callback (see rs_set_trace_cb).
+ */
+typedef enum {
+	// A request was added to the request queue (by rs_send_scp, rs_read or
+	// rs_write). No seq_num or slot is associated.
+	RS_TRACE_ENQUEUE,
+	
+	// A packet of the request was placed in an outstanding slot (and assigned a
+	// sequence number) ready for transmission.
+	RS_TRACE_DISPATCH,
+	
+	// The (re)transmission of a packet completed.
+	RS_TRACE_SENT,
+	
+	// A packet timed out waiting for a response.
+	RS_TRACE_TIMEOUT,
+	
+	// A response arrived for a packet.
+	RS_TRACE_RESPONSE,
+	
+	// The request completed successfully (immediately before the user's
+	// callback is called).
+	RS_TRACE_COMPLETE,
+	
+	// The request failed or was cancelled (immediately before the user's
+	// callback is called). The error field gives the error.
+	RS_TRACE_CANCEL,
+} rs_trace_event_t;
+
+
+/**
+ * A trace event (see rs_set_trace_cb).
+ */
+typedef struct {
+	// What happened
+	rs_trace_event_t event;
+	
+	// When it happened (from uv_hrtime, nsec)
+	uint64_t time;
+	
+	// An ID unique to the request (within its connection) which the event
+	// relates to.
+	unsigned int request_id;
+	
+	// The sequence number of the packet and the index of the outstanding slot
+	// involved (or -1 if not applicable).
+	int seq_num;
+	int slot;
+	
+	// For RS_TRACE_CANCEL, the error reported to the user's callback (zero
+	// otherwise).
+	int error;
+} rs_trace_t;
+
+
+/**
+ * Callback function type for tracing events.
+ *
+ * @param conn The connection the event occurred in.
+ * @param trace The event. This pointer is only valid during the callback.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_trace_cb)(rs_conn_t *conn,
+                            const rs_trace_t *trace,
+                            void *cb_data);
+
+
+/**
+ * Register a callback to be called whenever a significant event occurs in the
+ * lifecycle of a request (see rs_trace_event_t).
+ *
+ * Tracing is only available if Rig SCP was compiled with RS_TRACE enabled (the
+ * default). When no callback is registered, tracing has no cost beyond a
+ * single test for each event.
+ *
+ * Warning: the callback must not call any other function in this library.
+ *
+ * @param cb The callback or NULL to stop tracing.
+ * @param cb_data A user-defined pointer to be passed to the callback function.
+ * @returns 0 on success or -1 if tracing is not available.
+ */
+int rs_set_trace_cb(rs_conn_t *conn, rs_trace_cb cb, void *cb_data);
+
+
+/**
+ * Returns a name for the given trace event type.
+ */
+const char *rs_trace_event_name(rs_trace_event_t event);
+
+
+/**
+ * Format a trace event as a JSON object in the Trace Event Format used by
+ * Chrome's about://tracing and Perfetto.
+ *
+ * Each request becomes an async event (keyed by its request_id) whose
+ * lifetime spans from RS_TRACE_ENQUEUE until RS_TRACE_COMPLETE or
+ * RS_TRACE_CANCEL with every other event an instant within it. To produce a
+ * trace file, write the objects, separated by commas, within a JSON array.
+ *
+ * @param trace The event to format.
+ * @param buf The buffer to write the (null-terminated) JSON object into.
+ * @param len The length of buf.
+ * @returns the length of the JSON object, as for snprintf. If this is len or
+ *          more, the output was truncated.
+ */
+int rs_trace_to_json(const rs_trace_t *trace, char *buf, size_t len);
+
+
+/**
+ * The number of buckets in the RTT histogram of rs_stats_t.
+ */
+#define RS_STATS_RTT_BUCKETS 24
+
+
+/**
+ * Statistics describing the activity of a connection (see rs_get_stats).
+ *
+ * Unless otherwise stated, values count events since the connection was
+ * created or the most recent call to rs_reset_stats.
+ */
+typedef struct {
+	// Packets transmitted (including retransmissions) and their total size in
+	// bytes (excluding UDP/IP headers).
+	uint64_t n_packets_sent;
+	uint64_t n_bytes_sent;
+	
+	// Packets received (including duplicate and stale responses) and their total
+	// size in bytes (excluding UDP/IP headers).
+	uint64_t n_packets_received;
+	uint64_t n_bytes_received;
+	
+	// Retransmissions made after a packet's timeout expired and fast
+	// retransmissions (see rs_conn_opts_t.fast_retransmit).
+	uint64_t n_retransmits_timeout;
+	uint64_t n_retransmits_fast;
+	
+	// Requests which failed with RS_ETIMEOUT and RS_EBAD_RC respectively.
+	uint64_t n_timeouts;
+	uint64_t n_bad_rc;
+	
+	// Read/write packets retried following a response code in
+	// rs_conn_opts_t.retry_rcs.
+	uint64_t n_retries_rc;
+	
+	// Read/write requests merged into an earlier queued request (see
+	// rs_conn_opts_t.coalesce).
+	uint64_t n_coalesced;
+	
+	// Responses which arrived while every preallocated receive buffer was in
+	// use (and so were received into a buffer allocated with malloc instead).
+	uint64_t n_recv_pool_exhausted;
+	
+	// The current number of requests in the request queue and the largest
+	// number seen.
+	size_t queue_depth;
+	size_t queue_depth_peak;
+	
+	// The current number of occupied outstanding slots and the mean number
+	// occupied at the moment each packet was transmitted (a measure of window
+	// utilisation).
+	unsigned int n_active;
+	double mean_active;
+	
+	// The current window size (see rs_conn_opts_t.dynamic_window, always
+	// n_outstanding otherwise).
+	unsigned int window;
+	
+	// The current retransmission timeout (msec) for a packet's first
+	// transmission (see rs_conn_opts_t.adaptive_timeout).
+	uint64_t rto;
+	
+	// The smoothed round-trip time and its mean deviation (usec) or zero if no
+	// RTTs have been measured.
+	uint64_t srtt;
+	uint64_t rttvar;
+	
+	// A histogram of measured round-trip times. Bucket 0 counts RTTs under 2
+	// usec, bucket i counts RTTs from 2^i usec up to 2^(i+1) usec and the last
+	// bucket also counts all longer RTTs. RTTs are only measured for packets
+	// which were not retransmitted.
+	uint64_t rtt_histogram[RS_STATS_RTT_BUCKETS];
+} rs_stats_t;
+
+
+/**
+ * Get statistics describing the activity of a connection.
+ *
+ * Statistics are only gathered if Rig SCP was compiled with RS_STATS enabled
+ * (the default).
+ *
+ * @param conn The connection to get the statistics of.
+ * @param stats Set to the statistics (or zeroed if statistics are not
+ *              gathered).
+ * @returns 0 on success or -1 if statistics are not gathered.
+ */
+int rs_get_stats(rs_conn_t *conn, rs_stats_t *stats);
+
+
+/**
+ * Reset the counters of a connection's statistics to zero.
+ *
+ * Values describing the current state of the connection (e.g. the queue depth
+ * and RTT estimate) are unaffected and the peak queue depth is reset to the
+ * current depth.
+ */
+void rs_reset_stats(rs_conn_t *conn);
+
+
+struct rs_pool;
+/**
+ * A pool of SCP connections, one per SpiNNaker board, which routes each
+ * request to the board with the Ethernet connection nearest the destination
+ * chip (see rs_pool_init).
+ */
+typedef struct rs_pool rs_pool_t;
+
+
+/**
+ * A region of memory on a particular chip to be read or written as part of a
+ * pool-wide operation (see rs_pool_read_regions).
+ */
+typedef struct {
+	// The chip (X<<8 | Y) and CPU number to send the read/write to
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	
+	// The address and buffer to read/write (as for rs_read/rs_write)
+	uint32_t address;
+	uv_buf_t data;
+} rs_pool_region_t;
+
+
+/**
+ * Callback function type for pool-wide operations, called once every part of
+ * the operation has completed.
+ *
+ * @param pool The pool the operation was submitted to.
+ * @param error 0 if every part of the operation succeeded, otherwise the error
+ *              reported by the first part to fail (as for rs_rw_cb).
+ * @param cmd_rc The command return code accompanying error (if applicable).
+ * @param cb_data The user-supplied pointer.
+ */
+typedef void (*rs_pool_cb)(rs_pool_t *pool,
+                           int error,
+                           uint16_t cmd_rc,
+                           void *cb_data);
+
+
+/**
+ * Create an (initially empty) pool of connections. Connections are added with
+ * rs_pool_add_board.
+ *
+ * @param loop The libuv event loop to use.
+ * @param opts The options used for every connection in the pool (copied,
+ *             along with the array of retry_rcs).
+ * @returns a pointer to the pool or NULL on failure. The pool must be freed
+ *          using rs_pool_free.
+ */
+rs_pool_t *rs_pool_init(uv_loop_t *loop, const rs_conn_opts_t *opts);
+
+
+/**
+ * Add a board to a pool, creating a connection to it.
+ *
+ * Once boards have been added, requests for a chip are sent via the board whose
+ * Ethernet chip is nearest (in hops, ignoring wrap-around links) unless
+ * explicitly mapped otherwise using rs_pool_map_chip.
+ *
+ * @param addr The address of the board's Ethernet connection (copied).
+ * @param eth_chip The coordinates (X<<8 | Y) of the board's Ethernet chip.
+ * @returns the index of the board or -1 on failure.
+ */
+int rs_pool_add_board(rs_pool_t *pool,
+                      const struct sockaddr *addr,
+                      uint16_t eth_chip);
+
+
+/**
+ * Explicitly route requests for a particular chip via a given board.
+ *
+ * @param chip The chip coordinates (X<<8 | Y).
+ * @param board The index of the board (as returned by rs_pool_add_board).
+ * @returns 0 on success or -1 if the board does not exist or memory could not
+ *          be allocated.
+ */
+int rs_pool_map_chip(rs_pool_t *pool, uint16_t chip, int board);
+
+
+/**
+ * Get the connection used for requests to a given chip.
+ *
+ * @returns the connection or NULL if the pool has no boards.
+ */
+rs_conn_t *rs_pool_conn(rs_pool_t *pool, uint16_t chip);
+
+
+/**
+ * As rs_send_scp but sent via the connection for dest_addr.
+ *
+ * @returns 0 on success or -1 if the pool has no boards or the request could
+ *          not be queued.
+ */
+int rs_pool_send_scp(rs_pool_t *pool,
+                     uint16_t dest_addr,
+                     uint8_t dest_cpu,
+                     uint16_t cmd_rc,
+                     unsigned int n_args_send,
+                     unsigned int n_args_recv,
+                     uint32_t arg1,
+                     uint32_t arg2,
+                     uint32_t arg3,
+                     uv_buf_t data,
+                     size_t data_max_len,
+                     rs_send_scp_cb cb,
+                     void *cb_data);
+
+/**
+ * As rs_write but sent via the connection for dest_addr.
+ */
+int rs_pool_write(rs_pool_t *pool,
+                  uint16_t dest_addr,
+                  uint8_t dest_cpu,
+                  uint32_t address,
+                  uv_buf_t data,
+                  rs_rw_cb cb,
+                  void *cb_data);
+
+/**
+ * As rs_read but sent via the connection for dest_addr.
+ */
+int rs_pool_read(rs_pool_t *pool,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint32_t address,
+                 uv_buf_t data,
+                 rs_rw_cb cb,
+                 void *cb_data);
+
+
+/**
+ * Read a set of regions, potentially on many different chips, with each region
+ * read via the connection for its chip. The reads proceed in parallel across
+ * all boards and a single callback is made once all have completed.
+ *
+ * Should a connection's request queue be full (see max_queue_length in
+ * rs_conn_opts_t), the remaining regions are queued as earlier regions
+ * complete. Any region which cannot be queued fails with RS_EFULL or
+ * UV_ENOMEM, reported via the callback.
+ *
+ * @param n_regions The number of regions to read.
+ * @param regions The regions to read (copied).
+ * @param cb Called once all regions have been read (or failed).
+ * @returns 0 if successfully queued (in which case the callback will be
+ *          called), RS_EFULL if the request queue was full and no region
+ *          could be queued or -1 on other failures (including regions with no
+ *          connection). On failure nothing is read and the callback will not
+ *          be called.
+ */
+int rs_pool_read_regions(rs_pool_t *pool,
+                         unsigned int n_regions,
+                         const rs_pool_region_t *regions,
+                         rs_pool_cb cb,
+                         void *cb_data);
+
+/**
+ * As rs_pool_read_regions but writing each region.
+ */
+int rs_pool_write_regions(rs_pool_t *pool,
+                          unsigned int n_regions,
+                          const rs_pool_region_t *regions,
+                          rs_pool_cb cb,
+                          void *cb_data);
+
+
+/**
+ * Get the statistics of every connection in a pool combined (see
+ * rs_get_stats). Counters, histograms and values describing the current state
+ * (e.g. queue depths and windows) are summed across connections while the RTT
+ * estimates and timeouts are the largest of any connection.
+ *
+ * @returns 0 on success or -1 if statistics are not gathered.
+ */
+int rs_pool_get_stats(rs_pool_t *pool, rs_stats_t *stats);
+
+
+/**
+ * Reset the statistics of every connection in a pool (see rs_reset_stats).
+ */
+void rs_pool_reset_stats(rs_pool_t *pool);
+
+
+/**
+ * Free a pool and all of its connections (see rs_free). All outstanding
+ * requests are cancelled.
+ *
+ * @param cb Called once every connection has been freed. May be NULL.
+ */
+void rs_pool_free(rs_pool_t *pool, rs_free_cb cb, void *cb_data);
+
+
+/**
+ * As rs_send_scp_ex but may be called from any thread.
+ *
+ * The request is passed to the connection's event loop thread via a lock-free
+ * queue and queued from there. The callback is made on the connection's loop
+ * thread (or, for connections belonging to an rs_shard_t with a callback loop,
+ * on the thread running that loop). This function must not be called once
+ * rs_free has been called on the connection.
+ *
+ * Since requests are only queued once they reach the loop thread, a failure
+ * to queue is reported via the callback rather than the return value, with
+ * the error:
+ *
+ * * RS_EFULL if the request queue was full (see max_queue_length in
+ *   rs_conn_opts_t). The drain callback (see rs_set_drain_cb) is then called,
+ *   on the loop thread, once the queue has room.
+ * * UV_ENOMEM on other failures.
+ *
+ * @returns 0 if successfully submitted, non-zero otherwise.
+ */
+int rs_send_scp_ts(rs_conn_t *conn,
+                   rs_priority_t priority,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint16_t cmd_rc,
+                   unsigned int n_args_send,
+                   unsigned int n_args_recv,
+                   uint32_t arg1,
+                   uint32_t arg2,
+                   uint32_t arg3,
+                   uv_buf_t data,
+                   size_t data_max_len,
+                   rs_send_scp_cb cb,
+                   void *cb_data);
+
+/**
+ * As rs_write_ex but may be called from any thread (see rs_send_scp_ts).
+ */
+int rs_write_ts(rs_conn_t *conn,
+                rs_priority_t priority,
+                uint16_t dest_addr,
+                uint8_t dest_cpu,
+                uint32_t address,
+                uv_buf_t data,
+                rs_rw_cb cb,
+                void *cb_data);
+
+/**
+ * As rs_read_ex but may be called from any thread (see rs_send_scp_ts).
+ */
+int rs_read_ts(rs_conn_t *conn,
+               rs_priority_t priority,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint32_t address,
+               uv_buf_t data,
+               rs_rw_cb cb,
+               void *cb_data);
+
+
+struct rs_shard;
+/**
+ * A set of threads, each running its own event loop, amongst which SCP
+ * connections are divided (see rs_shard_init).
+ */
+typedef struct rs_shard rs_shard_t;
+
+
+/**
+ * Create a shard of event loop threads.
+ *
+ * Connections are added using rs_shard_add_conn before the threads are started
+ * with rs_shard_start. Requests may then only be submitted to the connections
+ * using the thread-safe functions (rs_send_scp_ts, rs_write_ts and
+ * rs_read_ts).
+ *
+ * @param n_threads The number of threads (and event loops) to create.
+ * @param cb_loop If non-NULL, all request callbacks are made on the thread
+ *                running this loop, otherwise callbacks are made on the thread
+ *                owning the connection. If non-NULL, this function and
+ *                rs_shard_free must be called from the thread running cb_loop.
+ * @returns the new shard or NULL on failure. Must be freed with rs_shard_free.
+ */
+rs_shard_t *rs_shard_init(unsigned int n_threads, uv_loop_t *cb_loop);
+
+
+/**
+ * Add a connection to a shard. Connections are assigned to the shard's threads
+ * in turn. Must be called before rs_shard_start.
+ *
+ * @param addr The address of the machine (as for rs_init_ex). Must remain valid
+ *             until the shard is freed.
+ * @param opts Connection options (as for rs_init_ex).
+ * @returns the new connection or NULL on failure. The connection is freed
+ *          along with the shard and must not be passed to rs_free.
+ */
+rs_conn_t *rs_shard_add_conn(rs_shard_t *shard,
+                             const struct sockaddr *addr,
+                             const rs_conn_opts_t *opts);
+
+
+/**
+ * Start the threads of a shard.
+ *
+ * @returns 0 on success or -1 on failure (in which case the shard must still
+ *          be freed with rs_shard_free).
+ */
+int rs_shard_start(rs_shard_t *shard);
+
+
+/**
+ * Free a shard, waiting for its threads to exit. All incomplete requests are
+ * cancelled with the error RS_EFREE and, if the shard has a callback loop,
+ * their callbacks made before this function returns.
+ */
+void rs_shard_free(rs_shard_t *shard);
+
+
 /**
  * Error number returned when a read or write command receives a bad response
  * code.
@@ -239,6 +1350,20 @@ void rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data);
 #define RS_EFREE 3
 
 
+/**
+ * Error number returned for requests queued after a fence (see rs_fence) when
+ * a request before the fence failed.
+ */
+#define RS_EFENCE 4
+
+
+/**
+ * Error number returned when a request could not be queued because the request
+ * queue was full (see max_queue_length in rs_conn_opts_t).
+ */
+#define RS_EFULL 5
+
+
 /**
  * Returns the error message for the given error code.
  */
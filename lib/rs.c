@@ -5,6 +5,7 @@
 
 #include <sys/socket.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -17,6 +18,33 @@
 #include <rs__scp.h>
 
 
+void
+rs_conn_opts_init(rs_conn_opts_t *opts)
+{
+	opts->scp_data_length = 256;
+	opts->probe_dest_addr = 0;
+	opts->probe_dest_cpu = 0;
+	opts->timeout = 500;
+	opts->adaptive_timeout = false;
+	opts->min_timeout = 10;
+	opts->n_tries = 5;
+	opts->n_outstanding = 1;
+	opts->dynamic_window = false;
+	opts->fast_retransmit = 0;
+	opts->batch = false;
+	opts->n_reserved = 0;
+	opts->n_interleaved = 1;
+	opts->interleave_shortest_first = false;
+	opts->max_in_flight_per_dest = 0;
+	opts->coalesce = false;
+	opts->retry_rcs = NULL;
+	opts->n_retry_rcs = 0;
+	opts->retry_backoff = 1;
+	opts->max_queue_length = 0;
+	opts->queue_low_water = 0;
+}
+
+
 rs_conn_t *
 rs_init(uv_loop_t *loop,
         const struct sockaddr *addr,
@@ -24,6 +52,22 @@ rs_init(uv_loop_t *loop,
         uint64_t timeout,
         unsigned int n_tries,
         unsigned int n_outstanding)
+{
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = scp_data_length;
+	opts.timeout = timeout;
+	opts.n_tries = n_tries;
+	opts.n_outstanding = n_outstanding;
+	
+	return rs_init_ex(loop, addr, &opts);
+}
+
+
+rs_conn_t *
+rs_init_ex(uv_loop_t *loop,
+           const struct sockaddr *addr,
+           const rs_conn_opts_t *opts)
 {
 	rs_conn_t *conn = malloc(sizeof(rs_conn_t));
 	if (!conn) return NULL;
@@ -31,10 +75,57 @@ rs_init(uv_loop_t *loop,
 	// Store arguments
 	conn->loop = loop;
 	conn->addr = addr;
-	conn->scp_data_length = scp_data_length;
-	conn->timeout = timeout;
-	conn->n_tries = n_tries;
-	conn->n_outstanding = n_outstanding;
+	conn->scp_data_length = opts->scp_data_length;
+	
+	// When the SCP data length is to be discovered, a provisional length is
+	// used until the probe completes (see rs__probe.c)
+	conn->probe_state = RS__PROBE_NONE;
+	conn->probe_dest_addr = opts->probe_dest_addr;
+	conn->probe_dest_cpu = opts->probe_dest_cpu;
+	conn->probed_scp_data_length = 0;
+	if (conn->scp_data_length == RS_SCP_DATA_LENGTH_AUTO) {
+		conn->scp_data_length = RS__PROBE_SCP_DATA_LENGTH;
+		conn->probe_state = RS__PROBE_PENDING;
+	}
+	conn->timeout = opts->timeout;
+	conn->adaptive_timeout = opts->adaptive_timeout;
+	conn->min_timeout = MIN(opts->min_timeout, opts->timeout);
+	conn->n_tries = opts->n_tries;
+	conn->n_outstanding = opts->n_outstanding;
+	conn->dynamic_window = opts->dynamic_window;
+	conn->fast_retransmit = opts->fast_retransmit;
+	conn->batch = opts->batch;
+	
+	// At least one slot must remain available to normal priority requests
+	conn->n_reserved = MIN(opts->n_reserved,
+	                       conn->n_outstanding ? conn->n_outstanding - 1 : 0);
+	
+	conn->n_interleaved = MAX(opts->n_interleaved, 1);
+	conn->shortest_first = opts->interleave_shortest_first;
+	conn->max_in_flight_per_dest = opts->max_in_flight_per_dest;
+	conn->coalesce = opts->coalesce;
+	
+	memset(conn->retry_rcs, 0, sizeof(conn->retry_rcs));
+	unsigned int r;
+	for (r = 0; r < opts->n_retry_rcs; r++) {
+		uint16_t rc = opts->retry_rcs[r];
+		if (rc < 256)
+			conn->retry_rcs[rc / 8] |= 1u << (rc % 8);
+	}
+	conn->retry_backoff = MAX(opts->retry_backoff, 1);
+	
+	conn->max_queue_length = opts->max_queue_length;
+	conn->queue_low_water = opts->queue_low_water;
+	conn->drain_cb = NULL;
+	conn->drain_cb_data = NULL;
+	
+	// No requests have failed yet
+	int p;
+	for (p = 0; p < RS_N_PRIORITIES; p++) {
+		conn->fence_failed[p] = false;
+		conn->fence_cancelling[p] = false;
+		conn->queue_was_full[p] = false;
+	}
 	
 	// Clear the 'free' flag since we don't wish to free the strucutre
 	// immediately!
@@ -43,16 +134,62 @@ rs_init(uv_loop_t *loop,
 	
 	// Initialise counters
 	conn->next_seq_num = 0;
-	conn->next_rw_id = 0;
+	conn->next_req_id = 0;
+	
+#ifdef RS_TRACE
+	conn->trace_cb = NULL;
+	conn->trace_cb_data = NULL;
+#endif
+	conn->n_active = 0;
+	
+	// No RTT measurements have been made yet
+	conn->rtt_measured = false;
+	conn->srtt = 0;
+	conn->rttvar = 0;
+	conn->rto = conn->timeout;
+	
+#ifdef RS_STATS
+	memset(&(conn->stats), 0, sizeof(rs_stats_t));
+	conn->stats_active_sum = 0;
+#endif
+	
+	// The window starts fully open
+	conn->window = conn->n_outstanding;
+	conn->window_growth = 0;
+	conn->window_recovering = false;
+	conn->window_recovery_seq = 0;
+	
+	// Nothing has been transmitted yet
+	conn->tx_head = NULL;
+	conn->tx_tail = NULL;
+	conn->next_tx_num = 0;
+	
+#ifdef RS_ZERO_COPY_READ
+	conn->zc_os = NULL;
+#endif
 	
-	// Initialise the socket
-	if (uv_udp_init(conn->loop, &(conn->udp_handle))) {
+	// Initialise the socket (asking libuv to use recvmmsg when batching)
+	int err;
+#ifdef RS__HAVE_RECVMMSG
+	if (conn->batch)
+		err = uv_udp_init_ex(conn->loop, &(conn->udp_handle),
+		                     AF_UNSPEC | UV_UDP_RECVMMSG);
+	else
+#endif
+		err = uv_udp_init(conn->loop, &(conn->udp_handle));
+	if (err) {
 		// Socket init failed!
 		free(conn);
 		return NULL;
 	}
 	conn->udp_handle_closed = false;
 	
+#ifdef RS__HAVE_RECVMMSG
+	conn->recvmmsg = conn->batch && uv_udp_using_recvmmsg(&(conn->udp_handle));
+#else
+	conn->recvmmsg = false;
+#endif
+	
 	// Pass a pointer to the SCP connection whenever UDP data arrives
 	conn->udp_handle.data = (void *)conn;
 	
@@ -67,19 +204,89 @@ rs_init(uv_loop_t *loop,
 	}
 	
 	
-	// Create a queue for requests to be placed in
-	conn->request_queue = rs__q_init(sizeof(rs__req_t));
-	if (!conn->request_queue) {
+	// Create a queue for requests of each priority to be placed in
+	if (rs__init_request_queues(conn)) {
 		// Queue allocation failed!
 		// XXX: Doesn't close UDP handle before freeing!
 		free(conn);
 		return NULL;
 	}
 	
+	// Preallocate the buffers incoming packets will be received into. Since each
+	// outstanding slot awaits at most one response at a time, one buffer per slot
+	// is allocated, each large enough for the largest SCP packet which may arrive
+	// (plus two padding bytes). When libuv is using recvmmsg, it instead requires
+	// a single large buffer which it splits into fixed-size chunks, one per
+	// packet, so a single buffer with a chunk per slot is used.
+	if (conn->recvmmsg)
+		conn->recv_pool = rs__buf_pool_init(
+			RS__RECVMMSG_CHUNK_SIZE *
+				MAX(MIN(conn->n_outstanding, RS__RECVMMSG_MAX_CHUNKS), 1),
+			1);
+	else
+		conn->recv_pool = rs__buf_pool_init(
+			RS__SIZEOF_SCP_PACKET(3, conn->scp_data_length) + 2,
+			conn->n_outstanding);
+	conn->old_recv_pool = NULL;
+	if (!conn->recv_pool) {
+		rs__free_request_queues(conn);
+		// XXX: Doesn't close UDP handle before freeing!
+		free(conn);
+		return NULL;
+	}
+	
+	// Set up the indices of outstanding slots with a power-of-two number of
+	// buckets at least as large as the number of outstanding slots.
+	unsigned int n_buckets = 1;
+	while (n_buckets < conn->n_outstanding)
+		n_buckets <<= 1;
+	conn->index_mask = n_buckets - 1;
+	conn->seq_index = calloc(n_buckets, sizeof(rs__outstanding_t *));
+	conn->rw_index = calloc(n_buckets, sizeof(rs__outstanding_t *));
+	conn->dest_index = calloc(n_buckets, sizeof(rs__outstanding_t *));
+	
+	// Set up space for batches of packets (one entry per outstanding slot)
+	conn->batching = false;
+	conn->n_batched = 0;
+	conn->batch_slots = NULL;
+#ifdef RS__HAVE_SENDMMSG
+	conn->batch_msgs = NULL;
+	conn->batch_iovs = NULL;
+#endif
+	bool batch_alloc_failed = false;
+	if (conn->batch) {
+		conn->batch_slots = malloc(sizeof(rs__outstanding_t *) *
+		                           conn->n_outstanding);
+		batch_alloc_failed |= !conn->batch_slots;
+#ifdef RS__HAVE_SENDMMSG
+		conn->batch_msgs = calloc(conn->n_outstanding, sizeof(struct mmsghdr));
+		conn->batch_iovs = calloc(2 * conn->n_outstanding, sizeof(struct iovec));
+		batch_alloc_failed |= !conn->batch_msgs || !conn->batch_iovs;
+#endif
+	}
+	
+	if (!conn->seq_index || !conn->rw_index || !conn->dest_index ||
+	    batch_alloc_failed) {
+		rs__free_batch(conn);
+		free(conn->seq_index);
+		free(conn->rw_index);
+		free(conn->dest_index);
+		rs__buf_pool_free(conn->recv_pool);
+		rs__free_request_queues(conn);
+		// XXX: Doesn't close UDP handle before freeing!
+		free(conn);
+		return NULL;
+	}
+	
 	// Set up the outstanding slots
 	conn->outstanding = calloc(conn->n_outstanding, sizeof(rs__outstanding_t));
 	if (!conn->outstanding) {
-		rs__q_free(conn->request_queue);
+		rs__free_batch(conn);
+		free(conn->seq_index);
+		free(conn->rw_index);
+		free(conn->dest_index);
+		rs__buf_pool_free(conn->recv_pool);
+		rs__free_request_queues(conn);
 		// XXX: Doesn't close UDP handle before freeing!
 		free(conn);
 		return NULL;
@@ -91,6 +298,9 @@ rs_init(uv_loop_t *loop,
 		conn->outstanding[i].active = false;
 		conn->outstanding[i].send_req_active = false;
 		conn->outstanding[i].cancelled = false;
+		conn->outstanding[i].indexed = false;
+		conn->outstanding[i].batched = false;
+		conn->outstanding[i].tx_listed = false;
 		
 		// Allocate sufficient space to buffer SCP packet data (and two empty
 		// padding bytes required when transmitting SCP over UDP).
@@ -99,31 +309,79 @@ rs_init(uv_loop_t *loop,
 		if (!conn->outstanding[i].packet.base) {
 			while (--i >= 0)
 				free(conn->outstanding[i].packet.base);
-			rs__q_free(conn->request_queue);
+			rs__free_batch(conn);
+			free(conn->seq_index);
+			free(conn->rw_index);
+			free(conn->dest_index);
+			rs__buf_pool_free(conn->recv_pool);
+			rs__free_request_queues(conn);
 			free(conn);
 			return NULL;
 		}
 		// Zero the two included padding bytes
 		memset(conn->outstanding[i].packet.base, 0, 2);
 		
-		// Initialise the timer
-		if (uv_timer_init(conn->loop, &(conn->outstanding[i].timer_handle))) {
-			// Timer init failed, cleanup
-			while (i >= 0)
-				// XXX: Doesn't close timer handles before freeing!
-				free(conn->outstanding[i--].packet.base);
-			rs__q_free(conn->request_queue);
-			free(conn);
-			return NULL;
-		}
-		conn->outstanding[i].timer_handle_closed = false;
+		conn->outstanding[i].timer_active = false;
+		conn->outstanding[i].retry_pending = false;
 		
-		// Set the user data for UDP requests and timer ticks.
+		// Set the user data for UDP requests.
 		conn->outstanding[i].send_req.data = (void *)&(conn->outstanding[i]);
-		conn->outstanding[i].timer_handle.data =
-			(void *)&(conn->outstanding[i]);
 	}
 	
+	// Initialise the timer which handles all timeouts
+	if (uv_timer_init(conn->loop, &(conn->timer_handle))) {
+		// Timer init failed, cleanup
+		for (i = 0; i < conn->n_outstanding; i++)
+			free(conn->outstanding[i].packet.base);
+		free(conn->outstanding);
+		rs__free_batch(conn);
+		free(conn->seq_index);
+		free(conn->rw_index);
+		free(conn->dest_index);
+		rs__buf_pool_free(conn->recv_pool);
+		rs__free_request_queues(conn);
+		// XXX: Doesn't close UDP handle before freeing!
+		free(conn);
+		return NULL;
+	}
+	conn->timer_handle_closed = false;
+	conn->timer_handle.data = (void *)conn;
+	
+	// Initialise the async handle through which requests arrive from other
+	// threads
+	if (uv_async_init(conn->loop, &(conn->ts_async_handle), rs__ts_async_cb)) {
+		// XXX: Doesn't close UDP or timer handles before freeing!
+		for (i = 0; i < conn->n_outstanding; i++)
+			free(conn->outstanding[i].packet.base);
+		free(conn->outstanding);
+		rs__free_batch(conn);
+		free(conn->seq_index);
+		free(conn->rw_index);
+		free(conn->dest_index);
+		rs__buf_pool_free(conn->recv_pool);
+		rs__free_request_queues(conn);
+		free(conn);
+		return NULL;
+	}
+	conn->ts_async_handle_closed = false;
+	conn->ts_async_handle.data = (void *)conn;
+	rs__mpsc_init(&(conn->ts_queue));
+	conn->ts_cb_queue = NULL;
+	conn->timer_head = NULL;
+	conn->timer_tail = NULL;
+	conn->timer_due = 0;
+	
+	// All slots start out free (pushed in reverse order so that low-numbered
+	// slots are used first)
+	conn->free_slots = NULL;
+	for (i = conn->n_outstanding - 1; i >= 0; i--)
+		rs__push_free_slot(conn, &(conn->outstanding[i]));
+	
+	// Start discovering the SCP data length (carrying on with the provisional
+	// length if the probe can't even be queued)
+	if (conn->probe_state == RS__PROBE_PENDING && rs__probe_start(conn))
+		conn->probe_state = RS__PROBE_NONE;
+	
 	return conn;
 }
 
@@ -143,9 +401,32 @@ rs_send_scp(rs_conn_t *conn,
             rs_send_scp_cb cb,
             void *cb_data)
 {
-	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
+	return rs_send_scp_ex(conn, RS_PRIORITY_NORMAL,
+	                      dest_addr, dest_cpu, cmd_rc,
+	                      n_args_send, n_args_recv, arg1, arg2, arg3,
+	                      data, data_max_len, cb, cb_data);
+}
+
+
+int
+rs_send_scp_ex(rs_conn_t *conn,
+               rs_priority_t priority,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint16_t cmd_rc,
+               unsigned int n_args_send,
+               unsigned int n_args_recv,
+               uint32_t arg1,
+               uint32_t arg2,
+               uint32_t arg3,
+               uv_buf_t data,
+               size_t data_max_len,
+               rs_send_scp_cb cb,
+               void *cb_data)
+{
+	rs__req_t *req = rs__enqueue(conn, priority);
 	if (!req)
-		return -1;
+		return rs__enqueue_error(conn, priority);
 	
 	// Queue up the supplied request
 	req->type = RS__REQ_SCP_PACKET;
@@ -162,7 +443,7 @@ rs_send_scp(rs_conn_t *conn,
 	req->data.scp_packet.cb = cb;
 	req->cb_data = cb_data;
 	
-	rs__process_request_queue(conn);
+	rs__enqueued(conn, req);
 	
 	return 0;
 }
@@ -177,22 +458,47 @@ rs_write(rs_conn_t *conn,
          rs_rw_cb cb,
          void *cb_data)
 {
-	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
+	return rs_write_ex(conn, RS_PRIORITY_NORMAL,
+	                   dest_addr, dest_cpu, address, data, cb, cb_data);
+}
+
+
+int
+rs_write_ex(rs_conn_t *conn,
+            rs_priority_t priority,
+            uint16_t dest_addr,
+            uint8_t dest_cpu,
+            uint32_t address,
+            uv_buf_t data,
+            rs_rw_cb cb,
+            void *cb_data)
+{
+	if (conn->coalesce) {
+		// Should merging fail (for want of memory), queue the request alone
+		if (rs__coalesce(conn, priority, RS__REQ_WRITE,
+		                 dest_addr, dest_cpu, address, data,
+		                 cb, cb_data) > 0)
+			return 0;
+	}
+	
+	rs__req_t *req = rs__enqueue(conn, priority);
 	if (!req)
-		return -1;
+		return rs__enqueue_error(conn, priority);
 	
 	// Queue up the supplied request
 	req->type = RS__REQ_WRITE;
 	req->dest_addr = dest_addr;
 	req->dest_cpu = dest_cpu;
-	req->data.rw.id = conn->next_rw_id++;
+	req->data.rw.id = req->id;
 	req->data.rw.address = address;
 	req->data.rw.data = data;
 	req->data.rw.orig_data = data;
 	req->data.rw.cb = cb;
 	req->cb_data = cb_data;
+	rs__pack_scp_template(req->data.rw.header, dest_addr, dest_cpu,
+	                      RS__SCP_CMD_WRITE);
 	
-	rs__process_request_queue(conn);
+	rs__enqueued(conn, req);
 	
 	return 0;
 }
@@ -207,24 +513,166 @@ rs_read(rs_conn_t *conn,
         rs_rw_cb cb,
         void *cb_data)
 {
-	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
+	return rs_read_ex(conn, RS_PRIORITY_NORMAL,
+	                  dest_addr, dest_cpu, address, data, cb, cb_data);
+}
+
+
+int
+rs_read_ex(rs_conn_t *conn,
+           rs_priority_t priority,
+           uint16_t dest_addr,
+           uint8_t dest_cpu,
+           uint32_t address,
+           uv_buf_t data,
+           rs_rw_cb cb,
+           void *cb_data)
+{
+	if (conn->coalesce) {
+		// Should merging fail (for want of memory), queue the request alone
+		if (rs__coalesce(conn, priority, RS__REQ_READ,
+		                 dest_addr, dest_cpu, address, data,
+		                 cb, cb_data) > 0)
+			return 0;
+	}
+	
+	rs__req_t *req = rs__enqueue(conn, priority);
 	if (!req)
-		return -1;
+		return rs__enqueue_error(conn, priority);
 	
 	// Queue up the supplied request
 	req->type = RS__REQ_READ;
 	req->dest_addr = dest_addr;
 	req->dest_cpu = dest_cpu;
-	req->data.rw.id = conn->next_rw_id++;
+	req->data.rw.id = req->id;
 	req->data.rw.address = address;
 	req->data.rw.data = data;
 	req->data.rw.orig_data = data;
 	req->data.rw.cb = cb;
 	req->cb_data = cb_data;
+	rs__pack_scp_template(req->data.rw.header, dest_addr, dest_cpu,
+	                      RS__SCP_CMD_READ);
+	
+	rs__enqueued(conn, req);
+	
+	return 0;
+}
+
+
+int
+rs_get_stats(rs_conn_t *conn, rs_stats_t *stats)
+{
+#ifdef RS_STATS
+	*stats = conn->stats;
 	
-	rs__process_request_queue(conn);
+	// Fill in the values which describe the current state
+	stats->queue_depth = rs__request_queue_length(conn);
+	stats->n_active = conn->n_active;
+	stats->mean_active = stats->n_packets_sent
+	                     ? (double)conn->stats_active_sum / stats->n_packets_sent
+	                     : 0.0;
+	stats->window = conn->window;
+	stats->rto = conn->rto;
+	stats->srtt = conn->srtt;
+	stats->rttvar = conn->rttvar;
 	
+	// Counted by the receive buffer pool itself
+	stats->n_recv_pool_exhausted = conn->recv_pool->n_exhausted;
+	
+	return 0;
+#else
+	memset(stats, 0, sizeof(rs_stats_t));
+	return -1;
+#endif
+}
+
+
+void
+rs_reset_stats(rs_conn_t *conn)
+{
+#ifdef RS_STATS
+	memset(&(conn->stats), 0, sizeof(rs_stats_t));
+	conn->stats_active_sum = 0;
+	conn->recv_pool->n_exhausted = 0;
+	conn->stats.queue_depth_peak = rs__request_queue_length(conn);
+#endif
+}
+
+
+void
+rs_set_drain_cb(rs_conn_t *conn, rs_drain_cb cb, void *cb_data)
+{
+	conn->drain_cb = cb;
+	conn->drain_cb_data = cb_data;
+}
+
+
+size_t
+rs_get_scp_data_length(rs_conn_t *conn)
+{
+	return conn->scp_data_length;
+}
+
+
+int
+rs_set_trace_cb(rs_conn_t *conn, rs_trace_cb cb, void *cb_data)
+{
+#ifdef RS_TRACE
+	conn->trace_cb = cb;
+	conn->trace_cb_data = cb_data;
 	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+const char *
+rs_trace_event_name(rs_trace_event_t event)
+{
+	switch (event) {
+		case RS_TRACE_ENQUEUE:  return "enqueue";
+		case RS_TRACE_DISPATCH: return "dispatch";
+		case RS_TRACE_SENT:     return "sent";
+		case RS_TRACE_TIMEOUT:  return "timeout";
+		case RS_TRACE_RESPONSE: return "response";
+		case RS_TRACE_COMPLETE: return "complete";
+		case RS_TRACE_CANCEL:   return "cancel";
+		default:                return "unknown";
+	}
+}
+
+
+int
+rs_trace_to_json(const rs_trace_t *trace, char *buf, size_t len)
+{
+	// Requests are async events which begin when enqueued and end on completion
+	// or cancellation, everything else is an async instant event.
+	const char *phase;
+	switch (trace->event) {
+		case RS_TRACE_ENQUEUE:  phase = "b"; break;
+		case RS_TRACE_COMPLETE:
+		case RS_TRACE_CANCEL:   phase = "e"; break;
+		default:                phase = "n"; break;
+	}
+	
+	// Begin and end events must share the same name to be paired up
+	const char *name;
+	if (*phase == 'n')
+		name = rs_trace_event_name(trace->event);
+	else
+		name = "request";
+	
+	// Timestamps are in microseconds
+	return snprintf(buf, len,
+	                "{\"name\":\"%s\",\"cat\":\"rs\",\"ph\":\"%s\","
+	                "\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":0,"
+	                "\"args\":{\"event\":\"%s\",\"seq_num\":%d,"
+	                "\"slot\":%d,\"error\":%d}}",
+	                name, phase,
+	                trace->request_id, trace->time / 1000.0,
+	                rs_trace_event_name(trace->event), trace->seq_num,
+	                trace->slot, trace->error);
 }
 
 
@@ -240,9 +688,9 @@ rs__udp_handle_closed_cb(uv_handle_t *handle)
 void
 rs__timer_handle_closed_cb(uv_handle_t *handle)
 {
-	rs__outstanding_t *os = (rs__outstanding_t *)handle->data;
-	os->timer_handle_closed = true;
-	rs_free(os->conn, NULL, NULL);
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	conn->timer_handle_closed = true;
+	rs_free(conn, NULL, NULL);
 }
 
 
@@ -269,40 +717,55 @@ rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data)
 	if (!uv_is_closing((uv_handle_t *)&(conn->udp_handle)))
 		uv_close((uv_handle_t *)&(conn->udp_handle), rs__udp_handle_closed_cb);
 	
-	for (i = 0; i < conn->n_outstanding; i++) {
-		// Cancel all outstanding requests
+	// Cancel all outstanding requests
+	for (i = 0; i < conn->n_outstanding; i++)
 		rs__cancel_outstanding(conn, &(conn->outstanding[i]), RS_EFREE, -1);
-		
-		// Close the timer handles
-		if (!uv_is_closing((uv_handle_t *)&(conn->outstanding[i].timer_handle)))
-			uv_close((uv_handle_t *)&(conn->outstanding[i].timer_handle),
-			         rs__timer_handle_closed_cb);
-	}
+	
+	// Close the timer handle
+	if (!uv_is_closing((uv_handle_t *)&(conn->timer_handle)))
+		uv_close((uv_handle_t *)&(conn->timer_handle), rs__timer_handle_closed_cb);
+	
+	// Stop accepting requests from other threads and cancel any not yet queued
+	if (!uv_is_closing((uv_handle_t *)&(conn->ts_async_handle)))
+		uv_close((uv_handle_t *)&(conn->ts_async_handle),
+		         rs__ts_async_handle_closed_cb);
+	rs__ts_cancel_all(conn, RS_EFREE);
 	
 	// Cancel all remaining queued requests
 	rs__req_t *req;
-	while ((req = rs__q_remove(conn->request_queue)))
-		rs__cancel_queued(conn, req, RS_EFREE);
+	for (i = RS_N_PRIORITIES - 1; i >= 0; i--) {
+		while (conn->n_active_reqs[i]) {
+			req = &(conn->active_reqs[i][0]);
+			rs__cancel_queued(conn, req, RS_EFREE);
+			rs__remove_active(conn, req);
+		}
+		while ((req = rs__q_remove(conn->request_queue[i])))
+			rs__cancel_queued(conn, req, RS_EFREE);
+	}
 	
-	// Check whether any UDP send requests are active or timer handle closures
-	// (which require us to postpone the free since their handles would get freed
-	// too!)
-	for (i = 0; i < conn->n_outstanding; i++) {
+	// Check whether any UDP send requests are active (which require us to
+	// postpone the free since their handles would get freed too!)
+	for (i = 0; i < conn->n_outstanding; i++)
 		if (conn->outstanding[i].send_req_active)
 			return;
-		if (!conn->outstanding[i].timer_handle_closed)
-			return;
-	}
 	
-	// Likewise with the UDP handle
-	if (!conn->udp_handle_closed)
+	// Likewise with the UDP, timer and async handles
+	if (!conn->udp_handle_closed || !conn->timer_handle_closed ||
+	    !conn->ts_async_handle_closed)
 		return;
 	
 	// Everything has shut down, free all resources now!
 	for (i = 0; i < conn->n_outstanding; i++)
 		free(conn->outstanding[i].packet.base);
 	free(conn->outstanding);
-	rs__q_free(conn->request_queue);
+	rs__free_batch(conn);
+	free(conn->seq_index);
+	free(conn->rw_index);
+	free(conn->dest_index);
+	rs__buf_pool_free(conn->recv_pool);
+	if (conn->old_recv_pool)
+		rs__buf_pool_free(conn->old_recv_pool);
+	rs__free_request_queues(conn);
 	
 	// Just before freeing the main struct, take a copy of the callback function
 	cb = conn->free_cb;
@@ -324,6 +787,12 @@ static const char RS__ETIMEOUT_MSG[] = "SCP command timed out";
 static const char RS__EFREE_NAME[] = "RS_EFREE";
 static const char RS__EFREE_MSG[] = "SCP connection was closed/freed";
 
+static const char RS__EFENCE_NAME[] = "RS_EFENCE";
+static const char RS__EFENCE_MSG[] = "A request before a fence failed";
+
+static const char RS__EFULL_NAME[] = "RS_EFULL";
+static const char RS__EFULL_MSG[] = "Request queue is full";
+
 
 const char *
 rs_strerror(int err)
@@ -332,6 +801,8 @@ rs_strerror(int err)
 		case RS_EBAD_RC:  return RS__EBAD_RC_MSG;
 		case RS_ETIMEOUT: return RS__ETIMEOUT_MSG;
 		case RS_EFREE:    return RS__EFREE_MSG;
+		case RS_EFENCE:   return RS__EFENCE_MSG;
+		case RS_EFULL:    return RS__EFULL_MSG;
 		default:          return uv_strerror(err);
 	}
 }
@@ -344,6 +815,8 @@ rs_err_name(int err)
 		case RS_EBAD_RC:  return RS__EBAD_RC_NAME;
 		case RS_ETIMEOUT: return RS__ETIMEOUT_NAME;
 		case RS_EFREE:    return RS__EFREE_NAME;
+		case RS_EFENCE:   return RS__EFENCE_NAME;
+		case RS_EFULL:    return RS__EFULL_NAME;
 		default:          return uv_err_name(err);
 	}
 }
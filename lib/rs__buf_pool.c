@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs__buf_pool.h>
+
+
+rs__buf_pool_t *
+rs__buf_pool_init(size_t buf_size, unsigned int n_bufs)
+{
+	rs__buf_pool_t *pool = malloc(sizeof(rs__buf_pool_t));
+	if (!pool) return NULL;
+	
+	pool->buf_size = buf_size;
+	pool->n_bufs = n_bufs;
+	pool->n_exhausted = 0;
+	
+	// Allocate all buffers in one go
+	pool->block = malloc(buf_size * n_bufs);
+	if (!pool->block && n_bufs) {
+		free(pool);
+		return NULL;
+	}
+	
+	pool->free_bufs = malloc(sizeof(char *) * n_bufs);
+	if (!pool->free_bufs && n_bufs) {
+		free(pool->block);
+		free(pool);
+		return NULL;
+	}
+	
+	// Initially all buffers are free
+	unsigned int i;
+	for (i = 0; i < n_bufs; i++)
+		pool->free_bufs[i] = pool->block + (i * buf_size);
+	pool->n_free = n_bufs;
+	
+	return pool;
+}
+
+
+void
+rs__buf_pool_alloc(rs__buf_pool_t *pool, uv_buf_t *buf)
+{
+	if (pool->n_free) {
+		buf->base = pool->free_bufs[--pool->n_free];
+	} else {
+		// Pool exhausted, fall back on malloc
+		pool->n_exhausted++;
+		buf->base = malloc(pool->buf_size);
+	}
+	
+	if (buf->base)
+		buf->len = pool->buf_size;
+	else
+		buf->len = 0;
+}
+
+
+void
+rs__buf_pool_release(rs__buf_pool_t *pool, char *base)
+{
+	if (!base)
+		return;
+	
+	// Buffers which lie within the preallocated block are returned to the pool,
+	// anything else must have been allocated when the pool was exhausted.
+	if (rs__buf_pool_contains(pool, base))
+		pool->free_bufs[pool->n_free++] = base;
+	else
+		free(base);
+}
+
+
+bool
+rs__buf_pool_contains(rs__buf_pool_t *pool, char *base)
+{
+	return base >= pool->block &&
+	       base < pool->block + (pool->buf_size * pool->n_bufs);
+}
+
+
+void
+rs__buf_pool_free(rs__buf_pool_t *pool)
+{
+	free(pool->free_bufs);
+	free(pool->block);
+	free(pool);
+}
@@ -0,0 +1,88 @@
+/**
+ * A fixed-size pool of preallocated, equally sized buffers.
+ *
+ * All buffers are allocated in a single block when the pool is created and are
+ * handed out and returned in LIFO order (so recently used, cache-warm buffers
+ * are reused first). If the pool is exhausted, buffers are allocated
+ * individually with malloc and a counter is incremented; such buffers are
+ * transparently freed when returned to the pool.
+ */
+
+#ifndef RS__BUF_POOL_H
+#define RS__BUF_POOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+
+/**
+ * Data type which represents the pool.
+ */
+typedef struct rs__buf_pool {
+	// Size of each buffer in the pool (bytes)
+	size_t buf_size;
+	
+	// Number of buffers preallocated for the pool
+	unsigned int n_bufs;
+	
+	// The single block of memory containing all n_bufs buffers
+	char *block;
+	
+	// A stack of pointers to the buffers not currently in use. The next buffer
+	// to allocate is at free_bufs[n_free - 1].
+	char **free_bufs;
+	unsigned int n_free;
+	
+	// The number of times a buffer was requested while the pool was empty (and
+	// thus a buffer had to be allocated with malloc instead).
+	unsigned int n_exhausted;
+} rs__buf_pool_t;
+
+
+/**
+ * Allocate a new buffer pool.
+ *
+ * @param buf_size The size of each buffer in the pool.
+ * @param n_bufs The number of buffers to preallocate.
+ * @returns a pointer to a newly allocated pool or NULL on failure. This
+ *          structure must be freed using rs__buf_pool_free.
+ */
+rs__buf_pool_t *rs__buf_pool_init(size_t buf_size, unsigned int n_bufs);
+
+
+/**
+ * Take a buffer from the pool.
+ *
+ * If the pool is exhausted a new buffer is allocated using malloc and the
+ * pool's n_exhausted counter is incremented. If this allocation also fails, the
+ * buffer's base is set to NULL and its length to zero.
+ *
+ * @param buf Set to the allocated buffer (whose length will be buf_size).
+ */
+void rs__buf_pool_alloc(rs__buf_pool_t *pool, uv_buf_t *buf);
+
+
+/**
+ * Return a buffer obtained from rs__buf_pool_alloc to the pool.
+ *
+ * @param base The base pointer of the buffer to return. May be NULL in which
+ *             case nothing happens.
+ */
+void rs__buf_pool_release(rs__buf_pool_t *pool, char *base);
+
+
+/**
+ * Does the supplied buffer lie within the pool's preallocated block?
+ */
+bool rs__buf_pool_contains(rs__buf_pool_t *pool, char *base);
+
+
+/**
+ * Free all memory associated with a pool. Any buffers still in use become
+ * invalid.
+ */
+void rs__buf_pool_free(rs__buf_pool_t *pool);
+
+#endif
@@ -18,15 +18,20 @@ void
 rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
                        int error, uint16_t cmd_rc)
 {
-	int i;
-	
 	// Don't bother if the request has already been cancelled
 	if (!os->active || os->cancelled)
 		return;
 	
+	// The user callback (or the dispatching of other packets into the slots
+	// freed by this function) may reuse this slot for another request so a copy
+	// of this slot identifies the request being cancelled.
+	rs__outstanding_t orig_os = *os;
+	
 	// Indicate that this request has been cancelled
 	if (!os->send_req_active) {
 		os->active = false;
+		conn->n_active--;
+		rs__push_free_slot(conn, os);
 	} else {
 		// We can't mark this slot as inactive until the send request completes
 		// (otherwise it would be reused too soon). As a result the cancelled flag
@@ -35,37 +40,28 @@ rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
 		os->cancelled = true;
 	}
 	
-	// Kill the timeout timer (if running)
-	if (uv_is_active((uv_handle_t *)&(os->timer_handle)))
-		uv_timer_stop(&(os->timer_handle));
+	// No responses are awaited for this slot any more
+	rs__index_remove(conn, os);
+	rs__tx_remove(conn, os);
+	
+	// Kill the timeout (if running)
+	rs__timer_stop(conn, os);
 	
 	// This flag is set if this cancellation also requires that another
 	// outstanding slot must also be cancelled(i.e. in the case of reads and
-	// writes).
-	bool others_to_cancel = false;
-	// If this is a read/write, several things may require cancelling
-	if (os->type == RS__REQ_READ || os->type == RS__REQ_WRITE) {
-		// Find the other outstanding slots which are performing the same
-		// read/write request which must be cancelled too.
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *other_os = conn->outstanding + i;
-			if (// Skip things which have already been cancelled
-			    other_os->active && !other_os->cancelled &&
-			    // Skip things that aren't reads or writes (they won't have anything
-			    // to do with this request)
-			    other_os->type == os->type &&
-			    // Skip reads/writes which aren't part of the same request
-			    other_os->data.rw.id == os->data.rw.id) {
-				others_to_cancel = true;
-			}
-		}
-	}
+	// writes). The other outstanding slots which are performing the same
+	// read/write request are those remaining in the read/write index.
+	bool others_to_cancel = (os->type == RS__REQ_READ ||
+	                         os->type == RS__REQ_WRITE) &&
+	                        rs__index_find_rw_sibling(conn, os);
 	
 	// Send the user callback indicating failiure. If this is a read/write
 	// request, multiple outstanding slots may be cancelled and to prevent the
 	// user callback being called multiple times, only the last one to be
 	// cancelled will raise the callback.
 	if (!others_to_cancel) {
+		conn->fence_failed[orig_os.priority] = true;
+		RS__TRACE_OS(conn, RS_TRACE_CANCEL, os, error);
 		switch (os->type) {
 			case RS__REQ_SCP_PACKET:
 				os->data.scp_packet.cb(conn, error,
@@ -79,30 +75,28 @@ rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
 				               cmd_rc, os->data.rw.orig_data,
 				               os->cb_data);
 				break;
+			
+			case RS__REQ_FENCE:
+				// Never dispatched
+				break;
 		}
 	}
 	
 	// If this is a read/write, several things may require cancelling
 	if (os->type == RS__REQ_READ || os->type == RS__REQ_WRITE) {
-		// Find the other outstanding slots which are performing the same read/write
-		// request and cancel them too.
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *other_os = conn->outstanding + i;
-			if (// Skip things which have already been cancelled
-			    other_os->active && !other_os->cancelled &&
-			    // Skip things that aren't reads or writes (they won't have anything
-			    // to do with this request)
-			    other_os->type == os->type &&
-			    // Skip reads/writes which aren't part of the same request
-			    other_os->data.rw.id == os->data.rw.id) {
-				rs__cancel_outstanding(conn, other_os, error, cmd_rc);
-			}
-		}
+		// If this read/write request still has packets to dispatch, remove it
+		// from the active set (before cancelling other slots since each
+		// cancellation frees a slot which would otherwise be filled with another
+		// of its packets)
+		rs__req_t *req = rs__active_rw(conn, &orig_os);
+		if (req)
+			rs__remove_active(conn, req);
 		
-		// If this read/write request is still in the request queue, remove it
-		rs__req_t *req = rs__q_peek(conn->request_queue);
-		if (req && req->type == os->type && req->data.rw.id == os->data.rw.id)
-			rs__q_remove(conn->request_queue);
+		// Find the other outstanding slots which are performing the same read/write
+		// request and cancel them too (cancelling removes them from the index).
+		rs__outstanding_t *other_os;
+		while ((other_os = rs__index_find_rw_sibling(conn, &orig_os)))
+			rs__cancel_outstanding(conn, other_os, error, cmd_rc);
 	}
 	
 	// We have possibly cleared an outstanding packet, attempt to queue a new
@@ -114,8 +108,14 @@ rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
 void
 rs__cancel_queued(rs_conn_t *conn, rs__req_t *req, int error)
 {
+	// Fences have no callback
+	if (req->type == RS__REQ_FENCE)
+		return;
+	
 	// Just raise the associated callback with an error status. The caller will
 	// handle the removing of the request from the queue
+	conn->fence_failed[req->priority] = true;
+	RS__TRACE(conn, RS_TRACE_CANCEL, req->id, -1, -1, error);
 	switch (req->type) {
 		case RS__REQ_SCP_PACKET:
 			req->data.scp_packet.cb(conn, error,
@@ -129,5 +129,9 @@ rs__cancel_queued(rs_conn_t *conn, rs__req_t *req, int error)
 			                0, req->data.rw.orig_data,
 			                req->cb_data);
 			break;
+		
+		case RS__REQ_FENCE:
+			// Handled above
+			break;
 	}
 }
@@ -0,0 +1,203 @@
+/**
+ * Coalescing of small, contiguous reads and writes.
+ *
+ * When a read or write is queued directly behind a (not yet dispatched) read or
+ * write of the same type to the same destination which ends where the new one
+ * begins, and both fit in a single packet, the two are merged. The queued
+ * request is redirected to read/write an internal buffer (into which any data
+ * to write is copied) and its callback replaced with one which, on completion,
+ * copies out any data read and calls each original request's callback in turn.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * One of the original requests merged into a coalesced request.
+ */
+typedef struct {
+	uv_buf_t data;
+	rs_rw_cb cb;
+	void *cb_data;
+} rs__coalesce_part_t;
+
+
+/**
+ * A coalesced request's state (the cb_data of the queued request).
+ */
+typedef struct {
+	// Is the merged request a read (whose data must be copied out)?
+	bool read;
+	
+	// The buffer the merged request reads/writes and its size (the
+	// scp_data_length when the group was started, which may since have changed
+	// if the length was being discovered, see rs__probe.c)
+	char *buf;
+	size_t capacity;
+	
+	// The original requests, in address order
+	rs__coalesce_part_t *parts;
+	unsigned int n_parts;
+	unsigned int max_parts;
+} rs__coalesce_t;
+
+
+static void
+rs__coalesce_cb(rs_conn_t *conn,
+                int error,
+                uint16_t cmd_rc,
+                uv_buf_t data,
+                void *cb_data)
+{
+	rs__coalesce_t *group = (rs__coalesce_t *)cb_data;
+	
+	// Pass on the outcome to each original request
+	size_t offset = 0;
+	unsigned int i;
+	for (i = 0; i < group->n_parts; i++) {
+		rs__coalesce_part_t *part = &(group->parts[i]);
+		if (!error && group->read)
+			memcpy(part->data.base, group->buf + offset, part->data.len);
+		offset += part->data.len;
+		
+		part->cb(conn, error, cmd_rc, part->data, part->cb_data);
+	}
+	
+	free(group->parts);
+	free(group->buf);
+	free(group);
+}
+
+
+/**
+ * Add a part to a coalesced request.
+ *
+ * @returns 0 on success or -1 on failure to allocate memory.
+ */
+static int
+rs__coalesce_add_part(rs__coalesce_t *group,
+                      uv_buf_t data,
+                      rs_rw_cb cb,
+                      void *cb_data)
+{
+	if (group->n_parts == group->max_parts) {
+		unsigned int max_parts = group->max_parts * 2;
+		rs__coalesce_part_t *parts =
+			realloc(group->parts, max_parts * sizeof(rs__coalesce_part_t));
+		if (!parts)
+			return -1;
+		group->parts = parts;
+		group->max_parts = max_parts;
+	}
+	
+	rs__coalesce_part_t *part = &(group->parts[group->n_parts++]);
+	part->data = data;
+	part->cb = cb;
+	part->cb_data = cb_data;
+	return 0;
+}
+
+
+/**
+ * Turn a queued read/write into a coalesced request consisting of just itself.
+ *
+ * @returns the new state or NULL on failure to allocate memory (in which case
+ *          the request is left unchanged).
+ */
+static rs__coalesce_t *
+rs__coalesce_start(rs_conn_t *conn, rs__req_t *req)
+{
+	rs__coalesce_t *group = malloc(sizeof(rs__coalesce_t));
+	if (!group)
+		return NULL;
+	
+	group->read = req->type == RS__REQ_READ;
+	group->capacity = conn->scp_data_length;
+	group->buf = malloc(group->capacity);
+	group->max_parts = 4;
+	group->n_parts = 0;
+	group->parts = malloc(group->max_parts * sizeof(rs__coalesce_part_t));
+	if (!group->buf || !group->parts) {
+		free(group->buf);
+		free(group->parts);
+		free(group);
+		return NULL;
+	}
+	
+	rs__coalesce_add_part(group, req->data.rw.orig_data,
+	                      req->data.rw.cb, req->cb_data);
+	
+	// Redirect the request to the internal buffer
+	if (req->type == RS__REQ_WRITE)
+		memcpy(group->buf, req->data.rw.data.base, req->data.rw.data.len);
+	req->data.rw.data.base = group->buf;
+	req->data.rw.orig_data = req->data.rw.data;
+	req->data.rw.cb = rs__coalesce_cb;
+	req->cb_data = (void *)group;
+	
+	return group;
+}
+
+
+int
+rs__coalesce(rs_conn_t *conn,
+             rs_priority_t priority,
+             rs__req_type_t type,
+             uint16_t dest_addr,
+             uint8_t dest_cpu,
+             uint32_t address,
+             uv_buf_t data,
+             rs_rw_cb cb,
+             void *cb_data)
+{
+	if ((int)priority < 0 || (int)priority >= RS_N_PRIORITIES)
+		return 0;
+	
+	// Only the most recently queued request (which, being queued, has not been
+	// started) may be extended.
+	rs__req_t *req = rs__q_peek_last(conn->request_queue[priority]);
+	if (!req ||
+	    req->type != type ||
+	    req->dest_addr != dest_addr ||
+	    req->dest_cpu != dest_cpu ||
+	    req->data.rw.address + req->data.rw.data.len != address ||
+	    !data.len)
+		return 0;
+	
+	// The merged request must fit in a packet and, if already merged, within
+	// its group's buffer
+	rs__coalesce_t *group = NULL;
+	size_t max_len = conn->scp_data_length;
+	if (req->data.rw.cb == rs__coalesce_cb) {
+		group = (rs__coalesce_t *)req->cb_data;
+		max_len = MIN(max_len, group->capacity);
+	}
+	if (req->data.rw.data.len + data.len > max_len)
+		return 0;
+	
+	if (!group) {
+		group = rs__coalesce_start(conn, req);
+		if (!group)
+			return -1;
+	}
+	
+	if (rs__coalesce_add_part(group, data, cb, cb_data))
+		return -1;
+	
+	if (type == RS__REQ_WRITE)
+		memcpy(group->buf + req->data.rw.data.len, data.base, data.len);
+	req->data.rw.data.len += data.len;
+	req->data.rw.orig_data = req->data.rw.data;
+	
+	RS__STATS_INC(conn, n_coalesced, 1);
+	
+	return 1;
+}
@@ -0,0 +1,103 @@
+/**
+ * Internal functions which implement fast retransmission.
+ *
+ * Slots awaiting responses are kept in a list ordered by the time of their
+ * latest transmission. When a response arrives, every slot transmitted before
+ * the packet responded to has been "overtaken" and once a slot has been
+ * overtaken enough times its packet (or the response to it) is assumed lost and
+ * is retransmitted immediately rather than when its timer expires.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Does transmission number a come before transmission number b (allowing for
+ * wrap-around)?
+ */
+#define RS__TX_BEFORE(a, b) (((int32_t)((uint32_t)(a) - (uint32_t)(b))) < 0)
+
+
+void
+rs__tx_record(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->fast_retransmit)
+		return;
+	
+	rs__tx_remove(conn, os);
+	
+	os->tx_num = conn->next_tx_num++;
+	os->n_overtaken = 0;
+	
+	os->tx_prev = conn->tx_tail;
+	os->tx_next = NULL;
+	if (conn->tx_tail)
+		conn->tx_tail->tx_next = os;
+	else
+		conn->tx_head = os;
+	conn->tx_tail = os;
+	os->tx_listed = true;
+}
+
+
+void
+rs__tx_remove(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!os->tx_listed)
+		return;
+	
+	if (os->tx_prev)
+		os->tx_prev->tx_next = os->tx_next;
+	else
+		conn->tx_head = os->tx_next;
+	
+	if (os->tx_next)
+		os->tx_next->tx_prev = os->tx_prev;
+	else
+		conn->tx_tail = os->tx_prev;
+	
+	os->tx_listed = false;
+}
+
+
+void
+rs__fast_retransmit(rs_conn_t *conn, uint32_t tx_num)
+{
+	rs__outstanding_t *os;
+	
+	// Count the response against everything transmitted before it
+	for (os = conn->tx_head; os && RS__TX_BEFORE(os->tx_num, tx_num);
+	     os = os->tx_next)
+		os->n_overtaken++;
+	
+	// Retransmit slots overtaken too often. Since retransmission moves a slot to
+	// the end of the list (and may cancel other slots on failure) the search
+	// restarts from the head of the list after every retransmission.
+	bool retransmitted = true;
+	while (retransmitted) {
+		retransmitted = false;
+		for (os = conn->tx_head; os && RS__TX_BEFORE(os->tx_num, tx_num);
+		     os = os->tx_next) {
+			if (os->n_overtaken >= conn->fast_retransmit &&
+			    os->n_tries < conn->n_tries &&
+			    os->active && !os->cancelled &&
+			    !os->send_req_active && !os->batched) {
+				rs__timer_stop(conn, os);
+				
+				// A loss has been detected
+				rs__window_decrease(conn, os);
+				RS__STATS_INC(conn, n_retransmits_fast, 1);
+				rs__attempt_transmission(conn, os);
+				
+				retransmitted = true;
+				break;
+			}
+		}
+	}
+}
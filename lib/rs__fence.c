@@ -0,0 +1,108 @@
+/**
+ * Fences between dependent requests.
+ *
+ * A fence is a request (of type RS__REQ_FENCE) in the request queue which is
+ * never dispatched. While a fence is at the head of its queue, no further
+ * requests of that priority are admitted for dispatch (see rs__can_admit) and
+ * once every request of that priority queued before the fence has completed
+ * the fence is removed, allowing the following requests to be dispatched
+ * immediately.
+ *
+ * Failures are tracked per priority since the last fence was passed. If a
+ * request before a fence failed, passing the fence cancels the requests queued
+ * after it up to the next fence. Since these count as failures too, the next
+ * fence will cancel its requests in turn and so a whole chain of dependent
+ * stages is abandoned. The failure flag is cleared whenever a priority becomes
+ * idle so that a failure does not affect unrelated requests submitted later.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Are any requests of the given priority still being dispatched or awaiting
+ * responses?
+ */
+static bool
+rs__fence_busy(rs_conn_t *conn, rs_priority_t priority)
+{
+	if (conn->n_active_reqs[priority])
+		return true;
+	
+	unsigned int i;
+	for (i = 0; i < conn->n_outstanding; i++) {
+		rs__outstanding_t *os = &(conn->outstanding[i]);
+		if (os->active && !os->cancelled && os->priority == priority)
+			return true;
+	}
+	
+	return false;
+}
+
+
+void
+rs__process_fences(rs_conn_t *conn, rs_priority_t priority)
+{
+	// Fences are passed by the outermost call (cancelling a request may result
+	// in this function being called again via its callback)
+	if (conn->fence_cancelling[priority])
+		return;
+	
+	rs__q_t *queue = conn->request_queue[priority];
+	rs__req_t *req;
+	while ((req = (rs__req_t *)rs__q_peek(queue)) &&
+	       req->type == RS__REQ_FENCE) {
+		if (rs__fence_busy(conn, priority))
+			return;
+		
+		rs__q_remove(queue);
+		
+		if (!conn->fence_failed[priority])
+			continue;
+		
+		// A preceding request failed: cancel the requests up to the next fence
+		conn->fence_failed[priority] = false;
+		conn->fence_cancelling[priority] = true;
+		while ((req = (rs__req_t *)rs__q_peek(queue)) &&
+		       req->type != RS__REQ_FENCE) {
+			// The callback may queue further requests so a copy is cancelled
+			rs__req_t cancelled = *req;
+			rs__q_remove(queue);
+			rs__cancel_queued(conn, &cancelled, RS_EFENCE);
+		}
+		conn->fence_cancelling[priority] = false;
+	}
+	
+	// Forget about failures once everything has finished
+	if (conn->fence_failed[priority] && !req &&
+	    !rs__fence_busy(conn, priority))
+		conn->fence_failed[priority] = false;
+}
+
+
+int
+rs_fence_ex(rs_conn_t *conn, rs_priority_t priority)
+{
+	rs__req_t *req = rs__enqueue(conn, priority);
+	if (!req)
+		return rs__enqueue_error(conn, priority);
+	
+	req->type = RS__REQ_FENCE;
+	
+	// The fence may be passed immediately if nothing precedes it
+	rs__process_request_queue(conn);
+	return 0;
+}
+
+
+int
+rs_fence(rs_conn_t *conn)
+{
+	return rs_fence_ex(conn, RS_PRIORITY_NORMAL);
+}
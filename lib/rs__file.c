@@ -0,0 +1,416 @@
+/**
+ * File-backed reads and writes (rs_write_file and rs_read_file).
+ *
+ * The region is transferred in chunks through a small ring of internally
+ * allocated buffers. For a write, each buffer has a chunk read from the file
+ * (using a libuv fs request) which is then written to the machine using an
+ * ordinary write request after which the buffer moves on to the next chunk.
+ * Reads work the other way around. Since each chunk has a fixed location in
+ * both the file and the machine's memory, chunks need not complete in order and
+ * the loop is never blocked on file I/O. Should the request queue be full when
+ * a chunk's read/write is to be queued, it is queued once another chunk
+ * completes instead.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * The number of SCP packets' worth of data in each chunk.
+ */
+#define RS__FILE_PACKETS_PER_CHUNK 16
+
+
+struct rs__file;
+
+/**
+ * A buffer in the ring.
+ */
+typedef struct {
+	struct rs__file *file;
+	
+	// The fs request used to read/write the file
+	uv_fs_t fs_req;
+	
+	// The buffer (of chunk_len bytes)
+	char *base;
+	
+	// Is a chunk currently being transferred using this buffer? And is its
+	// read/write waiting to be queued (the request queue was full)?
+	bool busy;
+	bool queue_pending;
+	
+	// The offset (within the region) and length of the chunk and the number of
+	// bytes of the chunk read from/written to the file so far (fs requests can
+	// complete partially).
+	size_t offset;
+	size_t len;
+	size_t n_done;
+} rs__file_buf_t;
+
+
+/**
+ * State of a file-backed read or write.
+ */
+typedef struct rs__file {
+	rs_conn_t *conn;
+	
+	// Writing (file to machine) or reading (machine to file)?
+	bool write;
+	
+	// The region of the machine's memory
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint32_t address;
+	size_t length;
+	
+	// The file and the offset within it of the start of the region
+	uv_file fd;
+	int64_t file_offset;
+	
+	// The offset of the next chunk to start, the number of chunks in progress
+	// and how many of those are waiting to be queued
+	size_t next_offset;
+	unsigned int n_busy;
+	unsigned int n_pending;
+	
+	// The first error to occur (no further chunks are started once set)
+	int error;
+	uint16_t cmd_rc;
+	
+	// Set while rs__file_progress is running and set again if it is called in
+	// the meantime.
+	bool in_progress;
+	bool again;
+	
+	rs_file_cb cb;
+	void *cb_data;
+	
+	// The ring of buffers, all allocated in a single block
+	size_t chunk_len;
+	char *block;
+	unsigned int n_bufs;
+	rs__file_buf_t bufs[];
+} rs__file_t;
+
+
+static void rs__file_progress(rs__file_t *file);
+static void rs__file_fs_step(rs__file_buf_t *buf);
+static void rs__file_queue_chunk(rs__file_buf_t *buf);
+
+
+/**
+ * Mark the chunk using the supplied buffer as complete.
+ */
+static void
+rs__file_chunk_done(rs__file_buf_t *buf, int error, uint16_t cmd_rc)
+{
+	rs__file_t *file = buf->file;
+	
+	buf->busy = false;
+	file->n_busy--;
+	if (error && !file->error) {
+		file->error = error;
+		file->cmd_rc = cmd_rc;
+	}
+	
+	rs__file_progress(file);
+}
+
+
+static void
+rs__file_rw_cb(rs_conn_t *conn,
+               int error,
+               uint16_t cmd_rc,
+               uv_buf_t data,
+               void *cb_data)
+{
+	rs__file_buf_t *buf = (rs__file_buf_t *)cb_data;
+	
+	if (error || buf->file->write)
+		rs__file_chunk_done(buf, error, cmd_rc);
+	else
+		rs__file_fs_step(buf);  // Now write the chunk to the file
+}
+
+
+static void
+rs__file_fs_cb(uv_fs_t *req)
+{
+	rs__file_buf_t *buf = (rs__file_buf_t *)req->data;
+	rs__file_t *file = buf->file;
+	
+	ssize_t result = req->result;
+	uv_fs_req_cleanup(req);
+	
+	if (result < 0) {
+		rs__file_chunk_done(buf, result, 0);
+		return;
+	} else if (result == 0) {
+		// When writing to the machine, the file ended before the region did
+		rs__file_chunk_done(buf, UV_EOF, 0);
+		return;
+	}
+	
+	buf->n_done += result;
+	if (buf->n_done < buf->len) {
+		// Transfer the rest
+		rs__file_fs_step(buf);
+	} else if (file->write) {
+		rs__file_queue_chunk(buf);
+	} else {
+		rs__file_chunk_done(buf, 0, 0);
+	}
+}
+
+
+/**
+ * Read (when writing to the machine) or write (when reading from the machine)
+ * the remainder of a chunk from/to the file.
+ */
+static void
+rs__file_fs_step(rs__file_buf_t *buf)
+{
+	rs__file_t *file = buf->file;
+	
+	uv_buf_t data;
+	data.base = buf->base + buf->n_done;
+	data.len = buf->len - buf->n_done;
+	int64_t offset = file->file_offset + buf->offset + buf->n_done;
+	
+	buf->fs_req.data = (void *)buf;
+	int retval;
+	if (file->write)
+		retval = uv_fs_read(file->conn->loop, &(buf->fs_req), file->fd,
+		                    &data, 1, offset, rs__file_fs_cb);
+	else
+		retval = uv_fs_write(file->conn->loop, &(buf->fs_req), file->fd,
+		                     &data, 1, offset, rs__file_fs_cb);
+	if (retval)
+		rs__file_chunk_done(buf, retval, 0);
+}
+
+
+/**
+ * Queue the write of a chunk to the machine (once read from the file) or read
+ * of a chunk from the machine.
+ *
+ * Should the request queue be full while other chunks are in progress, the
+ * chunk is marked as pending and queued again by rs__file_progress.
+ */
+static void
+rs__file_queue_chunk(rs__file_buf_t *buf)
+{
+	rs__file_t *file = buf->file;
+	
+	uv_buf_t data;
+	data.base = buf->base;
+	data.len = buf->len;
+	int retval;
+	if (file->write)
+		retval = rs_write(file->conn, file->dest_addr, file->dest_cpu,
+		                  file->address + buf->offset, data,
+		                  rs__file_rw_cb, buf);
+	else
+		retval = rs_read(file->conn, file->dest_addr, file->dest_cpu,
+		                 file->address + buf->offset, data,
+		                 rs__file_rw_cb, buf);
+	
+	// The number of other chunks in progress, whose completion will provide the
+	// chance to try again
+	unsigned int n_others = file->n_busy - file->n_pending -
+	                        (buf->queue_pending ? 0 : 1);
+	if (retval == RS_EFULL && n_others) {
+		if (!buf->queue_pending) {
+			buf->queue_pending = true;
+			file->n_pending++;
+		}
+		return;
+	}
+	
+	if (buf->queue_pending) {
+		buf->queue_pending = false;
+		file->n_pending--;
+	}
+	if (retval)
+		rs__file_chunk_done(buf, (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM, 0);
+}
+
+
+/**
+ * Start transferring the next chunk using the supplied (free) buffer.
+ */
+static void
+rs__file_chunk_start(rs__file_t *file, rs__file_buf_t *buf)
+{
+	buf->busy = true;
+	buf->offset = file->next_offset;
+	buf->len = MIN(file->chunk_len, file->length - file->next_offset);
+	buf->n_done = 0;
+	file->next_offset += buf->len;
+	file->n_busy++;
+	
+	if (file->write)
+		rs__file_fs_step(buf);
+	else
+		rs__file_queue_chunk(buf);
+}
+
+
+/**
+ * Start chunks using any free buffers and complete the transfer once done.
+ */
+static void
+rs__file_progress(rs__file_t *file)
+{
+	if (file->in_progress) {
+		file->again = true;
+		return;
+	}
+	file->in_progress = true;
+	
+	do {
+		file->again = false;
+		
+		unsigned int i;
+		
+		// Retry chunks which could not be queued (or, following an error, give
+		// up on them)
+		for (i = 0; i < file->n_bufs; i++) {
+			rs__file_buf_t *buf = &(file->bufs[i]);
+			if (!buf->queue_pending)
+				continue;
+			if (file->error) {
+				buf->queue_pending = false;
+				file->n_pending--;
+				rs__file_chunk_done(buf, 0, 0);
+			} else {
+				rs__file_queue_chunk(buf);
+			}
+		}
+		
+		// Only start new chunks while the request queue has room
+		for (i = 0; i < file->n_bufs; i++)
+			if (!file->error && !file->n_pending &&
+			    file->next_offset < file->length && !file->bufs[i].busy)
+				rs__file_chunk_start(file, &(file->bufs[i]));
+	} while (file->again);
+	
+	// Complete once nothing remains in progress (any buffers still in use
+	// following an error must be waited for).
+	if (!file->n_busy && (file->error || file->next_offset >= file->length)) {
+		file->cb(file->conn, file->error, file->cmd_rc, file->cb_data);
+		free(file->block);
+		free(file);
+		return;
+	}
+	
+	file->in_progress = false;
+}
+
+
+/**
+ * Common implementation of rs_write_file and rs_read_file.
+ */
+static int
+rs__file(rs_conn_t *conn,
+         bool write,
+         uint16_t dest_addr,
+         uint8_t dest_cpu,
+         uint32_t address,
+         uv_file fd,
+         int64_t file_offset,
+         size_t length,
+         rs_file_cb cb,
+         void *cb_data)
+{
+	// Enough buffers to keep the window full with one to spare
+	size_t chunk_len = conn->scp_data_length * RS__FILE_PACKETS_PER_CHUNK;
+	unsigned int n_bufs = (conn->n_outstanding / RS__FILE_PACKETS_PER_CHUNK) + 2;
+	
+	// Don't allocate more buffers than could be used
+	size_t n_chunks = (length + chunk_len - 1) / chunk_len;
+	if (n_chunks < n_bufs)
+		n_bufs = MAX(n_chunks, 1);
+	
+	rs__file_t *file = malloc(sizeof(rs__file_t) +
+	                          n_bufs * sizeof(rs__file_buf_t));
+	if (!file)
+		return -1;
+	
+	file->block = malloc(n_bufs * chunk_len);
+	if (!file->block) {
+		free(file);
+		return -1;
+	}
+	
+	file->conn = conn;
+	file->write = write;
+	file->dest_addr = dest_addr;
+	file->dest_cpu = dest_cpu;
+	file->address = address;
+	file->length = length;
+	file->fd = fd;
+	file->file_offset = file_offset;
+	file->next_offset = 0;
+	file->n_busy = 0;
+	file->n_pending = 0;
+	file->error = 0;
+	file->cmd_rc = 0;
+	file->in_progress = false;
+	file->again = false;
+	file->cb = cb;
+	file->cb_data = cb_data;
+	file->chunk_len = chunk_len;
+	file->n_bufs = n_bufs;
+	
+	unsigned int i;
+	for (i = 0; i < n_bufs; i++) {
+		file->bufs[i].file = file;
+		file->bufs[i].base = file->block + (i * chunk_len);
+		file->bufs[i].busy = false;
+		file->bufs[i].queue_pending = false;
+	}
+	
+	rs__file_progress(file);
+	return 0;
+}
+
+
+int
+rs_write_file(rs_conn_t *conn,
+              uint16_t dest_addr,
+              uint8_t dest_cpu,
+              uint32_t address,
+              uv_file fd,
+              int64_t file_offset,
+              size_t length,
+              rs_file_cb cb,
+              void *cb_data)
+{
+	return rs__file(conn, true, dest_addr, dest_cpu, address,
+	                fd, file_offset, length, cb, cb_data);
+}
+
+
+int
+rs_read_file(rs_conn_t *conn,
+             uint16_t dest_addr,
+             uint8_t dest_cpu,
+             uint32_t address,
+             uv_file fd,
+             int64_t file_offset,
+             size_t length,
+             rs_file_cb cb,
+             void *cb_data)
+{
+	return rs__file(conn, false, dest_addr, dest_cpu, address,
+	                fd, file_offset, length, cb, cb_data);
+}
@@ -0,0 +1,283 @@
+/**
+ * Filling regions with a constant word (rs_fill).
+ *
+ * The word-aligned, whole-word middle of the region is filled using a single
+ * SC&MP CMD_FILL command while any unaligned bytes at either end are written
+ * using ordinary (small) writes. All parts proceed in parallel with a single
+ * callback once all have completed. Should the request queue be full, queuing
+ * pauses until a part completes.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * The parts of a fill operation, queued in this order.
+ */
+typedef enum {
+	// The unaligned bytes at the start of the region (written)
+	RS__FILL_HEAD,
+	
+	// The whole words in the middle of the region (filled with CMD_FILL)
+	RS__FILL_BODY,
+	
+	// The unaligned bytes at the end of the region (written)
+	RS__FILL_TAIL,
+	
+	RS__FILL_N_PARTS
+} rs__fill_part_t;
+
+
+/**
+ * State of a fill operation.
+ */
+typedef struct {
+	rs_conn_t *conn;
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint32_t value;
+	
+	// The address and length of each part (see rs__fill_part_t)
+	uint32_t part_address[RS__FILL_N_PARTS];
+	size_t part_len[RS__FILL_N_PARTS];
+	
+	// The next part to queue and the number of parts queued but not yet
+	// complete
+	unsigned int next_part;
+	unsigned int n_busy;
+	
+	// Set while rs__fill_progress is running and set again if it is called in
+	// the meantime.
+	bool in_progress;
+	bool again;
+	
+	// The first error to occur and the accompanying cmd_rc
+	int error;
+	uint16_t cmd_rc;
+	
+	rs_fill_cb cb;
+	void *cb_data;
+	
+	// The data written to the unaligned head and tail of the region
+	uint8_t head[3];
+	uint8_t tail[3];
+} rs__fill_t;
+
+
+static void rs__fill_progress(rs__fill_t *fill);
+
+
+/**
+ * Record the failure of a part (keeping only the first error).
+ */
+static void
+rs__fill_fail(rs__fill_t *fill, int error, uint16_t cmd_rc)
+{
+	if (!fill->error) {
+		fill->error = error;
+		fill->cmd_rc = cmd_rc;
+	}
+}
+
+
+static void
+rs__fill_rw_cb(rs_conn_t *conn,
+               int error,
+               uint16_t cmd_rc,
+               uv_buf_t data,
+               void *cb_data)
+{
+	rs__fill_t *fill = (rs__fill_t *)cb_data;
+	if (error)
+		rs__fill_fail(fill, error, cmd_rc);
+	fill->n_busy--;
+	rs__fill_progress(fill);
+}
+
+
+static void
+rs__fill_scp_cb(rs_conn_t *conn,
+                int error,
+                uint16_t cmd_rc,
+                unsigned int n_args,
+                uint32_t arg1,
+                uint32_t arg2,
+                uint32_t arg3,
+                uv_buf_t data,
+                void *cb_data)
+{
+	rs__fill_t *fill = (rs__fill_t *)cb_data;
+	if (!error && cmd_rc != RS__SCP_CMD_OK)
+		error = RS_EBAD_RC;
+	if (error)
+		rs__fill_fail(fill, error, cmd_rc);
+	fill->n_busy--;
+	rs__fill_progress(fill);
+}
+
+
+/**
+ * Produce the bytes of memory starting at the supplied address when filled
+ * with the given (little-endian) word.
+ */
+static void
+rs__fill_bytes(uint8_t *buf, uint32_t address, size_t len, uint32_t value)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8_t)(value >> (8 * ((address + i) % 4)));
+}
+
+
+/**
+ * Queue the next (non-empty) part of the fill.
+ *
+ * @returns 0 on success (or if no parts remain) or the value returned by
+ *          rs_write/rs_send_scp otherwise.
+ */
+static int
+rs__fill_queue_next(rs__fill_t *fill)
+{
+	while (fill->next_part < RS__FILL_N_PARTS &&
+	       !fill->part_len[fill->next_part])
+		fill->next_part++;
+	if (fill->next_part == RS__FILL_N_PARTS)
+		return 0;
+	
+	unsigned int part = fill->next_part;
+	uint32_t address = fill->part_address[part];
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	if (part == RS__FILL_HEAD)
+		data.base = (void *)fill->head;
+	else if (part == RS__FILL_TAIL)
+		data.base = (void *)fill->tail;
+	if (data.base)
+		data.len = fill->part_len[part];
+	
+	fill->n_busy++;
+	int retval;
+	if (part == RS__FILL_BODY)
+		retval = rs_send_scp(fill->conn, fill->dest_addr, fill->dest_cpu,
+		                     RS__SCP_CMD_FILL, 3, 0,
+		                     address, fill->value, fill->part_len[part],
+		                     data, 0, rs__fill_scp_cb, fill);
+	else
+		retval = rs_write(fill->conn, fill->dest_addr, fill->dest_cpu,
+		                  address, data, rs__fill_rw_cb, fill);
+	if (retval)
+		fill->n_busy--;
+	else
+		fill->next_part++;
+	
+	return retval;
+}
+
+
+/**
+ * Queue as many of the remaining parts as possible and complete the fill once
+ * all are done.
+ *
+ * Should the request queue be full while parts are in progress, the
+ * remaining parts are left to be queued as those complete. Parts which can't
+ * be queued otherwise fail with RS_EFULL or UV_ENOMEM.
+ */
+static void
+rs__fill_progress(rs__fill_t *fill)
+{
+	if (fill->in_progress) {
+		fill->again = true;
+		return;
+	}
+	fill->in_progress = true;
+	
+	do {
+		fill->again = false;
+		
+		while (fill->next_part < RS__FILL_N_PARTS) {
+			int retval = rs__fill_queue_next(fill);
+			if (!retval)
+				continue;
+			if (retval == RS_EFULL && fill->n_busy)
+				break;
+			
+			rs__fill_fail(fill, (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM, 0);
+			fill->next_part++;
+		}
+	} while (fill->again);
+	
+	if (!fill->n_busy && fill->next_part == RS__FILL_N_PARTS) {
+		fill->cb(fill->conn, fill->error, fill->cmd_rc, fill->cb_data);
+		free(fill);
+		return;
+	}
+	
+	fill->in_progress = false;
+}
+
+
+int
+rs_fill(rs_conn_t *conn,
+        uint16_t dest_addr,
+        uint8_t dest_cpu,
+        uint32_t address,
+        size_t length,
+        uint32_t value,
+        rs_fill_cb cb,
+        void *cb_data)
+{
+	// Split the region into an unaligned head, a whole number of words and an
+	// unaligned tail.
+	size_t head_len = MIN((4 - (address % 4)) % 4, length);
+	size_t body_len = (length - head_len) & ~(size_t)3;
+	size_t tail_len = length - head_len - body_len;
+	uint32_t body_address = address + head_len;
+	uint32_t tail_address = body_address + body_len;
+	
+	rs__fill_t *fill = malloc(sizeof(rs__fill_t));
+	if (!fill)
+		return -1;
+	
+	fill->conn = conn;
+	fill->dest_addr = dest_addr;
+	fill->dest_cpu = dest_cpu;
+	fill->value = value;
+	fill->part_address[RS__FILL_HEAD] = address;
+	fill->part_len[RS__FILL_HEAD] = head_len;
+	fill->part_address[RS__FILL_BODY] = body_address;
+	fill->part_len[RS__FILL_BODY] = body_len;
+	fill->part_address[RS__FILL_TAIL] = tail_address;
+	fill->part_len[RS__FILL_TAIL] = tail_len;
+	fill->next_part = 0;
+	fill->n_busy = 0;
+	fill->in_progress = true;
+	fill->again = false;
+	fill->error = 0;
+	fill->cmd_rc = 0;
+	fill->cb = cb;
+	fill->cb_data = cb_data;
+	rs__fill_bytes(fill->head, address, head_len, value);
+	rs__fill_bytes(fill->tail, tail_address, tail_len, value);
+	
+	// Should the first part fail to be queued, nothing has been started and the
+	// failure is reported immediately (without calling the callback).
+	int retval = rs__fill_queue_next(fill);
+	if (retval) {
+		free(fill);
+		return (retval == RS_EFULL) ? RS_EFULL : -1;
+	}
+	
+	fill->in_progress = false;
+	rs__fill_progress(fill);
+	
+	return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * Internal functions for finding outstanding slots by sequence number or
+ * read/write ID.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Is the supplied slot part of a read/write request (and thus in rw_index)?
+ */
+#define IS_RW(os) ((os)->type == RS__REQ_READ || (os)->type == RS__REQ_WRITE)
+
+/**
+ * The bucket in dest_index for a given destination.
+ */
+#define DEST_BUCKET(conn, dest_addr, dest_cpu) \
+	(((((dest_addr) >> 8) ^ (dest_addr)) * 32u + (dest_cpu)) & (conn)->index_mask)
+
+
+void
+rs__index_insert(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	rs__outstanding_t **bucket;
+	
+	// Insert at the head of the sequence number bucket
+	bucket = conn->seq_index + (os->seq_num & conn->index_mask);
+	os->seq_prev = NULL;
+	os->seq_next = *bucket;
+	if (*bucket)
+		(*bucket)->seq_prev = os;
+	*bucket = os;
+	
+	// Insert at the head of the read/write ID bucket
+	if (IS_RW(os)) {
+		bucket = conn->rw_index + (os->data.rw.id & conn->index_mask);
+		os->rw_prev = NULL;
+		os->rw_next = *bucket;
+		if (*bucket)
+			(*bucket)->rw_prev = os;
+		*bucket = os;
+	}
+	
+	// Insert at the head of the destination bucket
+	if (conn->max_in_flight_per_dest) {
+		bucket = conn->dest_index + DEST_BUCKET(conn, os->dest_addr, os->dest_cpu);
+		os->dest_prev = NULL;
+		os->dest_next = *bucket;
+		if (*bucket)
+			(*bucket)->dest_prev = os;
+		*bucket = os;
+	}
+	
+	os->indexed = true;
+}
+
+
+void
+rs__index_remove(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!os->indexed)
+		return;
+	
+	// Unlink from the sequence number bucket
+	if (os->seq_prev)
+		os->seq_prev->seq_next = os->seq_next;
+	else
+		conn->seq_index[os->seq_num & conn->index_mask] = os->seq_next;
+	if (os->seq_next)
+		os->seq_next->seq_prev = os->seq_prev;
+	
+	// Unlink from the read/write ID bucket
+	if (IS_RW(os)) {
+		if (os->rw_prev)
+			os->rw_prev->rw_next = os->rw_next;
+		else
+			conn->rw_index[os->data.rw.id & conn->index_mask] = os->rw_next;
+		if (os->rw_next)
+			os->rw_next->rw_prev = os->rw_prev;
+	}
+	
+	// Unlink from the destination bucket
+	if (conn->max_in_flight_per_dest) {
+		if (os->dest_prev)
+			os->dest_prev->dest_next = os->dest_next;
+		else
+			conn->dest_index[DEST_BUCKET(conn, os->dest_addr, os->dest_cpu)] =
+				os->dest_next;
+		if (os->dest_next)
+			os->dest_next->dest_prev = os->dest_prev;
+	}
+	
+	os->indexed = false;
+}
+
+
+rs__outstanding_t *
+rs__index_find_seq_num(rs_conn_t *conn, uint16_t seq_num)
+{
+	// Since sequence numbers are allocated sequentially, the (at most
+	// n_outstanding) awaited sequence numbers rarely share a bucket.
+	rs__outstanding_t *os = conn->seq_index[seq_num & conn->index_mask];
+	while (os && os->seq_num != seq_num)
+		os = os->seq_next;
+	return os;
+}
+
+
+rs__outstanding_t *
+rs__index_find_rw_sibling(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// The slots of a single read/write request all share a bucket and since
+	// newly dispatched slots are inserted at the head of the bucket, siblings are
+	// typically found immediately.
+	rs__outstanding_t *other = conn->rw_index[os->data.rw.id & conn->index_mask];
+	while (other) {
+		if (other != os &&
+		    other->type == os->type &&
+		    other->data.rw.id == os->data.rw.id)
+			return other;
+		other = other->rw_next;
+	}
+	return NULL;
+}
+
+
+unsigned int
+rs__index_count_dest(rs_conn_t *conn, uint16_t dest_addr, uint8_t dest_cpu)
+{
+	unsigned int count = 0;
+	rs__outstanding_t *os =
+		conn->dest_index[DEST_BUCKET(conn, dest_addr, dest_cpu)];
+	while (os) {
+		if (os->dest_addr == dest_addr && os->dest_cpu == dest_cpu)
+			count++;
+		os = os->dest_next;
+	}
+	return count;
+}
@@ -0,0 +1,175 @@
+/**
+ * Internal functions for interleaving the packets of concurrent requests.
+ *
+ * Rather than being dispatched directly from the head of the request queue,
+ * requests are first moved into a per-priority set of up to n_interleaved
+ * active requests. Packets are dispatched from the active requests in turn
+ * (or, when shortest_first is set, from the active request with the least data
+ * remaining) with the request at the head of the queue being admitted to the
+ * set whenever there is room for it. A request leaves the set once its last
+ * packet has been dispatched.
+ *
+ * Active requests whose destination already has max_in_flight_per_dest packets
+ * awaiting responses are passed over so that requests for other destinations
+ * may be dispatched in the meantime.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+rs__req_t *
+rs__active_rw(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	rs__req_t *active = conn->active_reqs[os->priority];
+	unsigned int i;
+	for (i = 0; i < conn->n_active_reqs[os->priority]; i++)
+		if (active[i].type == os->type && active[i].data.rw.id == os->data.rw.id)
+			return &(active[i]);
+	
+	return NULL;
+}
+
+
+void
+rs__remove_active(rs_conn_t *conn, rs__req_t *req)
+{
+	rs_priority_t priority = req->priority;
+	rs__req_t *active = conn->active_reqs[priority];
+	unsigned int i = req - active;
+	
+	// Shuffle the following requests down to keep the set in admission order
+	conn->n_active_reqs[priority]--;
+	memmove(&(active[i]), &(active[i + 1]),
+	        (conn->n_active_reqs[priority] - i) * sizeof(rs__req_t));
+	
+	// The request which takes this one's place is next in line if this one
+	// was.
+	if (conn->active_next[priority] > i)
+		conn->active_next[priority]--;
+}
+
+
+/**
+ * Can the request at the head of the queue of the given priority be admitted
+ * to the active set?
+ */
+static bool
+rs__can_admit(rs_conn_t *conn, rs_priority_t priority)
+{
+	if (conn->n_active_reqs[priority] >= conn->n_interleaved ||
+	    conn->fence_cancelling[priority])
+		return false;
+	
+	// Requests queued after a fence wait for the fence to be passed (see
+	// rs__process_fences)
+	rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue[priority]);
+	return req && req->type != RS__REQ_FENCE;
+}
+
+
+bool
+rs__pending_requests(rs_conn_t *conn, rs_priority_t priority)
+{
+	return conn->n_active_reqs[priority] || rs__can_admit(conn, priority);
+}
+
+
+/**
+ * Move the request at the head of the queue of the given priority into the
+ * active set.
+ *
+ * @returns the request's new location.
+ */
+static rs__req_t *
+rs__admit(rs_conn_t *conn, rs_priority_t priority)
+{
+	rs__req_t *req =
+		&(conn->active_reqs[priority][conn->n_active_reqs[priority]++]);
+	*req = *(rs__req_t *)rs__q_peek(conn->request_queue[priority]);
+	rs__q_remove(conn->request_queue[priority]);
+	return req;
+}
+
+
+/**
+ * Can a packet be dispatched from the supplied request without exceeding the
+ * limit on packets in flight to its destination?
+ */
+static bool
+rs__dest_available(rs_conn_t *conn, rs__req_t *req)
+{
+	return !conn->max_in_flight_per_dest ||
+	       rs__index_count_dest(conn, req->dest_addr, req->dest_cpu) <
+	         conn->max_in_flight_per_dest;
+}
+
+
+/**
+ * The number of bytes left to dispatch for an active request (SCP packets
+ * count as empty, being as short as requests get).
+ */
+static size_t
+rs__remaining(rs__req_t *req)
+{
+	return (req->type == RS__REQ_SCP_PACKET) ? 0 : req->data.rw.data.len;
+}
+
+
+rs__req_t *
+rs__next_request(rs_conn_t *conn, rs_priority_t priority)
+{
+	rs__req_t *active = conn->active_reqs[priority];
+	rs__req_t *req;
+	unsigned int i;
+	
+	if (conn->shortest_first) {
+		// Admit as many requests as possible to choose amongst
+		while (rs__can_admit(conn, priority))
+			rs__admit(conn, priority);
+		
+		// Pick the available active request with the least data remaining
+		req = NULL;
+		for (i = 0; i < conn->n_active_reqs[priority]; i++)
+			if ((!req || rs__remaining(&(active[i])) < rs__remaining(req)) &&
+			    rs__dest_available(conn, &(active[i])))
+				req = &(active[i]);
+		return req;
+	}
+	
+	// Each active request takes its turn after which the request at the head
+	// of the queue is admitted (if there is room for it). Requests which may not
+	// be dispatched are skipped over (admitting further requests in their
+	// place if possible), stopping once every active request has been tried.
+	unsigned int n_tried = 0;
+	while (n_tried <= conn->n_active_reqs[priority]) {
+		if (conn->active_next[priority] >= conn->n_active_reqs[priority]) {
+			conn->active_next[priority] = 0;
+			while (rs__can_admit(conn, priority)) {
+				req = rs__admit(conn, priority);
+				if (rs__dest_available(conn, req))
+					return req;
+				n_tried++;
+			}
+			
+			if (!conn->n_active_reqs[priority])
+				break;
+		}
+		
+		req = &(active[conn->active_next[priority]++]);
+		if (rs__dest_available(conn, req))
+			return req;
+		n_tried++;
+	}
+	
+	return NULL;
+}
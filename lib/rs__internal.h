@@ -5,20 +5,106 @@
 #ifndef RS__INTERNAL_H
 #define RS__INTERNAL_H
 
+#include <sys/socket.h>
+
 #include <uv.h>
 
 #include <rs.h>
 #include <rs__queue.h>
+#include <rs__buf_pool.h>
+#include <rs__mpsc.h>
+#include <rs__scp.h>
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
 #ifndef MAX
-#define MAX(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+
+/**
+ * Platform support for batched transmission and reception (see
+ * rs_conn_opts_t.batch). libuv does not provide a batched send, so sendmmsg is
+ * called directly on the UDP socket where available. Batched reception is
+ * provided by libuv (since v1.39) using recvmmsg where it is supported.
+ */
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define RS__HAVE_SENDMMSG
+#endif
+
+#if UV_VERSION_HEX >= 0x012700
+#define RS__HAVE_RECVMMSG
+#endif
+
+
+/**
+ * When receiving using recvmmsg, libuv splits each receive buffer into chunks
+ * of this size, receiving up to RS__RECVMMSG_MAX_CHUNKS packets, each into its
+ * own chunk.
+ */
+#define RS__RECVMMSG_CHUNK_SIZE (64 * 1024)
+#define RS__RECVMMSG_MAX_CHUNKS 20
+
+
+/**
+ * The SCP data length used while the actual length is being discovered (and
+ * should discovery fail). All SpiNNaker machines support at least this
+ * length.
+ */
+#define RS__PROBE_SCP_DATA_LENGTH 256
+
+/**
+ * Statistics gathering (see rs_get_stats). When RS_STATS is not defined, these
+ * macros compile to nothing.
+ *
+ * RS__STATS_INC(conn, field, n) adds n to conn->stats.field.
+ *
+ * RS__MEASURE_RTT(conn) is true if round-trip times should be measured (i.e.
+ * for the statistics or the adaptive timeout).
+ */
+#ifdef RS_STATS
+#define RS__STATS_INC(conn, field, n) ((conn)->stats.field += (n))
+#define RS__MEASURE_RTT(conn) true
+#else
+#define RS__STATS_INC(conn, field, n) ((void)0)
+#define RS__MEASURE_RTT(conn) ((conn)->adaptive_timeout)
 #endif
 
 
+/**
+ * Tracing (see rs_set_trace_cb). When RS_TRACE is not defined, these macros
+ * compile to nothing. Otherwise the event is only generated if a callback is
+ * registered.
+ *
+ * RS__TRACE(conn, event, request_id, seq_num, slot, error) reports an event.
+ *
+ * RS__TRACE_OS(conn, event, os, error) reports an event relating to the
+ * packet in an outstanding slot.
+ */
+#ifdef RS_TRACE
+#define RS__TRACE(conn, event, request_id, seq_num, slot, error) do { \
+		if ((conn)->trace_cb) \
+			rs__trace((conn), (event), (request_id), (seq_num), (slot), (error)); \
+	} while (0)
+#else
+#define RS__TRACE(conn, event, request_id, seq_num, slot, error) ((void)0)
+#endif
+
+#define RS__TRACE_OS(conn, event, os, error) \
+	RS__TRACE((conn), (event), (os)->req_id, (os)->seq_num, \
+	          (int)((os) - (conn)->outstanding), (error))
+
+
+/**
+ * The number of bytes which precede the payload in a CMD_READ response as it
+ * arrives from the network (i.e. the two padding bytes followed by an SDP and
+ * SCP header without arguments).
+ */
+#define RS__READ_RESPONSE_HEADER_LENGTH (2 + RS__SIZEOF_SCP_PACKET(0, 0))
+
+
 /**
  * Indicates the type of request.
  */
@@ -31,17 +117,34 @@ typedef enum {
 	
 	// Send a bulk write request
 	RS__REQ_WRITE,
+	
+	// A fence (see rs_fence) which holds back the requests queued after it
+	RS__REQ_FENCE,
 } rs__req_type_t;
 
 
+/**
+ * The progress of the discovery of a connection's SCP data length (see
+ * rs__probe.c).
+ */
+typedef enum {
+	// The SCP data length is known (or discovery has finished)
+	RS__PROBE_NONE,
+	
+	// The probing CMD_VER has been queued or is awaiting its response
+	RS__PROBE_PENDING,
+	
+	// The probe has completed and the connection's buffers are to be resized
+	// once no packets are in flight
+	RS__PROBE_RESIZE,
+} rs__probe_state_t;
+
+
 /**
  * Represents a request sent to a SpiNNaker machine which may be either a single
  * SCP packet or a bulk read/write.
  */
 typedef struct {
-	// Data required by the queue datastructure.
-	rs__q_entry_t _;
-	
 	// What type of request is this?
 	rs__req_type_t type;
 	
@@ -51,6 +154,12 @@ typedef struct {
 	// The CPU number this request is destined for
 	uint8_t dest_cpu;
 	
+	// A unique ID assigned to this request (reported when tracing).
+	unsigned int id;
+	
+	// The priority of this request (and thus which request queue it is in)
+	rs_priority_t priority;
+	
 	// The data supplied to be supplied to the callback on completion of this
 	// request
 	void *cb_data;
@@ -87,7 +196,8 @@ typedef struct {
 		
 		// Data for read/write requests
 		struct {
-			// A unique ID assigned to this read/write request.
+			// A unique ID assigned to this read/write request (the same as the
+			// request's id).
 			unsigned int id;
 			
 			// The address to read/write to. This is advanced as the read/write
@@ -104,6 +214,10 @@ typedef struct {
 			// proceeds.
 			uv_buf_t orig_data;
 			
+			// The part of the header shared by all of the request's packets (see
+			// rs__pack_scp_template), packed when the request is queued.
+			uint8_t header[RS__SCP_TEMPLATE_LENGTH];
+			
 			// Callback function on completion
 			rs_rw_cb cb;
 		} rw;
@@ -112,49 +226,167 @@ typedef struct {
 } rs__req_t;
 
 
+/**
+ * A request submitted from another thread using one of the thread-safe
+ * submission functions (e.g. rs_read_ts). The same structure later holds the
+ * result of the request if the callback must be delivered via a callback
+ * queue.
+ */
+typedef struct rs__ts_req rs__ts_req_t;
+struct rs__ts_req {
+	// Data required by the MPSC queues.
+	rs__mpsc_entry_t _;
+	
+	// The request (as passed to rs_send_scp_ex, rs_read_ex or rs_write_ex)
+	rs__req_type_t type;
+	rs_priority_t priority;
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint16_t cmd_rc;
+	unsigned int n_args_send;
+	unsigned int n_args_recv;
+	uint32_t arg1;
+	uint32_t arg2;
+	uint32_t arg3;
+	uint32_t address;
+	uv_buf_t data;
+	size_t data_max_len;
+	rs_send_scp_cb scp_cb;
+	rs_rw_cb rw_cb;
+	void *cb_data;
+	
+	// The callback queue via which the callback is to be delivered (or NULL to
+	// call it directly).
+	struct rs__cb_queue *cb_queue;
+	
+	// The arguments for the callback (filled in when the request completes)
+	rs_conn_t *conn;
+	int error;
+	unsigned int n_args;
+};
+
+
+/**
+ * A queue of completed thread-safe requests (rs__ts_req_t) whose callbacks are
+ * to be made on the thread running a particular event loop (see rs__shard.c).
+ */
+typedef struct rs__cb_queue {
+	// Async handle (on the callback loop) used to signal new arrivals. Must be
+	// the first member: the queue is freed by the handle's close callback.
+	uv_async_t async_handle;
+	
+	// Completed requests awaiting their callbacks
+	rs__mpsc_t queue;
+} rs__cb_queue_t;
+
+
 /**
  * State used by an outstanding transmission request.
  */
-typedef struct {
+typedef struct rs__outstanding rs__outstanding_t;
+struct rs__outstanding {
 	// Pointer to the owning rs_conn_t, required since a pointer to this struct is
 	// used as the user-data for a number of callbacks.
 	rs_conn_t *conn;
 	
+	// The destination of the packet being sent
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	
+	// Doubly-linked lists linking this slot into the connection's indices of
+	// slots awaiting responses (see rs__index_insert). One list links together
+	// slots whose sequence numbers share a bucket in seq_index, another those
+	// whose read/write IDs share a bucket in rw_index and the last (only used
+	// when max_in_flight_per_dest is set) those whose destinations share a
+	// bucket in dest_index.
+	rs__outstanding_t *seq_prev;
+	rs__outstanding_t *seq_next;
+	rs__outstanding_t *rw_prev;
+	rs__outstanding_t *rw_next;
+	rs__outstanding_t *dest_prev;
+	rs__outstanding_t *dest_next;
+	
+	// Is this slot currently in the indices?
+	bool indexed;
+	
+	// When fast retransmission is enabled, a doubly-linked list linking together
+	// all slots awaiting responses in the order of their latest transmission
+	// (see rs__tx_record) and whether this slot is in it.
+	rs__outstanding_t *tx_prev;
+	rs__outstanding_t *tx_next;
+	bool tx_listed;
+	
+	// When fast retransmission is enabled, the number assigned to the latest
+	// transmission of this slot's packet (from conn->next_tx_num) and the number
+	// of responses which have arrived for packets transmitted since then.
+	uint32_t tx_num;
+	unsigned int n_overtaken;
+	
+	// When this slot is in the connection's free slot list, the next slot in the
+	// list (or NULL at the end of the list).
+	rs__outstanding_t *next_free;
+	
 	// Is this outstanding slot currently awaiting a response?
 	bool active;
 	
 	// The type of request that is active
 	rs__req_type_t type;
 	
+	// The ID of the request the active packet belongs to
+	unsigned int req_id;
+	
+	// The priority of the request the active packet belongs to
+	rs_priority_t priority;
+	
 	// The sequence number allocated to the packet whose response is being awaited
 	uint16_t seq_num;
 	
 	// The number of attempts made to transmit the current packet
 	unsigned int n_tries;
 	
+	// The time (from uv_hrtime, nsec) at which the current packet was first
+	// transmitted. Only recorded when RS__MEASURE_RTT is true.
+	uint64_t send_time;
+	
 	// The raw packet value and its length (to be used for retransmission). The
 	// packet will have two null padding bytes at the start of the allocated
 	// packet buffer. (The padding bytes are required when passing SCP packets
 	// over UDP).
 	uv_buf_t packet;
 	
+	// Payload data to be transmitted immediately after the packet above (or a
+	// zero-length buffer if the packet is self-contained). Used by writes to send
+	// data directly from the user's buffer without first copying it into the
+	// packet buffer.
+	uv_buf_t payload;
+	
 	// The current UDP send request (or NULL if the send operation is complete)
 	uv_udp_send_t send_req;
 	
 	// Is a UDP send request actually pending?
 	bool send_req_active;
 	
+	// Is this slot's packet waiting in the connection's batch of packets to be
+	// transmitted (see rs__flush_batch)?
+	bool batched;
+	
 	// If this outstanding request is cancelled while send_req_active, this flag
 	// indicates that the send_req callback should mark this outstanding slot as
 	// inactive.
 	bool cancelled;
 	
-	// The timeout timer handle
-	uv_timer_t timer_handle;
+	// While awaiting a response, the time (from uv_now) at which the packet
+	// times out, whether the slot is in the connection's deadline-ordered list of
+	// timeouts (see rs__timer_start) and its neighbours in that list.
+	uint64_t deadline;
+	bool timer_active;
+	rs__outstanding_t *timer_prev;
+	rs__outstanding_t *timer_next;
 	
-	// Flag indicating that the timer handle has been closed (and thus freeing can
-	// occur)
-	bool timer_handle_closed;
+	// Set while the slot's timer is running to retry the packet following a
+	// transient error response (see rs__retry_later) rather than to time out.
+	// Cleared whenever the timer is stopped.
+	bool retry_pending;
 	
 	// The data supplied to be supplied to the callback on completion of this
 	// request
@@ -199,16 +431,42 @@ typedef struct {
 		} rw;
 	} data;
 	
-} rs__outstanding_t;
+};
 
 
 struct rs_conn {
 	// Maximum number of bytes in an SCP packet's data field
 	size_t scp_data_length;
 	
-	// Number of msec to wait before retransmitting a packet
+	// Number of msec to wait before retransmitting a packet (or, if
+	// adaptive_timeout is set, the upper bound on the retransmission timeout)
 	uint64_t timeout;
 	
+	// Should the retransmission timeout be derived from measured RTTs (see
+	// rs__rtt_sample)? If so, the lower bound on the timeout (msec).
+	bool adaptive_timeout;
+	uint64_t min_timeout;
+	
+	// The smoothed round-trip time and its mean deviation (usec) and whether any
+	// RTT sample has yet been taken.
+	bool rtt_measured;
+	uint64_t srtt;
+	uint64_t rttvar;
+	
+	// The current retransmission timeout (msec) for a packet's first
+	// transmission. Always conn->timeout unless adaptive_timeout is set.
+	uint64_t rto;
+	
+#ifdef RS_STATS
+	// Connection statistics. Fields describing the current state of the
+	// connection are only filled in by rs_get_stats.
+	rs_stats_t stats;
+	
+	// The sum of n_active sampled at each transmission (from which
+	// stats.mean_active is computed).
+	uint64_t stats_active_sum;
+#endif
+	
 	// Number of transmission attempts before giving up (including the initial
 	// attempt)
 	unsigned int n_tries;
@@ -216,6 +474,41 @@ struct rs_conn {
 	// Number of outstanding commands which can be in progress at any time
 	unsigned int n_outstanding;
 	
+	// Should the window be adjusted dynamically (see rs__window_decrease)?
+	bool dynamic_window;
+	
+	// The number of outstanding slots which may currently be active (always
+	// between 1 and n_outstanding).
+	unsigned int window;
+	
+	// The number of OK responses received since the window last grew.
+	unsigned int window_growth;
+	
+	// Set after the window shrinks until a response arrives to a packet sent
+	// after the shrink (i.e. one with a sequence number no earlier than
+	// window_recovery_seq). Losses of earlier packets are considered part of the
+	// same congestion event and do not shrink the window further.
+	bool window_recovering;
+	uint16_t window_recovery_seq;
+	
+	// The number of responses to later transmissions after which a packet is
+	// retransmitted early (or 0 if fast retransmission is disabled).
+	unsigned int fast_retransmit;
+	
+	// When fast retransmission is enabled, the list (via tx_prev/tx_next) of
+	// slots awaiting responses, oldest transmission first, and the number to
+	// assign to the next transmission.
+	rs__outstanding_t *tx_head;
+	rs__outstanding_t *tx_tail;
+	uint32_t next_tx_num;
+	
+	// Should packets be transmitted and received in batches where possible?
+	bool batch;
+	
+	// Is libuv receiving packets using recvmmsg (and thus receive buffers are
+	// split into RS__RECVMMSG_CHUNK_SIZE byte chunks)?
+	bool recvmmsg;
+	
 	// The libuv event loop this connection lives in
 	uv_loop_t *loop;
 	
@@ -229,20 +522,181 @@ struct rs_conn {
 	// freeing can occur)
 	bool udp_handle_closed;
 	
-	// Request queue containing rs__req_t entries representing SCP packets or bulk
-	// reads/writes which have not yet been handled.
-	rs__q_t *request_queue;
+	// A single timer which handles the timeouts of all outstanding slots and a
+	// flag indicating it has been closed (and thus freeing can occur).
+	uv_timer_t timer_handle;
+	bool timer_handle_closed;
+	
+	// Requests (rs__ts_req_t) submitted from other threads awaiting queueing by
+	// ts_async_handle's callback on the loop thread and a flag indicating the
+	// async handle has been closed (and thus freeing can occur).
+	rs__mpsc_t ts_queue;
+	uv_async_t ts_async_handle;
+	bool ts_async_handle_closed;
+	
+	// If non-NULL, the callback queue via which the callbacks of requests
+	// submitted using the thread-safe functions are delivered.
+	rs__cb_queue_t *ts_cb_queue;
+	
+	// A doubly-linked list (via timer_prev/timer_next) of the slots whose
+	// timeouts are running, ordered by deadline (earliest first).
+	rs__outstanding_t *timer_head;
+	rs__outstanding_t *timer_tail;
+	
+	// When timer_handle is active, the time (from uv_now) at which it will fire.
+	// This may be earlier than the deadline at the head of the list (e.g. if the
+	// slot at the head received a response) in which case the timer simply
+	// re-arms itself when it fires.
+	uint64_t timer_due;
+	
+	// Request queues, one per priority, containing rs__req_t entries
+	// representing SCP packets or bulk reads/writes which have not yet been
+	// handled.
+	rs__q_t *request_queue[RS_N_PRIORITIES];
+	
+	// The maximum number of requests each request queue may hold (0 for no
+	// limit) and the length to which a queue must fall, after a submission is
+	// rejected for want of space, before the drain callback is called.
+	size_t max_queue_length;
+	size_t queue_low_water;
+	
+	// Called (if not NULL) when a full request queue drains (see
+	// rs_set_drain_cb).
+	rs_drain_cb drain_cb;
+	void *drain_cb_data;
+	
+	// For each priority, has a submission been rejected because the queue was
+	// full since the drain callback was last called?
+	bool queue_was_full[RS_N_PRIORITIES];
+	
+	// The number of slots in the window which only requests with a priority
+	// above RS_PRIORITY_NORMAL may use. Always less than n_outstanding.
+	unsigned int n_reserved;
+	
+	// The maximum number of requests of each priority which may be active (i.e.
+	// whose packets may be dispatched concurrently) at once (at least 1).
+	unsigned int n_interleaved;
+	
+	// If set, dispatch packets from the active request with the least data
+	// remaining rather than from each in turn.
+	bool shortest_first;
+	
+	// For each priority, an array of n_interleaved slots holding (in order of
+	// admission) the n_active_reqs requests which have been removed from the
+	// request queue but still have packets to dispatch. active_next gives the
+	// index of the request to dispatch from next (with n_active_reqs meaning that
+	// the head of the request queue is to be admitted next).
+	rs__req_t *active_reqs[RS_N_PRIORITIES];
+	unsigned int n_active_reqs[RS_N_PRIORITIES];
+	unsigned int active_next[RS_N_PRIORITIES];
+	
+	// A bitmap of the response codes (below 256) which cause read/write
+	// packets to be retried rather than failed (see rs_conn_opts_t.retry_rcs)
+	// and the delay before the first retry of a packet (ms).
+	uint8_t retry_rcs[256 / 8];
+	uint64_t retry_backoff;
+	
+	// For each priority, has a request failed since the last fence was passed
+	// (or since the priority was last idle)? If so, the next fence to be passed
+	// cancels the requests queued after it (see rs__process_fences).
+	bool fence_failed[RS_N_PRIORITIES];
+	
+	// For each priority, set while the requests queued after a fence are being
+	// cancelled, during which no requests of that priority are admitted.
+	bool fence_cancelling[RS_N_PRIORITIES];
+	
+	// The maximum number of packets which may await responses from any one
+	// destination (dest_addr, dest_cpu) at once, or 0 for no limit.
+	unsigned int max_in_flight_per_dest;
+	
+	// Merge small contiguous reads/writes queued back-to-back (see
+	// rs__coalesce)?
+	bool coalesce;
 	
 	// An array of n_outstanding outstanding packet transmission attempt states.
 	rs__outstanding_t *outstanding;
 	
+	// The number of outstanding slots whose active flag is set.
+	unsigned int n_active;
+	
+	// A singly-linked stack (via next_free) of the outstanding slots which are
+	// ready to be used, i.e. which are neither active nor have a pending UDP send
+	// request. Slots are pushed using rs__push_free_slot whenever they become
+	// ready.
+	rs__outstanding_t *free_slots;
+	
+	// Hash tables of doubly-linked lists of the outstanding slots which are
+	// awaiting a response (i.e. active and not cancelled), indexed by sequence
+	// number, by read/write ID and by destination respectively. All tables have
+	// index_mask + 1 buckets (a power of two no smaller than n_outstanding) and
+	// the bucket for a given key is (key & index_mask).
+	rs__outstanding_t **seq_index;
+	rs__outstanding_t **rw_index;
+	rs__outstanding_t **dest_index;
+	unsigned int index_mask;
+	
+	// A pool of preallocated buffers into which incoming packets are received.
+	// Each buffer is large enough to hold the largest expected SCP packet (plus
+	// the two padding bytes).
+	rs__buf_pool_t *recv_pool;
+	
+	// A receive buffer pool which was replaced (when the SCP data length was
+	// discovered) while one of its buffers was still in use, or NULL. The pool
+	// is freed once its buffers have all been returned.
+	rs__buf_pool_t *old_recv_pool;
+	
+	// The progress of the discovery of scp_data_length, the destination of the
+	// probing CMD_VER and the length its response reported (0 if the probe
+	// failed).
+	rs__probe_state_t probe_state;
+	uint16_t probe_dest_addr;
+	uint8_t probe_dest_cpu;
+	size_t probed_scp_data_length;
+	
+	// When batching, set while the request queue is being processed. Packets
+	// transmitted during this time are added to batch_slots (in order) rather
+	// than being sent immediately and are sent together by rs__flush_batch.
+	bool batching;
+	rs__outstanding_t **batch_slots;
+	unsigned int n_batched;
+	
+#ifdef RS__HAVE_SENDMMSG
+	// Message headers and IO vectors (two per message: packet and payload) used
+	// to transmit batches with sendmmsg. Each array has an entry per outstanding
+	// slot.
+	struct mmsghdr *batch_msgs;
+	struct iovec *batch_iovs;
+#endif
+	
+#ifdef RS_ZERO_COPY_READ
+	// If non-NULL, the outstanding slot whose read response is being received
+	// directly into the user's buffer. The receive buffer lent to libuv starts
+	// RS__READ_RESPONSE_HEADER_LENGTH bytes before the slot's slice of the user's
+	// buffer (see rs__zc_recv_alloc).
+	rs__outstanding_t *zc_os;
+	
+	// The (already received) user data overwritten by the packet header when
+	// receiving directly into a user's buffer.
+	char zc_saved[RS__READ_RESPONSE_HEADER_LENGTH];
+	
+	// The header of the last packet received directly into a user's buffer,
+	// moved out of the way of the user's data.
+	char zc_header[RS__READ_RESPONSE_HEADER_LENGTH];
+#endif
+	
 	// Counter used to assign packet sequence numbers. Contains the next value to
 	// be assigned.
 	uint16_t next_seq_num;
 	
-	// Counter used to assign unique IDs to read/write requests. Contains the next
-	// value to be assigned.
-	unsigned int next_rw_id;
+	// Counter used to assign unique IDs to requests. Contains the next value to
+	// be assigned.
+	unsigned int next_req_id;
+	
+#ifdef RS_TRACE
+	// The trace callback (or NULL if not tracing) and its data
+	rs_trace_cb trace_cb;
+	void *trace_cb_data;
+#endif
 	
 	// A flag which indicates that this structure should be freed as soon as
 	// possible.
@@ -254,12 +708,179 @@ struct rs_conn {
 };
 
 
+/**
+ * Add an outstanding slot which is now awaiting a response to the connection's
+ * sequence number index (and, for reads and writes, the read/write ID index).
+ *
+ * Must be called once the slot's seq_num, type, dest_addr, dest_cpu and (for
+ * read/writes) data.rw.id fields have been set.
+ */
+void rs__index_insert(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Remove an outstanding slot from the indices (e.g. because a response
+ * arrived or it was cancelled). Does nothing if the slot is not indexed.
+ */
+void rs__index_remove(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Find the outstanding slot awaiting a response with the given sequence
+ * number.
+ *
+ * @returns the slot or NULL if no slot is awaiting that sequence number (e.g.
+ *          for stale or duplicate responses).
+ */
+rs__outstanding_t *rs__index_find_seq_num(rs_conn_t *conn, uint16_t seq_num);
+
+
+/**
+ * Find an outstanding slot, other than the one given, awaiting a response for
+ * the same read/write request as the supplied read/write slot.
+ *
+ * @returns the slot or NULL if the supplied slot is the only one.
+ */
+rs__outstanding_t *rs__index_find_rw_sibling(rs_conn_t *conn,
+                                             rs__outstanding_t *os);
+
+
+/**
+ * Count the outstanding slots awaiting responses from the given destination.
+ * Only valid when max_in_flight_per_dest is set.
+ */
+unsigned int rs__index_count_dest(rs_conn_t *conn,
+                                  uint16_t dest_addr, uint8_t dest_cpu);
+
+
+/**
+ * Add an outstanding slot which has just become ready for reuse (i.e. it is
+ * nolonger active and has no pending UDP send request) to the connection's list
+ * of free slots.
+ *
+ * Must be called exactly once each time a slot becomes ready.
+ */
+void rs__push_free_slot(rs_conn_t *conn, rs__outstanding_t *os);
+
+
 /**
  * If and outstanding slots are available, process commands from the queue.
  */
 void rs__process_request_queue(rs_conn_t *conn);
 
 
+/**
+ * Allocate the connection's request queues.
+ *
+ * @returns 0 on success or -1 if allocation failed (in which case no queues
+ *          remain allocated).
+ */
+int rs__init_request_queues(rs_conn_t *conn);
+
+
+/**
+ * Free the connection's request queues (which should be empty).
+ */
+void rs__free_request_queues(rs_conn_t *conn);
+
+
+/**
+ * The total number of requests in all of the connection's request queues.
+ */
+size_t rs__request_queue_length(rs_conn_t *conn);
+
+
+/**
+ * Add a new request to the queue for the given priority, assigning it a
+ * request ID. The caller must fill in the remaining fields and then call
+ * rs__enqueued.
+ *
+ * @returns the new request or NULL if the priority is invalid or allocation
+ *          failed.
+ */
+rs__req_t *rs__enqueue(rs_conn_t *conn, rs_priority_t priority);
+
+
+/**
+ * The value to be returned by a submission function when rs__enqueue fails:
+ * RS_EFULL if the queue for the given priority is full and -1 otherwise.
+ */
+int rs__enqueue_error(rs_conn_t *conn, rs_priority_t priority);
+
+
+/**
+ * To be called once a request returned by rs__enqueue has been filled in.
+ * Records the request's arrival and attempts to dispatch it.
+ */
+void rs__enqueued(rs_conn_t *conn, rs__req_t *req);
+
+
+/**
+ * Pass any fences at the head of the request queue of the given priority whose
+ * preceding requests have all completed (see rs__fence.c). Should a request
+ * before a fence have failed, the requests queued after the fence (up to the
+ * next fence) are cancelled with RS_EFENCE.
+ */
+void rs__process_fences(rs_conn_t *conn, rs_priority_t priority);
+
+
+/**
+ * Queue the CMD_VER used to discover the SCP data length (see rs__probe.c).
+ *
+ * @returns 0 on success or -1 if the request could not be queued.
+ */
+int rs__probe_start(rs_conn_t *conn);
+
+
+/**
+ * Must dispatch be held back while the SCP data length is discovered? Once
+ * the probe has completed and no packets are in flight, the connection's
+ * buffers are resized as required by this call.
+ */
+bool rs__probe_blocking(rs_conn_t *conn);
+
+
+/**
+ * Return a buffer allocated by rs__udp_recv_alloc_cb to the pool it came from.
+ */
+void rs__recv_release(rs_conn_t *conn, char *base);
+
+
+/**
+ * Get the active read/write request (see rs__interleave.c) being performed by
+ * an outstanding slot, or NULL if all of the request's packets have been
+ * dispatched.
+ */
+rs__req_t *rs__active_rw(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Remove a request from the set of active requests.
+ */
+void rs__remove_active(rs_conn_t *conn, rs__req_t *req);
+
+
+/**
+ * Are there any requests of the given priority waiting to be dispatched (i.e.
+ * active requests or a queued request which may be admitted to the active
+ * set)?
+ */
+bool rs__pending_requests(rs_conn_t *conn, rs_priority_t priority);
+
+
+/**
+ * Choose the active request of the given priority to dispatch a packet from
+ * next, admitting queued requests to the active set as required. Requests for
+ * destinations with max_in_flight_per_dest packets in flight are skipped.
+ *
+ * The caller must remove SCP packet requests and completely dispatched
+ * read/write requests from the active set (rs__remove_active).
+ *
+ * @returns the request or NULL if no request may be dispatched.
+ */
+rs__req_t *rs__next_request(rs_conn_t *conn, rs_priority_t priority);
+
+
 /**
  * Attempt (re-)transmission of an outstanding packet.
  *
@@ -268,11 +889,57 @@ void rs__process_request_queue(rs_conn_t *conn);
  * transmission fails. If the transmission fails, the user's callback will be
  * called appropriately, the slot marked as inactive and the request cancelled.
  *
+ * If the connection is currently batching, the packet is added to the batch
+ * and transmitted by rs__flush_batch instead.
+ *
  * Note: The outstanding slot must be active when calling this function.
  */
 void rs__attempt_transmission(rs_conn_t *conn, rs__outstanding_t *os);
 
 
+/**
+ * Retransmit the packet in an outstanding slot after a backoff, following a
+ * transient error response to it. The slot remains active (and in the indices,
+ * under a new sequence number) in the meantime and the retransmission counts
+ * towards n_tries.
+ */
+void rs__retry_later(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Transmit the packet in an outstanding slot using uv_udp_send. If this fails,
+ * the request is cancelled.
+ */
+void rs__send_packet(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Transmit all packets in the connection's batch and clear the batching flag.
+ *
+ * Packets are sent using as few sendmmsg calls as possible, starting their
+ * timeout timers immediately. Should sendmmsg be unavailable or fail, the
+ * remaining packets are sent individually using rs__send_packet.
+ */
+void rs__flush_batch(rs_conn_t *conn);
+
+
+#ifdef RS__HAVE_SENDMMSG
+/**
+ * Called by rs__flush_batch. Transmit as many packets from the start of the
+ * batch as possible with a single sendmmsg call.
+ *
+ * @returns the number of packets sent (0 on failure).
+ */
+unsigned int rs__sendmmsg(rs_conn_t *conn);
+#endif
+
+
+/**
+ * Free the batch arrays allocated by rs_init_ex (if any).
+ */
+void rs__free_batch(rs_conn_t *conn);
+
+
 /**
  * Cancel the sending of a given outstanding request.
  *
@@ -327,6 +994,11 @@ bool rs__process_queued_rw(rs_conn_t *conn,
 
 /**
  * Callback function to allocate memory in advance of an SCP packet arriving.
+ *
+ * Buffers are taken from the connection's recv_pool (see rs__buf_pool_alloc).
+ * If RS_ZERO_COPY_READ is defined and a single CMD_READ response is awaited,
+ * the buffer may instead point into the user's read buffer (see
+ * rs__zc_recv_alloc).
  */
 void rs__udp_recv_alloc_cb(uv_handle_t *handle,
                            size_t suggested_size, uv_buf_t *buf);
@@ -337,7 +1009,7 @@ void rs__udp_recv_alloc_cb(uv_handle_t *handle,
  *
  * If an outstanding slot with a matching sequence number is found,
  * rs__process_response will be called with the response and the UDP data (which
- * will be freed as soon as rs__process_response returns).
+ * will be returned to the recv_pool as soon as rs__process_response returns).
  */
 void rs__udp_recv_cb(uv_udp_t *handle,
                      ssize_t nread, const uv_buf_t *buf,
@@ -346,9 +1018,200 @@ void rs__udp_recv_cb(uv_udp_t *handle,
 
 
 /**
- * Callback function when a timeout occurs on a packet.
+ * Called by rs__udp_recv_cb. Find the outstanding slot awaiting the supplied
+ * packet (not including padding bytes) and process it. Packets which are not
+ * awaited are ignored.
+ */
+void rs__dispatch_response(rs_conn_t *conn, uv_buf_t buf);
+
+
+#ifdef RS_ZERO_COPY_READ
+/**
+ * Called by rs__udp_recv_alloc_cb. If exactly one outstanding slot is active
+ * and it is awaiting a CMD_READ response, lend libuv a receive buffer
+ * positioned such that the response's payload lands directly in the slot's
+ * slice of the user's buffer.
+ *
+ * The header of the response will overwrite the
+ * RS__READ_RESPONSE_HEADER_LENGTH bytes immediately before the slice. These
+ * bytes are saved and restored by rs__zc_recv, as a result, this is only done
+ * when those bytes lie within the user's buffer (and thus have already been
+ * received since no other slot is active).
+ *
+ * @returns true if a buffer was allocated, false if the normal receive path
+ *          should be used.
+ */
+bool rs__zc_recv_alloc(rs_conn_t *conn, uv_buf_t *buf);
+
+
+/**
+ * Called by rs__udp_recv_cb for buffers allocated by rs__zc_recv_alloc.
+ *
+ * Moves the packet header out of the way and restores the user's data it
+ * overwrote. If the packet is the expected response, it is processed without
+ * any copying of the payload. Otherwise the packet is reassembled and processed
+ * as normal.
+ */
+void rs__zc_recv(rs_conn_t *conn, ssize_t nread, const uv_buf_t *buf);
+#endif
+
+
+/**
+ * Update the connection's RTT estimate (and, if adaptive_timeout is set, its
+ * retransmission timeout) with the round-trip time of a packet which received a
+ * response without being retransmitted (Karn's algorithm).
  *
- * Simply attempts to retransmit the packet.
+ * @param rtt The measured round-trip time (usec).
+ */
+void rs__rtt_sample(rs_conn_t *conn, uint64_t rtt);
+
+
+/**
+ * Record the transmission of a slot's packet in the connection's statistics.
+ */
+#ifdef RS_STATS
+#define RS__STATS_SENT(conn, os) do { \
+		(conn)->stats.n_packets_sent++; \
+		(conn)->stats.n_bytes_sent += (os)->packet.len + (os)->payload.len; \
+		(conn)->stats_active_sum += (conn)->n_active; \
+	} while (0)
+#else
+#define RS__STATS_SENT(conn, os) ((void)0)
+#endif
+
+
+/**
+ * Record the insertion of a request into the connection's request queue in the
+ * connection's statistics.
+ */
+#ifdef RS_STATS
+#define RS__STATS_QUEUED(conn) do { \
+		size_t queue_depth = rs__request_queue_length(conn); \
+		if (queue_depth > (conn)->stats.queue_depth_peak) \
+			(conn)->stats.queue_depth_peak = queue_depth; \
+	} while (0)
+#else
+#define RS__STATS_QUEUED(conn) ((void)0)
+#endif
+
+
+#ifdef RS_STATS
+/**
+ * Add a round-trip time measurement (usec) to the connection's RTT histogram.
+ */
+void rs__stats_rtt(rs_conn_t *conn, uint64_t rtt);
+#endif
+
+
+#ifdef RS_TRACE
+/**
+ * Generate a trace event (see RS__TRACE).
+ */
+void rs__trace(rs_conn_t *conn, rs_trace_event_t event,
+               unsigned int request_id, int seq_num, int slot, int error);
+#endif
+
+
+/**
+ * Get the timeout (msec) to wait for a response to the latest transmission of
+ * an outstanding slot's packet.
+ *
+ * When adaptive timeouts are enabled, this is the connection's current
+ * retransmission timeout doubled for each retransmission of the packet and
+ * limited to conn->timeout.
+ */
+uint64_t rs__slot_timeout(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Shrink the window multiplicatively following the loss of the packet in the
+ * supplied slot (or a busy response to it).
+ *
+ * Does nothing unless dynamic_window is set or if the packet was sent before
+ * the last time the window shrank.
+ */
+void rs__window_decrease(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Grow the window additively following an OK response to the packet in the
+ * supplied slot: by one slot per window's worth of OK responses.
+ *
+ * Does nothing unless dynamic_window is set.
+ */
+void rs__window_increase(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Does the supplied SCP return code indicate that the machine was busy (and
+ * thus that the window should shrink)?
+ */
+bool rs__window_busy_rc(uint16_t cmd_rc);
+
+
+/**
+ * Record the (re)transmission of a slot's packet, moving the slot to the end of
+ * the connection's transmission-ordered list.
+ *
+ * Does nothing unless fast retransmission is enabled.
+ */
+void rs__tx_record(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Remove a slot which is nolonger awaiting a response from the connection's
+ * transmission-ordered list. Does nothing if the slot is not in the list.
+ */
+void rs__tx_remove(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Called by rs__process_response once a response has been fully processed.
+ * Count the response against every slot whose latest transmission came before
+ * the transmission numbered tx_num (that of the response's packet) and
+ * retransmit those which have now been overtaken conn->fast_retransmit times.
+ *
+ * Packets which have no transmission attempts remaining are left to time out.
+ */
+void rs__fast_retransmit(rs_conn_t *conn, uint32_t tx_num);
+
+
+/**
+ * Start the timeout for a slot's packet, adding it to the connection's
+ * deadline-ordered list of timeouts.
+ *
+ * Since most packets are given the same timeout, the new deadline is usually
+ * the latest and the slot is added at the end of the list in constant time.
+ * The connection's timer is only restarted if it is not running or would fire
+ * too late.
+ *
+ * @param timeout The number of milliseconds until the timeout (see
+ *                rs__slot_timeout).
+ */
+void rs__timer_start(rs_conn_t *conn, rs__outstanding_t *os, uint64_t timeout);
+
+
+/**
+ * Stop the timeout for a slot's packet (if it is running).
+ *
+ * The connection's timer is left running (unless no timeouts remain) and will
+ * re-arm itself for the next deadline when it fires.
+ */
+void rs__timer_stop(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Start the connection's timer if it is not running (or would fire too late)
+ * so that it fires at the earliest deadline in the list of timeouts.
+ */
+void rs__timer_arm(rs_conn_t *conn);
+
+
+/**
+ * Callback function when the connection's timer fires.
+ *
+ * Attempts to retransmit every packet whose timeout has passed and then
+ * re-arms the timer for the earliest remaining deadline.
  */
 void rs__timer_cb(uv_timer_t *handle);
 
@@ -392,11 +1255,86 @@ void rs__udp_handle_closed_cb(uv_handle_t *handle);
 
 
 /**
- * Callback on closing a timer handle.
+ * Callback on closing the timer handle.
  *
  * Simply used to attempt to complete the freeing process once this handle has
  * been closed.
  */
 void rs__timer_handle_closed_cb(uv_handle_t *handle);
 
+
+/**
+ * Attempt to merge a read or write into the most recently queued request of
+ * the same priority (see rs_conn_opts_t.coalesce). Merging is possible when
+ * that request has the same type and destination, ends at the supplied address
+ * and the combined length fits within a single packet.
+ *
+ * @returns 1 if the request was merged (and need not be queued), 0 if it could
+ *          not be merged and -1 on failure to allocate memory. In either of
+ *          the latter cases the queued requests are left intact and the
+ *          request may still be queued on its own.
+ */
+int rs__coalesce(rs_conn_t *conn,
+                 rs_priority_t priority,
+                 rs__req_type_t type,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint32_t address,
+                 uv_buf_t data,
+                 rs_rw_cb cb,
+                 void *cb_data);
+
+
+/**
+ * Callback on closing the thread-safe submission async handle.
+ *
+ * Simply used to attempt to complete the freeing process once this handle has
+ * been closed.
+ */
+void rs__ts_async_handle_closed_cb(uv_handle_t *handle);
+
+
+/**
+ * Callback for ts_async_handle: queues all requests submitted from other
+ * threads.
+ */
+void rs__ts_async_cb(uv_async_t *handle);
+
+
+/**
+ * Cancel all requests submitted from other threads which have not yet been
+ * queued (used when freeing a connection).
+ */
+void rs__ts_cancel_all(rs_conn_t *conn, int error);
+
+
+/**
+ * Create a callback queue on the given loop. Must be called from the thread
+ * running the loop (or before it is started).
+ *
+ * @returns the queue or NULL on failure.
+ */
+rs__cb_queue_t *rs__cb_queue_init(uv_loop_t *loop);
+
+
+/**
+ * Add a completed request to a callback queue. May be called from any thread.
+ */
+void rs__cb_queue_push(rs__cb_queue_t *cb_queue, rs__ts_req_t *ts_req);
+
+
+/**
+ * Make the callbacks of all requests in a callback queue. Must be called from
+ * the thread running the queue's loop.
+ */
+void rs__cb_queue_drain(rs__cb_queue_t *cb_queue);
+
+
+/**
+ * Deliver any remaining callbacks and free a callback queue. Must be called
+ * from the thread running the queue's loop once no more requests will be
+ * added. The queue is freed once its async handle has closed.
+ */
+void rs__cb_queue_free(rs__cb_queue_t *cb_queue);
+
 #endif
@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <rs__mpsc.h>
+
+
+void
+rs__mpsc_init(rs__mpsc_t *q)
+{
+	__atomic_store_n(&(q->head), NULL, __ATOMIC_RELEASE);
+}
+
+
+bool
+rs__mpsc_push(rs__mpsc_t *q, rs__mpsc_entry_t *entry)
+{
+	rs__mpsc_entry_t *head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+	do {
+		entry->next = head;
+	} while (!__atomic_compare_exchange_n(&(q->head), &head, entry, true,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	
+	return head == NULL;
+}
+
+
+rs__mpsc_entry_t *
+rs__mpsc_take_all(rs__mpsc_t *q)
+{
+	rs__mpsc_entry_t *entry = __atomic_exchange_n(&(q->head), NULL,
+	                                              __ATOMIC_ACQUIRE);
+	
+	// The entries were taken most-recent first, reverse them
+	rs__mpsc_entry_t *first = NULL;
+	while (entry) {
+		rs__mpsc_entry_t *next = entry->next;
+		entry->next = first;
+		first = entry;
+		entry = next;
+	}
+	
+	return first;
+}
@@ -0,0 +1,64 @@
+/**
+ * A lock-free, intrusive, multiple-producer single-consumer queue.
+ *
+ * Any number of threads may push entries concurrently while a single consumer
+ * takes all entries pushed so far in one go (and in the order they were
+ * pushed). Since the consumer only ever takes the whole queue, the
+ * implementation is a simple atomic stack which is immune to the ABA problem.
+ *
+ * Users must define their structs to contain an rs__mpsc_entry_t as their
+ * first element.
+ */
+
+#ifndef RS__MPSC_H
+#define RS__MPSC_H
+
+#include <stdbool.h>
+
+
+/**
+ * An entry in the queue.
+ */
+struct rs__mpsc_entry;
+typedef struct rs__mpsc_entry rs__mpsc_entry_t;
+struct rs__mpsc_entry {
+	// The next entry (in the stack while queued, in the list returned by
+	// rs__mpsc_take_all afterwards).
+	rs__mpsc_entry_t *next;
+};
+
+
+/**
+ * Data type which represents the queue.
+ */
+typedef struct {
+	// The most recently pushed entry (or NULL if empty). Only accessed
+	// atomically.
+	rs__mpsc_entry_t *head;
+} rs__mpsc_t;
+
+
+/**
+ * Initialise an empty queue.
+ */
+void rs__mpsc_init(rs__mpsc_t *q);
+
+
+/**
+ * Add an entry to the queue. May be called from any thread.
+ *
+ * @returns true if the queue was empty beforehand.
+ */
+bool rs__mpsc_push(rs__mpsc_t *q, rs__mpsc_entry_t *entry);
+
+
+/**
+ * Remove all entries from the queue. Must only be called by one thread at a
+ * time.
+ *
+ * @returns the first entry pushed (or NULL if empty). Subsequent entries are
+ *          linked via their next field.
+ */
+rs__mpsc_entry_t *rs__mpsc_take_all(rs__mpsc_t *q);
+
+#endif
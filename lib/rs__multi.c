@@ -0,0 +1,260 @@
+/**
+ * Broadcast writes of one buffer to many chips (rs_write_multi).
+ *
+ * The buffer is split into packet-sized chunks which are written to each
+ * target in turn (chunk 0 to every target, then chunk 1 to every target and so
+ * on) so that consecutive packets go to different chips, avoiding overrunning
+ * any one chip's monitor. Each chunk write refers directly to its slice of the
+ * user's buffer so the payload is never copied. Only a bounded number of chunk
+ * writes are queued at once, the next being queued as each completes. Should
+ * the request queue be full, queuing pauses until a chunk write completes.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * The number of chunk writes queued at once for each outstanding slot.
+ */
+#define RS__MULTI_QUEUED_PER_SLOT 2
+
+
+struct rs__multi;
+
+/**
+ * A chunk write in progress (the callback data for the write).
+ */
+typedef struct {
+	struct rs__multi *multi;
+	bool busy;
+	
+	// The index of the target being written to
+	unsigned int target;
+} rs__multi_slot_t;
+
+
+/**
+ * State of a broadcast write.
+ */
+typedef struct rs__multi {
+	rs_conn_t *conn;
+	
+	// The user's targets (into which the outcome of each is written)
+	unsigned int n_targets;
+	rs_target_t *targets;
+	
+	// The region and data to write
+	uint32_t address;
+	uv_buf_t data;
+	
+	// The length of each chunk (fixed when the write starts since the
+	// connection's SCP data length may change if it is being discovered)
+	size_t chunk_len;
+	
+	// The chunk and target of the next chunk write to queue
+	size_t next_offset;
+	unsigned int next_target;
+	
+	// The number of chunk writes in progress
+	unsigned int n_busy;
+	
+	// Set while rs__multi_progress is running and set again if it is called in
+	// the meantime.
+	bool in_progress;
+	bool again;
+	
+	rs_write_multi_cb cb;
+	void *cb_data;
+	
+	// Callback data for chunk writes in progress
+	unsigned int n_slots;
+	rs__multi_slot_t slots[];
+} rs__multi_t;
+
+
+static void rs__multi_progress(rs__multi_t *multi);
+
+
+/**
+ * Record the failure of a target (keeping only the first error).
+ */
+static void
+rs__multi_fail(rs_target_t *target, int error, uint16_t cmd_rc)
+{
+	if (!target->error) {
+		target->error = error;
+		target->cmd_rc = cmd_rc;
+	}
+}
+
+
+static void
+rs__multi_rw_cb(rs_conn_t *conn,
+                int error,
+                uint16_t cmd_rc,
+                uv_buf_t data,
+                void *cb_data)
+{
+	rs__multi_slot_t *slot = (rs__multi_slot_t *)cb_data;
+	rs__multi_t *multi = slot->multi;
+	
+	if (error)
+		rs__multi_fail(&(multi->targets[slot->target]), error, cmd_rc);
+	
+	slot->busy = false;
+	multi->n_busy--;
+	rs__multi_progress(multi);
+}
+
+
+/**
+ * Queue the next chunk write (skipping targets which have already failed).
+ *
+ * Should the request queue be full while other chunk writes are in progress,
+ * the chunk write is left to be queued once one of them completes.
+ *
+ * @returns false if no chunk write was queued.
+ */
+static bool
+rs__multi_queue_next(rs__multi_t *multi, rs__multi_slot_t *slot)
+{
+	rs_conn_t *conn = multi->conn;
+	
+	while (multi->next_offset < multi->data.len) {
+		unsigned int t = multi->next_target;
+		size_t offset = multi->next_offset;
+		rs_target_t *target = &(multi->targets[t]);
+		
+		bool queued = false;
+		if (!target->error) {
+			uv_buf_t chunk;
+			chunk.base = multi->data.base + offset;
+			chunk.len = MIN(multi->chunk_len, multi->data.len - offset);
+			
+			slot->busy = true;
+			slot->target = t;
+			multi->n_busy++;
+			int retval = rs_write(conn, target->dest_addr, target->dest_cpu,
+			                      multi->address + offset, chunk,
+			                      rs__multi_rw_cb, slot);
+			if (retval) {
+				slot->busy = false;
+				multi->n_busy--;
+				if (retval == RS_EFULL && multi->n_busy)
+					return false;
+				rs__multi_fail(target,
+				               (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM, 0);
+			} else {
+				queued = true;
+			}
+		}
+		
+		// Move on to the next target (and chunk)
+		if (++multi->next_target == multi->n_targets) {
+			multi->next_target = 0;
+			multi->next_offset += multi->chunk_len;
+		}
+		
+		if (queued)
+			return true;
+	}
+	
+	return false;
+}
+
+
+/**
+ * Queue chunk writes using any free slots and complete the write once done.
+ */
+static void
+rs__multi_progress(rs__multi_t *multi)
+{
+	if (multi->in_progress) {
+		multi->again = true;
+		return;
+	}
+	multi->in_progress = true;
+	
+	do {
+		multi->again = false;
+		
+		unsigned int i;
+		for (i = 0; i < multi->n_slots; i++)
+			if (!multi->slots[i].busy &&
+			    !rs__multi_queue_next(multi, &(multi->slots[i])))
+				break;
+	} while (multi->again);
+	
+	if (!multi->n_busy && multi->next_offset >= multi->data.len) {
+		// Report the first target to fail (in target order)
+		int error = 0;
+		unsigned int n_failed = 0;
+		unsigned int i;
+		for (i = 0; i < multi->n_targets; i++) {
+			if (multi->targets[i].error) {
+				if (!n_failed)
+					error = multi->targets[i].error;
+				n_failed++;
+			}
+		}
+		
+		multi->cb(multi->conn, error, n_failed,
+		          multi->n_targets, multi->targets, multi->cb_data);
+		free(multi);
+		return;
+	}
+	
+	multi->in_progress = false;
+}
+
+
+int
+rs_write_multi(rs_conn_t *conn,
+               unsigned int n_targets,
+               rs_target_t *targets,
+               uint32_t address,
+               uv_buf_t data,
+               rs_write_multi_cb cb,
+               void *cb_data)
+{
+	unsigned int n_slots = conn->n_outstanding * RS__MULTI_QUEUED_PER_SLOT;
+	rs__multi_t *multi = malloc(sizeof(rs__multi_t) +
+	                            n_slots * sizeof(rs__multi_slot_t));
+	if (!multi)
+		return -1;
+	
+	multi->conn = conn;
+	multi->n_targets = n_targets;
+	multi->targets = targets;
+	multi->address = address;
+	multi->data = data;
+	multi->chunk_len = conn->scp_data_length;
+	multi->next_offset = n_targets ? 0 : data.len;
+	multi->next_target = 0;
+	multi->n_busy = 0;
+	multi->in_progress = false;
+	multi->again = false;
+	multi->cb = cb;
+	multi->cb_data = cb_data;
+	multi->n_slots = n_slots;
+	
+	unsigned int i;
+	for (i = 0; i < n_slots; i++) {
+		multi->slots[i].multi = multi;
+		multi->slots[i].busy = false;
+	}
+	for (i = 0; i < n_targets; i++) {
+		targets[i].error = 0;
+		targets[i].cmd_rc = 0;
+	}
+	
+	rs__multi_progress(multi);
+	return 0;
+}
@@ -0,0 +1,619 @@
+/**
+ * A pool of connections to the boards of a multi-board machine which routes
+ * requests by destination chip.
+ *
+ * The pool is built entirely on the public connection API: each board has its
+ * own rs_conn_t and requests are simply forwarded to the connection for the
+ * destination chip.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * The number of distinct chip coordinates (and thus entries in a route table).
+ */
+#define RS__POOL_N_CHIPS (1 << 16)
+
+/**
+ * Flag set in a route table entry which was set explicitly by rs_pool_map_chip
+ * (rather than chosen automatically).
+ */
+#define RS__POOL_ROUTE_EXPLICIT 0x8000u
+
+
+/**
+ * A board in a pool.
+ */
+typedef struct {
+	// The address of the board's Ethernet connection. The connection retains a
+	// pointer to this so the board structure must not move.
+	struct sockaddr_storage addr;
+	
+	// The coordinates of the board's Ethernet chip
+	uint16_t eth_chip;
+	
+	// The connection to the board
+	rs_conn_t *conn;
+} rs__pool_board_t;
+
+
+struct rs_pool {
+	// The event loop and options used by every connection. The options' array
+	// of retry_rcs points to the pool's own copy (since the connections are
+	// created long after rs_pool_init returns).
+	uv_loop_t *loop;
+	rs_conn_opts_t opts;
+	uint16_t *retry_rcs;
+	
+	// The boards in the pool
+	rs__pool_board_t **boards;
+	unsigned int n_boards;
+	
+	// A table with an entry for every chip giving the index of the board via
+	// which requests for that chip are sent, plus one (0 if not yet known),
+	// optionally OR'd with RS__POOL_ROUTE_EXPLICIT. Allocated on first use and
+	// filled in lazily.
+	uint16_t *routes;
+	
+	// When freeing, the number of connections yet to be freed and the callback
+	// to call once all have been.
+	unsigned int n_freeing;
+	rs_free_cb free_cb;
+	void *free_cb_data;
+};
+
+
+/**
+ * A region of a pool-wide operation and the connection it is sent via.
+ */
+typedef struct {
+	rs_pool_region_t region;
+	rs_conn_t *conn;
+} rs__pool_op_region_t;
+
+
+/**
+ * State of a pool-wide operation (e.g. rs_pool_read_regions).
+ */
+typedef struct {
+	rs_pool_t *pool;
+	bool write;
+	
+	// The index of the next region to queue and the number of regions queued
+	// but not yet complete
+	unsigned int next_region;
+	unsigned int n_busy;
+	
+	// Set while rs__pool_op_progress is running and set again if it is called
+	// in the meantime.
+	bool in_progress;
+	bool again;
+	
+	// The first error to occur and the accompanying cmd_rc
+	int error;
+	uint16_t cmd_rc;
+	
+	rs_pool_cb cb;
+	void *cb_data;
+	
+	// The user's regions (copied)
+	unsigned int n_regions;
+	rs__pool_op_region_t regions[];
+} rs__pool_op_t;
+
+
+rs_pool_t *
+rs_pool_init(uv_loop_t *loop, const rs_conn_opts_t *opts)
+{
+	rs_pool_t *pool = malloc(sizeof(rs_pool_t));
+	if (!pool) return NULL;
+	
+	pool->loop = loop;
+	pool->opts = *opts;
+	pool->retry_rcs = NULL;
+	if (opts->n_retry_rcs) {
+		pool->retry_rcs = malloc(opts->n_retry_rcs * sizeof(uint16_t));
+		if (!pool->retry_rcs) {
+			free(pool);
+			return NULL;
+		}
+		memcpy(pool->retry_rcs, opts->retry_rcs,
+		       opts->n_retry_rcs * sizeof(uint16_t));
+	}
+	pool->opts.retry_rcs = pool->retry_rcs;
+	pool->boards = NULL;
+	pool->n_boards = 0;
+	pool->routes = NULL;
+	pool->n_freeing = 0;
+	pool->free_cb = NULL;
+	pool->free_cb_data = NULL;
+	
+	return pool;
+}
+
+
+/**
+ * Allocate the route table if it has not been already.
+ *
+ * @returns 0 on success or -1 on allocation failure.
+ */
+static int
+rs__pool_alloc_routes(rs_pool_t *pool)
+{
+	if (!pool->routes)
+		pool->routes = calloc(RS__POOL_N_CHIPS, sizeof(uint16_t));
+	return pool->routes ? 0 : -1;
+}
+
+
+int
+rs_pool_add_board(rs_pool_t *pool,
+                  const struct sockaddr *addr,
+                  uint16_t eth_chip)
+{
+	if (pool->n_boards >= RS__POOL_ROUTE_EXPLICIT - 1)
+		return -1;
+	
+	rs__pool_board_t **boards = realloc(pool->boards,
+	                                    sizeof(rs__pool_board_t *) *
+	                                    (pool->n_boards + 1));
+	if (!boards)
+		return -1;
+	pool->boards = boards;
+	
+	rs__pool_board_t *board = malloc(sizeof(rs__pool_board_t));
+	if (!board)
+		return -1;
+	
+	memset(&(board->addr), 0, sizeof(board->addr));
+	memcpy(&(board->addr), addr, (addr->sa_family == AF_INET6)
+	                             ? sizeof(struct sockaddr_in6)
+	                             : sizeof(struct sockaddr_in));
+	board->eth_chip = eth_chip;
+	board->conn = rs_init_ex(pool->loop, (struct sockaddr *)&(board->addr),
+	                         &(pool->opts));
+	if (!board->conn) {
+		free(board);
+		return -1;
+	}
+	
+	pool->boards[pool->n_boards] = board;
+	
+	// The nearest board may have changed for any chip not routed explicitly
+	if (pool->routes) {
+		unsigned int chip;
+		for (chip = 0; chip < RS__POOL_N_CHIPS; chip++)
+			if (!(pool->routes[chip] & RS__POOL_ROUTE_EXPLICIT))
+				pool->routes[chip] = 0;
+	}
+	
+	return pool->n_boards++;
+}
+
+
+int
+rs_pool_map_chip(rs_pool_t *pool, uint16_t chip, int board)
+{
+	if (board < 0 || (unsigned int)board >= pool->n_boards)
+		return -1;
+	
+	if (rs__pool_alloc_routes(pool))
+		return -1;
+	
+	pool->routes[chip] = (board + 1) | RS__POOL_ROUTE_EXPLICIT;
+	return 0;
+}
+
+
+/**
+ * The number of hops between two chips on SpiNNaker's hexagonal mesh (ignoring
+ * wrap-around links).
+ */
+static unsigned int
+rs__pool_distance(uint16_t a, uint16_t b)
+{
+	int dx = (int)(a >> 8) - (int)(b >> 8);
+	int dy = (int)(a & 0xFF) - (int)(b & 0xFF);
+	
+	// Diagonal links join (x, y) and (x+1, y+1) so moving in both dimensions in
+	// the same direction is cheaper.
+	if ((dx >= 0) == (dy >= 0))
+		return (unsigned int)MAX(abs(dx), abs(dy));
+	else
+		return (unsigned int)(abs(dx) + abs(dy));
+}
+
+
+/**
+ * Get the board requests for a given chip are sent via.
+ *
+ * @returns the board or NULL if the pool has no boards.
+ */
+static rs__pool_board_t *
+rs__pool_route(rs_pool_t *pool, uint16_t chip)
+{
+	if (!pool->n_boards)
+		return NULL;
+	
+	// Use the cached route if available
+	if (pool->routes && pool->routes[chip])
+		return pool->boards[(pool->routes[chip] & ~RS__POOL_ROUTE_EXPLICIT) - 1];
+	
+	// Find the nearest Ethernet chip
+	unsigned int best = 0;
+	unsigned int i;
+	for (i = 1; i < pool->n_boards; i++)
+		if (rs__pool_distance(chip, pool->boards[i]->eth_chip) <
+		    rs__pool_distance(chip, pool->boards[best]->eth_chip))
+			best = i;
+	
+	// Cache the route (if the table can't be allocated the route is simply
+	// recomputed next time)
+	if (!rs__pool_alloc_routes(pool))
+		pool->routes[chip] = best + 1;
+	
+	return pool->boards[best];
+}
+
+
+rs_conn_t *
+rs_pool_conn(rs_pool_t *pool, uint16_t chip)
+{
+	rs__pool_board_t *board = rs__pool_route(pool, chip);
+	return board ? board->conn : NULL;
+}
+
+
+int
+rs_pool_send_scp(rs_pool_t *pool,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint16_t cmd_rc,
+                 unsigned int n_args_send,
+                 unsigned int n_args_recv,
+                 uint32_t arg1,
+                 uint32_t arg2,
+                 uint32_t arg3,
+                 uv_buf_t data,
+                 size_t data_max_len,
+                 rs_send_scp_cb cb,
+                 void *cb_data)
+{
+	rs_conn_t *conn = rs_pool_conn(pool, dest_addr);
+	if (!conn)
+		return -1;
+	
+	return rs_send_scp(conn, dest_addr, dest_cpu, cmd_rc,
+	                   n_args_send, n_args_recv, arg1, arg2, arg3,
+	                   data, data_max_len, cb, cb_data);
+}
+
+
+int
+rs_pool_write(rs_pool_t *pool,
+              uint16_t dest_addr,
+              uint8_t dest_cpu,
+              uint32_t address,
+              uv_buf_t data,
+              rs_rw_cb cb,
+              void *cb_data)
+{
+	rs_conn_t *conn = rs_pool_conn(pool, dest_addr);
+	if (!conn)
+		return -1;
+	
+	return rs_write(conn, dest_addr, dest_cpu, address, data, cb, cb_data);
+}
+
+
+int
+rs_pool_read(rs_pool_t *pool,
+             uint16_t dest_addr,
+             uint8_t dest_cpu,
+             uint32_t address,
+             uv_buf_t data,
+             rs_rw_cb cb,
+             void *cb_data)
+{
+	rs_conn_t *conn = rs_pool_conn(pool, dest_addr);
+	if (!conn)
+		return -1;
+	
+	return rs_read(conn, dest_addr, dest_cpu, address, data, cb, cb_data);
+}
+
+
+static void rs__pool_op_progress(rs__pool_op_t *op);
+
+
+/**
+ * Record the failure of a region (keeping only the first error).
+ */
+static void
+rs__pool_op_fail(rs__pool_op_t *op, int error, uint16_t cmd_rc)
+{
+	if (!op->error) {
+		op->error = error;
+		op->cmd_rc = cmd_rc;
+	}
+}
+
+
+/**
+ * Callback for each read/write of a pool-wide operation.
+ */
+static void
+rs__pool_op_rw_cb(rs_conn_t *conn,
+                  int error,
+                  uint16_t cmd_rc,
+                  uv_buf_t data,
+                  void *cb_data)
+{
+	rs__pool_op_t *op = (rs__pool_op_t *)cb_data;
+	
+	if (error)
+		rs__pool_op_fail(op, error, cmd_rc);
+	
+	op->n_busy--;
+	rs__pool_op_progress(op);
+}
+
+
+/**
+ * Queue the read/write of the next region of a pool-wide operation.
+ *
+ * @returns 0 on success or the value returned by rs_read/rs_write otherwise.
+ */
+static int
+rs__pool_op_queue_next(rs__pool_op_t *op)
+{
+	rs__pool_op_region_t *r = &(op->regions[op->next_region]);
+	const rs_pool_region_t *region = &(r->region);
+	
+	op->n_busy++;
+	int retval;
+	if (op->write)
+		retval = rs_write(r->conn, region->dest_addr, region->dest_cpu,
+		                  region->address, region->data,
+		                  rs__pool_op_rw_cb, op);
+	else
+		retval = rs_read(r->conn, region->dest_addr, region->dest_cpu,
+		                 region->address, region->data,
+		                 rs__pool_op_rw_cb, op);
+	if (retval)
+		op->n_busy--;
+	else
+		op->next_region++;
+	
+	return retval;
+}
+
+
+/**
+ * Queue as many of the remaining regions of a pool-wide operation as possible
+ * and complete the operation once all are done.
+ *
+ * Should a request queue be full while regions are in progress, the remaining
+ * regions are left to be queued as those complete. Regions which can't be
+ * queued otherwise fail with RS_EFULL or UV_ENOMEM.
+ */
+static void
+rs__pool_op_progress(rs__pool_op_t *op)
+{
+	if (op->in_progress) {
+		op->again = true;
+		return;
+	}
+	op->in_progress = true;
+	
+	do {
+		op->again = false;
+		
+		while (op->next_region < op->n_regions) {
+			int retval = rs__pool_op_queue_next(op);
+			if (!retval)
+				continue;
+			if (retval == RS_EFULL && op->n_busy)
+				break;
+			
+			rs__pool_op_fail(op, (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM, 0);
+			op->next_region++;
+		}
+	} while (op->again);
+	
+	if (!op->n_busy && op->next_region == op->n_regions) {
+		op->cb(op->pool, op->error, op->cmd_rc, op->cb_data);
+		free(op);
+		return;
+	}
+	
+	op->in_progress = false;
+}
+
+
+/**
+ * Common implementation of rs_pool_read_regions and rs_pool_write_regions.
+ */
+static int
+rs__pool_rw_regions(rs_pool_t *pool,
+                    bool write,
+                    unsigned int n_regions,
+                    const rs_pool_region_t *regions,
+                    rs_pool_cb cb,
+                    void *cb_data)
+{
+	rs__pool_op_t *op = malloc(sizeof(rs__pool_op_t) +
+	                           n_regions * sizeof(rs__pool_op_region_t));
+	if (!op)
+		return -1;
+	
+	op->pool = pool;
+	op->write = write;
+	op->next_region = 0;
+	op->n_busy = 0;
+	op->in_progress = true;
+	op->again = false;
+	op->error = 0;
+	op->cmd_rc = 0;
+	op->cb = cb;
+	op->cb_data = cb_data;
+	op->n_regions = n_regions;
+	
+	// Every region must have a route before any is started
+	unsigned int i;
+	for (i = 0; i < n_regions; i++) {
+		op->regions[i].region = regions[i];
+		op->regions[i].conn = rs_pool_conn(pool, regions[i].dest_addr);
+		if (!op->regions[i].conn) {
+			free(op);
+			return -1;
+		}
+	}
+	
+	// Should the first region fail to be queued, nothing has been started and
+	// the failure is reported immediately (without calling the callback).
+	if (n_regions) {
+		int retval = rs__pool_op_queue_next(op);
+		if (retval) {
+			free(op);
+			return (retval == RS_EFULL) ? RS_EFULL : -1;
+		}
+	}
+	
+	op->in_progress = false;
+	rs__pool_op_progress(op);
+	
+	return 0;
+}
+
+int
+rs_pool_read_regions(rs_pool_t *pool,
+                     unsigned int n_regions,
+                     const rs_pool_region_t *regions,
+                     rs_pool_cb cb,
+                     void *cb_data)
+{
+	return rs__pool_rw_regions(pool, false, n_regions, regions, cb, cb_data);
+}
+
+
+int
+rs_pool_write_regions(rs_pool_t *pool,
+                      unsigned int n_regions,
+                      const rs_pool_region_t *regions,
+                      rs_pool_cb cb,
+                      void *cb_data)
+{
+	return rs__pool_rw_regions(pool, true, n_regions, regions, cb, cb_data);
+}
+
+
+int
+rs_pool_get_stats(rs_pool_t *pool, rs_stats_t *stats)
+{
+	memset(stats, 0, sizeof(rs_stats_t));
+	
+	unsigned int i;
+	for (i = 0; i < pool->n_boards; i++) {
+		rs_stats_t s;
+		if (rs_get_stats(pool->boards[i]->conn, &s))
+			return -1;
+		
+		stats->n_packets_sent += s.n_packets_sent;
+		stats->n_bytes_sent += s.n_bytes_sent;
+		stats->n_packets_received += s.n_packets_received;
+		stats->n_bytes_received += s.n_bytes_received;
+		stats->n_retransmits_timeout += s.n_retransmits_timeout;
+		stats->n_retransmits_fast += s.n_retransmits_fast;
+		stats->n_timeouts += s.n_timeouts;
+		stats->n_bad_rc += s.n_bad_rc;
+		stats->n_retries_rc += s.n_retries_rc;
+		stats->n_coalesced += s.n_coalesced;
+		stats->n_recv_pool_exhausted += s.n_recv_pool_exhausted;
+		stats->queue_depth += s.queue_depth;
+		stats->queue_depth_peak += s.queue_depth_peak;
+		stats->n_active += s.n_active;
+		stats->mean_active += s.mean_active;
+		stats->window += s.window;
+		stats->rto = MAX(stats->rto, s.rto);
+		stats->srtt = MAX(stats->srtt, s.srtt);
+		stats->rttvar = MAX(stats->rttvar, s.rttvar);
+		
+		unsigned int j;
+		for (j = 0; j < RS_STATS_RTT_BUCKETS; j++)
+			stats->rtt_histogram[j] += s.rtt_histogram[j];
+	}
+
+#ifdef RS_STATS
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+void
+rs_pool_reset_stats(rs_pool_t *pool)
+{
+	unsigned int i;
+	for (i = 0; i < pool->n_boards; i++)
+		rs_reset_stats(pool->boards[i]->conn);
+}
+
+
+/**
+ * Called each time one of the pool's connections has been freed. Frees the
+ * pool once all have been.
+ */
+static void
+rs__pool_conn_freed(void *data)
+{
+	rs_pool_t *pool = (rs_pool_t *)data;
+	
+	if (--pool->n_freeing)
+		return;
+	
+	unsigned int i;
+	for (i = 0; i < pool->n_boards; i++)
+		free(pool->boards[i]);
+	free(pool->boards);
+	free(pool->routes);
+	free(pool->retry_rcs);
+	
+	// Just before freeing the pool, take a copy of the callback function
+	rs_free_cb cb = pool->free_cb;
+	void *cb_data = pool->free_cb_data;
+	free(pool);
+	
+	if (cb)
+		cb(cb_data);
+}
+
+
+void
+rs_pool_free(rs_pool_t *pool, rs_free_cb cb, void *cb_data)
+{
+	pool->free_cb = cb;
+	pool->free_cb_data = cb_data;
+	
+	// An extra count is held until every connection's free has been started
+	// since connections may be freed immediately.
+	pool->n_freeing = pool->n_boards + 1;
+	
+	unsigned int i;
+	for (i = 0; i < pool->n_boards; i++)
+		rs_free(pool->boards[i]->conn, rs__pool_conn_freed, pool);
+	
+	rs__pool_conn_freed(pool);
+}
@@ -0,0 +1,181 @@
+/**
+ * Discovery of a connection's SCP data length.
+ *
+ * When a connection is created with an scp_data_length of
+ * RS_SCP_DATA_LENGTH_AUTO, a CMD_VER is queued (at high priority, ahead of
+ * any user request) to the probe destination and a provisional length of
+ * RS__PROBE_SCP_DATA_LENGTH is used. No further packets are dispatched until
+ * the probe has completed: once its response has arrived and no other packets
+ * remain in flight the outstanding slots' packet buffers and the receive
+ * buffer pool are resized to suit the length reported (the low 16 bits of the
+ * CMD_VER response's arg2) and dispatch resumes.
+ *
+ * Should the probe fail (or report a length outside of
+ * RS__PROBE_MIN_SCP_DATA_LENGTH to RS__PROBE_MAX_SCP_DATA_LENGTH), the
+ * provisional length is kept.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * The SCP command used to probe the machine.
+ */
+#define RS__PROBE_CMD_VER 0
+
+/**
+ * The range of data lengths accepted from the probe: at least one word and no
+ * more than fits (with its two padding bytes and headers) in a single UDP
+ * datagram.
+ */
+#define RS__PROBE_MIN_SCP_DATA_LENGTH 4
+#define RS__PROBE_MAX_SCP_DATA_LENGTH \
+	(65507 - 2 - RS__SIZEOF_SCP_PACKET(3, 0))
+
+
+static void
+rs__probe_cb(rs_conn_t *conn,
+             int error,
+             uint16_t cmd_rc,
+             unsigned int n_args,
+             uint32_t arg1,
+             uint32_t arg2,
+             uint32_t arg3,
+             uv_buf_t data,
+             void *cb_data)
+{
+	size_t scp_data_length = arg2 & 0xFFFF;
+	if (!error && cmd_rc == RS__SCP_CMD_OK && n_args >= 2 &&
+	    scp_data_length >= RS__PROBE_MIN_SCP_DATA_LENGTH &&
+	    scp_data_length <= RS__PROBE_MAX_SCP_DATA_LENGTH)
+		conn->probed_scp_data_length = scp_data_length;
+	
+	// The buffers are resized once the probe's slot has been freed (see
+	// rs__probe_blocking)
+	conn->probe_state = RS__PROBE_RESIZE;
+}
+
+
+int
+rs__probe_start(rs_conn_t *conn)
+{
+	rs__req_t *req = rs__enqueue(conn, RS_PRIORITY_HIGH);
+	if (!req)
+		return -1;
+	
+	req->type = RS__REQ_SCP_PACKET;
+	req->dest_addr = conn->probe_dest_addr;
+	req->dest_cpu = conn->probe_dest_cpu;
+	req->data.scp_packet.cmd_rc = RS__PROBE_CMD_VER;
+	req->data.scp_packet.n_args_send = 3;
+	req->data.scp_packet.n_args_recv = 3;
+	req->data.scp_packet.arg1 = 0;
+	req->data.scp_packet.arg2 = 0;
+	req->data.scp_packet.arg3 = 0;
+	
+	// The version string in the response is not needed
+	req->data.scp_packet.data.base = NULL;
+	req->data.scp_packet.data.len = 0;
+	req->data.scp_packet.data_max_len = 0;
+	
+	req->data.scp_packet.cb = rs__probe_cb;
+	req->cb_data = NULL;
+	
+	rs__enqueued(conn, req);
+	return 0;
+}
+
+
+/**
+ * Resize the outstanding slots' packet buffers and the receive buffers for a
+ * new SCP data length.
+ *
+ * Should an allocation fail, the smaller of the old and new lengths (for
+ * which every buffer is still large enough) is used.
+ */
+static void
+rs__probe_resize(rs_conn_t *conn, size_t scp_data_length)
+{
+	size_t buf_size = RS__SIZEOF_SCP_PACKET(3, scp_data_length) + 2;
+	bool failed = false;
+	
+	// The packet buffers hold nothing of value between packets but the padding
+	// bytes, which realloc preserves.
+	unsigned int i;
+	for (i = 0; i < conn->n_outstanding; i++) {
+		char *base = realloc(conn->outstanding[i].packet.base, buf_size);
+		if (base)
+			conn->outstanding[i].packet.base = base;
+		else
+			failed = true;
+	}
+	
+	// When receiving with recvmmsg, the receive buffers are already large
+	// enough for any packet. Otherwise the pool is replaced: the buffer into
+	// which the probe's response arrived may still be in use (and is returned to
+	// the old pool by rs__recv_release).
+	if (!conn->recvmmsg && !failed) {
+		rs__buf_pool_t *pool = rs__buf_pool_init(buf_size, conn->n_outstanding);
+		if (pool) {
+			rs__buf_pool_t *old_pool = conn->recv_pool;
+			conn->recv_pool = pool;
+			
+			// Keep the count of exhaustions (see rs_get_stats)
+			pool->n_exhausted = old_pool->n_exhausted;
+			
+			// (The length is only discovered once so no pool was replaced before)
+			if (old_pool->n_free == old_pool->n_bufs)
+				rs__buf_pool_free(old_pool);
+			else
+				conn->old_recv_pool = old_pool;
+		} else {
+			failed = true;
+		}
+	}
+	
+	if (failed)
+		conn->scp_data_length = MIN(conn->scp_data_length, scp_data_length);
+	else
+		conn->scp_data_length = scp_data_length;
+}
+
+
+bool
+rs__probe_blocking(rs_conn_t *conn)
+{
+	switch (conn->probe_state) {
+		case RS__PROBE_NONE:
+			return false;
+		
+		case RS__PROBE_PENDING:
+			// Until it is dispatched, the probe is the first request in line
+			return conn->n_active > 0;
+		
+		case RS__PROBE_RESIZE:
+			break;
+	}
+	
+	// Wait until no packet is in flight or still being sent (and so no packet
+	// buffer is in use)
+	if (conn->n_active || conn->free)
+		return true;
+	unsigned int i;
+	for (i = 0; i < conn->n_outstanding; i++)
+		if (conn->outstanding[i].send_req_active)
+			return true;
+	
+	if (conn->probed_scp_data_length &&
+	    conn->probed_scp_data_length != conn->scp_data_length)
+		rs__probe_resize(conn, conn->probed_scp_data_length);
+	
+	conn->probe_state = RS__PROBE_NONE;
+	return false;
+}
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -21,9 +22,16 @@ rs__process_queued_scp_packet(rs_conn_t *conn,
                               rs__outstanding_t *os)
 {
 	os->active = true;
+	conn->n_active++;
 	os->type = RS__REQ_SCP_PACKET;
 	os->seq_num = conn->next_seq_num++;
+	os->req_id = req->id;
+	os->priority = req->priority;
+	os->dest_addr = req->dest_addr;
+	os->dest_cpu = req->dest_cpu;
 	os->n_tries = 0;
+	rs__index_insert(conn, os);
+	RS__TRACE_OS(conn, RS_TRACE_DISPATCH, os, 0);
 	
 	// Keep a pointer to the location to store the response
 	os->data.scp_packet.n_args_recv = req->data.scp_packet.n_args_recv;
@@ -54,6 +62,8 @@ rs__process_queued_scp_packet(rs_conn_t *conn,
 	// Update the length of the outstanding packet (including the two padding
 	// bytes)
 	os->packet.len = packet.len + 2;
+	os->payload.base = NULL;
+	os->payload.len = 0;
 }
 
 
@@ -63,10 +73,17 @@ rs__process_queued_rw(rs_conn_t *conn,
                       rs__outstanding_t *os)
 {
 	os->active = true;
+	conn->n_active++;
 	os->type = req->type;
 	os->seq_num = conn->next_seq_num++;
 	os->data.rw.id = req->data.rw.id;
+	os->req_id = req->id;
+	os->priority = req->priority;
+	os->dest_addr = req->dest_addr;
+	os->dest_cpu = req->dest_cpu;
 	os->n_tries = 0;
+	rs__index_insert(conn, os);
+	RS__TRACE_OS(conn, RS_TRACE_DISPATCH, os, 0);
 	
 	// Slice off a chunk of the data as large as will fit in a packet
 	uint32_t address = req->data.rw.address;
@@ -90,84 +107,241 @@ rs__process_queued_rw(rs_conn_t *conn,
 	uv_buf_t packet;
 	packet.base = os->packet.base + 2;
 	
-	// Pack the packet ready for transmission
-	if (os->type == RS__REQ_READ) {
-		uv_buf_t empty;
-		empty.base = NULL;
-		empty.len = 0;
-		rs__pack_scp_packet(&packet,
-		                    conn->scp_data_length,
-		                    req->dest_addr,
-		                    req->dest_cpu,
-		                    RS__SCP_CMD_READ,
-		                    os->seq_num,
-		                    3,
-		                    address,
-		                    os->data.rw.data.len,
-		                    req_type,
-		                    empty);
-	} else {
-		rs__pack_scp_packet(&packet,
-		                    conn->scp_data_length,
-		                    req->dest_addr,
-		                    req->dest_cpu,
-		                    RS__SCP_CMD_WRITE,
-		                    os->seq_num,
-		                    3,
-		                    address,
-		                    os->data.rw.data.len,
-		                    req_type,
-		                    os->data.rw.data);
-	}
+	// Pack the packet header ready for transmission from the request's
+	// template, filling in just the fields which differ between packets.
+	// Neither reads nor writes include data in the packet buffer: reads have no
+	// payload while the payload of a write is transmitted directly from the
+	// user's buffer.
+	rs__pack_scp_packet_template(&packet,
+	                             req->data.rw.header,
+	                             os->seq_num,
+	                             address,
+	                             os->data.rw.data.len,
+	                             req_type);
 	
 	// Update the length of the outstanding packet (including the two padding
 	// bytes)
 	os->packet.len = packet.len + 2;
+	if (os->type == RS__REQ_WRITE) {
+		os->payload = os->data.rw.data;
+	} else {
+		os->payload.base = NULL;
+		os->payload.len = 0;
+	}
 	
 	// The last packet has been sent if the remaining data is empty
 	return req->data.rw.data.len <= 0;
 }
 
 
+void
+rs__push_free_slot(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	os->next_free = conn->free_slots;
+	conn->free_slots = os;
+}
+
+
+int
+rs__init_request_queues(rs_conn_t *conn)
+{
+	int i;
+	for (i = 0; i < RS_N_PRIORITIES; i++) {
+		conn->request_queue[i] = rs__q_init(sizeof(rs__req_t),
+		                                    conn->max_queue_length);
+		conn->active_reqs[i] = malloc(conn->n_interleaved * sizeof(rs__req_t));
+		conn->n_active_reqs[i] = 0;
+		conn->active_next[i] = 0;
+		if (!conn->request_queue[i] || !conn->active_reqs[i]) {
+			if (conn->request_queue[i])
+				rs__q_free(conn->request_queue[i]);
+			free(conn->active_reqs[i]);
+			while (--i >= 0) {
+				rs__q_free(conn->request_queue[i]);
+				free(conn->active_reqs[i]);
+			}
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+
+void
+rs__free_request_queues(rs_conn_t *conn)
+{
+	int i;
+	for (i = 0; i < RS_N_PRIORITIES; i++) {
+		rs__q_free(conn->request_queue[i]);
+		free(conn->active_reqs[i]);
+	}
+}
+
+
+size_t
+rs__request_queue_length(rs_conn_t *conn)
+{
+	size_t length = 0;
+	int i;
+	for (i = 0; i < RS_N_PRIORITIES; i++)
+		length += conn->request_queue[i]->length + conn->n_active_reqs[i];
+	return length;
+}
+
+
+rs__req_t *
+rs__enqueue(rs_conn_t *conn, rs_priority_t priority)
+{
+	if ((int)priority < 0 || (int)priority >= RS_N_PRIORITIES)
+		return NULL;
+	
+	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue[priority]);
+	if (!req) {
+		if (rs__q_full(conn->request_queue[priority]))
+			conn->queue_was_full[priority] = true;
+		return NULL;
+	}
+	
+	req->id = conn->next_req_id++;
+	req->priority = priority;
+	
+	return req;
+}
+
+
+int
+rs__enqueue_error(rs_conn_t *conn, rs_priority_t priority)
+{
+	if ((int)priority < 0 || (int)priority >= RS_N_PRIORITIES)
+		return -1;
+	
+	return rs__q_full(conn->request_queue[priority]) ? RS_EFULL : -1;
+}
+
+
+void
+rs__enqueued(rs_conn_t *conn, rs__req_t *req)
+{
+	RS__STATS_QUEUED(conn);
+	RS__TRACE(conn, RS_TRACE_ENQUEUE, req->id, -1, -1, 0);
+	rs__process_request_queue(conn);
+}
+
+
+/**
+ * Find the request which should be dispatched next: one of the highest
+ * priority with requests which may be dispatched, so long as those requests
+ * may use another slot. Normal priority requests may not use the slots
+ * reserved for higher priorities.
+ *
+ * @returns the request or NULL if nothing may be dispatched.
+ */
+static rs__req_t *
+rs__next_dispatch(rs_conn_t *conn)
+{
+	int i;
+	for (i = RS_N_PRIORITIES - 1; i >= 0; i--) {
+		if (!rs__pending_requests(conn, i))
+			continue;
+		
+		unsigned int limit = conn->window;
+		if (i == RS_PRIORITY_NORMAL && conn->n_reserved)
+			limit = (limit > conn->n_reserved) ? limit - conn->n_reserved : 1;
+		if (conn->n_active >= limit)
+			return NULL;
+		
+		// If all of this priority's requests are for destinations with too many
+		// packets in flight, lower priority requests may proceed.
+		rs__req_t *req = rs__next_request(conn, i);
+		if (req)
+			return req;
+	}
+	
+	return NULL;
+}
+
+
+/**
+ * Release the memory held by empty request queues and call the drain callback
+ * for any queue which was full and has since drained to the low-water mark.
+ */
+static void
+rs__process_drained_queues(rs_conn_t *conn)
+{
+	if (conn->free)
+		return;
+	
+	int i;
+	for (i = RS_N_PRIORITIES - 1; i >= 0; i--) {
+		rs__q_t *queue = conn->request_queue[i];
+		rs__q_trim(queue);
+		
+		if (conn->queue_was_full[i] && queue->length <= conn->queue_low_water) {
+			conn->queue_was_full[i] = false;
+			if (conn->drain_cb)
+				conn->drain_cb(conn, i, conn->drain_cb_data);
+		}
+	}
+}
+
+
 void
 rs__process_request_queue(rs_conn_t *conn)
 {
+	// When batching, the packets transmitted are collected up and sent together
+	// at the end of the outermost call.
+	bool flush = conn->batch && !conn->batching;
+	if (flush)
+		conn->batching = true;
+	
+	// Requests held back by fences may now be ready to go
 	int i;
+	for (i = RS_N_PRIORITIES - 1; i >= 0; i--)
+		rs__process_fences(conn, i);
 	
 	// Process as many packets as possible before running out
 	while (1) {
-		// Find a free outstanding slot
-		rs__outstanding_t *os = NULL;
-		for (i = 0; i < conn->n_outstanding; i++) {
-			if (!conn->outstanding[i].active &&
-			    !conn->outstanding[i].send_req_active) {
-				os = &(conn->outstanding[i]);
-				break;
-			}
-		}
+		// Nothing but the probe may be sent while the SCP data length is being
+		// discovered (see rs__probe.c)
+		if (rs__probe_blocking(conn))
+			break;
 		
-		// Find a request to send
-		rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue);
+		// Stop if there is no available slot or request (or the window is full)
+		if (!conn->free_slots || conn->n_active >= conn->window)
+			break;
+		rs__req_t *req = rs__next_dispatch(conn);
+		if (!req)
+			break;
 		
-		// Stop if there is no available slot or request
-		if (!os || !req)
-			return;
+		// Take a free outstanding slot
+		rs__outstanding_t *os = conn->free_slots;
+		conn->free_slots = os->next_free;
 		
 		// Place the request int the outstanding slot
 		switch (req->type) {
 			case RS__REQ_SCP_PACKET:
 				rs__process_queued_scp_packet(conn, req, os);
-				rs__q_remove(conn->request_queue);
+				rs__remove_active(conn, req);
 				break;
 				
 			case RS__REQ_READ:
 			case RS__REQ_WRITE:
 				if (rs__process_queued_rw(conn, req, os))
-					rs__q_remove(conn->request_queue);
+					rs__remove_active(conn, req);
+				break;
+			
+			case RS__REQ_FENCE:
+				// Never admitted for dispatch
 				break;
 		}
 		
 		// Transmit the packet
 		rs__attempt_transmission(conn, os);
 	}
+	
+	if (flush)
+		rs__flush_batch(conn);
+	
+	rs__process_drained_queues(conn);
 }
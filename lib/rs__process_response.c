@@ -36,12 +36,20 @@ rs__process_response_scp_packet(rs_conn_t *conn, rs__outstanding_t *os,
 	                      &arg1, &arg2, &arg3,
 	                      &data);
 	
+	// Busy return codes indicate congestion, anything else shows the SCP packet
+	// got through
+	if (rs__window_busy_rc(cmd_rc))
+		rs__window_decrease(conn, os);
+	else
+		rs__window_increase(conn, os);
+	
 	// Copy the data into the user supplied buffer
 	size_t data_len = MIN(os->data.scp_packet.data_max_len, data.len);
 	memcpy(os->data.scp_packet.data.base, data.base, data_len);
 	os->data.scp_packet.data.len = data_len;
 	
 	// Call the user's callback
+	RS__TRACE_OS(conn, RS_TRACE_COMPLETE, os, 0);
 	os->data.scp_packet.cb(conn, false,
 	                       cmd_rc,
 	                       n_args,
@@ -51,12 +59,20 @@ rs__process_response_scp_packet(rs_conn_t *conn, rs__outstanding_t *os,
 }
 
 
+/**
+ * Should a read/write packet receiving the given response code be retried?
+ */
+static bool
+rs__retry_rc(rs_conn_t *conn, uint16_t cmd_rc)
+{
+	return cmd_rc < 256 && (conn->retry_rcs[cmd_rc / 8] & (1u << (cmd_rc % 8)));
+}
+
+
 void
 rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
                         uv_buf_t buf)
 {
-	int i;
-	
 	// Unpack the packet
 	unsigned int n_args = 0;
 	uint16_t cmd_rc;
@@ -70,9 +86,21 @@ rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
 	
 	// Check the response was OK and fail if not
 	if (cmd_rc != RS__SCP_CMD_OK) {
+		if (rs__window_busy_rc(cmd_rc))
+			rs__window_decrease(conn, os);
+		
+		// Transient errors are retried while attempts remain
+		if (rs__retry_rc(conn, cmd_rc) && os->n_tries < conn->n_tries) {
+			RS__STATS_INC(conn, n_retries_rc, 1);
+			rs__retry_later(conn, os);
+			return;
+		}
+		
+		RS__STATS_INC(conn, n_bad_rc, 1);
 		rs__cancel_outstanding(conn, os, RS_EBAD_RC, cmd_rc);
 		return;
 	}
+	rs__window_increase(conn, os);
 	
 	// If reading, copy the received data into the user supplied buffer
 	if (os->type == RS__REQ_READ) {
@@ -81,26 +109,18 @@ rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
 		os->data.rw.data.len = data_len;  // Not actually used anywhere
 	}
 	
-	// Determine if this is the last outstanding command in the request.
-	bool last_outstanding = true;
-	// Look for any *other* outstanding commands which are part of this request
-	// which are still active.
-	for (i = 0; i < conn->n_outstanding; i++) {
-		if (&(conn->outstanding[i]) != os &&
-		    conn->outstanding[i].active &&
-		    conn->outstanding[i].type == os->type &&
-		    conn->outstanding[i].data.rw.id == os->data.rw.id) {
-			last_outstanding = false;
-		}
-	}
-	// Check to see if this command relates to the command at the head of the
-	// request queue.
-	rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue);
-	if (req && req->type == os->type && req->data.rw.id == os->data.rw.id)
+	// Determine if this is the last outstanding command in the request, i.e.
+	// there are no *other* outstanding commands which are part of this request
+	// still awaiting responses.
+	bool last_outstanding = !rs__index_find_rw_sibling(conn, os);
+	// Check to see if this command relates to a request which still has packets
+	// to dispatch.
+	if (rs__active_rw(conn, os))
 		last_outstanding = false;
 	
 	// If this was the last outstanding command, call the users callback.
 	if (last_outstanding) {
+		RS__TRACE_OS(conn, RS_TRACE_COMPLETE, os, 0);
 		os->data.rw.cb(conn, false,
 		               cmd_rc,
 		               os->data.rw.orig_data,
@@ -112,9 +132,26 @@ rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
 void
 rs__process_response(rs_conn_t *conn, rs__outstanding_t *os, uv_buf_t buf)
 {
-	// Stop the timeout timer
-	if (uv_is_active((uv_handle_t *)&(os->timer_handle)))
-		uv_timer_stop(&(os->timer_handle));
+	RS__TRACE_OS(conn, RS_TRACE_RESPONSE, os, 0);
+	
+	// No further responses are awaited by this slot
+	rs__index_remove(conn, os);
+	rs__tx_remove(conn, os);
+	uint32_t tx_num = os->tx_num;
+	uint16_t seq_num = os->seq_num;
+	
+	// Stop the timeout
+	rs__timer_stop(conn, os);
+	
+	// Measure the RTT, so long as the packet was not retransmitted and thus the
+	// response is known to be to the first transmission (Karn's algorithm)
+	if (RS__MEASURE_RTT(conn) && os->n_tries == 1) {
+		uint64_t rtt = (uv_hrtime() - os->send_time) / 1000;
+		rs__rtt_sample(conn, rtt);
+#ifdef RS_STATS
+		rs__stats_rtt(conn, rtt);
+#endif
+	}
 	
 	// Deal with the packet depending on its type
 	switch (os->type) {
@@ -126,10 +163,31 @@ rs__process_response(rs_conn_t *conn, rs__outstanding_t *os, uv_buf_t buf)
 		case RS__REQ_WRITE:
 			rs__process_response_rw(conn, os, buf);
 			break;
+		
+		case RS__REQ_FENCE:
+			// Never dispatched
+			break;
 	}
 	
 	// Mark this outstanding slot as inactive again and trigger queue processing
-	// since we just freed up an outstanding slot.
-	os->active = false;
+	// since we just freed up an outstanding slot. If the response resulted in
+	// the slot being cancelled, the slot will already have been marked inactive
+	// (or will be once its pending send completes) and may even have been
+	// reused by another packet (with a new sequence number) already.
+	if (os->active && !os->cancelled && os->seq_num == seq_num) {
+		os->active = false;
+		conn->n_active--;
+		
+		// If a (re)transmission is still pending the slot will become free once it
+		// completes (see rs__udp_send_cb).
+		if (!os->send_req_active)
+			rs__push_free_slot(conn, os);
+	}
+	
+	// Packets transmitted before this one which have still not received a
+	// response may have been lost
+	if (conn->fast_retransmit)
+		rs__fast_retransmit(conn, tx_num);
+	
 	rs__process_request_queue(conn);
 }
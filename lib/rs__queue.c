@@ -1,148 +1,147 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include <rs__queue.h>
 
 /**
- * Calculate the pointer to the rs__q_entry_t in the given block at the
- * specified index.
+ * Calculate the pointer to the entry at the given position in the queue (where
+ * 0 is the head of the queue).
  *
  * @param rs__q_t *q
- * @param rs__q_block_t *blk
- * @param int entry
- * @returns rs__q_entry_t *
+ * @param size_t i
+ * @returns void *
  */
-#define BLOCK_ENTRY(q, blk, entry) \
-	((rs__q_entry_t *)((char *)((blk)->block) + ((entry) * ((q)->data_size))))
-
-/**
- * Initialise the entries of a block of queue entries as a linked list.
- * Also marks the entry as empty.
- * Doesn't initialise the last "next" pointer.
- */
-void
-rs__q_block_init(rs__q_t *q, rs__q_block_t *block) {
-	size_t i;
-	for (i = 0; i < block->size; i++) {
-		BLOCK_ENTRY(q, block, i)->empty = true;
-		
-		if (i < block->size - 1)
-			BLOCK_ENTRY(q, block, i)->next = BLOCK_ENTRY(q, block, i + 1);
-	}
-}
+#define QUEUE_ENTRY(q, i) \
+	((void *)((q)->entries + \
+	          ((((q)->head + (i)) % (q)->capacity) * (q)->data_size)))
 
 
 rs__q_t *
-rs__q_init(size_t data_size)
+rs__q_init(size_t data_size, size_t max_length)
 {
 	rs__q_t *q = malloc(sizeof(rs__q_t));
 	if (!q) return NULL;
 	
 	q->data_size = data_size;
+	q->max_length = max_length;
+	q->length = 0;
+	q->head = 0;
 	
-	// Allocate the initial block of queue entries
-	q->blocks = malloc(sizeof(rs__q_block_t));
-	if (!q->blocks) {
-		free(q);
-		return NULL;
-	}
-	q->blocks->next = NULL;
-	q->blocks->size = RS__Q_FIRST_BLOCK_SIZE;
-	q->blocks->block = calloc(RS__Q_FIRST_BLOCK_SIZE, q->data_size);
-	if (!q->blocks->block) {
-		free(q->blocks);
+	// Allocate the initial ring buffer (no larger than the queue may become)
+	q->capacity = RS__Q_FIRST_BLOCK_SIZE;
+	if (max_length && max_length < q->capacity)
+		q->capacity = max_length;
+	q->entries = malloc(q->capacity * q->data_size);
+	if (!q->entries) {
 		free(q);
 		return NULL;
 	}
 	
-	// Initialise the block as a closed loop
-	rs__q_block_init(q, q->blocks);
-	BLOCK_ENTRY(q, q->blocks, q->blocks->size - 1)->next =
-		BLOCK_ENTRY(q, q->blocks, 0);
+	return q;
+}
+
+
+/**
+ * Move the queue's entries into a new ring buffer of the given capacity (which
+ * must be at least the queue's length), starting at index 0.
+ *
+ * @returns 0 on success or -1 if allocation failed (in which case the queue is
+ *          unchanged).
+ */
+static int
+rs__q_resize(rs__q_t *q, size_t capacity)
+{
+	char *entries = malloc(capacity * q->data_size);
+	if (!entries)
+		return -1;
+	
+	// Copy the entries from the head to the end of the old buffer and then any
+	// which wrapped around to its start
+	size_t n_before_wrap = q->capacity - q->head;
+	if (n_before_wrap > q->length)
+		n_before_wrap = q->length;
+	memcpy(entries, q->entries + (q->head * q->data_size),
+	       n_before_wrap * q->data_size);
+	memcpy(entries + (n_before_wrap * q->data_size), q->entries,
+	       (q->length - n_before_wrap) * q->data_size);
 	
-	// Set the head and tail to point to the same (empty) entries
-	q->head = (rs__q_entry_t *)q->blocks->block;
-	q->tail = (rs__q_entry_t *)q->blocks->block;
+	free(q->entries);
+	q->entries = entries;
+	q->capacity = capacity;
+	q->head = 0;
 	
-	return q;
+	return 0;
 }
 
 
 void *
 rs__q_insert(rs__q_t *q)
 {
-	// Allocate more buffer space if the queue would become full upon inserting
-	// this item
-	if (!q->head->next->empty) {
-		// Allocate storage for the new block, making the new allocation twice as
-		// large as the last one.
-		rs__q_block_t *new_block = malloc(sizeof(rs__q_block_t));
-		if (!new_block) return NULL;
-		new_block->size = q->blocks->size * 2;
-		new_block->block = calloc(new_block->size, q->data_size);
-		if (!new_block->block) {
-			// Fail
-			free(new_block);
+	if (rs__q_full(q))
+		return NULL;
+	
+	// Double the size of the buffer when it is full
+	if (q->length == q->capacity) {
+		size_t capacity = q->capacity * 2;
+		if (q->max_length && capacity > q->max_length)
+			capacity = q->max_length;
+		if (rs__q_resize(q, capacity))
 			return NULL;
-		}
-		
-		// Initialise the new block and insert it into the queue's linked list
-		rs__q_block_init(q, new_block);
-		BLOCK_ENTRY(q, new_block, new_block->size - 1)->next = q->head->next;
-		q->head->next = (rs__q_entry_t *)new_block->block;
-		
-		// Insert the new block into to the linked list of blocks
-		new_block->next = q->blocks;
-		q->blocks = new_block;
 	}
 	
-	// Advance the head of the queue and return the entry which was previously at
-	// the head.
-	rs__q_entry_t *entry = q->head;
-	entry->empty = false;
-	q->head = q->head->next;
-	return (void *)entry;
+	return QUEUE_ENTRY(q, q->length++);
 }
 
 
 void *
 rs__q_remove(rs__q_t *q)
 {
-	rs__q_entry_t *entry = q->tail;
-	
-	// Advance the tail of the queue and return the entry if it is not empty.
-	if (!entry->empty) {
-		entry->empty = true;
-		q->tail = q->tail->next;
-		return (void *)entry;
-	} else {
+	if (!q->length)
 		return NULL;
-	}
+	
+	void *entry = QUEUE_ENTRY(q, 0);
+	q->head = (q->head + 1) % q->capacity;
+	q->length--;
+	return entry;
 }
 
 
 void *
 rs__q_peek(rs__q_t *q)
 {
-	if (!q->tail->empty) {
-		return (void *)q->tail;
-	} else {
-		return NULL;
-	}
+	return q->length ? QUEUE_ENTRY(q, 0) : NULL;
+}
+
+
+void *
+rs__q_peek_last(rs__q_t *q)
+{
+	return q->length ? QUEUE_ENTRY(q, q->length - 1) : NULL;
+}
+
+
+bool
+rs__q_full(rs__q_t *q)
+{
+	return q->max_length && q->length >= q->max_length;
 }
 
 
 void
-rs__q_free(rs__q_t *q)
+rs__q_trim(rs__q_t *q)
 {
-	// Free the queue blocks
-	while (q->blocks) {
-		rs__q_block_t *block = q->blocks;
-		free(block->block);
-		q->blocks = block->next;
-		free(block);
-	}
+	if (q->length || q->capacity <= RS__Q_FIRST_BLOCK_SIZE)
+		return;
 	
-	// Free the queue structure
+	// Failure to allocate the smaller buffer just leaves the larger one in place
+	rs__q_resize(q, RS__Q_FIRST_BLOCK_SIZE);
+}
+
+
+void
+rs__q_free(rs__q_t *q)
+{
+	free(q->entries);
 	free(q);
 }
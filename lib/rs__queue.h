@@ -1,92 +1,67 @@
 /**
- * An growable FIFO queue.
+ * A growable (and optionally bounded) FIFO queue.
  *
- * This queue is designed to hold an ordered queue of user-defined structs. To
- * achieve this, users must define their structs to contain an rs__q_entry_t as
- * their first element. This value will be used internally to manage the queue
- * and should not be used directly by users.
+ * This queue is designed to hold an ordered queue of user-defined structs of a
+ * fixed size. The entries are held in a single ring buffer which is doubled in
+ * size when full (up to the queue's maximum length, if any) and which may be
+ * shrunk back to its initial size again once the queue is empty (see
+ * rs__q_trim).
+ *
+ * Since the ring buffer may be reallocated, pointers to entries in the queue
+ * only remain valid until the next call to rs__q_insert or rs__q_trim.
  */
 
 #ifndef RS_QUEUE_H
 #define RS_QUEUE_H
 
+#include <stdlib.h>
 #include <stdbool.h>
 
 /**
- * The size to use for the initial allocation of queue entries.
+ * The initial capacity (in entries) of a queue's ring buffer.
  */
 #define RS__Q_FIRST_BLOCK_SIZE 8
 
 
-/**
- * An entry in a queue.
- */
-struct rs__q_entry;
-typedef struct rs__q_entry rs__q_entry_t;
-struct rs__q_entry {
-	// Is this entry empty?
-	bool empty;
-	
-	// Pointers forming a linked-list between entries in the queue.
-	rs__q_entry_t *next;
-};
-
-/**
- * A linked list of blocks of memory allocated to storing rs__q_entry_t. These
- * blocks are immediately followed by a user-defined block of data.
- */
-struct rs__q_block;
-typedef struct rs__q_block rs__q_block_t;
-struct rs__q_block {
-	// Pointer to the allocated block
-	void *block;
-	
-	// Size of the block (in entries)
-	size_t size;
-	
-	// Pointer to the next allocated block or NULL if no more blocks are
-	// allocated.
-	rs__q_block_t *next;
-};
-
 /**
  * Data type which represents the queue.
  */
 typedef struct rs__q {
-	// Size of each entry in the queue (including the size of the rs__q_entry_t).
+	// Size of each entry in the queue.
 	size_t data_size;
 	
-	// Pointers to the head and tail of the queue. Items are inserted into the
-	// head of the queue and taken from the tail. If tail points to an empty
-	// entry, the queue is empty. The head must always point to an empty entry.
-	// When an item is inserted the new head becomes head->next. If the new head
-	// is not empty, the queue must be enlarged. The tail points at the next entry
-	// to remove and when an item is removed, the new tail becomes tail->next. If
-	// the tail is empty, head == tail and the queue is empty.
-	rs__q_entry_t *head;
-	rs__q_entry_t *tail;
+	// The ring buffer of capacity entries. The entry to be removed next is at
+	// index head and the length entries which follow it (wrapping around) are
+	// the remainder of the queue.
+	char *entries;
+	size_t capacity;
+	size_t head;
+	
+	// The number of entries currently in the queue
+	size_t length;
 	
-	// A linked list of blocks of memory allocated to support the queue
-	rs__q_block_t *blocks;
+	// The maximum number of entries the queue may hold (0 for no limit)
+	size_t max_length;
 } rs__q_t;
 
 
 /**
  * Allocate a new queue in memory.
  *
- * @param data_size Size of the data blocks to be contained in the queue. Users
- *                  must include a rs__q_entry_t as the first entry in each data
- *                  block.
+ * @param data_size Size of the data blocks to be contained in the queue.
+ * @param max_length The maximum number of entries the queue may hold at once
+ *                   or 0 for no limit.
  * @returns a pointer to a newly allocated queue structure or NULL on failure.
  * This structure must be freed using rs__q_free.
  */
-rs__q_t *rs__q_init(size_t data_size);
+rs__q_t *rs__q_init(size_t data_size, size_t max_length);
 
 
 /**
  * Attempt to insert an entry into the queue.
  *
- * Returns a pointer to an entry in the queue or NULL on failure.
+ * Returns a pointer to an entry in the queue or NULL on failure (i.e. if the
+ * queue is full or memory could not be allocated).
  */
 void *rs__q_insert(rs__q_t *q);
 
@@ -95,6 +70,7 @@ void *rs__q_insert(rs__q_t *q);
  * Attempt to remove an entry into the queue.
  *
  * Returns a pointer to an entry in the queue or NULL if the queue is empty.
+ * The entry remains valid until the next insertion or trim.
  */
 void *rs__q_remove(rs__q_t *q);
 
@@ -106,6 +82,26 @@ void *rs__q_remove(rs__q_t *q);
 void *rs__q_peek(rs__q_t *q);
 
 
+/**
+ * Get a pointer to the most recently inserted entry in the queue (i.e. the last
+ * to be removed) or NULL if empty.
+ */
+void *rs__q_peek_last(rs__q_t *q);
+
+
+/**
+ * Is the queue holding its maximum number of entries?
+ */
+bool rs__q_full(rs__q_t *q);
+
+
+/**
+ * If the queue is empty, shrink its ring buffer back to its initial size,
+ * releasing the memory taken by a previous burst of entries.
+ */
+void rs__q_trim(rs__q_t *q);
+
+
 /**
  * Free all memory associated with a queue.
  */
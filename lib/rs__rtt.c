@@ -0,0 +1,62 @@
+/**
+ * Internal functions which estimate the round-trip time and derive the
+ * retransmission timeout from it.
+ *
+ * The estimator is that used by TCP (RFC 6298): the smoothed RTT and its mean
+ * deviation are exponentially weighted moving averages (with gains of 1/8 and
+ * 1/4 respectively) and the timeout is the smoothed RTT plus four deviations.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * The granularity of the timers used for retransmission (usec). The timeout is
+ * always at least this much larger than the smoothed RTT.
+ */
+#define RS__TIMER_GRANULARITY 1000
+
+
+void
+rs__rtt_sample(rs_conn_t *conn, uint64_t rtt)
+{
+	if (!conn->rtt_measured) {
+		conn->rtt_measured = true;
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = (rtt > conn->srtt) ? rtt - conn->srtt : conn->srtt - rtt;
+		conn->rttvar = conn->rttvar - (conn->rttvar / 4) + (delta / 4);
+		conn->srtt = conn->srtt - (conn->srtt / 8) + (rtt / 8);
+	}
+	
+	if (!conn->adaptive_timeout)
+		return;
+	
+	// Round up to whole milliseconds
+	uint64_t rto = conn->srtt + MAX(4 * conn->rttvar, RS__TIMER_GRANULARITY);
+	rto = (rto + 999) / 1000;
+	conn->rto = MIN(MAX(rto, conn->min_timeout), conn->timeout);
+}
+
+
+uint64_t
+rs__slot_timeout(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->adaptive_timeout)
+		return conn->timeout;
+	
+	// Back off exponentially with each retransmission
+	uint64_t timeout = conn->rto;
+	unsigned int i;
+	for (i = 1; i < os->n_tries && timeout < conn->timeout; i++)
+		timeout *= 2;
+	
+	return MIN(timeout, conn->timeout);
+}
@@ -0,0 +1,232 @@
+/**
+ * Vectored reads and writes (rs_readv and rs_writev).
+ *
+ * Each region is queued as an ordinary read or write (and so is split into
+ * packets and tracked by its own rw.id as usual) with all regions sharing a
+ * single operation record which counts the regions yet to complete. Since the
+ * regions are queued back-to-back their packets are pipelined through the
+ * window just as the packets of a single large request would be. Should the
+ * request queue be full, queuing pauses until a region completes.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+struct rs__rwv_op;
+
+/**
+ * The callback data for the read/write of a single region.
+ */
+typedef struct {
+	struct rs__rwv_op *op;
+	rs_region_t *region;
+} rs__rwv_part_t;
+
+
+/**
+ * State of a vectored read or write.
+ */
+typedef struct rs__rwv_op {
+	rs_conn_t *conn;
+	bool write;
+	
+	// The user's regions (into which the outcome of each is written)
+	unsigned int n_regions;
+	rs_region_t *regions;
+	
+	// The index of the next region to queue and the number of regions queued
+	// but not yet complete
+	unsigned int next_region;
+	unsigned int n_busy;
+	
+	// Set while rs__rwv_progress is running and set again if it is called in
+	// the meantime.
+	bool in_progress;
+	bool again;
+	
+	rs_rwv_cb cb;
+	void *cb_data;
+	
+	// Callback data for each region (n_regions entries)
+	rs__rwv_part_t parts[];
+} rs__rwv_op_t;
+
+
+static void rs__rwv_progress(rs__rwv_op_t *op);
+
+
+/**
+ * Callback for the read/write of each region.
+ */
+static void
+rs__rwv_rw_cb(rs_conn_t *conn,
+              int error,
+              uint16_t cmd_rc,
+              uv_buf_t data,
+              void *cb_data)
+{
+	rs__rwv_part_t *part = (rs__rwv_part_t *)cb_data;
+	rs__rwv_op_t *op = part->op;
+	
+	part->region->error = error;
+	part->region->cmd_rc = error ? cmd_rc : 0;
+	
+	op->n_busy--;
+	rs__rwv_progress(op);
+}
+
+
+/**
+ * Queue the read/write of the next region.
+ *
+ * @returns 0 on success or the value returned by rs_read/rs_write otherwise.
+ */
+static int
+rs__rwv_queue_next(rs__rwv_op_t *op)
+{
+	rs__rwv_part_t *part = &(op->parts[op->next_region]);
+	rs_region_t *region = &(op->regions[op->next_region]);
+	part->op = op;
+	part->region = region;
+	region->error = 0;
+	region->cmd_rc = 0;
+	
+	op->n_busy++;
+	int retval;
+	if (op->write)
+		retval = rs_write(op->conn, region->dest_addr, region->dest_cpu,
+		                  region->address, region->data,
+		                  rs__rwv_rw_cb, part);
+	else
+		retval = rs_read(op->conn, region->dest_addr, region->dest_cpu,
+		                 region->address, region->data,
+		                 rs__rwv_rw_cb, part);
+	if (retval)
+		op->n_busy--;
+	else
+		op->next_region++;
+	
+	return retval;
+}
+
+
+/**
+ * Queue as many of the remaining regions as possible and complete the
+ * operation once all are done.
+ *
+ * Should the request queue be full while regions are in progress, the
+ * remaining regions are left to be queued as those complete. Regions which
+ * can't be queued otherwise fail with RS_EFULL or UV_ENOMEM.
+ */
+static void
+rs__rwv_progress(rs__rwv_op_t *op)
+{
+	if (op->in_progress) {
+		op->again = true;
+		return;
+	}
+	op->in_progress = true;
+	
+	do {
+		op->again = false;
+		
+		while (op->next_region < op->n_regions) {
+			int retval = rs__rwv_queue_next(op);
+			if (!retval)
+				continue;
+			if (retval == RS_EFULL && op->n_busy)
+				break;
+			
+			rs_region_t *region = &(op->regions[op->next_region++]);
+			region->error = (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM;
+			region->cmd_rc = 0;
+		}
+	} while (op->again);
+	
+	if (!op->n_busy && op->next_region == op->n_regions) {
+		// Report the first region to fail (in region order)
+		int error = 0;
+		unsigned int i;
+		for (i = 0; i < op->n_regions && !error; i++)
+			error = op->regions[i].error;
+		
+		op->cb(op->conn, error, op->n_regions, op->regions, op->cb_data);
+		free(op);
+		return;
+	}
+	
+	op->in_progress = false;
+}
+
+
+/**
+ * Common implementation of rs_readv and rs_writev.
+ */
+static int
+rs__rwv(rs_conn_t *conn,
+        bool write,
+        unsigned int n_regions,
+        rs_region_t *regions,
+        rs_rwv_cb cb,
+        void *cb_data)
+{
+	rs__rwv_op_t *op = malloc(sizeof(rs__rwv_op_t) +
+	                          n_regions * sizeof(rs__rwv_part_t));
+	if (!op)
+		return -1;
+	
+	op->conn = conn;
+	op->write = write;
+	op->n_regions = n_regions;
+	op->regions = regions;
+	op->next_region = 0;
+	op->n_busy = 0;
+	op->in_progress = true;
+	op->again = false;
+	op->cb = cb;
+	op->cb_data = cb_data;
+	
+	// Should the first region fail to be queued, nothing has been started and
+	// the failure is reported immediately (without calling the callback).
+	if (n_regions) {
+		int retval = rs__rwv_queue_next(op);
+		if (retval) {
+			free(op);
+			return (retval == RS_EFULL) ? RS_EFULL : -1;
+		}
+	}
+	
+	op->in_progress = false;
+	rs__rwv_progress(op);
+	
+	return 0;
+}
+
+
+int
+rs_readv(rs_conn_t *conn,
+         unsigned int n_regions,
+         rs_region_t *regions,
+         rs_rwv_cb cb,
+         void *cb_data)
+{
+	return rs__rwv(conn, false, n_regions, regions, cb, cb_data);
+}
+
+
+int
+rs_writev(rs_conn_t *conn,
+          unsigned int n_regions,
+          rs_region_t *regions,
+          rs_rwv_cb cb,
+          void *cb_data)
+{
+	return rs__rwv(conn, true, n_regions, regions, cb, cb_data);
+}
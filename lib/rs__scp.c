@@ -13,24 +13,67 @@
 
 
 /**
- * Format of an SDP and SCP packet header.
+ * Byte offsets of the fields of an SDP and SCP packet header. All multi-byte
+ * fields are little-endian.
  */
-typedef struct {
+typedef enum {
 	// SDP headder
-	uint8_t flags;
-	uint8_t tag;
-	uint8_t dest_port_cpu;
-	uint8_t srce_port_cpu;
-	uint16_t dest_addr;
-	uint16_t srce_addr;
+	RS__SCP_OFF_FLAGS = 0,
+	RS__SCP_OFF_TAG = 1,
+	RS__SCP_OFF_DEST_PORT_CPU = 2,
+	RS__SCP_OFF_SRCE_PORT_CPU = 3,
+	RS__SCP_OFF_DEST_ADDR = 4,
+	RS__SCP_OFF_SRCE_ADDR = 6,
 	
 	// SCP headder
-	uint16_t cmd_rc;
-	uint16_t seq_num;
-	uint32_t arg1;
-	uint32_t arg2;
-	uint32_t arg3;
-} sdp_scp_header_t;
+	RS__SCP_OFF_CMD_RC = 8,
+	RS__SCP_OFF_SEQ_NUM = 10,
+	RS__SCP_OFF_ARG1 = 12,
+	RS__SCP_OFF_ARG2 = 16,
+	RS__SCP_OFF_ARG3 = 20,
+} rs__scp_offset_t;
+
+
+/**
+ * Little-endian loads and stores. Working a byte at a time is independent of
+ * the host's byte order and alignment requirements (packets start two bytes
+ * into their buffers) while compilers reduce these to single (unaligned)
+ * loads and stores on little-endian hosts.
+ */
+static void
+rs__put_u16(char *p, uint16_t v)
+{
+	uint8_t *b = (uint8_t *)p;
+	b[0] = v;
+	b[1] = v >> 8;
+}
+
+static void
+rs__put_u32(char *p, uint32_t v)
+{
+	uint8_t *b = (uint8_t *)p;
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+static uint16_t
+rs__get_u16(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static uint32_t
+rs__get_u32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint32_t)b[0] |
+	       ((uint32_t)b[1] << 8) |
+	       ((uint32_t)b[2] << 16) |
+	       ((uint32_t)b[3] << 24);
+}
 
 
 rs__scp_rw_type_t
@@ -45,6 +88,45 @@ rs__scp_rw_type(uint32_t address, uint32_t length)
 }
 
 
+void
+rs__pack_scp_template(uint8_t *template,
+                      uint16_t dest_addr,
+                      uint8_t dest_cpu,
+                      uint16_t cmd_rc)
+{
+	char *t = (char *)template;
+	
+	// SDP header
+	template[RS__SCP_OFF_FLAGS] = 0x87;  // Always require a reply
+	template[RS__SCP_OFF_TAG] = 0xFF;
+	template[RS__SCP_OFF_DEST_PORT_CPU] = dest_cpu & 0x1F;  // Port zero
+	template[RS__SCP_OFF_SRCE_PORT_CPU] = 0xFF;
+	rs__put_u16(t + RS__SCP_OFF_DEST_ADDR, dest_addr);
+	rs__put_u16(t + RS__SCP_OFF_SRCE_ADDR, 0);  // (0, 0)
+	
+	// SCP command
+	rs__put_u16(t + RS__SCP_OFF_CMD_RC, cmd_rc);
+}
+
+
+void
+rs__pack_scp_packet_template(uv_buf_t *buf,
+                             const uint8_t *template,
+                             uint16_t seq_num,
+                             uint32_t arg1,
+                             uint32_t arg2,
+                             uint32_t arg3)
+{
+	memcpy(buf->base, template, RS__SCP_TEMPLATE_LENGTH);
+	rs__put_u16(buf->base + RS__SCP_OFF_SEQ_NUM, seq_num);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG1, arg1);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG2, arg2);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG3, arg3);
+	
+	buf->len = RS__SIZEOF_SCP_PACKET(3, 0);
+}
+
+
 void
 rs__pack_scp_packet(uv_buf_t *buf,
                     size_t scp_data_length,
@@ -58,26 +140,13 @@ rs__pack_scp_packet(uv_buf_t *buf,
                     uint32_t arg3,
                     uv_buf_t data)
 {
-	// Set up the header
-	sdp_scp_header_t header;
-	
-	// SDP header
-	header.flags = 0x87;  // Always require a reply
-	header.tag = 0xFF;
-	header.dest_port_cpu = dest_cpu & 0x1F;  // Port zero
-	header.srce_port_cpu = 0xFF;
-	header.dest_addr = dest_addr;
-	header.srce_addr = 0;  // (0, 0)
-	
-	// SCP header
-	header.cmd_rc = cmd_rc;
-	header.seq_num = seq_num;
-	header.arg1 = arg1;
-	header.arg2 = arg2;
-	header.arg3 = arg3;
-	
-	// Copy the header into the buffer
-	memcpy(buf->base, &header, sizeof(sdp_scp_header_t));
+	// Set up the header (the argument fields are always written but unused
+	// ones are overwritten by the payload)
+	rs__pack_scp_template((uint8_t *)buf->base, dest_addr, dest_cpu, cmd_rc);
+	rs__put_u16(buf->base + RS__SCP_OFF_SEQ_NUM, seq_num);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG1, arg1);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG2, arg2);
+	rs__put_u32(buf->base + RS__SCP_OFF_ARG3, arg3);
 	
 	// Truncate the payload
 	data.len = MIN(data.len, scp_data_length);
@@ -94,8 +163,14 @@ rs__pack_scp_packet(uv_buf_t *buf,
 uint16_t
 rs__unpack_scp_packet_seq_num(uv_buf_t buf)
 {
-	sdp_scp_header_t *header = (sdp_scp_header_t *)buf.base;
-	return header->seq_num;
+	return rs__get_u16(buf.base + RS__SCP_OFF_SEQ_NUM);
+}
+
+
+void
+rs__pack_scp_packet_seq_num(uv_buf_t buf, uint16_t seq_num)
+{
+	rs__put_u16(buf.base + RS__SCP_OFF_SEQ_NUM, seq_num);
 }
 
 
@@ -109,29 +184,21 @@ rs__unpack_scp_packet(uv_buf_t buf,
                       uint32_t *arg3,
                       uv_buf_t *data)
 {
-	sdp_scp_header_t *header = (sdp_scp_header_t *)buf.base;
-	
 	// Unpack basic SCP fields
-	*cmd_rc = header->cmd_rc;
-	*seq_num = header->seq_num;
+	*cmd_rc = rs__get_u16(buf.base + RS__SCP_OFF_CMD_RC);
+	*seq_num = rs__get_u16(buf.base + RS__SCP_OFF_SEQ_NUM);
 	
-	// Truncate n_args if the packet is too short
-	if (buf.len <= RS__SIZEOF_SCP_PACKET(0, 0))
-		*n_args = MIN(0, *n_args);
-	else if (buf.len <= RS__SIZEOF_SCP_PACKET(1, 0))
-		*n_args = MIN(1, *n_args);
-	else if (buf.len <= RS__SIZEOF_SCP_PACKET(2, 0))
-		*n_args = MIN(2, *n_args);
-	else if (buf.len <= RS__SIZEOF_SCP_PACKET(3, 0))
-		*n_args = MIN(3, *n_args);
+	// Truncate n_args to the number of (whole) arguments the packet contains
+	unsigned int n_present = (buf.len - RS__SIZEOF_SCP_PACKET(0, 0)) / 4;
+	*n_args = MIN(*n_args, MIN(n_present, 3));
 	
 	// Unpack arguments (if present)
 	if (*n_args >= 1)
-		*arg1 = header->arg1;
+		*arg1 = rs__get_u32(buf.base + RS__SCP_OFF_ARG1);
 	if (*n_args >= 2)
-		*arg2 = header->arg2;
+		*arg2 = rs__get_u32(buf.base + RS__SCP_OFF_ARG2);
 	if (*n_args >= 3)
-		*arg3 = header->arg3;
+		*arg3 = rs__get_u32(buf.base + RS__SCP_OFF_ARG3);
 	
 	// Setup the pointers to the data
 	data->base = buf.base + RS__SIZEOF_SCP_PACKET(*n_args, 0);
@@ -30,13 +30,30 @@
 	)
 
 
+/**
+ * Number of bytes at the start of an SDP and SCP packet header which are the
+ * same for every packet of a read/write: the SDP header and the cmd_rc (see
+ * rs__pack_scp_template).
+ */
+#define RS__SCP_TEMPLATE_LENGTH (RS__SDP_HEADER_LENGTH + 2)
+
+
 /**
  * SCP cmd_rc numbers.
  */
 typedef enum {
 	RS__SCP_CMD_READ = 2,
 	RS__SCP_CMD_WRITE = 3,
+	RS__SCP_CMD_FILL = 5,
 	RS__SCP_CMD_OK = 128,
+	
+	// Return codes which indicate the machine was too busy to handle a command
+	RS__SCP_RC_TIMEOUT = 134,
+	RS__SCP_RC_BUF = 138,
+	RS__SCP_RC_P2P_NOREPLY = 139,
+	RS__SCP_RC_P2P_BUSY = 141,
+	RS__SCP_RC_P2P_TIMEOUT = 142,
+	RS__SCP_RC_PKT_TX = 143,
 } rs__scp_cmd_rc_t;
 
 
@@ -89,6 +106,43 @@ void rs__pack_scp_packet(uv_buf_t *buf,
                          uv_buf_t data);
 
 
+/**
+ * Pack the fixed part of the header (see RS__SCP_TEMPLATE_LENGTH) shared by
+ * every packet of a read/write. Packets are then packed from the template
+ * using rs__pack_scp_packet_template.
+ *
+ * @param template The RS__SCP_TEMPLATE_LENGTH byte buffer to fill.
+ * @param dest_addr The chip to send the packets to (x<<8 | y).
+ * @param dest_cpu The core to send the packets to.
+ * @param cmd_rc The SCP command.
+ */
+void rs__pack_scp_template(uint8_t *template,
+                           uint16_t dest_addr,
+                           uint8_t dest_cpu,
+                           uint16_t cmd_rc);
+
+
+/**
+ * Pack the header of an SCP packet with three arguments and no payload from a
+ * template produced by rs__pack_scp_template. Equivalent to (but cheaper than)
+ * rs__pack_scp_packet with the template's fields, three arguments and an empty
+ * payload.
+ *
+ * @param buf The buffer to write the packet to. Sets the length field.
+ * @param template The template.
+ * @param seq_num The sequence number of the packet
+ * @param arg1 Argument 1
+ * @param arg2 Argument 2
+ * @param arg3 Argument 3
+ */
+void rs__pack_scp_packet_template(uv_buf_t *buf,
+                                  const uint8_t *template,
+                                  uint16_t seq_num,
+                                  uint32_t arg1,
+                                  uint32_t arg2,
+                                  uint32_t arg3);
+
+
 /**
  * Unpack the sequence number from an SCP packet in a buffer.
  *
@@ -101,6 +155,15 @@ void rs__pack_scp_packet(uv_buf_t *buf,
 uint16_t rs__unpack_scp_packet_seq_num(uv_buf_t buf);
 
 
+/**
+ * Replace the sequence number of an SCP packet already packed into a buffer.
+ *
+ * @param buf The buffer containing the packet.
+ * @param seq_num The new sequence number.
+ */
+void rs__pack_scp_packet_seq_num(uv_buf_t buf, uint16_t seq_num);
+
+
 /**
  * Unpack an SCP packet from a buffer.
  *
@@ -113,7 +176,7 @@ uint16_t rs__unpack_scp_packet_seq_num(uv_buf_t buf);
  * @param seq_num The sequence number of the packet
  * @param n_args Input: the ideal number of arguments to unpack, output: the
  *               number of arguments actually unpacked (may be less if the input
- *               packet is too short).
+ *               packet is too short to contain them all in full).
  * @param arg1 Argument 1
  * @param arg2 Argument 2
  * @param arg3 Argument 3
@@ -0,0 +1,221 @@
+/**
+ * Sharding of connections across several event loop threads.
+ *
+ * Each thread in a shard runs its own libuv event loop and owns the
+ * connections assigned to it. Connections are assigned to threads in turn as
+ * they are added. Requests are submitted to the connections using the
+ * thread-safe submission functions (e.g. rs_read_ts) and, if a callback loop
+ * was given, their callbacks are delivered through a shared callback queue (see
+ * rs__ts.c) on the thread running that loop.
+ *
+ * Each thread's loop is kept alive by a stop async handle. When the shard is
+ * freed, each thread's stop handle is signalled which frees the thread's
+ * connections and closes the handle, allowing the loop (and so the thread) to
+ * exit once the connections have finished closing.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * A thread within a shard.
+ */
+typedef struct {
+	// The thread's event loop
+	uv_loop_t loop;
+	
+	// The thread itself (valid once the shard is started)
+	uv_thread_t thread;
+	
+	// Async handle used to ask the thread to free its connections and stop
+	uv_async_t stop_handle;
+	
+	// The connections owned by this thread
+	rs_conn_t **conns;
+	unsigned int n_conns;
+} rs__shard_thread_t;
+
+
+struct rs_shard {
+	// The threads in the shard
+	rs__shard_thread_t *threads;
+	unsigned int n_threads;
+	
+	// The thread which the next connection added will be assigned to
+	unsigned int next_thread;
+	
+	// The queue through which callbacks are delivered or NULL if callbacks are
+	// to be made on the connections' own threads.
+	rs__cb_queue_t *cb_queue;
+	
+	// Have the threads been started?
+	bool started;
+};
+
+
+static void
+rs__shard_stop_cb(uv_async_t *handle)
+{
+	rs__shard_thread_t *thread = (rs__shard_thread_t *)handle->data;
+	
+	unsigned int i;
+	for (i = 0; i < thread->n_conns; i++)
+		rs_free(thread->conns[i], NULL, NULL);
+	
+	uv_close((uv_handle_t *)handle, NULL);
+}
+
+
+static void
+rs__shard_thread_main(void *arg)
+{
+	rs__shard_thread_t *thread = (rs__shard_thread_t *)arg;
+	uv_run(&(thread->loop), UV_RUN_DEFAULT);
+}
+
+
+rs_shard_t *
+rs_shard_init(unsigned int n_threads, uv_loop_t *cb_loop)
+{
+	if (!n_threads)
+		return NULL;
+	
+	rs_shard_t *shard = malloc(sizeof(rs_shard_t));
+	if (!shard)
+		return NULL;
+	
+	shard->threads = calloc(n_threads, sizeof(rs__shard_thread_t));
+	if (!shard->threads) {
+		free(shard);
+		return NULL;
+	}
+	shard->n_threads = 0;
+	shard->next_thread = 0;
+	shard->started = false;
+	
+	if (cb_loop) {
+		shard->cb_queue = rs__cb_queue_init(cb_loop);
+		if (!shard->cb_queue) {
+			free(shard->threads);
+			free(shard);
+			return NULL;
+		}
+	} else {
+		shard->cb_queue = NULL;
+	}
+	
+	// Initialise each thread's loop
+	for (; shard->n_threads < n_threads; shard->n_threads++) {
+		rs__shard_thread_t *thread = &(shard->threads[shard->n_threads]);
+		if (uv_loop_init(&(thread->loop)))
+			goto fail;
+		if (uv_async_init(&(thread->loop), &(thread->stop_handle),
+		                  rs__shard_stop_cb)) {
+			uv_loop_close(&(thread->loop));
+			goto fail;
+		}
+		thread->stop_handle.data = (void *)thread;
+		thread->conns = NULL;
+		thread->n_conns = 0;
+	}
+	
+	return shard;
+
+fail:
+	// Tear down the loops initialised so far (a shard which was never started
+	// is freed on the calling thread).
+	rs_shard_free(shard);
+	return NULL;
+}
+
+
+rs_conn_t *
+rs_shard_add_conn(rs_shard_t *shard,
+                  const struct sockaddr *addr,
+                  const rs_conn_opts_t *opts)
+{
+	if (shard->started)
+		return NULL;
+	
+	rs__shard_thread_t *thread = &(shard->threads[shard->next_thread]);
+	
+	rs_conn_t **conns = realloc(thread->conns,
+	                            (thread->n_conns + 1) * sizeof(rs_conn_t *));
+	if (!conns)
+		return NULL;
+	thread->conns = conns;
+	
+	rs_conn_t *conn = rs_init_ex(&(thread->loop), addr, opts);
+	if (!conn)
+		return NULL;
+	conn->ts_cb_queue = shard->cb_queue;
+	
+	thread->conns[thread->n_conns++] = conn;
+	shard->next_thread = (shard->next_thread + 1) % shard->n_threads;
+	
+	return conn;
+}
+
+
+int
+rs_shard_start(rs_shard_t *shard)
+{
+	if (shard->started)
+		return -1;
+	
+	unsigned int i;
+	for (i = 0; i < shard->n_threads; i++) {
+		rs__shard_thread_t *thread = &(shard->threads[i]);
+		if (uv_thread_create(&(thread->thread), rs__shard_thread_main,
+		                     (void *)thread)) {
+			// Stop the threads already started, the remainder will be stopped on
+			// this thread when the shard is freed.
+			unsigned int j;
+			for (j = 0; j < i; j++) {
+				uv_async_send(&(shard->threads[j].stop_handle));
+				uv_thread_join(&(shard->threads[j].thread));
+			}
+			return -1;
+		}
+	}
+	
+	shard->started = true;
+	return 0;
+}
+
+
+void
+rs_shard_free(rs_shard_t *shard)
+{
+	unsigned int i;
+	for (i = 0; i < shard->n_threads; i++) {
+		rs__shard_thread_t *thread = &(shard->threads[i]);
+		
+		if (shard->started) {
+			uv_async_send(&(thread->stop_handle));
+			uv_thread_join(&(thread->thread));
+		} else if (!uv_is_closing((uv_handle_t *)&(thread->stop_handle))) {
+			// Never started (or stopped by a failed start): run the loop here
+			// until everything has closed.
+			rs__shard_stop_cb(&(thread->stop_handle));
+			uv_run(&(thread->loop), UV_RUN_DEFAULT);
+		}
+		
+		uv_loop_close(&(thread->loop));
+		free(thread->conns);
+	}
+	
+	// All connections are now closed and so no more callbacks will be queued,
+	// deliver those which remain.
+	if (shard->cb_queue)
+		rs__cb_queue_free(shard->cb_queue);
+	
+	free(shard->threads);
+	free(shard);
+}
@@ -0,0 +1,25 @@
+/**
+ * Internal functions which gather connection statistics.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+#ifdef RS_STATS
+void
+rs__stats_rtt(rs_conn_t *conn, uint64_t rtt)
+{
+	// Bucket by the position of the most significant bit
+	unsigned int bucket = 0;
+	while ((rtt >>= 1) && bucket < RS_STATS_RTT_BUCKETS - 1)
+		bucket++;
+	
+	conn->stats.rtt_histogram[bucket]++;
+}
+#endif
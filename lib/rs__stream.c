@@ -0,0 +1,300 @@
+/**
+ * Streaming reads (rs_read_stream).
+ *
+ * The region is read in chunks, one per buffer in a caller-supplied ring of
+ * buffers, with each chunk being an ordinary read request. Chunks may complete
+ * in any order but are passed to the user's callback strictly in order once
+ * every chunk before them has been. Once the callback for a chunk returns its
+ * buffer is reused for the next chunk yet to be read, so at most one chunk per
+ * buffer is ever in flight and memory use is independent of the region's
+ * length.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+struct rs__stream;
+
+/**
+ * The state of each buffer in the ring.
+ */
+typedef enum {
+	// Not in use, may be used to read the next chunk
+	RS__STREAM_FREE,
+	
+	// A read of a chunk into the buffer is in progress
+	RS__STREAM_READING,
+	
+	// The chunk has been read and awaits its turn to be passed to the user
+	RS__STREAM_READY,
+} rs__stream_buf_state_t;
+
+
+/**
+ * A buffer in the ring.
+ */
+typedef struct {
+	struct rs__stream *stream;
+	
+	// The user-supplied buffer
+	uv_buf_t buf;
+	
+	rs__stream_buf_state_t state;
+	
+	// The offset and length of the chunk read into this buffer
+	uint32_t offset;
+	size_t len;
+} rs__stream_buf_t;
+
+
+/**
+ * State of a streaming read.
+ */
+typedef struct rs__stream {
+	rs_conn_t *conn;
+	
+	// The region being read
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint32_t address;
+	size_t length;
+	
+	// The offset of the next chunk to read and the buffer to read it into
+	size_t next_offset;
+	unsigned int next_read;
+	
+	// The buffer holding the next chunk to pass to the user
+	unsigned int next_deliver;
+	
+	// The number of reads in progress
+	unsigned int n_reading;
+	
+	// The first error to occur (chunks are no longer delivered once set)
+	int error;
+	uint16_t cmd_rc;
+	
+	// Set while rs__stream_progress is running and, if it is called again in
+	// the meantime (e.g. when a read fails immediately), also set again to
+	// make it go around again.
+	bool in_progress;
+	bool again;
+	
+	rs_read_stream_cb cb;
+	void *cb_data;
+	
+	// The ring of buffers
+	unsigned int n_bufs;
+	rs__stream_buf_t bufs[];
+} rs__stream_t;
+
+
+static void rs__stream_progress(rs__stream_t *stream);
+
+
+/**
+ * Callback for the read of each chunk.
+ */
+static void
+rs__stream_read_cb(rs_conn_t *conn,
+                   int error,
+                   uint16_t cmd_rc,
+                   uv_buf_t data,
+                   void *cb_data)
+{
+	rs__stream_buf_t *buf = (rs__stream_buf_t *)cb_data;
+	rs__stream_t *stream = buf->stream;
+	
+	stream->n_reading--;
+	if (error) {
+		buf->state = RS__STREAM_FREE;
+		if (!stream->error) {
+			stream->error = error;
+			stream->cmd_rc = cmd_rc;
+		}
+	} else {
+		buf->state = RS__STREAM_READY;
+	}
+	
+	rs__stream_progress(stream);
+}
+
+
+/**
+ * Start reading chunks into as many free buffers as possible.
+ *
+ * Should the request queue be full while other chunks are being read, the
+ * remaining chunks are left to be started once one of those completes.
+ */
+static void
+rs__stream_read_chunks(rs__stream_t *stream)
+{
+	while (!stream->error &&
+	       stream->next_offset < stream->length &&
+	       stream->bufs[stream->next_read].state == RS__STREAM_FREE) {
+		rs__stream_buf_t *buf = &(stream->bufs[stream->next_read]);
+		
+		buf->offset = stream->next_offset;
+		buf->len = MIN(buf->buf.len, stream->length - stream->next_offset);
+		buf->state = RS__STREAM_READING;
+		
+		stream->next_offset += buf->len;
+		stream->next_read = (stream->next_read + 1) % stream->n_bufs;
+		stream->n_reading++;
+		
+		uv_buf_t data;
+		data.base = buf->buf.base;
+		data.len = buf->len;
+		int retval = rs_read(stream->conn, stream->dest_addr, stream->dest_cpu,
+		                     stream->address + buf->offset, data,
+		                     rs__stream_read_cb, buf);
+		if (retval) {
+			// The chunk was never started
+			buf->state = RS__STREAM_FREE;
+			stream->next_offset -= buf->len;
+			stream->next_read = (stream->next_read + stream->n_bufs - 1) %
+			                    stream->n_bufs;
+			stream->n_reading--;
+			if (retval == RS_EFULL && stream->n_reading)
+				break;
+			stream->error = (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM;
+			stream->cmd_rc = 0;
+		}
+	}
+}
+
+
+/**
+ * Pass on any chunks which are next in line, read further chunks into the
+ * freed buffers and report the end of the stream once reached.
+ */
+static void
+rs__stream_progress(rs__stream_t *stream)
+{
+	if (stream->in_progress) {
+		stream->again = true;
+		return;
+	}
+	stream->in_progress = true;
+	
+	do {
+		stream->again = false;
+		
+		// After an error, wait for the reads in progress to finish (since they
+		// use the user's buffers) before reporting it.
+		if (stream->error) {
+			if (!stream->n_reading) {
+				uv_buf_t data;
+				data.base = NULL;
+				data.len = 0;
+				stream->cb(stream->conn, stream->error, stream->cmd_rc,
+				           0, data, true, stream->cb_data);
+				free(stream);
+				return;
+			}
+			break;
+		}
+		
+		// Pass on chunks in order
+		rs__stream_buf_t *buf;
+		while ((buf = &(stream->bufs[stream->next_deliver]))->state ==
+		       RS__STREAM_READY) {
+			bool last = buf->offset + buf->len == stream->length;
+			
+			uv_buf_t data;
+			data.base = buf->buf.base;
+			data.len = buf->len;
+			stream->cb(stream->conn, 0, 0, buf->offset, data, last,
+			           stream->cb_data);
+			if (last) {
+				free(stream);
+				return;
+			}
+			
+			buf->state = RS__STREAM_FREE;
+			stream->next_deliver = (stream->next_deliver + 1) % stream->n_bufs;
+		}
+		
+		rs__stream_read_chunks(stream);
+	} while (stream->again || stream->error);
+	
+	stream->in_progress = false;
+}
+
+
+int
+rs_read_stream(rs_conn_t *conn,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint32_t address,
+               size_t length,
+               unsigned int n_bufs,
+               const uv_buf_t *bufs,
+               rs_read_stream_cb cb,
+               void *cb_data)
+{
+	unsigned int i;
+	
+	if (!n_bufs)
+		return -1;
+	for (i = 0; i < n_bufs; i++)
+		if (!bufs[i].len)
+			return -1;
+	
+	rs__stream_t *stream = malloc(sizeof(rs__stream_t) +
+	                              n_bufs * sizeof(rs__stream_buf_t));
+	if (!stream)
+		return -1;
+	
+	stream->conn = conn;
+	stream->dest_addr = dest_addr;
+	stream->dest_cpu = dest_cpu;
+	stream->address = address;
+	stream->length = length;
+	stream->next_offset = 0;
+	stream->next_read = 0;
+	stream->next_deliver = 0;
+	stream->n_reading = 0;
+	stream->error = 0;
+	stream->cmd_rc = 0;
+	stream->in_progress = false;
+	stream->again = false;
+	stream->cb = cb;
+	stream->cb_data = cb_data;
+	stream->n_bufs = n_bufs;
+	for (i = 0; i < n_bufs; i++) {
+		stream->bufs[i].stream = stream;
+		stream->bufs[i].buf = bufs[i];
+		stream->bufs[i].state = RS__STREAM_FREE;
+	}
+	
+	// An empty region is complete immediately
+	if (!length) {
+		uv_buf_t data;
+		data.base = bufs[0].base;
+		data.len = 0;
+		free(stream);
+		cb(conn, 0, 0, 0, data, true, cb_data);
+		return 0;
+	}
+	
+	// Fail immediately if not even the first chunk can be queued
+	stream->in_progress = true;
+	rs__stream_read_chunks(stream);
+	stream->in_progress = false;
+	if (stream->next_offset == 0) {
+		free(stream);
+		return -1;
+	}
+	
+	// Deal with anything which happened in the meantime
+	if (stream->again || stream->error)
+		rs__stream_progress(stream);
+	return 0;
+}
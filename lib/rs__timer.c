@@ -0,0 +1,125 @@
+/**
+ * Internal functions which manage packet timeouts.
+ *
+ * Rather than giving every outstanding slot its own libuv timer, each
+ * connection has a single timer and a list of the slots' deadlines, ordered
+ * earliest first. The timer is armed for the earliest deadline and is not
+ * disturbed when slots stop their timeouts (as happens for nearly every
+ * response), instead re-arming itself for the next deadline when it fires.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+void
+rs__timer_start(rs_conn_t *conn, rs__outstanding_t *os, uint64_t timeout)
+{
+	rs__timer_stop(conn, os);
+	
+	uint64_t now = uv_now(conn->loop);
+	os->deadline = now + timeout;
+	
+	// Find the slot which should precede this one (searching from the end since
+	// the new deadline is most likely the latest)
+	rs__outstanding_t *prev = conn->timer_tail;
+	while (prev && prev->deadline > os->deadline)
+		prev = prev->timer_prev;
+	
+	os->timer_prev = prev;
+	os->timer_next = prev ? prev->timer_next : conn->timer_head;
+	if (os->timer_next)
+		os->timer_next->timer_prev = os;
+	else
+		conn->timer_tail = os;
+	if (prev)
+		prev->timer_next = os;
+	else
+		conn->timer_head = os;
+	os->timer_active = true;
+	
+	rs__timer_arm(conn);
+}
+
+
+void
+rs__timer_stop(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!os->timer_active)
+		return;
+	
+	if (os->timer_prev)
+		os->timer_prev->timer_next = os->timer_next;
+	else
+		conn->timer_head = os->timer_next;
+	
+	if (os->timer_next)
+		os->timer_next->timer_prev = os->timer_prev;
+	else
+		conn->timer_tail = os->timer_prev;
+	
+	os->timer_active = false;
+	os->retry_pending = false;
+	
+	// Don't keep the timer (and thus the event loop) running without reason
+	if (!conn->timer_head && uv_is_active((uv_handle_t *)&(conn->timer_handle)))
+		uv_timer_stop(&(conn->timer_handle));
+}
+
+
+void
+rs__timer_cb(uv_timer_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	uint64_t now = uv_now(conn->loop);
+	
+	// Deal with every packet which has timed out. Note that retransmission may
+	// result in other slots' timeouts being stopped (e.g. if a read is
+	// cancelled) so the head of the list is re-read after each.
+	rs__outstanding_t *os;
+	while ((os = conn->timer_head) && os->deadline <= now) {
+		bool retry = os->retry_pending;
+		rs__timer_stop(conn, os);
+		
+		// The backoff before retrying after an error response has elapsed
+		if (retry) {
+			rs__attempt_transmission(conn, os);
+			continue;
+		}
+		
+		RS__TRACE_OS(conn, RS_TRACE_TIMEOUT, os, 0);
+		
+		// The packet didn't arrive, shrink the window and attempt retransmission
+		// (which will fail if done too many times)
+		rs__window_decrease(conn, os);
+		if (os->n_tries < conn->n_tries)
+			RS__STATS_INC(conn, n_retransmits_timeout, 1);
+		rs__attempt_transmission(conn, os);
+	}
+	
+	// Wait for the next deadline
+	rs__timer_arm(conn);
+}
+
+
+void
+rs__timer_arm(rs_conn_t *conn)
+{
+	if (!conn->timer_head || conn->free)
+		return;
+	
+	uint64_t deadline = conn->timer_head->deadline;
+	if (uv_is_active((uv_handle_t *)&(conn->timer_handle)) &&
+	    conn->timer_due <= deadline)
+		return;
+	
+	uint64_t now = uv_now(conn->loop);
+	conn->timer_due = deadline;
+	uv_timer_start(&(conn->timer_handle), rs__timer_cb,
+	               (deadline > now) ? deadline - now : 0, 0);
+}
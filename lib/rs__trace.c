@@ -0,0 +1,29 @@
+/**
+ * Internal functions which generate trace events.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+#ifdef RS_TRACE
+void
+rs__trace(rs_conn_t *conn, rs_trace_event_t event,
+          unsigned int request_id, int seq_num, int slot, int error)
+{
+	rs_trace_t trace;
+	trace.event = event;
+	trace.time = uv_hrtime();
+	trace.request_id = request_id;
+	trace.seq_num = seq_num;
+	trace.slot = slot;
+	trace.error = error;
+	
+	conn->trace_cb(conn, &trace, conn->trace_cb_data);
+}
+#endif
@@ -3,8 +3,10 @@
  */
 
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -26,34 +28,176 @@ rs__attempt_transmission(rs_conn_t *conn, rs__outstanding_t *os)
 		return;
 	
 	if (++os->n_tries <= conn->n_tries) {
-		// Attempt to transmit
-		os->send_req_active = true;
-		int err = uv_udp_send(&(os->send_req),
-		                      &(conn->udp_handle),
-		                      &(os->packet), 1,
-		                      conn->addr,
-		                      rs__udp_send_cb);
-		if (err) {
-			// Transmission failiure: clean up
-			os->send_req_active = false;
-			rs__cancel_outstanding(conn, os, err, -1);
-			return;
+		// Record when the packet was first sent to allow its RTT to be measured
+		if (RS__MEASURE_RTT(conn) && os->n_tries == 1)
+			os->send_time = uv_hrtime();
+		
+		rs__tx_record(conn, os);
+		
+		if (!conn->batching) {
+			rs__send_packet(conn, os);
+		} else if (!os->batched) {
+			// Defer transmission until the batch is flushed
+			os->batched = true;
+			conn->batch_slots[conn->n_batched++] = os;
 		}
 	} else {
 		// Maximum number of attempts made, fail and clean up.
+		RS__STATS_INC(conn, n_timeouts, 1);
 		rs__cancel_outstanding(conn, os, RS_ETIMEOUT, -1);
 	}
 }
 
 
 void
-rs__timer_cb(uv_timer_t *handle)
+rs__retry_later(rs_conn_t *conn, rs__outstanding_t *os)
 {
-	rs__outstanding_t *os = (rs__outstanding_t *)handle->data;
+	// The retry is sent with a new sequence number so that it is not mistaken
+	// for a duplicate of the packet which was rejected (and so that any late
+	// duplicate of the rejection is ignored).
+	os->seq_num = conn->next_seq_num++;
+	uv_buf_t packet;
+	packet.base = os->packet.base + 2;
+	packet.len = os->packet.len - 2;
+	rs__pack_scp_packet_seq_num(packet, os->seq_num);
+	rs__index_insert(conn, os);
 	
-	// The packet didn't arrive, attempt retransmission (which will fail if done
-	// too many times)
-	rs__attempt_transmission(os->conn, os);
+	// Back off exponentially (up to the timeout) with each attempt
+	uint64_t backoff = conn->retry_backoff << MIN(os->n_tries - 1, 16);
+	rs__timer_start(conn, os, MIN(backoff, conn->timeout));
+	os->retry_pending = true;
+}
+
+
+void
+rs__send_packet(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// Attempt to transmit the packet followed by its payload (if it has one
+	// which is not included in the packet buffer)
+	uv_buf_t bufs[2];
+	bufs[0] = os->packet;
+	bufs[1] = os->payload;
+	
+	os->send_req_active = true;
+	int err = uv_udp_send(&(os->send_req),
+	                      &(conn->udp_handle),
+	                      bufs, os->payload.len ? 2 : 1,
+	                      conn->addr,
+	                      rs__udp_send_cb);
+	if (err) {
+		// Transmission failiure: clean up
+		os->send_req_active = false;
+		rs__cancel_outstanding(conn, os, err, -1);
+		return;
+	}
+	
+	RS__STATS_SENT(conn, os);
+}
+
+
+void
+rs__flush_batch(rs_conn_t *conn)
+{
+	unsigned int i;
+	
+	// Note: transmission failures may result in user callbacks which add further
+	// packets to the batch (since the batching flag remains set) hence the loop.
+	while (conn->n_batched) {
+		// Drop any packets whose slots have been cancelled since being batched
+		unsigned int n = 0;
+		for (i = 0; i < conn->n_batched; i++) {
+			rs__outstanding_t *os = conn->batch_slots[i];
+			if (os->active && !os->cancelled)
+				conn->batch_slots[n++] = os;
+			else
+				os->batched = false;
+		}
+		conn->n_batched = n;
+		
+		unsigned int n_sent = 0;
+#ifdef RS__HAVE_SENDMMSG
+		if (conn->n_batched)
+			n_sent = rs__sendmmsg(conn);
+#endif
+		
+		// The packets sent are now awaiting responses
+		for (i = 0; i < n_sent; i++) {
+			rs__outstanding_t *os = conn->batch_slots[i];
+			os->batched = false;
+			RS__STATS_SENT(conn, os);
+			RS__TRACE_OS(conn, RS_TRACE_SENT, os, 0);
+			rs__timer_start(conn, os, rs__slot_timeout(conn, os));
+		}
+		conn->n_batched -= n_sent;
+		memmove(conn->batch_slots, conn->batch_slots + n_sent,
+		        conn->n_batched * sizeof(rs__outstanding_t *));
+		
+		// If batched transmission isn't working, send the remaining packets
+		// individually
+		if (!n_sent) {
+			while (conn->n_batched) {
+				rs__outstanding_t *os = conn->batch_slots[--conn->n_batched];
+				os->batched = false;
+				if (os->active && !os->cancelled)
+					rs__send_packet(conn, os);
+			}
+		}
+	}
+	
+	conn->batching = false;
+}
+
+
+#ifdef RS__HAVE_SENDMMSG
+unsigned int
+rs__sendmmsg(rs_conn_t *conn)
+{
+	uv_os_fd_t fd;
+	if (uv_fileno((uv_handle_t *)&(conn->udp_handle), &fd))
+		return 0;
+	
+	socklen_t addr_len = (conn->addr->sa_family == AF_INET6)
+	                     ? sizeof(struct sockaddr_in6)
+	                     : sizeof(struct sockaddr_in);
+	
+	unsigned int i;
+	for (i = 0; i < conn->n_batched; i++) {
+		rs__outstanding_t *os = conn->batch_slots[i];
+		struct iovec *iov = &(conn->batch_iovs[2 * i]);
+		struct msghdr *msg = &(conn->batch_msgs[i].msg_hdr);
+		
+		iov[0].iov_base = os->packet.base;
+		iov[0].iov_len = os->packet.len;
+		iov[1].iov_base = os->payload.base;
+		iov[1].iov_len = os->payload.len;
+		
+		msg->msg_name = (void *)conn->addr;
+		msg->msg_namelen = addr_len;
+		msg->msg_iov = iov;
+		msg->msg_iovlen = os->payload.len ? 2 : 1;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+	}
+	
+	int n_sent;
+	do {
+		n_sent = sendmmsg(fd, conn->batch_msgs, conn->n_batched, 0);
+	} while (n_sent < 0 && errno == EINTR);
+	
+	return (n_sent > 0) ? n_sent : 0;
+}
+#endif
+
+
+void
+rs__free_batch(rs_conn_t *conn)
+{
+	free(conn->batch_slots);
+#ifdef RS__HAVE_SENDMMSG
+	free(conn->batch_msgs);
+	free(conn->batch_iovs);
+#endif
 }
 
 
@@ -73,14 +217,25 @@ rs__udp_send_cb(uv_udp_send_t *req, int status)
 		return;
 	}
 	
+	// If a response has already arrived back the slot is now free and we should
+	// simply process the queue as users waiting for this slot would be waiting
+	// on the send_req_active flag clearing.
+	if (!os->active) {
+		rs__push_free_slot(conn, os);
+		rs__process_request_queue(conn);
+		return;
+	}
+	
 	// If we were waiting on this callback before the slot could be marked as
 	// inactive after cancellation, mark as inactive now.
-	if (os->active && os->cancelled) {
+	if (os->cancelled) {
 		os->active = false;
 		os->cancelled = false;
+		conn->n_active--;
 		
 		// Now that the slot is nolonger active, we may potentially handle new
 		// requests.
+		rs__push_free_slot(conn, os);
 		rs__process_request_queue(conn);
 		return;
 	}
@@ -91,15 +246,14 @@ rs__udp_send_cb(uv_udp_send_t *req, int status)
 		return;
 	}
 	
-	// The packet has been dispatched
-	if (os->active)
-		// Setup a timeout for the response
-		uv_timer_start(&(os->timer_handle), rs__timer_cb, conn->timeout, 0);
-	else
-		// A response has already arrived back thus we should simply process the
-		// queue as users waiting for this slot would be waiting on the
-		// send_req_active flag clearing.
-		rs__process_request_queue(conn);
+	// If the response has already arrived and a retry been scheduled, leave the
+	// retry's timer be
+	if (os->retry_pending)
+		return;
+	
+	// The packet has been dispatched, setup a timeout for the response
+	RS__TRACE_OS(conn, RS_TRACE_SENT, os, 0);
+	rs__timer_start(conn, os, rs__slot_timeout(conn, os));
 }
 
 
@@ -107,13 +261,19 @@ void
 rs__udp_recv_alloc_cb(uv_handle_t *handle,
                       size_t suggested_size, uv_buf_t *buf)
 {
-	// XXX: Just use malloc for now...
-	buf->base = malloc(suggested_size);
+	rs_conn_t *conn = (rs_conn_t *)(handle->data);
 	
-	if (buf->base)
-		buf->len = suggested_size;
-	else
-		buf->len = 0;
+#ifdef RS_ZERO_COPY_READ
+	// Receive straight into the user's buffer if possible
+	if (rs__zc_recv_alloc(conn, buf))
+		return;
+#endif
+	
+	// Note: the suggested_size is ignored since no valid response can be larger
+	// than the buffers in the pool. Should the pool be exhausted, a buffer is
+	// allocated on the heap instead (and the event recorded in the pool's
+	// n_exhausted counter).
+	rs__buf_pool_alloc(conn->recv_pool, buf);
 }
 
 
@@ -125,7 +285,18 @@ rs__udp_recv_cb(uv_udp_t *handle,
 {
 	rs_conn_t *conn = (rs_conn_t *)(handle->data);
 	
-	int i;
+	if (nread > 0) {
+		RS__STATS_INC(conn, n_packets_received, 1);
+		RS__STATS_INC(conn, n_bytes_received, nread);
+	}
+	
+#ifdef RS_ZERO_COPY_READ
+	// Buffers which point into a user's buffer are dealt with separately
+	if (conn->zc_os && buf->base) {
+		rs__zc_recv(conn, nread, buf);
+		return;
+	}
+#endif
 	
 	// Ignore anything which isn't long enough to be an SCP packet (note that 2
 	// empty bytes are included in the start of every SCP packet). This also skips
@@ -138,20 +309,135 @@ rs__udp_recv_cb(uv_udp_t *handle,
 		buf_.base += 2;
 		buf_.len = nread - 2;
 		
-		// Check to see if a packet with this sequence number is outstanding (if
-		// not, the packet is ignored too)
-		uint16_t seq_num = rs__unpack_scp_packet_seq_num(buf_);
-		
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *os = conn->outstanding + i;
-			if (os->active && os->seq_num == seq_num) {
-				rs__process_response(conn, os, buf_);
-				break;
-			}
+		rs__dispatch_response(conn, buf_);
+	}
+	
+#ifdef RS__HAVE_RECVMMSG
+	// When receiving with recvmmsg, each packet arrives in a chunk of a larger
+	// buffer which is returned in a final call (flagged as UV_UDP_MMSG_FREE).
+	if (flags & UV_UDP_MMSG_CHUNK)
+		return;
+#endif
+	
+	// Return the receive buffer to the pool
+	rs__recv_release(conn, buf->base);
+}
+
+
+void
+rs__recv_release(rs_conn_t *conn, char *base)
+{
+	// Buffers from a pool replaced while they were in use go back to their
+	// original pool, which is freed once all of its buffers have been returned.
+	rs__buf_pool_t *pool = conn->old_recv_pool;
+	if (pool && rs__buf_pool_contains(pool, base)) {
+		rs__buf_pool_release(pool, base);
+		if (pool->n_free == pool->n_bufs) {
+			rs__buf_pool_free(pool);
+			conn->old_recv_pool = NULL;
+		}
+	} else {
+		rs__buf_pool_release(conn->recv_pool, base);
+	}
+}
+
+
+void
+rs__dispatch_response(rs_conn_t *conn, uv_buf_t buf)
+{
+	// Check to see if a packet with this sequence number is outstanding (if
+	// not, e.g. a duplicate or stale response, the packet is ignored)
+	uint16_t seq_num = rs__unpack_scp_packet_seq_num(buf);
+	rs__outstanding_t *os = rs__index_find_seq_num(conn, seq_num);
+	if (os)
+		rs__process_response(conn, os, buf);
+}
+
+
+#ifdef RS_ZERO_COPY_READ
+bool
+rs__zc_recv_alloc(rs_conn_t *conn, uv_buf_t *buf)
+{
+	int i;
+	
+	// Only applicable when exactly one response is awaited (and libuv isn't
+	// going to chop the buffer up for use with recvmmsg)
+	if (conn->n_active != 1 || conn->recvmmsg)
+		return false;
+	
+	rs__outstanding_t *os = NULL;
+	for (i = 0; i < conn->n_outstanding; i++) {
+		if (conn->outstanding[i].active) {
+			os = &(conn->outstanding[i]);
+			break;
 		}
 	}
+	if (!os || os->cancelled || os->type != RS__REQ_READ)
+		return false;
+	
+	// The header must land on data within the user's buffer (which must already
+	// have been received since no other slot is active).
+	if (os->data.rw.data.base - os->data.rw.orig_data.base <
+	    RS__READ_RESPONSE_HEADER_LENGTH)
+		return false;
+	
+	// Save the user data which the header will overwrite
+	buf->base = os->data.rw.data.base - RS__READ_RESPONSE_HEADER_LENGTH;
+	buf->len = RS__READ_RESPONSE_HEADER_LENGTH + os->data.rw.data.len;
+	memcpy(conn->zc_saved, buf->base, RS__READ_RESPONSE_HEADER_LENGTH);
+	conn->zc_os = os;
 	
-	// Free receive buffer
-	if (buf->base)
-		free(buf->base);
+	return true;
+}
+
+
+void
+rs__zc_recv(rs_conn_t *conn, ssize_t nread, const uv_buf_t *buf)
+{
+	rs__outstanding_t *os = conn->zc_os;
+	conn->zc_os = NULL;
+	
+	// Move the header out of the way and restore the user data it overwrote
+	// (even if nothing arrived, just to be safe).
+	size_t header_len = MIN(MAX(nread, 0), RS__READ_RESPONSE_HEADER_LENGTH);
+	memcpy(conn->zc_header, buf->base, header_len);
+	memcpy(buf->base, conn->zc_saved, RS__READ_RESPONSE_HEADER_LENGTH);
+	
+	// Ignore anything which isn't long enough to be an SCP packet (see
+	// rs__udp_recv_cb).
+	if (nread < RS__SIZEOF_SCP_PACKET(0, 0) + 2)
+		return;
+	
+	uv_buf_t header;
+	header.base = conn->zc_header + 2;
+	header.len = RS__SIZEOF_SCP_PACKET(0, 0);
+	
+	if (os->indexed &&
+	    rs__unpack_scp_packet_seq_num(header) == os->seq_num &&
+	    nread == RS__READ_RESPONSE_HEADER_LENGTH + os->data.rw.data.len) {
+		// This is the expected response and its payload is already in place.
+		// Process just the header: since it has no payload, nothing will be
+		// copied.
+		rs__process_response(conn, os, header);
+	} else {
+		// Something else arrived (e.g. a duplicate or an error response),
+		// reassemble it in a normal receive buffer and process as usual.
+		uv_buf_t packet;
+		rs__buf_pool_alloc(conn->recv_pool, &packet);
+		if (!packet.base)
+			return;
+		size_t len = MIN(nread, packet.len);
+		memcpy(packet.base, conn->zc_header, header_len);
+		memcpy(packet.base + header_len,
+		       buf->base + header_len,
+		       len - header_len);
+		
+		uv_buf_t buf_;
+		buf_.base = packet.base + 2;
+		buf_.len = len - 2;
+		rs__dispatch_response(conn, buf_);
+		
+		rs__recv_release(conn, packet.base);
+	}
 }
+#endif
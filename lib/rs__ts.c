@@ -0,0 +1,374 @@
+/**
+ * Thread-safe request submission.
+ *
+ * Requests submitted using the rs_*_ts functions are pushed onto a lock-free
+ * MPSC queue (see rs__mpsc.h) belonging to the connection and the connection's
+ * async handle is signalled. The async handle's callback, which runs on the
+ * loop thread, then queues the requests as usual using the rs_*_ex functions.
+ *
+ * When the requests complete, their callbacks are either called directly (on
+ * the loop thread) or, if the connection has a callback queue (see
+ * rs__shard.c), the results are pushed onto the callback queue and the callback
+ * queue's async handle signalled so that the callbacks are made on the thread
+ * running the callback queue's loop.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__mpsc.h>
+
+
+/**
+ * Call the user's callback for a completed thread-safe request and free it.
+ */
+static void
+rs__ts_deliver(rs__ts_req_t *ts_req)
+{
+	switch (ts_req->type) {
+		case RS__REQ_SCP_PACKET:
+			ts_req->scp_cb(ts_req->conn, ts_req->error,
+			               ts_req->cmd_rc,
+			               ts_req->n_args,
+			               ts_req->arg1, ts_req->arg2, ts_req->arg3,
+			               ts_req->data,
+			               ts_req->cb_data);
+			break;
+		
+		case RS__REQ_READ:
+		case RS__REQ_WRITE:
+			ts_req->rw_cb(ts_req->conn, ts_req->error,
+			              ts_req->cmd_rc,
+			              ts_req->data,
+			              ts_req->cb_data);
+			break;
+		
+		case RS__REQ_FENCE:
+			// Not submitted via this interface
+			break;
+	}
+	
+	free(ts_req);
+}
+
+
+/**
+ * Deliver the result of a thread-safe request via the appropriate means.
+ */
+static void
+rs__ts_complete(rs__ts_req_t *ts_req)
+{
+	if (ts_req->cb_queue)
+		rs__cb_queue_push(ts_req->cb_queue, ts_req);
+	else
+		rs__ts_deliver(ts_req);
+}
+
+
+static void
+rs__ts_scp_cb(rs_conn_t *conn,
+              int error,
+              uint16_t cmd_rc,
+              unsigned int n_args,
+              uint32_t arg1,
+              uint32_t arg2,
+              uint32_t arg3,
+              uv_buf_t data,
+              void *cb_data)
+{
+	rs__ts_req_t *ts_req = (rs__ts_req_t *)cb_data;
+	ts_req->conn = conn;
+	ts_req->error = error;
+	ts_req->cmd_rc = cmd_rc;
+	ts_req->n_args = n_args;
+	ts_req->arg1 = arg1;
+	ts_req->arg2 = arg2;
+	ts_req->arg3 = arg3;
+	ts_req->data = data;
+	rs__ts_complete(ts_req);
+}
+
+
+static void
+rs__ts_rw_cb(rs_conn_t *conn,
+             int error,
+             uint16_t cmd_rc,
+             uv_buf_t data,
+             void *cb_data)
+{
+	rs__ts_req_t *ts_req = (rs__ts_req_t *)cb_data;
+	ts_req->conn = conn;
+	ts_req->error = error;
+	ts_req->cmd_rc = cmd_rc;
+	ts_req->data = data;
+	rs__ts_complete(ts_req);
+}
+
+
+/**
+ * Fail a thread-safe request before it was queued.
+ */
+static void
+rs__ts_fail(rs_conn_t *conn, rs__ts_req_t *ts_req, int error)
+{
+	ts_req->conn = conn;
+	ts_req->error = error;
+	ts_req->cmd_rc = 0;
+	ts_req->n_args = 0;
+	rs__ts_complete(ts_req);
+}
+
+
+void
+rs__ts_async_cb(uv_async_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	
+	rs__mpsc_entry_t *entry = rs__mpsc_take_all(&(conn->ts_queue));
+	while (entry) {
+		rs__ts_req_t *ts_req = (rs__ts_req_t *)entry;
+		entry = entry->next;
+		
+		ts_req->cb_queue = conn->ts_cb_queue;
+		
+		int retval;
+		switch (ts_req->type) {
+			case RS__REQ_SCP_PACKET:
+				retval = rs_send_scp_ex(conn, ts_req->priority,
+				                        ts_req->dest_addr, ts_req->dest_cpu,
+				                        ts_req->cmd_rc,
+				                        ts_req->n_args_send, ts_req->n_args_recv,
+				                        ts_req->arg1, ts_req->arg2, ts_req->arg3,
+				                        ts_req->data, ts_req->data_max_len,
+				                        rs__ts_scp_cb, (void *)ts_req);
+				break;
+			
+			case RS__REQ_WRITE:
+				retval = rs_write_ex(conn, ts_req->priority,
+				                     ts_req->dest_addr, ts_req->dest_cpu,
+				                     ts_req->address, ts_req->data,
+				                     rs__ts_rw_cb, (void *)ts_req);
+				break;
+			
+			case RS__REQ_READ:
+			default:
+				retval = rs_read_ex(conn, ts_req->priority,
+				                    ts_req->dest_addr, ts_req->dest_cpu,
+				                    ts_req->address, ts_req->data,
+				                    rs__ts_rw_cb, (void *)ts_req);
+				break;
+		}
+		
+		if (retval)
+			rs__ts_fail(conn, ts_req,
+			            (retval == RS_EFULL) ? RS_EFULL : UV_ENOMEM);
+	}
+}
+
+
+void
+rs__ts_cancel_all(rs_conn_t *conn, int error)
+{
+	rs__mpsc_entry_t *entry = rs__mpsc_take_all(&(conn->ts_queue));
+	while (entry) {
+		rs__ts_req_t *ts_req = (rs__ts_req_t *)entry;
+		entry = entry->next;
+		
+		ts_req->cb_queue = conn->ts_cb_queue;
+		rs__ts_fail(conn, ts_req, error);
+	}
+}
+
+
+void
+rs__ts_async_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	conn->ts_async_handle_closed = true;
+	rs_free(conn, NULL, NULL);
+}
+
+
+/**
+ * Push a request onto a connection's thread-safe queue and wake the loop.
+ */
+static void
+rs__ts_submit(rs_conn_t *conn, rs__ts_req_t *ts_req)
+{
+	// The loop only needs to be woken if the queue was empty: otherwise a wake
+	// up is already pending for the earlier requests. (uv_async_send coalesces
+	// signals anyway but this avoids a syscall per request when busy.)
+	if (rs__mpsc_push(&(conn->ts_queue), &(ts_req->_)))
+		uv_async_send(&(conn->ts_async_handle));
+}
+
+
+int
+rs_send_scp_ts(rs_conn_t *conn,
+               rs_priority_t priority,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint16_t cmd_rc,
+               unsigned int n_args_send,
+               unsigned int n_args_recv,
+               uint32_t arg1,
+               uint32_t arg2,
+               uint32_t arg3,
+               uv_buf_t data,
+               size_t data_max_len,
+               rs_send_scp_cb cb,
+               void *cb_data)
+{
+	rs__ts_req_t *ts_req = malloc(sizeof(rs__ts_req_t));
+	if (!ts_req)
+		return -1;
+	
+	ts_req->type = RS__REQ_SCP_PACKET;
+	ts_req->priority = priority;
+	ts_req->dest_addr = dest_addr;
+	ts_req->dest_cpu = dest_cpu;
+	ts_req->cmd_rc = cmd_rc;
+	ts_req->n_args_send = n_args_send;
+	ts_req->n_args_recv = n_args_recv;
+	ts_req->arg1 = arg1;
+	ts_req->arg2 = arg2;
+	ts_req->arg3 = arg3;
+	ts_req->data = data;
+	ts_req->data_max_len = data_max_len;
+	ts_req->scp_cb = cb;
+	ts_req->cb_data = cb_data;
+	
+	rs__ts_submit(conn, ts_req);
+	return 0;
+}
+
+
+/**
+ * Common implementation of rs_write_ts and rs_read_ts.
+ */
+static int
+rs__ts_rw(rs_conn_t *conn,
+          rs__req_type_t type,
+          rs_priority_t priority,
+          uint16_t dest_addr,
+          uint8_t dest_cpu,
+          uint32_t address,
+          uv_buf_t data,
+          rs_rw_cb cb,
+          void *cb_data)
+{
+	rs__ts_req_t *ts_req = malloc(sizeof(rs__ts_req_t));
+	if (!ts_req)
+		return -1;
+	
+	ts_req->type = type;
+	ts_req->priority = priority;
+	ts_req->dest_addr = dest_addr;
+	ts_req->dest_cpu = dest_cpu;
+	ts_req->address = address;
+	ts_req->data = data;
+	ts_req->rw_cb = cb;
+	ts_req->cb_data = cb_data;
+	
+	rs__ts_submit(conn, ts_req);
+	return 0;
+}
+
+
+int
+rs_write_ts(rs_conn_t *conn,
+            rs_priority_t priority,
+            uint16_t dest_addr,
+            uint8_t dest_cpu,
+            uint32_t address,
+            uv_buf_t data,
+            rs_rw_cb cb,
+            void *cb_data)
+{
+	return rs__ts_rw(conn, RS__REQ_WRITE, priority, dest_addr, dest_cpu,
+	                 address, data, cb, cb_data);
+}
+
+
+int
+rs_read_ts(rs_conn_t *conn,
+           rs_priority_t priority,
+           uint16_t dest_addr,
+           uint8_t dest_cpu,
+           uint32_t address,
+           uv_buf_t data,
+           rs_rw_cb cb,
+           void *cb_data)
+{
+	return rs__ts_rw(conn, RS__REQ_READ, priority, dest_addr, dest_cpu,
+	                 address, data, cb, cb_data);
+}
+
+
+static void
+rs__cb_queue_async_cb(uv_async_t *handle)
+{
+	rs__cb_queue_drain((rs__cb_queue_t *)handle->data);
+}
+
+
+rs__cb_queue_t *
+rs__cb_queue_init(uv_loop_t *loop)
+{
+	rs__cb_queue_t *cb_queue = malloc(sizeof(rs__cb_queue_t));
+	if (!cb_queue)
+		return NULL;
+	
+	rs__mpsc_init(&(cb_queue->queue));
+	
+	if (uv_async_init(loop, &(cb_queue->async_handle), rs__cb_queue_async_cb)) {
+		free(cb_queue);
+		return NULL;
+	}
+	cb_queue->async_handle.data = (void *)cb_queue;
+	
+	return cb_queue;
+}
+
+
+void
+rs__cb_queue_push(rs__cb_queue_t *cb_queue, rs__ts_req_t *ts_req)
+{
+	if (rs__mpsc_push(&(cb_queue->queue), &(ts_req->_)))
+		uv_async_send(&(cb_queue->async_handle));
+}
+
+
+void
+rs__cb_queue_drain(rs__cb_queue_t *cb_queue)
+{
+	rs__mpsc_entry_t *entry = rs__mpsc_take_all(&(cb_queue->queue));
+	while (entry) {
+		rs__ts_req_t *ts_req = (rs__ts_req_t *)entry;
+		entry = entry->next;
+		rs__ts_deliver(ts_req);
+	}
+}
+
+
+static void
+rs__cb_queue_closed_cb(uv_handle_t *handle)
+{
+	free(handle);
+}
+
+
+void
+rs__cb_queue_free(rs__cb_queue_t *cb_queue)
+{
+	rs__cb_queue_drain(cb_queue);
+	
+	// The async handle is the first member of the queue so the whole queue is
+	// freed once the handle has closed.
+	uv_close((uv_handle_t *)&(cb_queue->async_handle), rs__cb_queue_closed_cb);
+}
@@ -0,0 +1,93 @@
+/**
+ * Internal functions which dynamically size the window of outstanding packets.
+ *
+ * The window is adjusted using additive-increase/multiplicative-decrease
+ * (AIMD) as in TCP's congestion avoidance: it is halved whenever a packet is
+ * lost or the machine reports it is too busy and grows by one slot for each
+ * window's worth of OK responses.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * Is sequence number a before sequence number b (allowing for wrap-around)?
+ */
+#define RS__SEQ_BEFORE(a, b) (((int16_t)((uint16_t)(a) - (uint16_t)(b))) < 0)
+
+
+void
+rs__window_decrease(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->dynamic_window)
+		return;
+	
+	// Packets sent before the window last shrank are part of the same congestion
+	// event
+	if (conn->window_recovering &&
+	    RS__SEQ_BEFORE(os->seq_num, conn->window_recovery_seq))
+		return;
+	
+	conn->window = MAX(conn->window / 2, 1);
+	conn->window_growth = 0;
+	conn->window_recovering = true;
+	conn->window_recovery_seq = conn->next_seq_num;
+}
+
+
+void
+rs__window_increase(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->dynamic_window)
+		return;
+	
+	// A response to a packet sent since the window shrank ends the congestion
+	// event
+	if (conn->window_recovering &&
+	    !RS__SEQ_BEFORE(os->seq_num, conn->window_recovery_seq))
+		conn->window_recovering = false;
+	
+	if (conn->window < conn->n_outstanding &&
+	    ++conn->window_growth >= conn->window) {
+		conn->window++;
+		conn->window_growth = 0;
+	}
+}
+
+
+// The same codes as rs__window_busy_rc treats as busy
+const uint16_t rs_transient_rcs[] = {
+	RS__SCP_RC_TIMEOUT,
+	RS__SCP_RC_BUF,
+	RS__SCP_RC_P2P_NOREPLY,
+	RS__SCP_RC_P2P_BUSY,
+	RS__SCP_RC_P2P_TIMEOUT,
+	RS__SCP_RC_PKT_TX,
+};
+const unsigned int rs_n_transient_rcs =
+	sizeof(rs_transient_rcs) / sizeof(rs_transient_rcs[0]);
+
+
+bool
+rs__window_busy_rc(uint16_t cmd_rc)
+{
+	switch (cmd_rc) {
+		case RS__SCP_RC_TIMEOUT:
+		case RS__SCP_RC_BUF:
+		case RS__SCP_RC_P2P_NOREPLY:
+		case RS__SCP_RC_P2P_BUSY:
+		case RS__SCP_RC_P2P_TIMEOUT:
+		case RS__SCP_RC_PKT_TX:
+			return true;
+		
+		default:
+			return false;
+	}
+}
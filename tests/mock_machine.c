@@ -46,6 +46,11 @@ typedef struct {
  */
 #define MM__CMD_RC(p) (((sdp_scp_header_t *)(p))->cmd_rc)
 
+/**
+ * The cmd_rc of a CMD_VER packet.
+ */
+#define MM__CMD_VER 0
+
 /**
  * Unpack the response delay from a packet according to the definitions at the
  * top of the headder file.
@@ -180,6 +185,19 @@ static void mm__pack_response_write(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
                                     uv_buf_t *buf);
 
 
+/**
+ * Internal function: Fill some memory with a word.
+ */
+static void mm__pack_response_fill(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                                   uv_buf_t *buf);
+
+/**
+ * Internal function: pack a response to a CMD_VER (when respond_to_ver is set).
+ */
+static void mm__pack_response_ver(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                                  uv_buf_t *buf);
+
+
 mm_t *
 mm_init(uv_loop_t *loop)
 {
@@ -205,6 +223,9 @@ mm_init(uv_loop_t *loop)
 	mm->reqs = NULL;
 	mm->rws = NULL;
 	
+	mm->respond_to_ver = false;
+	mm->ver_scp_data_length = MM_SCP_DATA_LENGTH;
+	
 	return mm;
 }
 
@@ -402,6 +423,17 @@ mm__timer_cb(uv_timer_t *timer_handle)
 			mm__pack_response_write(mm, req, resp, &buf);
 			break;
 		
+		case RS__SCP_CMD_FILL:
+			mm__pack_response_fill(mm, req, resp, &buf);
+			break;
+		
+		case MM__CMD_VER:
+			if (mm->respond_to_ver)
+				mm__pack_response_ver(mm, req, resp, &buf);
+			else
+				mm__pack_response_generic(mm, req, resp, &buf);
+			break;
+		
 		default:
 			mm__pack_response_generic(mm, req, resp, &buf);
 			break;
@@ -450,6 +482,17 @@ mm__pack_response_generic(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
 }
 
 
+static void
+mm__pack_response_ver(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                      uv_buf_t *buf)
+{
+	// Echo the packet back with the header filled in as SC&MP would
+	mm__pack_response_generic(mm, req, resp, buf);
+	MM__CMD_RC(buf->base + 2) = RS__SCP_CMD_OK;
+	((sdp_scp_header_t *)(buf->base + 2))->arg2 = mm->ver_scp_data_length;
+}
+
+
 static void
 mm__pack_response_read(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
                        uv_buf_t *buf)
@@ -542,6 +585,48 @@ mm__pack_response_write(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
 }
 
 
+static void
+mm__pack_response_fill(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                       uv_buf_t *buf)
+{
+	void *p = req->buf.base;
+	uint32_t value = ((sdp_scp_header_t *)p)->arg2;
+	uint32_t length = ((sdp_scp_header_t *)p)->arg3;
+	
+	// Crash if the fill is unaligned or goes out of memory
+	if (MM__RW_ADDR(p) % 4 || length % 4 || MM__RW_ADDR(p) + length > MM_MAX_RW)
+		abort();
+	
+	mm_rw_t *rw = mm_get_rw(mm, MM__RW_ID(req->buf.base));
+	
+	// Generate a response packet, initially based on the request with the
+	// arguments stripped out (including 2 bytes padding)
+	buf->base = malloc(RS__SIZEOF_SCP_PACKET(0, 0) + 2);
+	if (!buf->base) abort();
+	buf->len = RS__SIZEOF_SCP_PACKET(0, 0) + 2;
+	memset(buf->base, 0, 2);
+	memcpy(buf->base + 2, req->buf.base, RS__SIZEOF_SCP_PACKET(0, 0));
+	
+	// Report failiure as required
+	if (MM__RW_N_RESP_BEFORE_ERROR(p) == 255 ||
+	    rw->n_responses_sent != MM__RW_N_RESP_BEFORE_ERROR(p))
+		MM__CMD_RC(buf->base + 2) = RS__SCP_CMD_OK;
+	else
+		MM__CMD_RC(buf->base + 2) = 0;
+	
+	// Fill the 'memory' (the machine is little-endian)
+	uint32_t addr;
+	for (addr = MM__RW_ADDR(p); addr < MM__RW_ADDR(p) + length; addr++) {
+		rw->data[addr] = (char)(value >> (8 * (addr % 4)));
+		if (rw->write_count[addr] < 255)
+			rw->write_count[addr]++;
+	}
+	
+	// Count the number of responses dealt with
+	rw->n_responses_sent++;
+}
+
+
 static void
 mm__send_cb(uv_udp_send_t *send_req, int status)
 {
@@ -17,6 +17,13 @@
  *   * Bits 31:24 of the address gives the number of successful requests to
  *     read/write instantly before delaying by dest_addr[7:0] attempts or 255
  *     to always return after dest_addr[7:0] attempts.
+ * * For CMD_FILL (arg1 = address, arg2 = word, arg3 = length):
+ *   * Bits 15:10 and 23:16 of the address are as for CMD_WRITE with the fill
+ *     being applied to the same memory as writes with the same identifier.
+ * * For CMD_VER (cmd_rc 0), only when respond_to_ver is set (otherwise echoed
+ *   like any other packet):
+ *   * The response has cmd_rc RC_OK and the low 16 bits of arg2 give
+ *     ver_scp_data_length (MM_SCP_DATA_LENGTH by default).
  *
  * This code is a joy of hideously inefficient data structures and linear
  * searches since its performance is truly irellevent.
@@ -41,6 +48,13 @@
  */
 #define MM_SCP_DATA_LENGTH 32
 
+/**
+ * The largest data field the mock machine will accept without crashing (for
+ * tests where the length reported by CMD_VER is changed, see
+ * ver_scp_data_length).
+ */
+#define MM_MAX_SCP_DATA_LENGTH 1024
+
 /**
  * Maximum total read/write size supported by the block.
  */
@@ -103,7 +117,7 @@ struct mm_req {
 	uint16_t seq_num;
 	
 	// Data buffer to store incoming packets (not including padding bytes)
-	char packet[RS__SIZEOF_SCP_PACKET(3, MM_SCP_DATA_LENGTH)];
+	char packet[RS__SIZEOF_SCP_PACKET(3, MM_MAX_SCP_DATA_LENGTH)];
 	uv_buf_t buf;
 	
 	// Count how many times the packet value received was different from the
@@ -172,6 +186,14 @@ struct mm {
 	
 	// Linked list of read/write block requests
 	mm_rw_t *rws;
+	
+	// Respond to CMD_VER as SC&MP does rather than echoing it (false by
+	// default)
+	bool respond_to_ver;
+	
+	// The data field length reported in CMD_VER responses (MM_SCP_DATA_LENGTH
+	// by default)
+	uint16_t ver_scp_data_length;
 };
 
 
@@ -0,0 +1,129 @@
+/**
+ * Test the receive buffer pool implementation.
+ */
+
+#include <check.h>
+
+#include <string.h>
+
+#include "tests.h"
+
+#include "rs__buf_pool.h"
+
+// Size of the buffers in the pool used in all tests
+#define BUF_SIZE 100
+
+// Number of buffers in the pool used in all tests
+#define N_BUFS 4
+
+static rs__buf_pool_t *pool = NULL;
+
+static void setup(void) {
+	pool = rs__buf_pool_init(BUF_SIZE, N_BUFS);
+	ck_assert(pool);
+}
+
+
+static void teardown(void) {
+	rs__buf_pool_free(pool);
+	pool = NULL;
+}
+
+
+START_TEST (test_reuse)
+{
+	// Make sure that a buffer allocated and released repeatedly is always the
+	// same buffer from the pool.
+	uv_buf_t first;
+	rs__buf_pool_alloc(pool, &first);
+	ck_assert(first.base);
+	ck_assert_uint_eq(first.len, BUF_SIZE);
+	rs__buf_pool_release(pool, first.base);
+	
+	int i;
+	for (i = 0; i < 100; i++) {
+		uv_buf_t buf;
+		rs__buf_pool_alloc(pool, &buf);
+		ck_assert(buf.base == first.base);
+		ck_assert_uint_eq(buf.len, BUF_SIZE);
+		rs__buf_pool_release(pool, buf.base);
+	}
+	
+	ck_assert_uint_eq(pool->n_free, N_BUFS);
+	ck_assert_uint_eq(pool->n_exhausted, 0);
+}
+END_TEST
+
+
+START_TEST (test_distinct)
+{
+	// Make sure that all buffers handed out simultaneously are distinct and
+	// usable.
+	uv_buf_t bufs[N_BUFS];
+	int i, j;
+	for (i = 0; i < N_BUFS; i++) {
+		rs__buf_pool_alloc(pool, &(bufs[i]));
+		ck_assert(bufs[i].base);
+		ck_assert_uint_eq(bufs[i].len, BUF_SIZE);
+		memset(bufs[i].base, i, BUF_SIZE);
+	}
+	
+	for (i = 0; i < N_BUFS; i++) {
+		for (j = 0; j < BUF_SIZE; j++)
+			ck_assert_int_eq(bufs[i].base[j], i);
+		rs__buf_pool_release(pool, bufs[i].base);
+	}
+	
+	ck_assert_uint_eq(pool->n_free, N_BUFS);
+	ck_assert_uint_eq(pool->n_exhausted, 0);
+}
+END_TEST
+
+
+START_TEST (test_exhaustion)
+{
+	// Make sure that when the pool runs dry allocations still succeed, are
+	// counted and are freed correctly when released (valgrind will complain
+	// otherwise).
+	uv_buf_t bufs[N_BUFS * 2];
+	int i;
+	for (i = 0; i < N_BUFS * 2; i++) {
+		rs__buf_pool_alloc(pool, &(bufs[i]));
+		ck_assert(bufs[i].base);
+		ck_assert_uint_eq(bufs[i].len, BUF_SIZE);
+	}
+	
+	ck_assert_uint_eq(pool->n_free, 0);
+	ck_assert_uint_eq(pool->n_exhausted, N_BUFS);
+	
+	// Release in a different order to allocation
+	for (i = (N_BUFS * 2) - 1; i >= 0; i--)
+		rs__buf_pool_release(pool, bufs[i].base);
+	
+	ck_assert_uint_eq(pool->n_free, N_BUFS);
+	ck_assert_uint_eq(pool->n_exhausted, N_BUFS);
+	
+	// Releasing NULL should be a no-op
+	rs__buf_pool_release(pool, NULL);
+	ck_assert_uint_eq(pool->n_free, N_BUFS);
+}
+END_TEST
+
+
+Suite *
+make_buf_pool_suite(void)
+{
+	Suite *s = suite_create("buf_pool");
+	
+	// Add tests to the test case
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_checked_fixture(tc_core, setup, teardown);
+	tcase_add_test(tc_core, test_reuse);
+	tcase_add_test(tc_core, test_distinct);
+	tcase_add_test(tc_core, test_exhaustion);
+	
+	// Add each test case to the suite
+	suite_add_tcase(s, tc_core);
+	
+	return s;
+}
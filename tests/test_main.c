@@ -18,6 +18,8 @@ main(int argc, char *argv[])
 	
 	// Add all suites
 	srunner_add_suite(sr, make_queue_suite());
+	srunner_add_suite(sr, make_buf_pool_suite());
+	srunner_add_suite(sr, make_mpsc_suite());
 	srunner_add_suite(sr, make_scp_suite());
 	srunner_add_suite(sr, make_rig_scp_suite());
 	
@@ -0,0 +1,149 @@
+/**
+ * Test the lock-free MPSC queue implementation.
+ */
+
+#include <check.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include "tests.h"
+
+#include "rs__mpsc.h"
+
+// Number of producer threads used in the concurrent test
+#define N_THREADS 4
+
+// Number of entries pushed by each producer thread
+#define N_PER_THREAD 10000
+
+/**
+ * An entry in the queue recording its producer and sequence number.
+ */
+typedef struct {
+	rs__mpsc_entry_t _;
+	
+	unsigned int thread;
+	unsigned int num;
+} entry_t;
+
+static rs__mpsc_t q;
+
+static void setup(void) {
+	rs__mpsc_init(&q);
+}
+
+
+static void teardown(void) {
+	// Nothing to do
+}
+
+
+START_TEST (test_empty)
+{
+	ck_assert(rs__mpsc_take_all(&q) == NULL);
+}
+END_TEST
+
+
+START_TEST (test_fifo)
+{
+	// Entries should be taken in the order they were pushed and only the first
+	// push into an empty queue should say so.
+	entry_t entries[10];
+	int i;
+	for (i = 0; i < 10; i++) {
+		entries[i].num = i;
+		ck_assert(rs__mpsc_push(&q, &(entries[i]._)) == (i == 0));
+	}
+	
+	rs__mpsc_entry_t *entry = rs__mpsc_take_all(&q);
+	for (i = 0; i < 10; i++) {
+		ck_assert(entry == &(entries[i]._));
+		entry = entry->next;
+	}
+	ck_assert(entry == NULL);
+	
+	// The queue is now empty again
+	ck_assert(rs__mpsc_take_all(&q) == NULL);
+	ck_assert(rs__mpsc_push(&q, &(entries[0]._)));
+	ck_assert(rs__mpsc_take_all(&q) == &(entries[0]._));
+}
+END_TEST
+
+
+static void
+producer(void *arg)
+{
+	entry_t *entries = (entry_t *)arg;
+	int i;
+	for (i = 0; i < N_PER_THREAD; i++)
+		rs__mpsc_push(&q, &(entries[i]._));
+}
+
+
+START_TEST (test_concurrent)
+{
+	// Several threads push concurrently while this thread takes entries. Every
+	// entry should arrive exactly once and each thread's entries should arrive
+	// in order.
+	entry_t *entries = malloc(sizeof(entry_t) * N_THREADS * N_PER_THREAD);
+	ck_assert(entries);
+	
+	uv_thread_t threads[N_THREADS];
+	unsigned int next_num[N_THREADS];
+	int t, i;
+	for (t = 0; t < N_THREADS; t++) {
+		for (i = 0; i < N_PER_THREAD; i++) {
+			entries[t * N_PER_THREAD + i].thread = t;
+			entries[t * N_PER_THREAD + i].num = i;
+		}
+		next_num[t] = 0;
+	}
+	for (t = 0; t < N_THREADS; t++)
+		ck_assert(!uv_thread_create(&(threads[t]), producer,
+		                            &(entries[t * N_PER_THREAD])));
+	
+	unsigned int n_taken = 0;
+	while (n_taken < N_THREADS * N_PER_THREAD) {
+		rs__mpsc_entry_t *entry = rs__mpsc_take_all(&q);
+		while (entry) {
+			entry_t *e = (entry_t *)entry;
+			ck_assert_uint_eq(e->num, next_num[e->thread]);
+			next_num[e->thread]++;
+			n_taken++;
+			entry = entry->next;
+		}
+	}
+	
+	for (t = 0; t < N_THREADS; t++)
+		uv_thread_join(&(threads[t]));
+	
+	ck_assert(rs__mpsc_take_all(&q) == NULL);
+	for (t = 0; t < N_THREADS; t++)
+		ck_assert_uint_eq(next_num[t], N_PER_THREAD);
+	
+	free(entries);
+}
+END_TEST
+
+
+Suite *
+make_mpsc_suite(void)
+{
+	Suite *s = suite_create("mpsc");
+	
+	// Add tests to the test case
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_checked_fixture(tc_core, setup, teardown);
+	tcase_add_test(tc_core, test_empty);
+	tcase_add_test(tc_core, test_fifo);
+	tcase_add_test(tc_core, test_concurrent);
+	
+	// Add each test case to the suite
+	suite_add_tcase(s, tc_core);
+	
+	return s;
+}
@@ -10,14 +10,13 @@
 
 // Data type placed in the queue during all tests
 typedef struct {
-	rs__q_entry_t _;
 	int value;
 } my_type_t;
 
 static rs__q_t *q = NULL;
 
 static void setup(void) {
-	q = rs__q_init(sizeof(my_type_t));
+	q = rs__q_init(sizeof(my_type_t), 0);
 	ck_assert(q);
 }
 
@@ -35,6 +34,7 @@ START_TEST (test_empty)
 	ck_assert(rs__q_remove(q) == NULL);
 	ck_assert(rs__q_peek(q) == NULL);
 	ck_assert(rs__q_remove(q) == NULL);
+	ck_assert_uint_eq(q->length, 0);
 }
 END_TEST
 
@@ -55,9 +55,8 @@ START_TEST (test_single_insertion)
 		ck_assert(rs__q_remove(q) == NULL);
 	}
 	
-	// Make sure that only one block was allocated!
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next == NULL);
+	// Make sure that the buffer never grew!
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE);
 }
 END_TEST
 
@@ -68,33 +67,36 @@ START_TEST (test_buffer_growth)
 	
 	int i;
 	
+	// Move the head of the queue part way around the buffer so that the queue
+	// wraps around the end of the buffer when full
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE / 2; i++) {
+		ck_assert(rs__q_insert(q));
+		ck_assert(rs__q_remove(q));
+	}
+	
 	// Insert a number of items which shouldn't grow the buffer
-	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE - 1; i++) {
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE; i++) {
 		my_type_t *e = (my_type_t *)rs__q_insert(q);
 		ck_assert(e);
 		e->value = i;
 	}
-	
-	// Make sure that only one block was allocated!
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next == NULL);
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE);
 	
 	// Insert another item which should grow the buffer
 	my_type_t *e = (my_type_t *)rs__q_insert(q);
 	ck_assert(e);
 	e->value = i++;
-	
-	// A new block should now have been allocated
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next);
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE * 2);
 	
 	// Removing things should come out in order
-	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE; i++) {
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE + 1; i++) {
+		ck_assert_uint_eq(q->length, RS__Q_FIRST_BLOCK_SIZE + 1 - i);
 		my_type_t *e = (my_type_t *)rs__q_peek(q);
 		ck_assert(e);
 		ck_assert(e->value == i);
 		ck_assert((my_type_t *)rs__q_remove(q) == e);
 	}
+	ck_assert_uint_eq(q->length, 0);
 	
 	// Nothing should be left
 	ck_assert(rs__q_peek(q) == NULL);
@@ -140,6 +142,107 @@ START_TEST (test_varying_size)
 END_TEST
 
 
+
+START_TEST (test_peek_last)
+{
+	// Make sure the most recently inserted entry is tracked, including when the
+	// buffer grows
+	int i;
+	ck_assert(rs__q_peek_last(q) == NULL);
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE * 2; i++) {
+		my_type_t *e = (my_type_t *)rs__q_insert(q);
+		ck_assert(e);
+		ck_assert((my_type_t *)rs__q_peek_last(q) == e);
+	}
+	
+	// Removing all but the last leaves it in place
+	my_type_t *last = (my_type_t *)rs__q_peek_last(q);
+	for (i = 0; i < (RS__Q_FIRST_BLOCK_SIZE * 2) - 1; i++) {
+		ck_assert(rs__q_remove(q));
+		ck_assert((my_type_t *)rs__q_peek_last(q) == last);
+	}
+	
+	// Emptying the queue leaves nothing
+	ck_assert((my_type_t *)rs__q_remove(q) == last);
+	ck_assert(rs__q_peek_last(q) == NULL);
+}
+END_TEST
+
+
+START_TEST (test_bounded)
+{
+	// Make sure a bounded queue refuses insertions once full and accepts them
+	// again once there is space
+	const size_t max_length = RS__Q_FIRST_BLOCK_SIZE * 2 + 3;
+	rs__q_t *bq = rs__q_init(sizeof(my_type_t), max_length);
+	ck_assert(bq);
+	
+	size_t i;
+	for (i = 0; i < max_length; i++) {
+		ck_assert(!rs__q_full(bq));
+		my_type_t *e = (my_type_t *)rs__q_insert(bq);
+		ck_assert(e);
+		e->value = i;
+	}
+	ck_assert(rs__q_full(bq));
+	ck_assert(rs__q_insert(bq) == NULL);
+	ck_assert_uint_eq(bq->length, max_length);
+	
+	// The buffer grew no larger than required
+	ck_assert_uint_eq(bq->capacity, max_length);
+	
+	// Space is made by removing an entry
+	ck_assert_int_eq(((my_type_t *)rs__q_remove(bq))->value, 0);
+	ck_assert(!rs__q_full(bq));
+	my_type_t *e = (my_type_t *)rs__q_insert(bq);
+	ck_assert(e);
+	e->value = i;
+	ck_assert(rs__q_full(bq));
+	
+	// Everything comes out in order
+	for (i = 1; i <= max_length; i++)
+		ck_assert_int_eq(((my_type_t *)rs__q_remove(bq))->value, i);
+	ck_assert(rs__q_remove(bq) == NULL);
+	
+	rs__q_free(bq);
+}
+END_TEST
+
+
+START_TEST (test_trim)
+{
+	// Make sure that the memory used by a burst of entries is released by
+	// trimming once (and only once) the queue is empty
+	int i;
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE * 4; i++) {
+		my_type_t *e = (my_type_t *)rs__q_insert(q);
+		ck_assert(e);
+		e->value = i;
+	}
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE * 4);
+	
+	// Trimming a non-empty queue does nothing
+	ck_assert(rs__q_remove(q));
+	rs__q_trim(q);
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE * 4);
+	ck_assert_int_eq(((my_type_t *)rs__q_peek(q))->value, 1);
+	
+	while (rs__q_remove(q))
+		;
+	rs__q_trim(q);
+	ck_assert_uint_eq(q->capacity, RS__Q_FIRST_BLOCK_SIZE);
+	
+	// The queue remains usable
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE * 2; i++) {
+		my_type_t *e = (my_type_t *)rs__q_insert(q);
+		ck_assert(e);
+		e->value = i;
+	}
+	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE * 2; i++)
+		ck_assert_int_eq(((my_type_t *)rs__q_remove(q))->value, i);
+}
+END_TEST
+
 Suite *
 make_queue_suite(void)
 {
@@ -152,6 +255,9 @@ make_queue_suite(void)
 	tcase_add_test(tc_core, test_single_insertion);
 	tcase_add_test(tc_core, test_buffer_growth);
 	tcase_add_test(tc_core, test_varying_size);
+	tcase_add_test(tc_core, test_peek_last);
+	tcase_add_test(tc_core, test_bounded);
+	tcase_add_test(tc_core, test_trim);
 	
 	// Add each test case to the suite
 	suite_add_tcase(s, tc_core);
@@ -11,6 +11,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 
@@ -20,6 +22,7 @@
 #include "mock_machine.h"
 
 #include "rs.h"
+#include "rs__internal.h"
 
 
 /******************************************************************************
@@ -1177,6 +1180,2751 @@ START_TEST (test_read_fail)
 END_TEST
 
 
+/**
+ * Make sure that a multi-packet read works when only a single packet may be
+ * outstanding at once (when zero-copy reads are enabled, all but the first
+ * response will be received directly into the read buffer). Also checks that
+ * duplicate response packets are ignored and that no data outside the read
+ * buffer is modified.
+ */
+START_TEST (test_single_outstanding_read)
+{
+	// Offset for the data in memory
+	const size_t offset = 10;
+	
+	// Number of packets to send
+	const size_t n_packets = 6;
+	
+	// Length of the read request selected to require the specified number of
+	// packets, with the last packet being half-length
+	const size_t length = (MM_SCP_DATA_LENGTH * n_packets)
+	                      - MM_SCP_DATA_LENGTH / 2;
+	
+	// Number of guard bytes either side of the read buffer
+	const size_t n_guard = 32;
+	
+	size_t i;
+	
+	// Connect to the mock machine with only one outstanding slot
+	rs_conn_t *conn1 = rs_init(loop,
+	                           (struct sockaddr *)&conn_addr,
+	                           MM_SCP_DATA_LENGTH,
+	                           TIMEOUT,
+	                           N_TRIES,
+	                           1);
+	ck_assert(conn1);
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++) {
+		rw->data[offset + i] = (unsigned char)i;
+	}
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer to hold the read data surrounded by guard bytes
+	unsigned char data_buf[n_guard + length + n_guard];
+	memset(data_buf, 0xAA, sizeof(data_buf));
+	uv_buf_t data;
+	data.base = (void *)(data_buf + n_guard);
+	data.len = length;
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Send the packet
+	ck_assert(!rs_read(conn1,
+	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                   3, // Send some duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// Check the right number of requests were sent
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	
+	// Check the data read is as expected
+	ck_assert(cb_data.conn == conn1);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	ck_assert(memcmp(cb_data.data.base, rw->data + offset, data.len) == 0);
+	
+	// Check the guard bytes were untouched
+	for (i = 0; i < n_guard; i++) {
+		ck_assert_uint_eq(data_buf[i], 0xAA);
+		ck_assert_uint_eq(data_buf[n_guard + length + i], 0xAA);
+	}
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that a multi-packet read works when many packets are outstanding
+ * at once (and thus many responses must be matched up with their outstanding
+ * slots). Also checks that duplicate response packets are ignored.
+ */
+START_TEST (test_large_window_read)
+{
+	// Number of outstanding slots to use (not a power of two)
+	const unsigned int n_outstanding = 13;
+	
+	// Length of the read (the whole of the mock machine's memory)
+	const size_t length = MM_MAX_RW;
+	
+	size_t i;
+	
+	// Connect to the mock machine with many outstanding slots
+	rs_conn_t *conn1 = rs_init(loop,
+	                           (struct sockaddr *)&conn_addr,
+	                           MM_SCP_DATA_LENGTH,
+	                           TIMEOUT,
+	                           N_TRIES,
+	                           n_outstanding);
+	ck_assert(conn1);
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++) {
+		rw->data[i] = (unsigned char)(i * 7);
+	}
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer to hold the read data
+	unsigned char data_buf[length];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	uint32_t addr = (0u |  // Start at the start of memory
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Send the packet
+	ck_assert(!rs_read(conn1,
+	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                   3, // Send some duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// Check the right number of requests were sent and all data was read once
+	ck_assert_uint_eq(rw->n_responses_sent, length / MM_SCP_DATA_LENGTH);
+	for (i = 0; i < length; i++)
+		ck_assert_uint_eq(rw->read_count[i], 1);
+	
+	// Check the data read is as expected
+	ck_assert(cb_data.conn == conn1);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	ck_assert(memcmp(cb_data.data.base, rw->data, data.len) == 0);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that retransmitted write packets (whose payload is sent directly
+ * from the user's buffer) are complete and identical to the original
+ * transmission.
+ */
+START_TEST (test_write_retransmit)
+{
+	// Offset for the data in memory
+	const size_t offset = 10;
+	
+	// Number of packets to send
+	const size_t n_packets = N_OUTSTANDING * 2;
+	
+	// Length of the write
+	const size_t length = MM_SCP_DATA_LENGTH * n_packets;
+	
+	size_t i;
+	
+	// Get a reference to the memory block we're going to write to
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer with some dummy data to write
+	unsigned char data_buf[length];
+	for (i = 0; i < length; i++)
+		data_buf[i] = (unsigned char)(i * 3);
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	// Send the packet
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_write(conn,
+	                    (1 << 8) | N_TRIES, // Respond after 1 msec on the final
+	                                        // attempt
+	                    0, // Send no duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once and succeeded
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	
+	// Check the data written was correct
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	ck_assert(memcmp(rw->data + offset, data_buf, data.len) == 0);
+	
+	// Check that every packet was retransmitted without changing
+	for (i = 0; i < n_packets; i++) {
+		mm_req_t *req = mm_get_req(mm, i);
+		ck_assert_uint_eq(req->n_changes, 1);
+		ck_assert_uint_eq(req->n_tries, N_TRIES);
+		ck_assert_uint_eq(req->buf.len,
+		                  RS__SIZEOF_SCP_PACKET(3, MM_SCP_DATA_LENGTH));
+		ck_assert(memcmp(req->buf.base + RS__SIZEOF_SCP_PACKET(3, 0),
+		                 data_buf + (i * MM_SCP_DATA_LENGTH),
+		                 MM_SCP_DATA_LENGTH) == 0);
+	}
+}
+END_TEST
+
+/**
+ * Make sure that writes and reads (including retransmissions) work when packets
+ * are transmitted and received in batches.
+ */
+START_TEST (test_batched_rw)
+{
+	// Length of the write/read (the whole of the mock machine's memory)
+	const size_t length = MM_MAX_RW;
+	
+	size_t i;
+	
+	// Connect to the mock machine with batching enabled
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 8;
+	opts.batch = true;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Set a buffer with some dummy data to write
+	unsigned char write_buf[length];
+	for (i = 0; i < length; i++)
+		write_buf[i] = (unsigned char)(i * 5);
+	uv_buf_t data;
+	data.base = (void *)write_buf;
+	data.len = length;
+	
+	uint32_t addr = (0u |  // Start at the start of memory
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Write the data, requiring every packet to be retransmitted once
+	rw_cb_data_t write_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	ck_assert(!rs_write(conn1,
+	                    (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                    0, // Send no duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &write_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(write_cb_data.generic_info.n_calls, 1);
+	ck_assert(!write_cb_data.error);
+	ck_assert(memcmp(rw->data, write_buf, length) == 0);
+	
+	// Read it back
+	unsigned char read_buf[length];
+	data.base = (void *)read_buf;
+	rw_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_read(conn1,
+	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                   2, // Send some duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(read_cb_data.generic_info.n_calls, 1);
+	ck_assert(!read_cb_data.error);
+	ck_assert(read_cb_data.data.len == length);
+	ck_assert(memcmp(read_buf, write_buf, length) == 0);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that the retransmission timeout adapts to the measured RTT when
+ * adaptive timeouts are enabled.
+ */
+START_TEST (test_adaptive_timeout)
+{
+	// A deliberately pessimistic upper bound on the timeout
+	const uint64_t timeout = 10 * TIMEOUT;
+	
+	// Lower bound on the timeout
+	const uint64_t min_timeout = 5;
+	
+	// Number of packets used to measure the RTT
+	const unsigned int n_packets = 8;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = timeout;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = N_OUTSTANDING;
+	opts.adaptive_timeout = true;
+	opts.min_timeout = min_timeout;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Send some packets which are responded to immediately
+	send_scp_cb_data_t cb_data[n_packets];
+	for (i = 0; i < n_packets; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_send_scp(conn1,
+		                       (1 << 8) | 1, // Respond after 1 msec and one attempt
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	for (i = 0; i < n_packets; i++)
+		ck_assert(!cb_data[i].error);
+	
+	// Make sure a lost packet is now retransmitted after a timeout far below the
+	// upper bound (though no shorter than the lower bound)
+	wait_for_cb((cb_data_t *)&(cb_data[0]));
+	ck_assert(!rs_send_scp(conn1,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &(cb_data[0])));
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	ck_assert(!cb_data[0].error);
+	ck_assert_int_ge(time_after - time_before, min_timeout);
+	ck_assert_int_lt(time_after - time_before, TIMEOUT);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that reads complete correctly when the window shrinks due to
+ * timeouts and grows again.
+ */
+START_TEST (test_dynamic_window)
+{
+	// Length of the read (the whole of the mock machine's memory)
+	const size_t length = MM_MAX_RW;
+	
+	size_t i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT / 10;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 8;
+	opts.dynamic_window = true;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++) {
+		rw->data[i] = (unsigned char)(i * 11);
+	}
+	
+	unsigned char data_buf[length];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	uint32_t addr = (0u |  // Start at the start of memory
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Read the data with every packet being lost once, then again without any
+	// losses
+	unsigned int attempts;
+	for (attempts = 2; attempts >= 1; attempts--) {
+		rw_cb_data_t cb_data;
+		wait_for_cb((cb_data_t *)&cb_data);
+		memset(data_buf, 0, length);
+		ck_assert(!rs_read(conn1,
+		                   (1 << 8) | attempts, // Respond after 1 msec
+		                   0, // Send no duplicates
+		                   addr,
+		                   data,
+		                   rw_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+		ck_assert(!cb_data.error);
+		ck_assert(memcmp(data_buf, rw->data, length) == 0);
+	}
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that a lost packet is retransmitted as soon as enough responses to
+ * later packets have arrived rather than waiting for its timeout.
+ */
+START_TEST (test_fast_retransmit)
+{
+	// A long timeout which should not be waited for
+	const uint64_t timeout = 10 * TIMEOUT;
+	
+	// Number of later packets to send after the lost packet
+	const unsigned int n_later = 3;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = timeout;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = n_later + 1;
+	opts.fast_retransmit = 2;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Send a packet which will be lost on its first transmission followed by
+	// some which won't be
+	send_scp_cb_data_t cb_data[n_later + 1];
+	for (i = 0; i < n_later + 1; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_send_scp(conn1,
+		                       (1 << 8) | (i == 0 ? 2 : 1), // Respond after 1 msec
+		                                                    // on the second attempt
+		                                                    // for the first packet
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &(cb_data[i])));
+	}
+	
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	
+	// All packets should have succeeded without waiting for the timeout
+	for (i = 0; i < n_later + 1; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+	}
+	ck_assert_int_lt(time_after - time_before, TIMEOUT);
+	
+	// Only the lost packet should have been retransmitted
+	ck_assert_uint_eq(mm_get_req(mm, 0)->n_tries, 2);
+	for (i = 1; i < n_later + 1; i++)
+		ck_assert_uint_eq(mm_get_req(mm, i)->n_tries, 1);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Make sure that connection statistics are gathered (if enabled) and can be
+ * reset.
+ */
+START_TEST (test_stats)
+{
+	unsigned int i;
+	rs_stats_t stats;
+	
+#ifndef RS_STATS
+	// Statistics not gathered
+	ck_assert(rs_get_stats(conn, &stats) == -1);
+	ck_assert_uint_eq(stats.n_packets_sent, 0);
+	return;
+#endif
+	
+	// Nothing has happened yet
+	ck_assert(!rs_get_stats(conn, &stats));
+	ck_assert_uint_eq(stats.n_packets_sent, 0);
+	ck_assert_uint_eq(stats.n_packets_received, 0);
+	ck_assert_uint_eq(stats.queue_depth, 0);
+	ck_assert_uint_eq(stats.window, N_OUTSTANDING);
+	ck_assert_uint_eq(stats.rto, TIMEOUT);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Send more packets than there are outstanding slots: the first is lost once,
+	// the others are not.
+	const unsigned int n_packets = N_OUTSTANDING + 2;
+	send_scp_cb_data_t cb_data[n_packets];
+	for (i = 0; i < n_packets; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_send_scp(conn,
+		                       (1 << 8) | (i == 0 ? 2 : 1), // Respond after 1 msec
+		                                                    // on the second attempt
+		                                                    // for the first packet
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &(cb_data[i])));
+	}
+	
+	// The excess packets should be queued
+	ck_assert(!rs_get_stats(conn, &stats));
+	ck_assert_uint_eq(stats.queue_depth, n_packets - N_OUTSTANDING);
+	ck_assert_uint_eq(stats.queue_depth_peak, n_packets - N_OUTSTANDING);
+	ck_assert_uint_eq(stats.n_active, N_OUTSTANDING);
+	
+	ck_assert(!wait_for_all_cb());
+	
+	ck_assert(!rs_get_stats(conn, &stats));
+	ck_assert_uint_eq(stats.n_packets_sent, n_packets + 1);
+	ck_assert_uint_eq(stats.n_bytes_sent,
+	                  (n_packets + 1) * (RS__SIZEOF_SCP_PACKET(0, 0) + 2));
+	ck_assert_uint_eq(stats.n_packets_received, n_packets);
+	ck_assert_uint_eq(stats.n_bytes_received,
+	                  n_packets * (RS__SIZEOF_SCP_PACKET(0, 0) + 2));
+	ck_assert_uint_eq(stats.n_retransmits_timeout, 1);
+	ck_assert_uint_eq(stats.n_retransmits_fast, 0);
+	ck_assert_uint_eq(stats.n_timeouts, 0);
+	ck_assert_uint_eq(stats.n_bad_rc, 0);
+	ck_assert_uint_eq(stats.queue_depth, 0);
+	ck_assert_uint_eq(stats.n_active, 0);
+	ck_assert(stats.mean_active >= 1.0);
+	ck_assert(stats.mean_active <= N_OUTSTANDING);
+	ck_assert(stats.srtt > 0);
+	
+	// Only the packets which were not retransmitted have RTTs measured
+	uint64_t n_rtts = 0;
+	for (i = 0; i < RS_STATS_RTT_BUCKETS; i++)
+		n_rtts += stats.rtt_histogram[i];
+	ck_assert_uint_eq(n_rtts, n_packets - 1);
+	
+	// No more responses arrived at once than there are receive buffers
+	ck_assert_uint_eq(stats.n_recv_pool_exhausted, 0);
+	
+	// Exhaust the receive buffer pool
+	rs__buf_pool_t *recv_pool = conn->recv_pool;
+	uv_buf_t recv_bufs[recv_pool->n_bufs + 1];
+	for (i = 0; i < recv_pool->n_bufs + 1; i++)
+		rs__buf_pool_alloc(recv_pool, &(recv_bufs[i]));
+	for (i = 0; i < recv_pool->n_bufs + 1; i++)
+		rs__buf_pool_release(recv_pool, recv_bufs[i].base);
+	ck_assert(!rs_get_stats(conn, &stats));
+	ck_assert_uint_eq(stats.n_recv_pool_exhausted, 1);
+	
+	// Resetting should clear the counters but not the RTT estimate
+	rs_reset_stats(conn);
+	ck_assert(!rs_get_stats(conn, &stats));
+	ck_assert_uint_eq(stats.n_packets_sent, 0);
+	ck_assert_uint_eq(stats.n_packets_received, 0);
+	ck_assert_uint_eq(stats.n_retransmits_timeout, 0);
+	ck_assert_uint_eq(stats.queue_depth_peak, 0);
+	ck_assert_uint_eq(stats.n_recv_pool_exhausted, 0);
+	ck_assert(stats.mean_active == 0.0);
+	ck_assert(stats.srtt > 0);
+	for (i = 0; i < RS_STATS_RTT_BUCKETS; i++)
+		ck_assert_uint_eq(stats.rtt_histogram[i], 0);
+}
+END_TEST
+
+/**
+ * Data recorded by trace_cb.
+ */
+#define MAX_TRACES 32
+typedef struct {
+	unsigned int n_traces;
+	rs_trace_t traces[MAX_TRACES];
+} trace_cb_data_t;
+
+
+void
+trace_cb(rs_conn_t *conn, const rs_trace_t *trace, void *cb_data)
+{
+	trace_cb_data_t *d = (trace_cb_data_t *)cb_data;
+	if (d->n_traces < MAX_TRACES)
+		d->traces[d->n_traces++] = *trace;
+}
+
+
+/**
+ * Make sure that the trace callback reports the lifecycle of a request.
+ */
+START_TEST (test_trace)
+{
+	unsigned int i;
+	
+	trace_cb_data_t trace_data;
+	trace_data.n_traces = 0;
+#ifndef RS_TRACE
+	// Tracing not available
+	ck_assert(rs_set_trace_cb(conn, trace_cb, &trace_data) == -1);
+	return;
+#endif
+	ck_assert(!rs_set_trace_cb(conn, trace_cb, &trace_data));
+	
+	// Create a callback which we'll wait on for a reply
+	send_scp_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Send a packet which must be retransmitted once
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!cb_data.error);
+	
+	// Stop tracing
+	ck_assert(!rs_set_trace_cb(conn, NULL, NULL));
+	
+	// Check the expected events were reported, in order
+	const rs_trace_event_t expected[] = {
+		RS_TRACE_ENQUEUE,
+		RS_TRACE_DISPATCH,
+		RS_TRACE_SENT,
+		RS_TRACE_TIMEOUT,
+		RS_TRACE_SENT,
+		RS_TRACE_RESPONSE,
+		RS_TRACE_COMPLETE,
+	};
+	const unsigned int n_expected = sizeof(expected) / sizeof(expected[0]);
+	ck_assert_uint_eq(trace_data.n_traces, n_expected);
+	for (i = 0; i < n_expected; i++) {
+		rs_trace_t *trace = &(trace_data.traces[i]);
+		ck_assert_int_eq(trace->event, expected[i]);
+		ck_assert_uint_eq(trace->request_id, trace_data.traces[0].request_id);
+		ck_assert_int_eq(trace->error, 0);
+		if (i > 0) {
+			ck_assert_int_eq(trace->seq_num, 0);
+			ck_assert_int_eq(trace->slot, 0);
+			ck_assert(trace->time >= trace_data.traces[i - 1].time);
+		} else {
+			ck_assert_int_eq(trace->seq_num, -1);
+			ck_assert_int_eq(trace->slot, -1);
+		}
+	}
+	
+	// The timeout should be about the right time after the first transmission
+	ck_assert(trace_data.traces[3].time - trace_data.traces[2].time >=
+	          (TIMEOUT - 1) * 1000000ull);
+	
+	// Check the exported trace format pairs requests up
+	char json[256];
+	ck_assert(rs_trace_to_json(&(trace_data.traces[0]), json, sizeof(json)) <
+	          sizeof(json));
+	ck_assert(strstr(json, "\"name\":\"request\""));
+	ck_assert(strstr(json, "\"ph\":\"b\""));
+	ck_assert(rs_trace_to_json(&(trace_data.traces[3]), json, sizeof(json)) <
+	          sizeof(json));
+	ck_assert(strstr(json, "\"name\":\"timeout\""));
+	ck_assert(strstr(json, "\"ph\":\"n\""));
+	ck_assert(rs_trace_to_json(&(trace_data.traces[6]), json, sizeof(json)) <
+	          sizeof(json));
+	ck_assert(strstr(json, "\"name\":\"request\""));
+	ck_assert(strstr(json, "\"ph\":\"e\""));
+}
+END_TEST
+
+
+/**
+ * Make sure that queued high priority requests are dispatched before queued
+ * normal priority ones and that invalid priorities are rejected.
+ */
+START_TEST (test_priority)
+{
+	// Number of normal priority packets to send
+	const unsigned int n_normal = N_OUTSTANDING + 2;
+	
+	unsigned int i;
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Queue up more normal priority packets than there are outstanding slots
+	// followed by a single high priority packet
+	send_scp_cb_data_t cb_data[n_normal + 1];
+	for (i = 0; i < n_normal + 1; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_send_scp_ex(conn,
+		                          (i < n_normal) ? RS_PRIORITY_NORMAL
+		                                         : RS_PRIORITY_HIGH,
+		                          (1 << 8) | 1, // Respond after 1 msec
+		                          0, // Send no duplicates
+		                          0, // An arbitrary cmd_rc
+		                          1, 1, i, 0, 0, // The packet num as an argument
+		                          data,
+		                          data.len,
+		                          send_scp_cb, &(cb_data[i])));
+	}
+	
+	// An invalid priority should be rejected
+	ck_assert(rs_send_scp_ex(conn, RS_N_PRIORITIES, 1, 0, 0, 0, 0, 0, 0, 0,
+	                         data, data.len, send_scp_cb, &(cb_data[0])));
+	
+	ck_assert(!wait_for_all_cb());
+	
+	for (i = 0; i < n_normal + 1; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+		ck_assert_uint_eq(cb_data[i].arg1, i);
+	}
+	
+	// The packets already in the outstanding slots are sent first, followed by
+	// the high priority packet and then the remaining normal priority packets.
+	for (i = 0; i < N_OUTSTANDING; i++)
+		ck_assert_uint_eq(UNPACK_RW_ADDR(mm_get_req(mm, i)->buf.base), i);
+	ck_assert_uint_eq(UNPACK_RW_ADDR(mm_get_req(mm, N_OUTSTANDING)->buf.base),
+	                  n_normal);
+	for (i = N_OUTSTANDING; i < n_normal; i++)
+		ck_assert_uint_eq(UNPACK_RW_ADDR(mm_get_req(mm, i + 1)->buf.base), i);
+}
+END_TEST
+
+/**
+ * Make sure that slots reserved for high priority requests are not used by
+ * normal priority requests.
+ */
+START_TEST (test_reserved_slots)
+{
+	// Delay before normal priority responses arrive
+	const unsigned int delay = 30;
+	
+	// Number of normal priority packets to send
+	const unsigned int n_normal = 3;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 2;
+	opts.n_reserved = 1;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Queue up some slow normal priority packets
+	send_scp_cb_data_t cb_data[n_normal];
+	for (i = 0; i < n_normal; i++)
+		ck_assert(!rs_send_scp(conn1,
+		                       (delay << 8) | 1, // Respond after a delay
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &(cb_data[i])));
+	
+	// The high priority packet should use the reserved slot immediately
+	send_scp_cb_data_t high_cb_data;
+	wait_for_cb((cb_data_t *)&high_cb_data);
+	ck_assert(!rs_send_scp_ex(conn1, RS_PRIORITY_HIGH,
+	                          (1 << 8) | 1, // Respond after 1 msec
+	                          0, // Send no duplicates
+	                          0, // An arbitrary cmd_rc
+	                          0, 0, 0, 0, 0, // No arguments
+	                          data,
+	                          data.len,
+	                          send_scp_cb, &high_cb_data));
+	for (i = 0; i < n_normal; i++)
+		cb_data[i].generic_info.n_calls = 0;
+	
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	
+	// The high priority packet should complete before any normal priority
+	// packet and should have been the second packet sent
+	ck_assert(!high_cb_data.error);
+	ck_assert_int_lt(time_after - time_before, delay);
+	for (i = 0; i < n_normal; i++)
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 0);
+	ck_assert_uint_eq(mm_get_req(mm, 1)->n_tries, 1);
+	
+	// The normal priority packets should complete one at a time since only one
+	// slot is available to them
+	for (i = 0; i < n_normal; i++)
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+	ck_assert(!wait_for_all_cb());
+	uv_update_time(loop);
+	time_after = uv_now(loop);
+	for (i = 0; i < n_normal; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+	}
+	ck_assert_int_ge(time_after - time_before, delay * n_normal);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Make sure that the packets of concurrent read requests are interleaved when
+ * requested. Test loop value:
+ *   0: No interleaving (the default)
+ *   1: Round-robin interleaving
+ *   2: Shortest remaining request first
+ */
+START_TEST (test_interleaved_rw)
+{
+	// Number of reads (the last is short)
+	const unsigned int n_reads = 3;
+	
+	// Number of packets required for the long reads
+	const unsigned int n_long_packets = 4;
+	
+	// Total number of packets to be sent
+	const unsigned int n_packets = ((n_reads - 1) * n_long_packets) + 1;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 1;
+	if (_i > 0)
+		opts.n_interleaved = n_reads;
+	opts.interleave_shortest_first = _i == 2;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Start the reads, each with its own rw ID
+	unsigned char data_buf[n_reads][MM_SCP_DATA_LENGTH * n_long_packets];
+	rw_cb_data_t cb_data[n_reads];
+	for (i = 0; i < n_reads; i++) {
+		uv_buf_t data;
+		data.base = (void *)data_buf[i];
+		data.len = (i < n_reads - 1) ? MM_SCP_DATA_LENGTH * n_long_packets
+		                             : MM_SCP_DATA_LENGTH;
+		uint32_t addr = (0u |  // Start at the start of memory
+		                 i<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_read(conn1,
+		                   (1 << 8) | 1, // Respond after 1 msec
+		                   0, // Send no duplicates
+		                   addr,
+		                   data,
+		                   rw_cb, &(cb_data[i])));
+	}
+	
+	ck_assert(!wait_for_all_cb());
+	
+	for (i = 0; i < n_reads; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+		ck_assert(memcmp(cb_data[i].data.base, mm_get_rw(mm, i)->data,
+		                 cb_data[i].data.len) == 0);
+	}
+	
+	// Find the order in which the packets of each read were sent
+	unsigned int first[n_reads];
+	unsigned int last[n_reads];
+	for (i = 0; i < n_reads; i++)
+		first[i] = n_packets;
+	for (i = 0; i < n_packets; i++) {
+		mm_req_t *req = mm_get_req(mm, i);
+		ck_assert(req);
+		unsigned int id = (UNPACK_RW_ADDR(req->buf.base) >> 10) & 0x3F;
+		ck_assert_uint_lt(id, n_reads);
+		if (first[id] == n_packets)
+			first[id] = i;
+		last[id] = i;
+	}
+	
+	switch (_i) {
+		case 0:
+			// Each read is completely sent before the next starts
+			for (i = 1; i < n_reads; i++)
+				ck_assert_uint_eq(first[i], last[i - 1] + 1);
+			break;
+		
+		case 1:
+			// Later reads are started before the first is complete
+			for (i = 1; i < n_reads; i++)
+				ck_assert_uint_lt(first[i], last[0]);
+			break;
+		
+		case 2:
+			// The short read overtakes the long reads as soon as the first packet
+			// is complete
+			ck_assert_uint_eq(first[n_reads - 1], 1);
+			break;
+	}
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Make sure that the number of packets in flight to a single destination is
+ * limited and that packets for other destinations overtake those which are
+ * held back.
+ */
+START_TEST (test_dest_limit)
+{
+	// Delay before the slow destination responds
+	const unsigned int delay = 20;
+	
+	// Number of packets to send to the slow destination
+	const unsigned int n_slow = 3;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = n_slow + 1;
+	opts.n_interleaved = n_slow + 1;
+	opts.max_in_flight_per_dest = 1;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Queue up several packets for one slow destination (the response delay
+	// forms part of the destination address) followed by a single packet for a
+	// fast destination.
+	send_scp_cb_data_t slow_cb_data[n_slow];
+	for (i = 0; i < n_slow; i++)
+		ck_assert(!rs_send_scp(conn1,
+		                       (delay << 8) | 1, // Respond after a delay
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &(slow_cb_data[i])));
+	send_scp_cb_data_t fast_cb_data;
+	wait_for_cb((cb_data_t *)&fast_cb_data);
+	ck_assert(!rs_send_scp(conn1,
+	                       (1 << 8) | 1, // Respond after 1 msec
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &fast_cb_data));
+	for (i = 0; i < n_slow; i++)
+		slow_cb_data[i].generic_info.n_calls = 0;
+	
+	// The fast destination's packet should be sent second, overtaking the slow
+	// destination's held-back packets, and should complete first
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!fast_cb_data.error);
+	for (i = 0; i < n_slow; i++)
+		ck_assert_uint_eq(slow_cb_data[i].generic_info.n_calls, 0);
+	sdp_scp_header_t *hdr = (sdp_scp_header_t *)mm_get_req(mm, 1)->buf.base;
+	ck_assert_uint_eq(hdr->dest_addr, (1 << 8) | 1);
+	
+	// The slow destination's packets should be sent one at a time
+	for (i = 0; i < n_slow; i++)
+		wait_for_cb((cb_data_t *)&(slow_cb_data[i]));
+	ck_assert(!wait_for_all_cb());
+	uv_update_time(loop);
+	uint64_t time_after = uv_now(loop);
+	for (i = 0; i < n_slow; i++) {
+		ck_assert_uint_eq(slow_cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!slow_cb_data[i].error);
+	}
+	ck_assert_int_ge(time_after - time_before, delay * n_slow);
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Callback data for pool-wide operations.
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	rs_pool_t *pool;
+	int error;
+	uint16_t cmd_rc;
+} pool_cb_data_t;
+
+
+void
+pool_cb(rs_pool_t *pool, int error, uint16_t cmd_rc, void *cb_data)
+{
+	pool_cb_data_t *d = (pool_cb_data_t *)cb_data;
+	d->pool = pool;
+	d->error = error;
+	d->cmd_rc = cmd_rc;
+	
+	d->generic_info.n_calls++;
+}
+
+
+void
+free_cb(void *cb_data)
+{
+	((cb_data_t *)cb_data)->n_calls++;
+}
+
+
+/**
+ * Make sure that a pool of connections routes requests to the board with the
+ * nearest Ethernet chip (or as explicitly mapped) and that regions on several
+ * boards can be read and written at once.
+ */
+START_TEST (test_pool)
+{
+	// Number of regions (one per board) and their length
+	const unsigned int n_regions = 2;
+	const size_t length = MM_SCP_DATA_LENGTH * 3;
+	
+	unsigned int i;
+	size_t j;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = N_OUTSTANDING;
+	rs_pool_t *pool = rs_pool_init(loop, &opts);
+	ck_assert(pool);
+	
+	// Nothing can be sent until boards are added
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	ck_assert(!rs_pool_conn(pool, 0));
+	ck_assert(rs_pool_read(pool, 0, 0, 0, data, rw_cb, NULL));
+	
+	// Add two "boards" (the usual mock machine and a second mock machine) whose
+	// Ethernet chips are at (0, 0) and (8, 0).
+	mm_t *mm1 = mm_init(loop);
+	ck_assert(mm1);
+	struct sockaddr_storage mm1_addr;
+	int namelen = sizeof(struct sockaddr_storage);
+	mm_getsockname(mm1, (struct sockaddr *)&mm1_addr, &namelen);
+	mm_t *mms[] = {mm, mm1};
+	ck_assert_int_eq(rs_pool_add_board(pool, (struct sockaddr *)&conn_addr,
+	                                   0u<<8 | 0u), 0);
+	ck_assert_int_eq(rs_pool_add_board(pool, (struct sockaddr *)&mm1_addr,
+	                                   8u<<8 | 0u), 1);
+	rs_conn_t *conn0 = rs_pool_conn(pool, 0u<<8 | 0u);
+	rs_conn_t *conn1 = rs_pool_conn(pool, 8u<<8 | 0u);
+	ck_assert(conn0 && conn1 && conn0 != conn1);
+	
+	// Chips are routed to the nearest Ethernet chip (note that the chip
+	// coordinates in the tests below also encode the mock machine's behaviour)
+	ck_assert(rs_pool_conn(pool, 1u<<8 | 1u) == conn0);
+	ck_assert(rs_pool_conn(pool, 8u<<8 | 1u) == conn1);
+	ck_assert(rs_pool_conn(pool, 5u<<8 | 1u) == conn1);
+	
+	// Unless explicitly mapped
+	ck_assert(rs_pool_map_chip(pool, 5u<<8 | 1u, 2));
+	ck_assert(!rs_pool_map_chip(pool, 5u<<8 | 1u, 0));
+	ck_assert(rs_pool_conn(pool, 5u<<8 | 1u) == conn0);
+	
+	// Write then read back one region on each board
+	unsigned char write_buf[n_regions][length];
+	unsigned char read_buf[n_regions][length];
+	rs_pool_region_t regions[n_regions];
+	for (i = 0; i < n_regions; i++) {
+		for (j = 0; j < length; j++)
+			write_buf[i][j] = (unsigned char)(i + j * 3);
+		
+		// Respond after 1 msec (via board 0) and 8 msec (via board 1)
+		regions[i].dest_addr = (i ? 8u : 1u)<<8 | 1u;
+		regions[i].dest_cpu = 0;
+		regions[i].address = (0u |  // Start at the start of memory
+		                      i<<10 |  // The RW ID
+		                      255u<<16 | // No errors
+		                      255u<<24); // Respond to all the same speed
+		regions[i].data.base = (void *)write_buf[i];
+		regions[i].data.len = length;
+	}
+	
+	pool_cb_data_t write_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	ck_assert(!rs_pool_write_regions(pool, n_regions, regions,
+	                                 pool_cb, &write_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(write_cb_data.generic_info.n_calls, 1);
+	ck_assert(write_cb_data.pool == pool);
+	ck_assert(!write_cb_data.error);
+	
+	for (i = 0; i < n_regions; i++) {
+		ck_assert(memcmp(mm_get_rw(mms[i], i)->data, write_buf[i], length) == 0);
+		regions[i].data.base = (void *)read_buf[i];
+	}
+	
+	pool_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_pool_read_regions(pool, n_regions, regions,
+	                                pool_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(read_cb_data.generic_info.n_calls, 1);
+	ck_assert(!read_cb_data.error);
+	for (i = 0; i < n_regions; i++)
+		ck_assert(memcmp(read_buf[i], write_buf[i], length) == 0);
+	
+#ifdef RS_STATS
+	// The statistics of both boards are combined
+	rs_stats_t stats;
+	ck_assert(!rs_pool_get_stats(pool, &stats));
+	ck_assert_uint_eq(stats.n_packets_sent,
+	                  2 * n_regions * (length / MM_SCP_DATA_LENGTH));
+	rs_pool_reset_stats(pool);
+	ck_assert(!rs_pool_get_stats(pool, &stats));
+	ck_assert_uint_eq(stats.n_packets_sent, 0);
+#endif
+	
+	cb_data_t pool_free_cb_data;
+	wait_for_cb(&pool_free_cb_data);
+	rs_pool_free(pool, free_cb, &pool_free_cb_data);
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(pool_free_cb_data.n_calls, 1);
+	
+	mm_free(mm1);
+}
+END_TEST
+
+
+
+/**
+ * Arguments for a thread submitting writes via rs_write_ts.
+ */
+typedef struct {
+	// The first RW ID to use (one per write)
+	unsigned int first_id;
+	
+	// The data to write and the callback data for each write
+	unsigned char (*bufs)[MM_SCP_DATA_LENGTH];
+	rw_cb_data_t *cb_data;
+} ts_writer_args_t;
+
+// Number of threads and writes per thread in test_thread_safe
+#define N_TS_THREADS 4
+#define N_TS_WRITES 4
+
+static void
+ts_writer(void *arg)
+{
+	ts_writer_args_t *args = (ts_writer_args_t *)arg;
+	unsigned int i;
+	for (i = 0; i < N_TS_WRITES; i++) {
+		uv_buf_t data;
+		data.base = (void *)args->bufs[i];
+		data.len = MM_SCP_DATA_LENGTH;
+		ck_assert(!rs_write_ts(conn, RS_PRIORITY_NORMAL,
+		                       1, 0,  // Respond to first attempt
+		                       (0u |  // Start at the start of memory
+		                        (args->first_id + i)<<10 |  // The RW ID
+		                        255u<<16 | // No errors
+		                        255u<<24), // Respond to all the same speed
+		                       data, rw_cb, &(args->cb_data[i])));
+	}
+}
+
+/**
+ * Check that requests may be submitted from several threads at once and that
+ * their callbacks are made on the loop thread.
+ */
+START_TEST (test_thread_safe)
+{
+	unsigned char bufs[N_TS_THREADS * N_TS_WRITES][MM_SCP_DATA_LENGTH];
+	rw_cb_data_t cb_data[N_TS_THREADS * N_TS_WRITES];
+	ts_writer_args_t args[N_TS_THREADS];
+	uv_thread_t threads[N_TS_THREADS];
+	unsigned int i, j;
+	
+	for (i = 0; i < N_TS_THREADS * N_TS_WRITES; i++) {
+		for (j = 0; j < MM_SCP_DATA_LENGTH; j++)
+			bufs[i][j] = (unsigned char)(i * 7 + j);
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+	}
+	
+	for (i = 0; i < N_TS_THREADS; i++) {
+		args[i].first_id = i * N_TS_WRITES;
+		args[i].bufs = &(bufs[i * N_TS_WRITES]);
+		args[i].cb_data = &(cb_data[i * N_TS_WRITES]);
+		ck_assert(!uv_thread_create(&(threads[i]), ts_writer, &(args[i])));
+	}
+	
+	// The callbacks all arrive on this thread's loop
+	ck_assert(!wait_for_all_cb());
+	for (i = 0; i < N_TS_THREADS; i++)
+		uv_thread_join(&(threads[i]));
+	
+	for (i = 0; i < N_TS_THREADS * N_TS_WRITES; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(cb_data[i].conn == conn);
+		ck_assert(!cb_data[i].error);
+		ck_assert(cb_data[i].data.base == (void *)bufs[i]);
+		ck_assert(memcmp(mm_get_rw(mm, i)->data, bufs[i],
+		                 MM_SCP_DATA_LENGTH) == 0);
+	}
+}
+END_TEST
+
+
+// The thread on which the most recent shard_rw_cb call was made
+static uv_thread_t shard_cb_thread;
+
+void
+shard_rw_cb(rs_conn_t *conn,
+            int error,
+            uint16_t cmd_rc,
+            uv_buf_t data,
+            void *cb_data)
+{
+	shard_cb_thread = uv_thread_self();
+	rw_cb(conn, error, cmd_rc, data, cb_data);
+}
+
+/**
+ * Check that connections in a shard each run on their own thread with the
+ * callbacks being delivered on the callback loop.
+ */
+START_TEST (test_shard)
+{
+	const size_t length = MM_SCP_DATA_LENGTH * 3;
+	unsigned int i;
+	
+	// A second "board" for the second thread's connection
+	mm_t *mm1 = mm_init(loop);
+	ck_assert(mm1);
+	struct sockaddr_storage mm1_addr;
+	int namelen = sizeof(struct sockaddr_storage);
+	mm_getsockname(mm1, (struct sockaddr *)&mm1_addr, &namelen);
+	mm_t *mms[] = {mm, mm1};
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = N_OUTSTANDING;
+	
+	rs_shard_t *shard = rs_shard_init(2, loop);
+	ck_assert(shard);
+	rs_conn_t *conns[2];
+	conns[0] = rs_shard_add_conn(shard, (struct sockaddr *)&conn_addr, &opts);
+	conns[1] = rs_shard_add_conn(shard, (struct sockaddr *)&mm1_addr, &opts);
+	ck_assert(conns[0] && conns[1]);
+	ck_assert(!rs_shard_start(shard));
+	
+	// Connections may not be added once started
+	ck_assert(!rs_shard_add_conn(shard, (struct sockaddr *)&conn_addr, &opts));
+	
+	// Read a block via each connection
+	unsigned char read_buf[2][length];
+	rw_cb_data_t cb_data[2];
+	for (i = 0; i < 2; i++) {
+		uv_buf_t data;
+		data.base = (void *)read_buf[i];
+		data.len = length;
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_read_ts(conns[i], RS_PRIORITY_NORMAL,
+		                      1, 0,  // Respond to first attempt
+		                      (0u |  // Start at the start of memory
+		                       i<<10 |  // The RW ID
+		                       255u<<16 | // No errors
+		                       255u<<24), // Respond to all the same speed
+		                      data, shard_rw_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	
+	uv_thread_t self = uv_thread_self();
+	ck_assert(uv_thread_equal(&shard_cb_thread, &self));
+	for (i = 0; i < 2; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(cb_data[i].conn == conns[i]);
+		ck_assert(!cb_data[i].error);
+		
+		ck_assert(memcmp(read_buf[i], mm_get_rw(mms[i], i)->data, length) == 0);
+	}
+	
+	// Requests incomplete when the shard is freed are reported as such before
+	// rs_shard_free returns (an unresponsive destination is used so the request
+	// is still outstanding).
+	rw_cb_data_t free_cb_data;
+	free_cb_data.generic_info.n_calls = 0;
+	uv_buf_t data;
+	data.base = (void *)read_buf[0];
+	data.len = length;
+	ck_assert(!rs_read_ts(conns[0], RS_PRIORITY_NORMAL,
+	                      0, 0,  // Never respond
+	                      (0u | 2u<<10 | 255u<<16 | 255u<<24),
+	                      data, rw_cb, &free_cb_data));
+	rs_shard_free(shard);
+	ck_assert_uint_eq(free_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(free_cb_data.error, RS_EFREE);
+	
+	mm_free(mm1);
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_readv/rs_writev callbacks (see rwv_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	int error;
+	unsigned int n_regions;
+	rs_region_t *regions;
+} rwv_cb_data_t;
+
+void
+rwv_cb(rs_conn_t *conn,
+       int error,
+       unsigned int n_regions,
+       rs_region_t *regions,
+       void *cb_data)
+{
+	rwv_cb_data_t *d = (rwv_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->n_regions = n_regions;
+	d->regions = regions;
+	
+	d->generic_info.n_calls++;
+}
+
+/**
+ * Check that vectored writes and reads complete with a single callback giving
+ * the outcome of each region.
+ */
+START_TEST (test_rwv)
+{
+	// Number of regions, the region which fails and each region's length
+	const unsigned int n_regions = 4;
+	const unsigned int bad_region = 2;
+	const size_t length = MM_SCP_DATA_LENGTH * 2 + 3;
+	
+	unsigned int i;
+	size_t j;
+	
+	unsigned char write_buf[n_regions][length];
+	unsigned char read_buf[n_regions][length];
+	rs_region_t regions[n_regions];
+	for (i = 0; i < n_regions; i++) {
+		for (j = 0; j < length; j++)
+			write_buf[i][j] = (unsigned char)(i * 5 + j);
+		
+		regions[i].dest_addr = 1;  // Respond to the first attempt
+		regions[i].dest_cpu = 0;
+		regions[i].address = (0u |  // Start at the start of memory
+		                      i<<10 |  // The RW ID
+		                      // Fail the first write of bad_region
+		                      (i == bad_region ? 0u : 255u)<<16 |
+		                      255u<<24); // Respond to all the same speed
+		regions[i].data.base = (void *)write_buf[i];
+		regions[i].data.len = length;
+	}
+	
+	rwv_cb_data_t write_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	ck_assert(!rs_writev(conn, n_regions, regions, rwv_cb, &write_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(write_cb_data.generic_info.n_calls, 1);
+	ck_assert(write_cb_data.conn == conn);
+	ck_assert_int_eq(write_cb_data.error, RS_EBAD_RC);
+	ck_assert_uint_eq(write_cb_data.n_regions, n_regions);
+	ck_assert(write_cb_data.regions == regions);
+	
+	// Only the bad region failed
+	for (i = 0; i < n_regions; i++) {
+		if (i == bad_region) {
+			ck_assert_int_eq(regions[i].error, RS_EBAD_RC);
+		} else {
+			ck_assert_int_eq(regions[i].error, 0);
+			ck_assert(memcmp(mm_get_rw(mm, i)->data, write_buf[i], length) == 0);
+		}
+	}
+	
+	// Read back the good regions
+	for (i = 0; i < n_regions - 1; i++) {
+		regions[i] = regions[i < bad_region ? i : i + 1];
+		regions[i].data.base = (void *)read_buf[i];
+	}
+	
+	rwv_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_readv(conn, n_regions - 1, regions, rwv_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(read_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(read_cb_data.error, 0);
+	for (i = 0; i < n_regions - 1; i++) {
+		ck_assert_int_eq(regions[i].error, 0);
+		ck_assert(memcmp(read_buf[i], write_buf[i < bad_region ? i : i + 1],
+		                 length) == 0);
+	}
+	
+	// An empty vector completes immediately
+	rwv_cb_data_t empty_cb_data;
+	empty_cb_data.generic_info.n_calls = 0;
+	ck_assert(!rs_readv(conn, 0, regions, rwv_cb, &empty_cb_data));
+	ck_assert_uint_eq(empty_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(empty_cb_data.error, 0);
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_read_stream callbacks (see read_stream_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// The ring of buffers (to check chunks are delivered within it)
+	unsigned int n_bufs;
+	uv_buf_t *bufs;
+	
+	// The data streamed so far, the number of chunks and the error reported
+	unsigned char *out;
+	size_t n_bytes;
+	unsigned int n_chunks;
+	int error;
+	bool last;
+} read_stream_cb_data_t;
+
+void
+read_stream_cb(rs_conn_t *conn,
+               int error,
+               uint16_t cmd_rc,
+               uint32_t offset,
+               uv_buf_t data,
+               bool last,
+               void *cb_data)
+{
+	read_stream_cb_data_t *d = (read_stream_cb_data_t *)cb_data;
+	
+	// Nothing arrives after the last call
+	ck_assert(!d->last);
+	d->last = last;
+	
+	if (error) {
+		ck_assert(last);
+		d->error = error;
+	} else {
+		// Chunks arrive in order and within the supplied buffers
+		ck_assert_uint_eq(offset, d->n_bytes);
+		bool in_ring = false;
+		unsigned int i;
+		for (i = 0; i < d->n_bufs; i++)
+			if ((char *)data.base == d->bufs[i].base &&
+			    data.len <= d->bufs[i].len)
+				in_ring = true;
+		ck_assert(in_ring);
+		
+		memcpy(d->out + offset, data.base, data.len);
+		d->n_bytes += data.len;
+		d->n_chunks++;
+	}
+	
+	if (last)
+		d->generic_info.n_calls++;
+}
+
+/**
+ * Check that streaming reads deliver the region in order using only the
+ * buffers supplied. Test 0 reads successfully, test 1 fails part way through.
+ */
+START_TEST (test_read_stream)
+{
+	// Number of buffers in the ring, the length of the region (not a multiple
+	// of the buffer size) and the response which fails in test 1.
+	const unsigned int n_bufs = 3;
+	const size_t length = MM_SCP_DATA_LENGTH * 10 + 5;
+	const unsigned int bad_response = 3;
+	
+	size_t i;
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++)
+		rw->data[i] = (unsigned char)(i * 3);
+	
+	unsigned char ring[n_bufs][MM_SCP_DATA_LENGTH];
+	uv_buf_t bufs[n_bufs];
+	for (i = 0; i < n_bufs; i++) {
+		bufs[i].base = (void *)ring[i];
+		bufs[i].len = MM_SCP_DATA_LENGTH;
+	}
+	
+	unsigned char out[length];
+	read_stream_cb_data_t cb_data;
+	cb_data.n_bufs = n_bufs;
+	cb_data.bufs = bufs;
+	cb_data.out = out;
+	cb_data.n_bytes = 0;
+	cb_data.n_chunks = 0;
+	cb_data.error = 0;
+	cb_data.last = false;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	uint32_t addr = (0u |  // Start at the start of memory
+	                 0u<<10 |  // The RW ID
+	                 (_i ? bad_response : 255u)<<16 |
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_read_stream(conn, 1, 0, addr, length, n_bufs, bufs,
+	                          read_stream_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.last);
+	
+	if (_i == 0) {
+		ck_assert_int_eq(cb_data.error, 0);
+		ck_assert_uint_eq(cb_data.n_bytes, length);
+		ck_assert_uint_eq(cb_data.n_chunks, 11);
+		ck_assert(memcmp(out, rw->data, length) == 0);
+	} else {
+		// The chunks before the failure still arrive
+		ck_assert_int_eq(cb_data.error, RS_EBAD_RC);
+		ck_assert_uint_eq(cb_data.n_chunks, bad_response);
+		ck_assert(memcmp(out, rw->data, cb_data.n_bytes) == 0);
+	}
+	
+	// Never more reads in flight than buffers
+	ck_assert_uint_le(rw->n_responses_sent, _i ? bad_response + n_bufs : 11);
+	
+	// An empty region completes immediately
+	cb_data.last = false;
+	cb_data.n_bytes = 0;
+	cb_data.generic_info.n_calls = 0;
+	ck_assert(!rs_read_stream(conn, 1, 0, addr, 0, n_bufs, bufs,
+	                          read_stream_cb, &cb_data));
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// No buffers is an error
+	ck_assert(rs_read_stream(conn, 1, 0, addr, length, 0, bufs,
+	                         read_stream_cb, &cb_data));
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_write_file/rs_read_file callbacks (see file_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	int error;
+	uint16_t cmd_rc;
+} file_cb_data_t;
+
+void
+file_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, void *cb_data)
+{
+	file_cb_data_t *d = (file_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->cmd_rc = cmd_rc;
+	
+	d->generic_info.n_calls++;
+}
+
+/**
+ * Check that regions can be written from and read into files.
+ */
+START_TEST (test_file)
+{
+	// Offset of the data within the files and the length of the region (several
+	// chunks long)
+	const int64_t file_offset = 7;
+	const size_t length = MM_MAX_RW - 24;
+	
+	size_t i;
+	
+	// A file containing some data to write
+	unsigned char data[length];
+	for (i = 0; i < length; i++)
+		data[i] = (unsigned char)(i * 11);
+	char src_name[] = "/tmp/test_rig_scp_XXXXXX";
+	int src_fd = mkstemp(src_name);
+	ck_assert_int_ge(src_fd, 0);
+	unlink(src_name);
+	ck_assert_int_eq(pwrite(src_fd, data, length, file_offset), length);
+	
+	uint32_t addr = (0u |  // Start at the start of memory
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	file_cb_data_t write_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	ck_assert(!rs_write_file(conn, 1, 0, addr, src_fd, file_offset, length,
+	                         file_cb, &write_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(write_cb_data.generic_info.n_calls, 1);
+	ck_assert(write_cb_data.conn == conn);
+	ck_assert_int_eq(write_cb_data.error, 0);
+	ck_assert(memcmp(mm_get_rw(mm, 0)->data, data, length) == 0);
+	
+	// Read it back into another file
+	char dst_name[] = "/tmp/test_rig_scp_XXXXXX";
+	int dst_fd = mkstemp(dst_name);
+	ck_assert_int_ge(dst_fd, 0);
+	unlink(dst_name);
+	
+	file_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_read_file(conn, 1, 0, addr, dst_fd, file_offset, length,
+	                        file_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(read_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(read_cb_data.error, 0);
+	
+	unsigned char read_back[length];
+	ck_assert_int_eq(pread(dst_fd, read_back, length, file_offset), length);
+	ck_assert(memcmp(read_back, data, length) == 0);
+	
+	// Writing more than the file contains fails
+	file_cb_data_t eof_cb_data;
+	wait_for_cb((cb_data_t *)&eof_cb_data);
+	ck_assert(!rs_write_file(conn, 1, 0, addr, src_fd, file_offset + 1, length,
+	                         file_cb, &eof_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(eof_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(eof_cb_data.error, UV_EOF);
+	
+	close(src_fd);
+	close(dst_fd);
+}
+END_TEST
+
+
+/**
+ * Check that small contiguous reads and writes queued while the window is full
+ * are merged into single packets when coalescing is enabled.
+ */
+START_TEST (test_coalesce)
+{
+	// The number and size of the small requests (one more than fits in a
+	// single packet)
+	const size_t part_len = 4;
+	const unsigned int n_parts = (MM_SCP_DATA_LENGTH / part_len) + 1;
+	const size_t length = n_parts * part_len;
+	
+	unsigned int i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 1;
+	opts.coalesce = true;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	unsigned char write_buf[length];
+	for (i = 0; i < length; i++)
+		write_buf[i] = (unsigned char)(i * 13);
+	unsigned char read_buf[length];
+	
+	// Fill the window with a request for another RW ID so that the small
+	// requests are queued
+	unsigned char filler[MM_SCP_DATA_LENGTH];
+	uv_buf_t data;
+	data.base = (void *)filler;
+	data.len = sizeof(filler);
+	rw_cb_data_t filler_cb_data;
+	wait_for_cb((cb_data_t *)&filler_cb_data);
+	ck_assert(!rs_write(conn1, 1, 0, (1u<<10 | 255u<<16 | 255u<<24), data,
+	                    rw_cb, &filler_cb_data));
+	
+	rw_cb_data_t cb_data[n_parts];
+	for (i = 0; i < n_parts; i++) {
+		data.base = (void *)(write_buf + i * part_len);
+		data.len = part_len;
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_write(conn1, 1, 0,
+		                    ((i * part_len) |  // Consecutive addresses
+		                     0u<<10 |  // The RW ID
+		                     255u<<16 | // No errors
+		                     255u<<24), // Respond to all the same speed
+		                    data, rw_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	
+	// Every request gets its own callback
+	for (i = 0; i < n_parts; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+		ck_assert(cb_data[i].data.base == (void *)(write_buf + i * part_len));
+		ck_assert_uint_eq(cb_data[i].data.len, part_len);
+	}
+	
+	// But only two packets were sent: one full one and one for the remainder
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	ck_assert_uint_eq(rw->n_responses_sent, 2);
+	ck_assert(memcmp(rw->data, write_buf, length) == 0);
+	
+	// Likewise when reading back
+	wait_for_cb((cb_data_t *)&filler_cb_data);
+	data.base = (void *)filler;
+	data.len = sizeof(filler);
+	ck_assert(!rs_read(conn1, 1, 0, (1u<<10 | 255u<<16 | 255u<<24), data,
+	                   rw_cb, &filler_cb_data));
+	for (i = 0; i < n_parts; i++) {
+		data.base = (void *)(read_buf + i * part_len);
+		data.len = part_len;
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_read(conn1, 1, 0,
+		                   ((i * part_len) | 0u<<10 | 255u<<16 | 255u<<24),
+		                   data, rw_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	for (i = 0; i < n_parts; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+	}
+	ck_assert_uint_eq(rw->n_responses_sent, 4);
+	ck_assert(memcmp(read_buf, write_buf, length) == 0);
+	
+#ifdef RS_STATS
+	rs_stats_t stats;
+	ck_assert(!rs_get_stats(conn1, &stats));
+	ck_assert_uint_eq(stats.n_coalesced, 2 * (n_parts - 2));
+#endif
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_fill callbacks (see fill_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	int error;
+	uint16_t cmd_rc;
+} fill_cb_data_t;
+
+void
+fill_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, void *cb_data)
+{
+	fill_cb_data_t *d = (fill_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->cmd_rc = cmd_rc;
+	
+	d->generic_info.n_calls++;
+}
+
+/**
+ * Check that rs_fill fills regions (aligned or otherwise) using a single
+ * CMD_FILL for the aligned part. The loop index selects the start offset.
+ */
+START_TEST (test_fill)
+{
+	// Fill a region starting at various alignments which is not a whole number
+	// of words long (and surrounded by untouched bytes)
+	const uint32_t offset = 8 + _i;
+	const size_t length = MM_SCP_DATA_LENGTH * 20 + 2;
+	const uint32_t value = 0xDEADBEEF;
+	
+	size_t i;
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < MM_MAX_RW; i++)
+		rw->data[i] = 0x55;
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	fill_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_fill(conn, 1, 0, addr, length, value, fill_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert_int_eq(cb_data.error, 0);
+	
+	// The region (and only the region) is filled
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + length)
+			ck_assert_uint_eq((uint8_t)rw->data[i],
+			                  (uint8_t)(value >> (8 * (i % 4))));
+		else
+			ck_assert_uint_eq((uint8_t)rw->data[i], 0x55);
+	}
+	
+	// Only a few packets were required: one CMD_FILL plus a write for the head
+	// (if unaligned) and tail (if any).
+	unsigned int n_packets = 1 + (offset % 4 ? 1 : 0) +
+	                         ((offset + length) % 4 ? 1 : 0);
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	
+	// Fill errors are reported
+	fill_cb_data_t bad_cb_data;
+	wait_for_cb((cb_data_t *)&bad_cb_data);
+	ck_assert(!rs_fill(conn, 1, 0, (0u | 1u<<10 | 0u<<16 | 255u<<24), 64,
+	                   value, fill_cb, &bad_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(bad_cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(bad_cb_data.error, RS_EBAD_RC);
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_write_multi callbacks (see write_multi_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	int error;
+	unsigned int n_failed;
+	unsigned int n_targets;
+	rs_target_t *targets;
+} write_multi_cb_data_t;
+
+void
+write_multi_cb(rs_conn_t *conn,
+               int error,
+               unsigned int n_failed,
+               unsigned int n_targets,
+               rs_target_t *targets,
+               void *cb_data)
+{
+	write_multi_cb_data_t *d = (write_multi_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->n_failed = n_failed;
+	d->n_targets = n_targets;
+	d->targets = targets;
+	
+	d->generic_info.n_calls++;
+}
+
+/**
+ * Check that rs_write_multi writes the same data to every target, reporting
+ * the targets which failed.
+ */
+START_TEST (test_write_multi)
+{
+	// The mock machine stores writes by RW ID regardless of the destination so
+	// every target writes into the same block: the destinations just select
+	// how (and whether) each target responds.
+	const size_t n_chunks = 5;
+	const size_t length = MM_SCP_DATA_LENGTH * (n_chunks - 1) + 3;
+	
+	size_t i;
+	
+	uv_buf_t data;
+	data.len = length;
+	data.base = malloc(length);
+	ck_assert(data.base);
+	for (i = 0; i < length; i++)
+		data.base[i] = (char)(i * 7);
+	
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	rs_target_t targets[4];
+	targets[0].dest_addr = 1;      // Respond immediately
+	targets[0].dest_cpu = 1;
+	targets[1].dest_addr = 1u<<8 | 1; // Respond after a delay
+	targets[1].dest_cpu = 2;
+	targets[2].dest_addr = 0;      // Never respond
+	targets[2].dest_cpu = 3;
+	targets[3].dest_addr = 2u<<8 | 1; // Respond after a longer delay
+	targets[3].dest_cpu = 4;
+	
+	write_multi_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_write_multi(conn, 4, targets, addr, data,
+	                          write_multi_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert_int_eq(cb_data.error, RS_ETIMEOUT);
+	ck_assert_uint_eq(cb_data.n_failed, 1);
+	ck_assert_uint_eq(cb_data.n_targets, 4);
+	ck_assert(cb_data.targets == targets);
+	
+	// Only the silent target failed
+	ck_assert_int_eq(targets[0].error, 0);
+	ck_assert_int_eq(targets[1].error, 0);
+	ck_assert_int_eq(targets[2].error, RS_ETIMEOUT);
+	ck_assert_int_eq(targets[3].error, 0);
+	
+	// The data arrived intact
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	ck_assert(memcmp(rw->data, data.base, length) == 0);
+	
+	// Every chunk was written to each responding target while the silent target
+	// was given up on after its first chunk.
+	ck_assert_uint_eq(rw->n_responses_sent, n_chunks * 3);
+	
+	// Writing to no targets completes immediately
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_write_multi(conn, 0, targets, addr, data,
+	                          write_multi_cb, &cb_data));
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert_int_eq(cb_data.error, 0);
+	ck_assert_uint_eq(cb_data.n_failed, 0);
+	
+	free(data.base);
+}
+END_TEST
+
+
+/**
+ * Callback data for requests whose completion order is recorded (see
+ * ordered_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	int error;
+	
+	// The number of ordered_cb calls made before this one
+	unsigned int order;
+} ordered_cb_data_t;
+
+static unsigned int n_ordered_cbs;
+
+void
+ordered_scp_cb(rs_conn_t *conn,
+               int error,
+               uint16_t cmd_rc,
+               unsigned int n_args,
+               uint32_t arg1,
+               uint32_t arg2,
+               uint32_t arg3,
+               uv_buf_t data,
+               void *cb_data)
+{
+	ordered_cb_data_t *d = (ordered_cb_data_t *)cb_data;
+	d->error = error;
+	d->order = n_ordered_cbs++;
+	
+	d->generic_info.n_calls++;
+}
+
+void
+ordered_rw_cb(rs_conn_t *conn,
+              int error,
+              uint16_t cmd_rc,
+              uv_buf_t data,
+              void *cb_data)
+{
+	ordered_cb_data_t *d = (ordered_cb_data_t *)cb_data;
+	d->error = error;
+	d->order = n_ordered_cbs++;
+	
+	d->generic_info.n_calls++;
+}
+
+/**
+ * Check that requests queued after a fence are only dispatched once those
+ * before it have completed and are cancelled if any of those failed.
+ */
+START_TEST (test_fence)
+{
+	uv_buf_t empty;
+	empty.base = NULL;
+	empty.len = 0;
+	
+	char write_data[MM_SCP_DATA_LENGTH * 2];
+	uv_buf_t write_buf;
+	write_buf.base = write_data;
+	write_buf.len = sizeof(write_data);
+	memset(write_data, 0xAB, sizeof(write_data));
+	
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// A slow write followed by a fence and a quick packet: the packet is not
+	// sent until the write has completed.
+	ordered_cb_data_t cb_data[4];
+	n_ordered_cbs = 0;
+	wait_for_cb((cb_data_t *)&(cb_data[0]));
+	ck_assert(!rs_write(conn, 20u<<8 | 1, 0, addr, write_buf,
+	                    ordered_rw_cb, &(cb_data[0])));
+	ck_assert(!rs_fence(conn));
+	wait_for_cb((cb_data_t *)&(cb_data[1]));
+	ck_assert(!rs_send_scp(conn, 1, 0, 0, 0, 0, 0, 0, 0, empty, 0,
+	                       ordered_scp_cb, &(cb_data[1])));
+	ck_assert(!rs_fence(conn));
+	wait_for_cb((cb_data_t *)&(cb_data[2]));
+	ck_assert(!rs_send_scp(conn, 1, 0, 0, 0, 0, 0, 0, 0, empty, 0,
+	                       ordered_scp_cb, &(cb_data[2])));
+	ck_assert(!wait_for_all_cb());
+	
+	unsigned int i;
+	for (i = 0; i < 3; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert_int_eq(cb_data[i].error, 0);
+		ck_assert_uint_eq(cb_data[i].order, i);
+	}
+	
+	// A failure before a fence cancels the requests after it and those after
+	// any subsequent fence
+	n_ordered_cbs = 0;
+	wait_for_cb((cb_data_t *)&(cb_data[0]));
+	ck_assert(!rs_send_scp(conn, 0, 0, 0, 0, 0, 0, 0, 0, empty, 0, // No reply
+	                       ordered_scp_cb, &(cb_data[0])));
+	ck_assert(!rs_fence(conn));
+	wait_for_cb((cb_data_t *)&(cb_data[1]));
+	ck_assert(!rs_write(conn, 1, 0, addr, write_buf,
+	                    ordered_rw_cb, &(cb_data[1])));
+	wait_for_cb((cb_data_t *)&(cb_data[2]));
+	ck_assert(!rs_send_scp(conn, 1, 0, 0, 0, 0, 0, 0, 0, empty, 0,
+	                       ordered_scp_cb, &(cb_data[2])));
+	ck_assert(!rs_fence(conn));
+	wait_for_cb((cb_data_t *)&(cb_data[3]));
+	ck_assert(!rs_send_scp(conn, 1, 0, 0, 0, 0, 0, 0, 0, empty, 0,
+	                       ordered_scp_cb, &(cb_data[3])));
+	ck_assert(!wait_for_all_cb());
+	
+	ck_assert_int_eq(cb_data[0].error, RS_ETIMEOUT);
+	for (i = 1; i < 4; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert_int_eq(cb_data[i].error, RS_EFENCE);
+		ck_assert_uint_eq(cb_data[i].order, i);
+	}
+	
+	// None of the cancelled requests were sent (only the first write)
+	ck_assert_uint_eq(mm_get_rw(mm, 0)->n_responses_sent, 2);
+	
+	// The failure is forgotten once the connection is idle
+	wait_for_cb((cb_data_t *)&(cb_data[0]));
+	ck_assert(!rs_fence(conn));
+	ck_assert(!rs_send_scp(conn, 1, 0, 0, 0, 0, 0, 0, 0, empty, 0,
+	                       ordered_scp_cb, &(cb_data[0])));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_int_eq(cb_data[0].error, 0);
+	
+	ck_assert(!strcmp(rs_err_name(RS_EFENCE), "RS_EFENCE"));
+}
+END_TEST
+
+
+/**
+ * Check that read/write packets receiving a response code listed in retry_rcs
+ * are retried rather than failing the request. The loop index selects whether
+ * the mock machine's error code (0) is retryable (0), whether it is not (1) or
+ * whether it is but no attempts remain (2).
+ */
+START_TEST (test_retry_rc)
+{
+	// Length of the write/read (several packets)
+	const size_t length = MM_SCP_DATA_LENGTH * 4;
+	
+	size_t i;
+	
+	const uint16_t retry_rcs[] = {0};
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = (_i == 2) ? 1 : N_TRIES;
+	opts.n_outstanding = N_OUTSTANDING;
+	if (_i == 1) {
+		opts.retry_rcs = rs_transient_rcs;
+		opts.n_retry_rcs = rs_n_transient_rcs;
+	} else {
+		opts.retry_rcs = retry_rcs;
+		opts.n_retry_rcs = 1;
+	}
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++)
+		rw->data[i] = (char)i;
+	
+	char read_data[length];
+	uv_buf_t read_buf;
+	read_buf.base = read_data;
+	read_buf.len = length;
+	memset(read_data, 0, length);
+	
+	// Read with the third response being an error
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 2u<<16 |  // Error on the third response
+	                 255u<<24); // Respond to all the same speed
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_read(conn1, 1, 0, addr, read_buf, rw_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	if (_i == 0) {
+		// The failed packet was retried (once) and the read succeeded
+		ck_assert_int_eq(cb_data.error, 0);
+		ck_assert(memcmp(read_data, rw->data, length) == 0);
+		ck_assert_uint_eq(rw->n_responses_sent, length / MM_SCP_DATA_LENGTH + 1);
+	} else {
+		ck_assert_int_eq(cb_data.error, RS_EBAD_RC);
+		ck_assert_uint_eq(cb_data.cmd_rc, 0);
+	}
+	
+#ifdef RS_STATS
+	rs_stats_t stats;
+	rs_get_stats(conn1, &stats);
+	ck_assert_uint_eq(stats.n_retries_rc, (_i == 0) ? 1 : 0);
+	ck_assert_uint_eq(stats.n_bad_rc, (_i == 0) ? 0 : 1);
+#endif
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Callback data for rs_set_drain_cb callbacks (see drain_cb).
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	rs_priority_t priority;
+	
+	// The number of requests completed (see drain_scp_cb) when called
+	unsigned int n_completed;
+} drain_cb_data_t;
+
+static unsigned int n_drain_completed;
+
+void
+drain_cb(rs_conn_t *conn, rs_priority_t priority, void *cb_data)
+{
+	drain_cb_data_t *d = (drain_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->priority = priority;
+	d->n_completed = n_drain_completed;
+	
+	d->generic_info.n_calls++;
+}
+
+void
+drain_scp_cb(rs_conn_t *conn,
+             int error,
+             uint16_t cmd_rc,
+             unsigned int n_args,
+             uint32_t arg1,
+             uint32_t arg2,
+             uint32_t arg3,
+             uv_buf_t data,
+             void *cb_data)
+{
+	n_drain_completed++;
+	send_scp_cb(conn, error, cmd_rc, n_args, arg1, arg2, arg3, data, cb_data);
+}
+
+/**
+ * Check that a bounded request queue rejects requests once full and that the
+ * drain callback is called once it has drained to the low-water mark.
+ */
+START_TEST (test_queue_full)
+{
+	const size_t max_queue_length = 4;
+	const size_t queue_low_water = 1;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = MM_SCP_DATA_LENGTH;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 1;
+	opts.max_queue_length = max_queue_length;
+	opts.queue_low_water = queue_low_water;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	drain_cb_data_t drain_cb_data;
+	wait_for_cb((cb_data_t *)&drain_cb_data);
+	rs_set_drain_cb(conn1, drain_cb, &drain_cb_data);
+	
+	uv_buf_t empty;
+	empty.base = NULL;
+	empty.len = 0;
+	
+	// One packet is dispatched immediately, the rest fill the queue
+	n_drain_completed = 0;
+	unsigned int i;
+	send_scp_cb_data_t cb_data[max_queue_length + 1];
+	for (i = 0; i < max_queue_length + 1; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_send_scp(conn1, 1u<<8 | 1, 0, 0, 1, 1, i, 0, 0,
+		                       empty, 0, drain_scp_cb, &(cb_data[i])));
+	}
+	
+	// Further requests (including fences) are rejected with a distinct error
+	send_scp_cb_data_t rejected_cb_data;
+	rejected_cb_data.generic_info.n_calls = 0;
+	ck_assert_int_eq(rs_send_scp(conn1, 1, 0, 0, 1, 1, 0, 0, 0, empty, 0,
+	                             send_scp_cb, &rejected_cb_data), RS_EFULL);
+	ck_assert_int_eq(rs_write(conn1, 1, 0, 0, empty,
+	                          rw_cb, &rejected_cb_data), RS_EFULL);
+	ck_assert_int_eq(rs_fence(conn1), RS_EFULL);
+	
+	// High priority requests have a queue of their own
+	ck_assert(!rs_send_scp_ex(conn1, RS_PRIORITY_HIGH, 1, 0, 0, 1, 1, 0, 0, 0,
+	                          empty, 0, send_scp_cb, &rejected_cb_data));
+	wait_for_cb((cb_data_t *)&rejected_cb_data);
+	
+	ck_assert(!wait_for_all_cb());
+	for (i = 0; i < max_queue_length + 1; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert_int_eq(cb_data[i].error, 0);
+		ck_assert_uint_eq(cb_data[i].arg1, i);
+	}
+	
+	// The drain callback was called (once) when the queue fell to the low-water
+	// mark, i.e. with all but the last queue_low_water queued requests (and the
+	// one in flight) complete.
+	ck_assert_uint_eq(drain_cb_data.generic_info.n_calls, 1);
+	ck_assert(drain_cb_data.conn == conn1);
+	ck_assert_int_eq(drain_cb_data.priority, RS_PRIORITY_NORMAL);
+	ck_assert_uint_eq(drain_cb_data.n_completed,
+	                  max_queue_length - queue_low_water);
+	
+	ck_assert(!strcmp(rs_err_name(RS_EFULL), "RS_EFULL"));
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Check that the internal producers of requests (rs_write_multi (_i == 0),
+ * rs_read_stream (_i == 1), rs_write_file/rs_read_file (_i == 2), rs_writev
+ * (_i == 3), rs_fill (_i == 4) and rs_pool_write_regions (_i == 5)) wait for
+ * room when the request queue is too short for everything they queue at once
+ * rather than failing, and that rs_fill reports RS_EFULL if it can't start.
+ */
+START_TEST (test_queue_full_producers)
+{
+	// A short SCP data length (so that the transfers take many packets) and a
+	// request queue much shorter than any of them would fill.
+	const size_t scp_data_length = 8;
+	
+	size_t i;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = scp_data_length;
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = (_i == 4) ? 1 : 16;
+	opts.max_queue_length = 1;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	if (_i == 0) {
+		const size_t n_chunks = 10;
+		const unsigned int n_targets = 4;
+		
+		unsigned char buf[n_chunks * scp_data_length];
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 7);
+		uv_buf_t data;
+		data.base = (void *)buf;
+		data.len = sizeof(buf);
+		
+		rs_target_t targets[n_targets];
+		for (i = 0; i < n_targets; i++) {
+			targets[i].dest_addr = 1;  // Respond immediately
+			targets[i].dest_cpu = i + 1;
+		}
+		
+		write_multi_cb_data_t cb_data;
+		wait_for_cb((cb_data_t *)&cb_data);
+		ck_assert(!rs_write_multi(conn1, n_targets, targets, addr, data,
+		                          write_multi_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_int_eq(cb_data.error, 0);
+		ck_assert_uint_eq(cb_data.n_failed, 0);
+		ck_assert_uint_eq(rw->n_responses_sent, n_chunks * n_targets);
+		ck_assert(memcmp(rw->data, buf, sizeof(buf)) == 0);
+	} else if (_i == 1) {
+		const unsigned int n_bufs = 24;
+		const size_t length = scp_data_length * 40;
+		
+		for (i = 0; i < length; i++)
+			rw->data[i] = (unsigned char)(i * 3);
+		
+		unsigned char ring[n_bufs][scp_data_length];
+		uv_buf_t bufs[n_bufs];
+		for (i = 0; i < n_bufs; i++) {
+			bufs[i].base = (void *)ring[i];
+			bufs[i].len = scp_data_length;
+		}
+		
+		unsigned char out[length];
+		read_stream_cb_data_t cb_data;
+		cb_data.n_bufs = n_bufs;
+		cb_data.bufs = bufs;
+		cb_data.out = out;
+		cb_data.n_bytes = 0;
+		cb_data.n_chunks = 0;
+		cb_data.error = 0;
+		cb_data.last = false;
+		wait_for_cb((cb_data_t *)&cb_data);
+		ck_assert(!rs_read_stream(conn1, 1, 0, addr, length, n_bufs, bufs,
+		                          read_stream_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_int_eq(cb_data.error, 0);
+		ck_assert_uint_eq(cb_data.n_bytes, length);
+		ck_assert(memcmp(out, rw->data, length) == 0);
+	} else if (_i == 2) {
+		const size_t length = MM_MAX_RW - 24;
+		
+		unsigned char data[length];
+		for (i = 0; i < length; i++)
+			data[i] = (unsigned char)(i * 11);
+		char src_name[] = "/tmp/test_rig_scp_XXXXXX";
+		int src_fd = mkstemp(src_name);
+		ck_assert_int_ge(src_fd, 0);
+		unlink(src_name);
+		ck_assert_int_eq(pwrite(src_fd, data, length, 0), length);
+		
+		file_cb_data_t write_cb_data;
+		wait_for_cb((cb_data_t *)&write_cb_data);
+		ck_assert(!rs_write_file(conn1, 1, 0, addr, src_fd, 0, length,
+		                         file_cb, &write_cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_int_eq(write_cb_data.error, 0);
+		ck_assert(memcmp(rw->data, data, length) == 0);
+		
+		char dst_name[] = "/tmp/test_rig_scp_XXXXXX";
+		int dst_fd = mkstemp(dst_name);
+		ck_assert_int_ge(dst_fd, 0);
+		unlink(dst_name);
+		
+		file_cb_data_t read_cb_data;
+		wait_for_cb((cb_data_t *)&read_cb_data);
+		ck_assert(!rs_read_file(conn1, 1, 0, addr, dst_fd, 0, length,
+		                        file_cb, &read_cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_int_eq(read_cb_data.error, 0);
+		
+		unsigned char read_back[length];
+		ck_assert_int_eq(pread(dst_fd, read_back, length, 0), length);
+		ck_assert(memcmp(read_back, data, length) == 0);
+		
+		close(src_fd);
+		close(dst_fd);
+	} else if (_i == 3 || _i == 5) {
+		const unsigned int n_regions = 32;
+		
+		unsigned char buf[n_regions * scp_data_length];
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 13);
+		
+		if (_i == 3) {
+			rs_region_t regions[n_regions];
+			for (i = 0; i < n_regions; i++) {
+				regions[i].dest_addr = 1;  // Respond immediately
+				regions[i].dest_cpu = 0;
+				regions[i].address = addr + i * scp_data_length;
+				regions[i].data.base = (void *)(buf + i * scp_data_length);
+				regions[i].data.len = scp_data_length;
+			}
+			
+			rwv_cb_data_t cb_data;
+			wait_for_cb((cb_data_t *)&cb_data);
+			ck_assert(!rs_writev(conn1, n_regions, regions, rwv_cb, &cb_data));
+			ck_assert(!wait_for_all_cb());
+			ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+			ck_assert_int_eq(cb_data.error, 0);
+		} else {
+			rs_pool_t *pool = rs_pool_init(loop, &opts);
+			ck_assert(pool);
+			ck_assert_int_eq(rs_pool_add_board(pool, (struct sockaddr *)&conn_addr,
+			                                   0u<<8 | 0u), 0);
+			
+			rs_pool_region_t regions[n_regions];
+			for (i = 0; i < n_regions; i++) {
+				regions[i].dest_addr = 1;  // Respond immediately
+				regions[i].dest_cpu = 0;
+				regions[i].address = addr + i * scp_data_length;
+				regions[i].data.base = (void *)(buf + i * scp_data_length);
+				regions[i].data.len = scp_data_length;
+			}
+			
+			pool_cb_data_t cb_data;
+			wait_for_cb((cb_data_t *)&cb_data);
+			ck_assert(!rs_pool_write_regions(pool, n_regions, regions,
+			                                 pool_cb, &cb_data));
+			ck_assert(!wait_for_all_cb());
+			ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+			ck_assert_int_eq(cb_data.error, 0);
+			
+			rs_pool_free(pool, NULL, NULL);
+		}
+		
+		ck_assert_uint_eq(rw->n_responses_sent, n_regions);
+		ck_assert(memcmp(rw->data, buf, sizeof(buf)) == 0);
+	} else {
+		// Fill the window and the queue: a fill can't be started at all
+		uv_buf_t empty;
+		empty.base = NULL;
+		empty.len = 0;
+		send_scp_cb_data_t scp_cb_data[2];
+		for (i = 0; i < 2; i++) {
+			wait_for_cb((cb_data_t *)&(scp_cb_data[i]));
+			ck_assert(!rs_send_scp(conn1, (1 << 8) | 1, // Respond after 1 msec
+			                       0, 0, 0, 0, 0, 0, 0, empty, 0,
+			                       send_scp_cb, &(scp_cb_data[i])));
+		}
+		fill_cb_data_t full_cb_data;
+		full_cb_data.generic_info.n_calls = 0;
+		ck_assert_int_eq(rs_fill(conn1, 1, 0, addr, 8, 0, fill_cb, &full_cb_data),
+		                 RS_EFULL);
+		ck_assert(!wait_for_all_cb());
+		ck_assert_uint_eq(full_cb_data.generic_info.n_calls, 0);
+		
+		// With an unaligned head and tail the fill takes three requests, more
+		// than the window and queue hold at once
+		const uint32_t offset = 1;
+		const size_t length = 30;
+		const uint32_t value = 0xDEADBEEF;
+		for (i = 0; i < MM_MAX_RW; i++)
+			rw->data[i] = 0x55;
+		
+		fill_cb_data_t cb_data;
+		wait_for_cb((cb_data_t *)&cb_data);
+		ck_assert(!rs_fill(conn1, 1, 0, addr + offset, length, value,
+		                   fill_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+		ck_assert_int_eq(cb_data.error, 0);
+		for (i = 0; i < offset + length + 4; i++) {
+			if (i >= offset && i < offset + length)
+				ck_assert_uint_eq((uint8_t)rw->data[i],
+				                  (uint8_t)(value >> (8 * (i % 4))));
+			else
+				ck_assert_uint_eq((uint8_t)rw->data[i], 0x55);
+		}
+	}
+	
+	rs_free(conn1, NULL, NULL);
+}
+END_TEST
+
+/**
+ * Check that the SCP data length is discovered from the machine's CMD_VER
+ * response before any read/write is dispatched (_i == 0) and that the
+ * provisional length is kept should the probe go unanswered (_i == 1) or
+ * report a length which is too short (_i == 2) or too long (_i == 3).
+ */
+START_TEST (test_scp_data_length_auto)
+{
+	// Length of the write/read: several packets if the length is discovered but
+	// a single packet of the provisional length otherwise.
+	const size_t length = (_i == 0) ? MM_SCP_DATA_LENGTH * 3
+	                                : MM_SCP_DATA_LENGTH;
+	
+	size_t i;
+	
+	mm->respond_to_ver = true;
+	if (_i == 2)
+		mm->ver_scp_data_length = 2;
+	else if (_i == 3)
+		mm->ver_scp_data_length = 0xFFFF;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = RS_SCP_DATA_LENGTH_AUTO;
+	opts.probe_dest_addr = (_i == 1) ? 0 : 1; // Respond never or first time
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = N_OUTSTANDING;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	// The provisional length is used until the probe completes
+	ck_assert_uint_eq(rs_get_scp_data_length(conn1), 256);
+	
+	char write_data[length];
+	char read_data[length];
+	for (i = 0; i < length; i++)
+		write_data[i] = (char)i;
+	memset(read_data, 0, length);
+	uv_buf_t write_buf;
+	write_buf.base = write_data;
+	write_buf.len = length;
+	uv_buf_t read_buf;
+	read_buf.base = read_data;
+	read_buf.len = length;
+	
+	// Queue a write and read immediately: had they been dispatched with the
+	// provisional length, the mock machine would have received packets too
+	// large for it.
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	rw_cb_data_t write_cb_data;
+	rw_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_write(conn1, 1, 0, addr, write_buf, rw_cb, &write_cb_data));
+	ck_assert(!rs_read(conn1, 1, 0, addr, read_buf, rw_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	ck_assert_int_eq(write_cb_data.error, 0);
+	ck_assert_int_eq(read_cb_data.error, 0);
+	ck_assert(memcmp(read_data, write_data, length) == 0);
+	
+	ck_assert_uint_eq(rs_get_scp_data_length(conn1),
+	                  (_i == 0) ? MM_SCP_DATA_LENGTH : 256);
+	
+	rs_free(conn1, NULL, NULL);
+	mm->respond_to_ver = false;
+}
+END_TEST
+
+
+/**
+ * Arguments for coalesce_late_cb: a write to queue once an SCP packet's
+ * response arrives.
+ */
+typedef struct {
+	send_scp_cb_data_t scp_cb_data;
+	
+	rs_conn_t *conn;
+	uint32_t address;
+	uv_buf_t data;
+	rw_cb_data_t *cb_data;
+} coalesce_late_args_t;
+
+
+static void
+coalesce_late_cb(rs_conn_t *conn,
+                 int error,
+                 uint16_t cmd_rc,
+                 unsigned int n_args,
+                 uint32_t arg1,
+                 uint32_t arg2,
+                 uint32_t arg3,
+                 uv_buf_t data,
+                 void *cb_data)
+{
+	coalesce_late_args_t *args = (coalesce_late_args_t *)cb_data;
+	send_scp_cb(conn, error, cmd_rc, n_args, arg1, arg2, arg3, data, cb_data);
+	
+	ck_assert(!rs_write(args->conn, 1, 0, args->address, args->data,
+	                    rw_cb, args->cb_data));
+}
+
+
+/**
+ * Check that writes coalesced while the SCP data length was being discovered
+ * are not extended beyond the buffer allocated for them once a larger length
+ * has been discovered.
+ */
+START_TEST (test_coalesce_scp_data_length_auto)
+{
+	// The discovered length (larger than the provisional length) and the writes:
+	// two merged while the provisional length applies and a third, queued once
+	// the larger length is known, which would overflow the provisional length.
+	const uint16_t scp_data_length = 512;
+	const size_t part_lens[] = {64, 64, 192};
+	const size_t length = 64 + 64 + 192;
+	
+	size_t i;
+	
+	mm->respond_to_ver = true;
+	mm->ver_scp_data_length = scp_data_length;
+	
+	rs_conn_opts_t opts;
+	rs_conn_opts_init(&opts);
+	opts.scp_data_length = RS_SCP_DATA_LENGTH_AUTO;
+	opts.probe_dest_addr = 1; // Respond first time
+	opts.timeout = TIMEOUT;
+	opts.n_tries = N_TRIES;
+	opts.n_outstanding = 1;
+	opts.coalesce = true;
+	rs_conn_t *conn1 = rs_init_ex(loop, (struct sockaddr *)&conn_addr, &opts);
+	ck_assert(conn1);
+	
+	unsigned char write_data[length];
+	for (i = 0; i < length; i++)
+		write_data[i] = (unsigned char)(i * 7);
+	
+	uint32_t addr = (0u |      // Start at the start of the buffer
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// An SCP packet which occupies the only slot once the probe has completed,
+	// and whose callback queues the last write
+	rw_cb_data_t cb_data[3];
+	coalesce_late_args_t args;
+	args.conn = conn1;
+	args.address = addr + part_lens[0] + part_lens[1];
+	args.data.base = (void *)(write_data + part_lens[0] + part_lens[1]);
+	args.data.len = part_lens[2];
+	args.cb_data = &(cb_data[2]);
+	uv_buf_t empty;
+	empty.base = NULL;
+	empty.len = 0;
+	wait_for_cb((cb_data_t *)&(args.scp_cb_data));
+	ck_assert(!rs_send_scp(conn1, 1, 0, 1, 0, 0, 0, 0, 0, empty, 0,
+	                       coalesce_late_cb, &args));
+	
+	// The first two writes are merged while the probe is outstanding
+	uv_buf_t data;
+	data.base = (void *)write_data;
+	data.len = part_lens[0];
+	wait_for_cb((cb_data_t *)&(cb_data[0]));
+	ck_assert(!rs_write(conn1, 1, 0, addr, data, rw_cb, &(cb_data[0])));
+	data.base = (void *)(write_data + part_lens[0]);
+	data.len = part_lens[1];
+	wait_for_cb((cb_data_t *)&(cb_data[1]));
+	ck_assert(!rs_write(conn1, 1, 0, addr + part_lens[0], data,
+	                    rw_cb, &(cb_data[1])));
+	
+	wait_for_cb((cb_data_t *)&(cb_data[2]));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(rs_get_scp_data_length(conn1), scp_data_length);
+	
+	for (i = 0; i < 3; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+	}
+	
+	// The last write was sent separately rather than merged
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	ck_assert_uint_eq(rw->n_responses_sent, 2);
+	ck_assert(memcmp(rw->data, write_data, length) == 0);
+	
+	rs_free(conn1, NULL, NULL);
+	mm->respond_to_ver = false;
+}
+END_TEST
 
 Suite *
 make_rig_scp_suite(void)
@@ -1198,6 +3946,34 @@ make_rig_scp_suite(void)
 	tcase_add_test(tc_core, test_non_obstructing);
 	tcase_add_test(tc_core, test_read_timeout);
 	tcase_add_test(tc_core, test_read_fail);
+	tcase_add_test(tc_core, test_single_outstanding_read);
+	tcase_add_test(tc_core, test_large_window_read);
+	tcase_add_test(tc_core, test_write_retransmit);
+	tcase_add_test(tc_core, test_batched_rw);
+	tcase_add_test(tc_core, test_adaptive_timeout);
+	tcase_add_test(tc_core, test_dynamic_window);
+	tcase_add_test(tc_core, test_fast_retransmit);
+	tcase_add_test(tc_core, test_stats);
+	tcase_add_test(tc_core, test_trace);
+	tcase_add_test(tc_core, test_priority);
+	tcase_add_test(tc_core, test_reserved_slots);
+	tcase_add_loop_test(tc_core, test_interleaved_rw, 0, 3);
+	tcase_add_test(tc_core, test_dest_limit);
+	tcase_add_test(tc_core, test_pool);
+	tcase_add_test(tc_core, test_thread_safe);
+	tcase_add_test(tc_core, test_shard);
+	tcase_add_test(tc_core, test_rwv);
+	tcase_add_loop_test(tc_core, test_read_stream, 0, 2);
+	tcase_add_test(tc_core, test_file);
+	tcase_add_test(tc_core, test_coalesce);
+	tcase_add_loop_test(tc_core, test_fill, 0, 4);
+	tcase_add_test(tc_core, test_write_multi);
+	tcase_add_test(tc_core, test_fence);
+	tcase_add_loop_test(tc_core, test_retry_rc, 0, 3);
+	tcase_add_test(tc_core, test_queue_full);
+	tcase_add_loop_test(tc_core, test_queue_full_producers, 0, 6);
+	tcase_add_loop_test(tc_core, test_scp_data_length_auto, 0, 4);
+	tcase_add_test(tc_core, test_coalesce_scp_data_length_auto);
 	
 	
 	// Add each test case to the suite
@@ -296,6 +296,66 @@ START_TEST (test_pack_scp_packet)
 END_TEST
 
 
+START_TEST (test_unpack_scp_packet_partial_arg)
+{
+	// Create a buffer large enough for the largest packet
+	char *buf_data[packet_len];
+	memcpy(buf_data, packet, packet_len);
+	uv_buf_t buf;
+	buf.base = (void *)buf_data;
+	
+	// Only arguments present in full are unpacked
+	size_t len;
+	for (len = packet_no_arg_no_data_len; len < packet_len; len++) {
+		buf.len = len;
+		unsigned int n_args = 3;
+		uint16_t cmd_rc = 0;
+		uint16_t seq_num = 0;
+		uint32_t arg1 = 0;
+		uint32_t arg2 = 0;
+		uint32_t arg3 = 0;
+		uv_buf_t data;
+		rs__unpack_scp_packet(buf,
+		                      &cmd_rc, &seq_num,
+		                      &n_args, &arg1, &arg2, &arg3,
+		                      &data);
+		unsigned int n_present = (len - packet_no_arg_no_data_len) / 4;
+		ck_assert_uint_eq(n_args, (n_present < 3) ? n_present : 3);
+		ck_assert_uint_eq(cmd_rc, 0xDEAD);
+		ck_assert_uint_eq(seq_num, 0xBEEF);
+		ck_assert_uint_eq(arg1, (n_args >= 1) ? 0x11213141 : 0);
+		ck_assert_uint_eq(arg2, (n_args >= 2) ? 0x12223242 : 0);
+		ck_assert_uint_eq(arg3, (n_args >= 3) ? 0x13233343 : 0);
+		ck_assert(data.base == buf.base + packet_no_arg_no_data_len + 4 * n_args);
+		ck_assert_uint_eq(data.len, len - packet_no_arg_no_data_len - 4 * n_args);
+	}
+}
+END_TEST
+
+
+START_TEST (test_pack_scp_packet_template)
+{
+	uint8_t template[RS__SCP_TEMPLATE_LENGTH];
+	rs__pack_scp_template(template, 0xA55A, 7, 0xDEAD);
+	
+	// Pack into a misaligned buffer (as packets are, following the padding
+	// bytes)
+	char buf_data[packet_len + 1];
+	uv_buf_t buf;
+	buf.base = buf_data + 1;
+	buf.len = 0;
+	rs__pack_scp_packet_template(&buf, template,
+	                             0xBEEF, 0x11213141, 0x12223242, 0x13233343);
+	ck_assert_uint_eq(buf.len, packet_len - 4);
+	ck_assert(memcmp(buf.base, packet, buf.len) == 0);
+	
+	// The sequence number may be replaced afterwards
+	rs__pack_scp_packet_seq_num(buf, 0x1234);
+	ck_assert_uint_eq(rs__unpack_scp_packet_seq_num(buf), 0x1234);
+}
+END_TEST
+
+
 Suite *
 make_scp_suite(void)
 {
@@ -308,6 +368,8 @@ make_scp_suite(void)
 	tcase_add_test(tc_core, test_unpack_scp_packet);
 	tcase_add_test(tc_core, test_unpack_scp_packet_seq_num);
 	tcase_add_test(tc_core, test_pack_scp_packet);
+	tcase_add_test(tc_core, test_unpack_scp_packet_partial_arg);
+	tcase_add_test(tc_core, test_pack_scp_packet_template);
 	
 	// Add each test case to the suite
 	suite_add_tcase(s, tc_core);
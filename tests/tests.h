@@ -7,6 +7,8 @@
 #include <check.h>
 
 Suite *make_queue_suite(void);
+Suite *make_buf_pool_suite(void);
+Suite *make_mpsc_suite(void);
 Suite *make_scp_suite(void);
 Suite *make_rig_scp_suite(void);
 